@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
 #include <getopt.h>
 
 #include "tap-ctl.h"
@@ -702,6 +703,130 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_cbt_usage(FILE *stream)
+{
+	fprintf(stream, "usage: cbt <-p pid> <-m minor> "
+		"[-c checkpoint] [-s since epoch [-o file]]\n");
+}
+
+static int
+tap_cli_cbt_print(const char *path)
+{
+	char buf[4096];
+	size_t n;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return errno;
+
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		fwrite(buf, 1, n, stdout);
+
+	fclose(f);
+	return 0;
+}
+
+static int
+tap_cli_cbt(int argc, char **argv)
+{
+	int c, fd, pid, minor, err;
+	tapdisk_message_cbt_t cbt;
+	const char *file;
+	char cwd[PATH_MAX];
+	char tmp[] = "/tmp/tap-ctl-cbt.XXXXXX";
+
+	pid   = -1;
+	minor = -1;
+	file  = NULL;
+
+	memset(&cbt, 0, sizeof(cbt));
+	cbt.op = TAPDISK_MESSAGE_CBT_INFO;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:cs:o:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'c':
+			cbt.op = TAPDISK_MESSAGE_CBT_CHECKPOINT;
+			break;
+		case 's':
+			cbt.op = TAPDISK_MESSAGE_CBT_QUERY;
+			cbt.epoch = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			file = optarg;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_cbt_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 ||
+	    (file && cbt.op != TAPDISK_MESSAGE_CBT_QUERY))
+		goto usage;
+
+	if (cbt.op != TAPDISK_MESSAGE_CBT_QUERY)
+		goto send;
+
+	/* tapdisk writes the extents, so hand it an absolute path */
+	if (!file) {
+		fd = mkstemp(tmp);
+		if (fd == -1)
+			return errno;
+		close(fd);
+		file = tmp;
+	}
+
+	if (file[0] != '/') {
+		if (!getcwd(cwd, sizeof(cwd)))
+			return errno;
+		err = snprintf(cbt.path, sizeof(cbt.path), "%s/%s", cwd, file);
+	} else
+		err = snprintf(cbt.path, sizeof(cbt.path), "%s", file);
+
+	if (err >= sizeof(cbt.path))
+		return ENAMETOOLONG;
+
+send:
+	err = tap_ctl_cbt(pid, minor, &cbt);
+
+	if (!err) {
+		switch (cbt.op) {
+		case TAPDISK_MESSAGE_CBT_INFO:
+			printf("epoch=%"PRIu64" oldest=%"PRIu64" "
+			       "block_size=%u\n",
+			       cbt.epoch, cbt.oldest, cbt.block_size);
+			break;
+		case TAPDISK_MESSAGE_CBT_CHECKPOINT:
+			printf("%"PRIu64"\n", cbt.epoch);
+			break;
+		case TAPDISK_MESSAGE_CBT_QUERY:
+			if (file == tmp)
+				err = tap_cli_cbt_print(tmp);
+			break;
+		}
+	}
+
+	if (file == tmp)
+		unlink(tmp);
+
+	return err;
+
+usage:
+	tap_cli_cbt_usage(stderr);
+	return EINVAL;
+}
+
 struct command commands[] = {
 	{ .name = "list",         .func = tap_cli_list          },
 	{ .name = "allocate",     .func = tap_cli_allocate      },
@@ -717,6 +842,7 @@ struct command commands[] = {
 	{ .name = "unpause",      .func = tap_cli_unpause       },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
+	{ .name = "cbt",          .func = tap_cli_cbt           },
 };
 
 #define print_commands()					\
@@ -1317,3 +1317,166 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		}			
 	}
 }
+
+/*
+ * AES-NI: sectors are independent CBC chains, so AES_NI_LANES of them are
+ * encrypted side by side to keep the AES unit busy, and decryption, which
+ * is parallel within a chain, works on AES_NI_LANES blocks at a time.
+ * The OpenSSL key schedules are usable as is once put in byte order; the
+ * decryption one is already the "equivalent inverse cipher" form that
+ * aesdec expects.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define AES_NI
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AES_NI_TARGET __attribute__((target("aes,sse2")))
+#define AES_NI_LANES  4
+#define AES_SECTOR    512
+
+static int AES_ni_available(void)
+{
+	static int available = -1;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (available < 0)
+		available = (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+			     (ecx & bit_AES));
+
+	return available;
+}
+
+static AES_NI_TARGET void AES_ni_load_key(const AES_KEY *key, __m128i *rk)
+{
+	u8 b[AES_BLOCK_SIZE];
+	int r, i;
+
+	for (r = 0; r <= key->rounds; r++) {
+		for (i = 0; i < 4; i++)
+			PUTU32(b + 4 * i, key->rd_key[4 * r + i]);
+		rk[r] = _mm_loadu_si128((const __m128i *)b);
+	}
+}
+
+static AES_NI_TARGET void
+AES_ni_cbc_encrypt_sectors(const unsigned char *in, unsigned char *out,
+			   uint64_t sector, unsigned long nb_sectors,
+			   const AES_KEY *key)
+{
+	__m128i rk[AES_MAXNR + 1], c[AES_NI_LANES];
+	unsigned long s, blk;
+	int i, r, lanes, rounds = key->rounds;
+
+	AES_ni_load_key(key, rk);
+
+	for (s = 0; s < nb_sectors; s += lanes) {
+		lanes = nb_sectors - s;
+		if (lanes > AES_NI_LANES)
+			lanes = AES_NI_LANES;
+
+		for (i = 0; i < lanes; i++)
+			c[i] = _mm_set_epi64x(0, sector + s + i);
+
+		for (blk = 0; blk < AES_SECTOR; blk += AES_BLOCK_SIZE) {
+			for (i = 0; i < lanes; i++) {
+				const unsigned char *p;
+
+				p = in + (s + i) * AES_SECTOR + blk;
+				c[i] = _mm_xor_si128(c[i],
+					_mm_loadu_si128((const __m128i *)p));
+				c[i] = _mm_xor_si128(c[i], rk[0]);
+			}
+			for (r = 1; r < rounds; r++)
+				for (i = 0; i < lanes; i++)
+					c[i] = _mm_aesenc_si128(c[i], rk[r]);
+			for (i = 0; i < lanes; i++) {
+				unsigned char *p;
+
+				p = out + (s + i) * AES_SECTOR + blk;
+				c[i] = _mm_aesenclast_si128(c[i], rk[rounds]);
+				_mm_storeu_si128((__m128i *)p, c[i]);
+			}
+		}
+	}
+}
+
+static AES_NI_TARGET void
+AES_ni_cbc_decrypt_sectors(const unsigned char *in, unsigned char *out,
+			   uint64_t sector, unsigned long nb_sectors,
+			   const AES_KEY *key)
+{
+	__m128i rk[AES_MAXNR + 1], c[AES_NI_LANES], x[AES_NI_LANES], prev;
+	unsigned long s, blk;
+	int i, r, rounds = key->rounds;
+
+	AES_ni_load_key(key, rk);
+
+	for (s = 0; s < nb_sectors; s++) {
+		prev = _mm_set_epi64x(0, sector + s);
+
+		for (blk = 0; blk < AES_SECTOR;
+		     blk += AES_NI_LANES * AES_BLOCK_SIZE) {
+			/* load everything first: in may be out */
+			for (i = 0; i < AES_NI_LANES; i++) {
+				c[i] = _mm_loadu_si128((const __m128i *)
+						       (in + blk +
+							i * AES_BLOCK_SIZE));
+				x[i] = _mm_xor_si128(c[i], rk[0]);
+			}
+			for (r = 1; r < rounds; r++)
+				for (i = 0; i < AES_NI_LANES; i++)
+					x[i] = _mm_aesdec_si128(x[i], rk[r]);
+			for (i = 0; i < AES_NI_LANES; i++) {
+				x[i] = _mm_aesdeclast_si128(x[i], rk[rounds]);
+				x[i] = _mm_xor_si128(x[i], i ? c[i - 1] : prev);
+				_mm_storeu_si128((__m128i *)
+						 (out + blk + i * AES_BLOCK_SIZE),
+						 x[i]);
+			}
+			prev = c[AES_NI_LANES - 1];
+		}
+
+		in  += AES_SECTOR;
+		out += AES_SECTOR;
+	}
+}
+#endif /* AES_NI */
+
+/*
+ * CBC over a run of 512 byte sectors, each chained from its own IV: the
+ * little endian sector number, as used by qcow and the Linux cryptoloop
+ * "plain" scheme.  in == out is supported.
+ */
+void AES_cbc_encrypt_sectors(const unsigned char *in, unsigned char *out,
+			     uint64_t sector, unsigned long nb_sectors,
+			     const AES_KEY *key, const int enc)
+{
+	unsigned char ivec[AES_BLOCK_SIZE];
+	unsigned long i;
+	int j;
+
+#ifdef AES_NI
+	if (AES_ni_available()) {
+		if (enc)
+			AES_ni_cbc_encrypt_sectors(in, out, sector,
+						   nb_sectors, key);
+		else
+			AES_ni_cbc_decrypt_sectors(in, out, sector,
+						   nb_sectors, key);
+		return;
+	}
+#endif
+
+	for (i = 0; i < nb_sectors; i++) {
+		memset(ivec, 0, sizeof(ivec));
+		for (j = 0; j < 8; j++)
+			ivec[j] = (unsigned char)((sector + i) >> (8 * j));
+
+		AES_cbc_encrypt(in, out, 512, key, ivec, enc);
+		in += 512;
+		out += 512;
+	}
+}
@@ -24,5 +24,8 @@ void AES_decrypt(const unsigned char *in, unsigned char *out,
 void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		     const unsigned long length, const AES_KEY *key,
 		     unsigned char *ivec, const int enc);
+void AES_cbc_encrypt_sectors(const unsigned char *in, unsigned char *out,
+			     uint64_t sector, unsigned long nb_sectors,
+			     const AES_KEY *key, const int enc);
 
 #endif
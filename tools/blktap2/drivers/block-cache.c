@@ -29,7 +29,11 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
@@ -45,66 +49,118 @@
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 
-#define RADIX_TREE_PAGE_SHIFT           12 /* 4K pages */
-#define RADIX_TREE_PAGE_SIZE            (1 << RADIX_TREE_PAGE_SHIFT)
-
-#define RADIX_TREE_NODE_SHIFT           9 /* 512B nodes */
-#define RADIX_TREE_NODE_SIZE            (1 << RADIX_TREE_NODE_SHIFT)
-#define RADIX_TREE_NODE_MASK            (RADIX_TREE_NODE_SIZE - 1)
+/*
+ * The cache lives in a shared memory segment, so that every tapdisk on
+ * the host reading the same parent image reads each block from disk
+ * once.  Blocks are keyed by (image, generation, block number); an
+ * image is identified by the device, inode, size and mtime of its
+ * file.  Eviction is ARC: recency (T1) and frequency (T2) lists of
+ * cached blocks, each shadowed by a ghost list (B1, B2) of recently
+ * evicted keys which steers the target size p of T1.
+ *
+ * TAPDISK2_BLOCK_CACHE_SIZE sets the size in bytes of the segment's
+ * data area.  Whoever creates the segment decides; later tapdisks use
+ * it as it is.
+ */
+#define BLOCK_CACHE_SHM_NAME            "/tapdisk-block-cache"
+#define BLOCK_CACHE_MAGIC               0x74646263 /* "tdbc" */
+#define BLOCK_CACHE_VERSION             1
+
+#define BLOCK_CACHE_BLOCK_SHIFT         12 /* 4K blocks */
+#define BLOCK_CACHE_BLOCK_SIZE          (1 << BLOCK_CACHE_BLOCK_SHIFT)
+#define BLOCK_CACHE_BLOCK_SECS_SHIFT    (BLOCK_CACHE_BLOCK_SHIFT - SECTOR_SHIFT)
+#define BLOCK_CACHE_BLOCK_SECS          (1 << BLOCK_CACHE_BLOCK_SECS_SHIFT)
+
+#define BLOCK_CACHE_DEFAULT_SIZE        (100 << 20) /* 100MB cache */
+#define BLOCK_CACHE_MAX_BLOCKS          16 /* per request */
+#define BLOCK_CACHE_IMAGES              256
+#define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
 
-#define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
+#define BLOCK_CACHE_NIL                 ((uint32_t)-1)
 
-#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
-#define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
-#define BLOCK_CACHE_PAGE_IDLETIME       60
+enum {
+	BLOCK_CACHE_T1 = 0,
+	BLOCK_CACHE_T2,
+	BLOCK_CACHE_B1,
+	BLOCK_CACHE_B2,
+	BLOCK_CACHE_FREE,
+	BLOCK_CACHE_LISTS,
+};
 
-typedef struct radix_tree               radix_tree_t;
-typedef struct radix_tree_node          radix_tree_node_t;
-typedef struct radix_tree_link          radix_tree_link_t;
-typedef struct radix_tree_leaf          radix_tree_leaf_t;
-typedef struct radix_tree_page          radix_tree_page_t;
+typedef struct block_cache_shm          block_cache_shm_t;
+typedef struct block_cache_list         block_cache_list_t;
+typedef struct block_cache_entry        block_cache_entry_t;
+typedef struct block_cache_image        block_cache_image_t;
+typedef struct block_cache_shm_stats    block_cache_shm_stats_t;
 
 typedef struct block_cache              block_cache_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
 
-struct radix_tree_page {
-	char                           *buf;
-	size_t                          size;
-	uint64_t                        sec;
-	radix_tree_link_t              *owners[BLOCK_CACHE_NODES_PER_PAGE];
+/* all links are indices into the entry array: the segment is mapped at
+ * a different address in every process */
+struct block_cache_list {
+	uint32_t                        mru;
+	uint32_t                        lru;
+	uint32_t                        size;
 };
 
-struct radix_tree_leaf {
-	radix_tree_page_t              *page;
-	char                           *buf;
+struct block_cache_entry {
+	uint64_t                        block;
+	uint32_t                        image;
+	uint32_t                        gen;
+	uint32_t                        hnext;
+	uint32_t                        prev;
+	uint32_t                        next;
+	uint32_t                        data;  /* NIL on ghost lists */
+	uint32_t                        list;
 };
 
-struct radix_tree_link {
-	uint32_t                        time;
-	union {
-		radix_tree_node_t      *next;
-		radix_tree_leaf_t       leaf;
-	} u;
+struct block_cache_image {
+	uint64_t                        dev;
+	uint64_t                        ino;
+	uint64_t                        size;
+	uint64_t                        mtime;
+	uint64_t                        used;
+	uint32_t                        gen;   /* 0: unused */
 };
 
-struct radix_tree_node {
-	int                             height;
-	radix_tree_link_t               links[RADIX_TREE_NODE_SIZE];
+struct block_cache_shm_stats {
+	uint64_t                        hits;
+	uint64_t                        misses;
+	uint64_t                        inserts;
+	uint64_t                        evictions;
+	uint64_t                        ghost_hits;
+	uint64_t                        resets;
 };
 
-struct radix_tree {
-	int                             height;
-	uint64_t                        size;
-	uint32_t                        nodes;
-	radix_tree_node_t              *root;
+struct block_cache_shm {
+	uint32_t                        magic;
+	uint32_t                        version;
+	uint64_t                        size;     /* of the whole segment */
 
-	block_cache_t                  *cache;
+	uint32_t                        blocks;   /* ARC c */
+	uint32_t                        entries;  /* 2c */
+	uint32_t                        buckets;  /* power of 2 */
+	uint32_t                        p;        /* ARC target for T1 */
+
+	uint64_t                        buckets_off;
+	uint64_t                        entries_off;
+	uint64_t                        free_off;
+	uint64_t                        data_off;
+	uint32_t                        free_data;
+
+	pthread_mutex_t                 lock;
+
+	uint64_t                        clock;
+	block_cache_image_t             images[BLOCK_CACHE_IMAGES];
+	block_cache_list_t              lists[BLOCK_CACHE_LISTS];
+
+	block_cache_shm_stats_t         stats;
 };
 
 struct block_cache_request {
 	int                             err;
-	char                           *buf;
 	uint64_t                        secs;
 	td_request_t                    treq;
 	block_cache_t                  *cache;
@@ -114,7 +170,7 @@ struct block_cache_stats {
 	uint64_t                        reads;
 	uint64_t                        hits;
 	uint64_t                        misses;
-	uint64_t                        prunes;
+	uint64_t                        uncached;
 };
 
 struct block_cache {
@@ -127,377 +183,741 @@ struct block_cache {
 	block_cache_request_t          *request_free_list[BLOCK_CACHE_REQUESTS];
 	int                             requests_free;
 
-	event_id_t                      timeout_id;
-
-	radix_tree_t                    tree;
+	block_cache_shm_t              *shm;
+	uint32_t                        image;
+	uint32_t                        gen;
 
 	block_cache_stats_t             stats;
 };
 
-static inline uint64_t
-radix_tree_calculate_size(int height)
+/* one mapping per process, shared by all caches and threads */
+static pthread_mutex_t block_cache_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static block_cache_shm_t *block_cache_map;
+static int block_cache_map_refs;
+
+static inline uint32_t *
+block_cache_buckets(block_cache_shm_t *shm)
 {
-	return (uint64_t)RADIX_TREE_NODE_SIZE <<
-	  (height * RADIX_TREE_NODE_SHIFT);
+	return (uint32_t *)((char *)shm + shm->buckets_off);
 }
 
-static inline int
-radix_tree_calculate_height(uint64_t sectors)
+static inline block_cache_entry_t *
+block_cache_entry(block_cache_shm_t *shm, uint32_t idx)
 {
-	int height;
-	uint64_t tree_size;
-
-	height = 1;  /* always allocate root node */
-	tree_size = radix_tree_calculate_size(height);
-	while (sectors > tree_size)
-		tree_size = radix_tree_calculate_size(++height);
-
-	return height;
+	if (idx == BLOCK_CACHE_NIL)
+		return NULL;
+	return (block_cache_entry_t *)((char *)shm + shm->entries_off) + idx;
 }
 
-static inline int
-radix_tree_index(radix_tree_node_t *node, uint64_t sector)
+static inline uint32_t
+block_cache_entry_index(block_cache_shm_t *shm, block_cache_entry_t *e)
 {
-	return ((sector >> (node->height * RADIX_TREE_NODE_SHIFT)) &
-		RADIX_TREE_NODE_MASK);
+	return e - (block_cache_entry_t *)((char *)shm + shm->entries_off);
 }
 
-static inline int
-radix_tree_node_contains_leaves(radix_tree_t *tree, radix_tree_node_t *node)
+static inline uint32_t *
+block_cache_free_data(block_cache_shm_t *shm)
 {
-	return (node->height == 0);
+	return (uint32_t *)((char *)shm + shm->free_off);
 }
 
-static inline int
-radix_tree_node_is_root(radix_tree_t *tree, radix_tree_node_t *node)
+static inline char *
+block_cache_data(block_cache_shm_t *shm, uint32_t data)
 {
-	return (node->height == tree->height);
+	return (char *)shm + shm->data_off +
+		((uint64_t)data << BLOCK_CACHE_BLOCK_SHIFT);
 }
 
-static inline uint64_t
-radix_tree_size(radix_tree_t *tree)
+static inline int
+block_cache_resident(block_cache_entry_t *e)
 {
-	return tree->size + tree->nodes * sizeof(radix_tree_node_t);
+	return (e->list == BLOCK_CACHE_T1 || e->list == BLOCK_CACHE_T2);
 }
 
-static inline void
-radix_tree_clear_link(radix_tree_link_t *link)
+static inline uint32_t
+block_cache_bucket(block_cache_shm_t *shm,
+		   uint32_t image, uint32_t gen, uint64_t block)
 {
-	if (link)
-		memset(link, 0, sizeof(radix_tree_link_t));
+	uint64_t h;
+
+	h  = block ^ ((((uint64_t)image << 32) | gen) * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return h & (shm->buckets - 1);
 }
 
-static inline radix_tree_node_t *
-radix_tree_allocate_node(radix_tree_t *tree, int height)
+static void
+block_cache_list_del(block_cache_shm_t *shm, block_cache_entry_t *e)
 {
-	radix_tree_node_t *node;
+	block_cache_list_t *list = &shm->lists[e->list];
+	block_cache_entry_t *prev, *next;
 
-	node = calloc(1, sizeof(radix_tree_node_t));
-	if (!node)
-		return NULL;
+	prev = block_cache_entry(shm, e->prev);
+	next = block_cache_entry(shm, e->next);
+
+	if (prev)
+		prev->next = e->next;
+	else
+		list->mru  = e->next;
+
+	if (next)
+		next->prev = e->prev;
+	else
+		list->lru  = e->prev;
 
-	node->height = height;
-	tree->nodes++;
+	list->size--;
+	e->prev = e->next = BLOCK_CACHE_NIL;
+}
 
-	return node;
+static void
+block_cache_list_add(block_cache_shm_t *shm, block_cache_entry_t *e, int l)
+{
+	block_cache_list_t *list = &shm->lists[l];
+	uint32_t idx = block_cache_entry_index(shm, e);
+	block_cache_entry_t *mru;
+
+	e->list = l;
+	e->prev = BLOCK_CACHE_NIL;
+	e->next = list->mru;
+
+	mru = block_cache_entry(shm, list->mru);
+	if (mru)
+		mru->prev = idx;
+	else
+		list->lru = idx;
+
+	list->mru = idx;
+	list->size++;
 }
 
-static inline radix_tree_node_t *
-radix_tree_allocate_child_node(radix_tree_t *tree, radix_tree_node_t *parent)
+static inline void
+block_cache_list_move(block_cache_shm_t *shm, block_cache_entry_t *e, int l)
 {
-	return radix_tree_allocate_node(tree, parent->height - 1);
+	block_cache_list_del(shm, e);
+	block_cache_list_add(shm, e, l);
 }
 
-void
-radix_tree_free_node(radix_tree_t *tree, radix_tree_node_t *node)
+static block_cache_entry_t *
+block_cache_find(block_cache_shm_t *shm,
+		 uint32_t image, uint32_t gen, uint64_t block)
 {
-	if (!node)
-		return;
+	block_cache_entry_t *e;
+	uint32_t idx;
+
+	idx = block_cache_buckets(shm)[block_cache_bucket(shm, image,
+							  gen, block)];
+	while ((e = block_cache_entry(shm, idx))) {
+		if (e->block == block && e->image == image && e->gen == gen)
+			return e;
+		idx = e->hnext;
+	}
+
+	return NULL;
+}
+
+static void
+block_cache_hash_add(block_cache_shm_t *shm, block_cache_entry_t *e)
+{
+	uint32_t *bucket;
 
-	free(node);
-	tree->nodes--;
+	bucket   = block_cache_buckets(shm) +
+		block_cache_bucket(shm, e->image, e->gen, e->block);
+	e->hnext = *bucket;
+	*bucket  = block_cache_entry_index(shm, e);
 }
 
-static inline radix_tree_page_t *
-radix_tree_allocate_page(radix_tree_t *tree,
-			 char *buf, uint64_t sec, size_t size)
+static void
+block_cache_hash_del(block_cache_shm_t *shm, block_cache_entry_t *e)
 {
-	radix_tree_page_t *page;
+	uint32_t *link, idx;
+	block_cache_entry_t *cur;
 
-	page = calloc(1, sizeof(radix_tree_page_t));
-	if (!page)
-		return NULL;
+	idx  = block_cache_entry_index(shm, e);
+	link = block_cache_buckets(shm) +
+		block_cache_bucket(shm, e->image, e->gen, e->block);
 
-	page->buf   = buf;
-	page->sec   = sec;
-	page->size  = size;
-	tree->size += size;
+	while ((cur = block_cache_entry(shm, *link))) {
+		if (*link == idx) {
+			*link = e->hnext;
+			break;
+		}
+		link = &cur->hnext;
+	}
 
-	return page;
+	e->hnext = BLOCK_CACHE_NIL;
 }
 
 static inline void
-radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
+block_cache_release_data(block_cache_shm_t *shm, block_cache_entry_t *e)
 {
-	int i;
-
-	for (i = 0; i < page->size >> RADIX_TREE_NODE_SHIFT; i++)
-		DBG("%s: ejecting sector 0x%llx\n",
-		    tree->cache->name, page->sec + i);
+	if (e->data == BLOCK_CACHE_NIL)
+		return;
 
-	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
-	tree->size -= page->size;
-	free(page->buf);
-	free(page);
+	block_cache_free_data(shm)[shm->free_data++] = e->data;
+	e->data = BLOCK_CACHE_NIL;
 }
 
 /*
- * remove a leaf and the shared radix_tree_page_t containing its buffer.
- * leaves are deleted, nodes are not; gc will reap the nodes later.
+ * ARC REPLACE: evict the LRU block of T1 or T2 to its ghost list.
+ * Only needed once all data blocks are in use.
  */
 static void
-radix_tree_remove_page(radix_tree_t *tree, radix_tree_page_t *page)
+block_cache_arc_replace(block_cache_shm_t *shm, int ghost_b2)
 {
-	int i;
+	block_cache_list_t *t1 = &shm->lists[BLOCK_CACHE_T1];
+	block_cache_entry_t *e;
+	int ghost;
 
-	if (!page)
+	if (shm->free_data)
 		return;
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++)
-		radix_tree_clear_link(page->owners[i]);
+	if (t1->size &&
+	    ((ghost_b2 && t1->size == shm->p) || t1->size > shm->p)) {
+		e     = block_cache_entry(shm, t1->lru);
+		ghost = BLOCK_CACHE_B1;
+	} else {
+		e     = block_cache_entry(shm,
+					  shm->lists[BLOCK_CACHE_T2].lru);
+		ghost = BLOCK_CACHE_B2;
+		if (!e) {
+			e     = block_cache_entry(shm, t1->lru);
+			ghost = BLOCK_CACHE_B1;
+		}
+	}
+
+	if (!e)
+		return;
 
-	radix_tree_free_page(tree, page);
+	block_cache_release_data(shm, e);
+	block_cache_list_move(shm, e, ghost);
+	shm->stats.evictions++;
 }
 
+/* forget the LRU entry of a list altogether */
 static void
-radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
-		       radix_tree_page_t *page, off_t off)
+block_cache_arc_drop(block_cache_shm_t *shm, int l)
 {
-	int i;
+	block_cache_entry_t *e;
 
-	if (off + RADIX_TREE_NODE_SIZE > page->size)
+	e = block_cache_entry(shm, shm->lists[l].lru);
+	if (!e)
 		return;
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++) {
-		if (page->owners[i])
-			continue;
+	if (block_cache_resident(e))
+		shm->stats.evictions++;
 
-		page->owners[i]   = link;
-		link->u.leaf.page = page;
-		link->u.leaf.buf  = page->buf + off;
+	block_cache_release_data(shm, e);
+	block_cache_hash_del(shm, e);
+	block_cache_list_move(shm, e, BLOCK_CACHE_FREE);
+}
+
+/*
+ * Make room for a block that was just read from disk, and return the
+ * entry for it, unlinked and with a data block attached.  Ghost hits
+ * adapt p; everything else is ARC's case IV.
+ */
+static block_cache_entry_t *
+block_cache_arc_admit(block_cache_shm_t *shm, uint32_t image,
+		      uint32_t gen, uint64_t block, int *list)
+{
+	block_cache_list_t *t1, *t2, *b1, *b2;
+	block_cache_entry_t *e;
+	uint32_t c, delta, l1, total;
+
+	t1 = &shm->lists[BLOCK_CACHE_T1];
+	t2 = &shm->lists[BLOCK_CACHE_T2];
+	b1 = &shm->lists[BLOCK_CACHE_B1];
+	b2 = &shm->lists[BLOCK_CACHE_B2];
+	c  = shm->blocks;
+
+	e = block_cache_find(shm, image, gen, block);
+	if (e && e->list == BLOCK_CACHE_B1) {
+		delta  = (b2->size > b1->size ? b2->size / b1->size : 1);
+		shm->p = (shm->p + delta < c ? shm->p + delta : c);
+		block_cache_arc_replace(shm, 0);
+		block_cache_list_del(shm, e);
+		shm->stats.ghost_hits++;
+		*list  = BLOCK_CACHE_T2;
+	} else if (e && e->list == BLOCK_CACHE_B2) {
+		delta  = (b1->size > b2->size ? b1->size / b2->size : 1);
+		shm->p = (shm->p > delta ? shm->p - delta : 0);
+		block_cache_arc_replace(shm, 1);
+		block_cache_list_del(shm, e);
+		shm->stats.ghost_hits++;
+		*list  = BLOCK_CACHE_T2;
+	} else {
+		l1    = t1->size + b1->size;
+		total = l1 + t2->size + b2->size;
+
+		if (l1 >= c) {
+			if (t1->size < c) {
+				block_cache_arc_drop(shm, BLOCK_CACHE_B1);
+				block_cache_arc_replace(shm, 0);
+			} else
+				block_cache_arc_drop(shm, BLOCK_CACHE_T1);
+		} else if (total >= c) {
+			if (total >= 2 * c)
+				block_cache_arc_drop(shm, BLOCK_CACHE_B2);
+			block_cache_arc_replace(shm, 0);
+		}
+
+		e = block_cache_entry(shm, shm->lists[BLOCK_CACHE_FREE].lru);
+		if (!e)
+			return NULL;
+
+		block_cache_list_del(shm, e);
+		e->block = block;
+		e->image = image;
+		e->gen   = gen;
+		block_cache_hash_add(shm, e);
+		*list    = BLOCK_CACHE_T1;
+	}
 
-		break;
+	if (!shm->free_data) {
+		/* cannot happen unless the lists are inconsistent */
+		block_cache_hash_del(shm, e);
+		block_cache_list_add(shm, e, BLOCK_CACHE_FREE);
+		return NULL;
 	}
+
+	e->data = block_cache_free_data(shm)[--shm->free_data];
+	return e;
 }
 
-static char *
-radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
+static void
+block_cache_shm_reset(block_cache_shm_t *shm)
 {
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
+	uint32_t i, *buckets, *free_data;
+	block_cache_entry_t *e;
+
+	buckets   = block_cache_buckets(shm);
+	free_data = block_cache_free_data(shm);
 
-	node = tree->root;
-	gettimeofday(&now, NULL);
+	for (i = 0; i < shm->buckets; i++)
+		buckets[i] = BLOCK_CACHE_NIL;
 
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+	for (i = 0; i < BLOCK_CACHE_LISTS; i++) {
+		shm->lists[i].mru  = BLOCK_CACHE_NIL;
+		shm->lists[i].lru  = BLOCK_CACHE_NIL;
+		shm->lists[i].size = 0;
+	}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			return link->u.leaf.buf;
+	for (i = 0; i < shm->entries; i++) {
+		e        = block_cache_entry(shm, i);
+		e->hnext = BLOCK_CACHE_NIL;
+		e->data  = BLOCK_CACHE_NIL;
+		block_cache_list_add(shm, e, BLOCK_CACHE_FREE);
+	}
 
-		if (!link->u.next)
-			return NULL;
+	for (i = 0; i < shm->blocks; i++)
+		free_data[i] = shm->blocks - 1 - i;
+	shm->free_data = shm->blocks;
 
-		node = link->u.next;
-	} while (1);
+	shm->p = 0;
+	shm->stats.resets++;
 }
 
-static char *
-radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
-		    radix_tree_page_t *page, off_t off)
+static int
+block_cache_shm_lock(block_cache_shm_t *shm)
 {
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
+	int err;
+
+	err = pthread_mutex_lock(&shm->lock);
+	if (err == EOWNERDEAD) {
+		/* a tapdisk died halfway through an update */
+		WARN("block cache lock owner died, resetting cache\n");
+		block_cache_shm_reset(shm);
+		pthread_mutex_consistent(&shm->lock);
+		err = 0;
+	}
 
-	node = tree->root;
-	gettimeofday(&now, NULL);
+	return -err;
+}
 
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+static inline void
+block_cache_shm_unlock(block_cache_shm_t *shm)
+{
+	pthread_mutex_unlock(&shm->lock);
+}
 
-		if (radix_tree_node_contains_leaves(tree, node)) {
-			radix_tree_remove_page(tree, link->u.leaf.page);
-			radix_tree_insert_leaf(tree, link, page, off);
-			return link->u.leaf.buf;
-		}
+static inline uint64_t
+block_cache_align(uint64_t off, uint64_t align)
+{
+	return (off + align - 1) & ~(align - 1);
+}
 
-		if (!link->u.next) {
-			link->u.next = radix_tree_allocate_child_node(tree,
-								      node);
-			if (!link->u.next)
-				return NULL;
-		}
+static uint64_t
+block_cache_shm_layout(block_cache_shm_t *shm, uint64_t bytes)
+{
+	uint64_t off;
+
+	shm->blocks  = bytes >> BLOCK_CACHE_BLOCK_SHIFT;
+	shm->entries = shm->blocks << 1;
+	for (shm->buckets = 1; shm->buckets < shm->entries; )
+		shm->buckets <<= 1;
+
+	off = block_cache_align(sizeof(*shm), 64);
+	shm->buckets_off = off;
+	off += (uint64_t)shm->buckets * sizeof(uint32_t);
+
+	off = block_cache_align(off, 64);
+	shm->entries_off = off;
+	off += (uint64_t)shm->entries * sizeof(block_cache_entry_t);
 
-		node = link->u.next;
-	} while (1);
+	off = block_cache_align(off, 64);
+	shm->free_off = off;
+	off += (uint64_t)shm->blocks * sizeof(uint32_t);
+
+	off = block_cache_align(off, BLOCK_CACHE_BLOCK_SIZE);
+	shm->data_off = off;
+	off += (uint64_t)shm->blocks << BLOCK_CACHE_BLOCK_SHIFT;
+
+	return off;
 }
 
 static int
-radix_tree_add_leaves(radix_tree_t *tree, char *buf,
-		      uint64_t sector, uint64_t sectors)
+block_cache_shm_format(block_cache_shm_t *shm, uint64_t bytes, int pshared)
 {
-	int i;
-	radix_tree_page_t *page;
+	pthread_mutexattr_t attr;
+	int err;
 
-	page = radix_tree_allocate_page(tree, buf, sector,
-					sectors << RADIX_TREE_NODE_SHIFT);
-	if (!page)
-		return -ENOMEM;
+	memset(shm, 0, sizeof(*shm));
+	shm->size = block_cache_shm_layout(shm, bytes);
 
-	for (i = 0; i < sectors; i++)
-		if (!radix_tree_add_leaf(tree, sector + i, 
-					 page, (i << RADIX_TREE_NODE_SHIFT)))
-			goto fail;
+	pthread_mutexattr_init(&attr);
+	if (pshared) {
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	}
+	err = pthread_mutex_init(&shm->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (err)
+		return -err;
+
+	block_cache_shm_reset(shm);
+	shm->stats.resets = 0;
+
+	shm->version = BLOCK_CACHE_VERSION;
+	__sync_synchronize();
+	shm->magic   = BLOCK_CACHE_MAGIC;
 
 	return 0;
+}
 
-fail:
-	page->buf = NULL;
-	radix_tree_remove_page(tree, page);
-	return -ENOMEM;
+static uint64_t
+block_cache_shm_size(uint64_t bytes)
+{
+	block_cache_shm_t shm;
+
+	memset(&shm, 0, sizeof(shm));
+	return block_cache_shm_layout(&shm, bytes);
 }
 
+/*
+ * tapdisk runs with mlockall(MCL_FUTURE), which would pin the whole
+ * segment in every process mapping it.  Only the per-process state
+ * needs to stay resident: let the cache itself be paged.
+ */
 static void
-radix_tree_delete_branch(radix_tree_t *tree, radix_tree_node_t *node)
+block_cache_shm_unpin(block_cache_shm_t *shm, uint64_t size)
 {
-	int i;
-	radix_tree_link_t *link;
+	if (munlock(shm, size))
+		DPRINTF("munlock failed: %d\n", -errno);
+}
 
-	if (!node)
-		return;
+/*
+ * A segment private to this process, when there is no shared memory
+ * to be had.
+ */
+static block_cache_shm_t *
+block_cache_map_private(uint64_t bytes)
+{
+	block_cache_shm_t *shm;
+	uint64_t size;
 
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
+	size = block_cache_shm_size(bytes);
+	shm  = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED)
+		return NULL;
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+	block_cache_shm_unpin(shm, size);
 
-		radix_tree_clear_link(link);
+	if (block_cache_shm_format(shm, bytes, 0)) {
+		munmap(shm, size);
+		return NULL;
 	}
 
-	radix_tree_free_node(tree, node);
-}
-
-static inline void
-radix_tree_destroy(radix_tree_t *tree)
-{
-	radix_tree_delete_branch(tree, tree->root);
-	tree->root = NULL;
+	return shm;
 }
 
 /*
- * returns 1 if @node is empty after pruning, 0 otherwise
+ * The creator formats the segment with the file locked; everybody
+ * else waits for the lock and validates what they find.  The magic is
+ * written last: a segment without it was left behind by a creator
+ * which died while formatting.  Nobody can have started using such a
+ * segment, so whoever finds it under the lock formats it again.
  */
-static int
-radix_tree_prune_branch(radix_tree_t *tree,
-			radix_tree_node_t *node, uint32_t now)
+static block_cache_shm_t *
+block_cache_map_shared(uint64_t bytes)
 {
-	int i, empty;
-	radix_tree_link_t *link;
+	block_cache_shm_t *shm;
+	struct stat st;
+	uint64_t size;
+	int fd, err;
 
-	empty = 1;
-	if (!node)
-		return empty;
+	shm = NULL;
 
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
+	fd = shm_open(BLOCK_CACHE_SHM_NAME, O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+		return NULL;
 
-		if (now - link->time < BLOCK_CACHE_PAGE_IDLETIME) {
-			if (radix_tree_node_contains_leaves(tree, node)) {
-				empty = 0;
-				continue;
-			}
+	if (flock(fd, LOCK_EX))
+		goto out;
+
+	if (fstat(fd, &st))
+		goto out;
 
-			if (radix_tree_prune_branch(tree, link->u.next, now))
-				radix_tree_clear_link(link);
-			else
-				empty = 0;
+	if (st.st_size) {
+		size = st.st_size;
+		shm  = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0);
+		if (shm == MAP_FAILED) {
+			shm = NULL;
+			goto out;
+		}
+
+		block_cache_shm_unpin(shm, size);
 
-			continue;
+		if (shm->magic == BLOCK_CACHE_MAGIC) {
+			if (shm->version != BLOCK_CACHE_VERSION ||
+			    shm->size != size) {
+				EPRINTF("incompatible block cache segment "
+					"%s\n", BLOCK_CACHE_SHM_NAME);
+				goto fail;
+			}
+			goto out;
 		}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+		EPRINTF("block cache segment %s was never initialized, "
+			"recreating it\n", BLOCK_CACHE_SHM_NAME);
+		munmap(shm, size);
+		shm = NULL;
+
+		/* drop whatever the dead creator wrote */
+		if (ftruncate(fd, 0))
+			goto out;
+	}
+
+	size = block_cache_shm_size(bytes);
+	if (ftruncate(fd, size))
+		goto out;
 
-		radix_tree_clear_link(link);
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		shm = NULL;
+		goto out;
 	}
 
-	if (empty && !radix_tree_node_is_root(tree, node))
-		radix_tree_free_node(tree, node);
+	block_cache_shm_unpin(shm, size);
+
+	err = block_cache_shm_format(shm, bytes, 1);
+	if (err)
+		goto fail;
+
+	DPRINTF("created shared block cache, %"PRIu64" bytes\n", size);
+
+out:
+	if (fd != -1) {
+		flock(fd, LOCK_UN);
+		close(fd);
+	}
+	return shm;
 
-	return empty;
+fail:
+	munmap(shm, size);
+	shm = NULL;
+	goto out;
 }
 
-/*
- * walk tree and free any node that has been idle for too long
- */
-static void
-radix_tree_prune(radix_tree_t *tree)
+static block_cache_shm_t *
+block_cache_map_get(void)
 {
-	struct timeval now;
+	const char *env;
+	uint64_t bytes;
+
+	pthread_mutex_lock(&block_cache_map_lock);
+
+	if (!block_cache_map) {
+		env   = getenv("TAPDISK2_BLOCK_CACHE_SIZE");
+		bytes = (env ? strtoull(env, NULL, 0) :
+			 BLOCK_CACHE_DEFAULT_SIZE);
+		if (bytes < BLOCK_CACHE_BLOCK_SIZE)
+			bytes = BLOCK_CACHE_BLOCK_SIZE;
+
+		block_cache_map = block_cache_map_shared(bytes);
+		if (!block_cache_map) {
+			DPRINTF("no shared block cache, using a private one\n");
+			block_cache_map = block_cache_map_private(bytes);
+		}
+	}
 
-	if (!tree->root)
-		return;
+	if (block_cache_map)
+		block_cache_map_refs++;
+
+	pthread_mutex_unlock(&block_cache_map_lock);
 
-	DPRINTF("tree %s has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+	return block_cache_map;
+}
 
-	gettimeofday(&now, NULL);
-	radix_tree_prune_branch(tree, tree->root, now.tv_sec);
+static void
+block_cache_map_put(block_cache_shm_t *shm)
+{
+	pthread_mutex_lock(&block_cache_map_lock);
+
+	if (!--block_cache_map_refs) {
+		munmap(block_cache_map, block_cache_map->size);
+		block_cache_map = NULL;
+	}
 
-	DPRINTF("tree %s now has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+	pthread_mutex_unlock(&block_cache_map_lock);
 }
 
-static inline int
-radix_tree_initialize(radix_tree_t *tree, uint64_t sectors)
+/*
+ * Find or assign the image slot for @name.  A slot is recycled from
+ * the least recently opened image, with a new generation, so blocks
+ * cached for its previous owner can never be hit again.
+ */
+static int
+block_cache_get_image(block_cache_t *cache, const char *name)
 {
-	tree->height = radix_tree_calculate_height(sectors);
-	tree->root   = radix_tree_allocate_node(tree, tree->height);
-	if (!tree->root)
-		return -ENOMEM;
+	block_cache_shm_t *shm = cache->shm;
+	block_cache_image_t *img, *victim;
+	struct stat st;
+	uint64_t ino;
+	int i, err;
+
+	if (stat(name, &st)) {
+		/* not a file: go by name and size */
+		ino = 0;
+		for (i = 0; name[i]; i++)
+			ino = ino * 31 + (unsigned char)name[i];
+		memset(&st, 0, sizeof(st));
+		st.st_ino  = ino;
+		st.st_size = cache->sectors << SECTOR_SHIFT;
+	}
+
+	err = block_cache_shm_lock(shm);
+	if (err)
+		return err;
+
+	victim = NULL;
+	for (i = 0; i < BLOCK_CACHE_IMAGES; i++) {
+		img = &shm->images[i];
+
+		if (img->gen &&
+		    img->dev   == st.st_dev &&
+		    img->ino   == st.st_ino &&
+		    img->size  == st.st_size &&
+		    img->mtime == (uint64_t)st.st_mtim.tv_sec * 1000000000ULL +
+		    st.st_mtim.tv_nsec)
+			goto found;
+
+		if (!victim || img->used < victim->used)
+			victim = img;
+	}
+
+	img        = victim;
+	img->dev   = st.st_dev;
+	img->ino   = st.st_ino;
+	img->size  = st.st_size;
+	img->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL +
+		st.st_mtim.tv_nsec;
+	if (!++img->gen)
+		img->gen++;
+
+found:
+	img->used   = ++shm->clock;
+	cache->image = img - shm->images;
+	cache->gen   = img->gen;
+
+	block_cache_shm_unlock(shm);
 
 	return 0;
 }
 
-static inline void
-radix_tree_free(radix_tree_t *tree)
+/*
+ * Copy out a block aligned range if every block of it is cached.
+ */
+static int
+block_cache_lookup(block_cache_t *cache, uint64_t block, int n, char *buf)
 {
-	radix_tree_destroy(tree);
+	block_cache_shm_t *shm = cache->shm;
+	block_cache_entry_t *e[BLOCK_CACHE_MAX_BLOCKS];
+	int i, hit;
+
+	if (block_cache_shm_lock(shm))
+		return 0;
+
+	hit = 1;
+	for (i = 0; i < n; i++) {
+		e[i] = block_cache_find(shm, cache->image, cache->gen,
+					block + i);
+		if (!e[i] || !block_cache_resident(e[i])) {
+			hit = 0;
+			break;
+		}
+	}
+
+	if (hit) {
+		for (i = 0; i < n; i++) {
+			memcpy(buf + (i << BLOCK_CACHE_BLOCK_SHIFT),
+			       block_cache_data(shm, e[i]->data),
+			       BLOCK_CACHE_BLOCK_SIZE);
+			block_cache_list_move(shm, e[i], BLOCK_CACHE_T2);
+		}
+		shm->stats.hits += n;
+	} else
+		shm->stats.misses += n;
+
+	block_cache_shm_unlock(shm);
+
+	return hit;
 }
 
 static void
-block_cache_prune_event(event_id_t id, char mode, void *private)
+block_cache_insert(block_cache_t *cache, uint64_t block, int n, char *buf)
 {
-	radix_tree_t *tree;
-	block_cache_t *cache;
+	block_cache_shm_t *shm = cache->shm;
+	block_cache_entry_t *e;
+	int i, list;
+
+	if (block_cache_shm_lock(shm))
+		return;
+
+	for (i = 0; i < n; i++) {
+		e = block_cache_find(shm, cache->image, cache->gen, block + i);
+		if (e && block_cache_resident(e))
+			continue; /* raced with another reader */
 
-	cache = (block_cache_t *)private;
-	tree  = &cache->tree;
+		e = block_cache_arc_admit(shm, cache->image, cache->gen,
+					  block + i, &list);
+		if (!e)
+			break;
 
-	radix_tree_prune(tree);
+		DBG("%s: populating block 0x%08"PRIx64"\n",
+		    cache->name, block + i);
+
+		memcpy(block_cache_data(shm, e->data),
+		       buf + (i << BLOCK_CACHE_BLOCK_SHIFT),
+		       BLOCK_CACHE_BLOCK_SIZE);
+		block_cache_list_add(shm, e, list);
+		shm->stats.inserts++;
+	}
+
+	block_cache_shm_unlock(shm);
 }
 
 static inline block_cache_request_t *
@@ -520,13 +940,12 @@ static int
 block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
 	int i, err;
-	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	if (!td_flag_test(flags, TD_OPEN_RDONLY))
 		return -EINVAL;
 
-	if (driver->info.sector_size != RADIX_TREE_NODE_SIZE)
+	if (driver->info.sector_size != DEFAULT_SECTOR_SIZE)
 		return -EINVAL;
 
 	cache = (block_cache_t *)driver->data;
@@ -536,169 +955,100 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	cache->sectors = driver->info.size;
 
-	tree = &cache->tree;
-	err  = radix_tree_initialize(tree, cache->sectors);
+	cache->shm = block_cache_map_get();
+	if (!cache->shm) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = block_cache_get_image(cache, name);
 	if (err)
 		goto fail;
 
-	tree->cache = cache;
 	cache->requests_free = BLOCK_CACHE_REQUESTS;
 	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
 		cache->request_free_list[i] = cache->requests + i;
 
-	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
-							  -1, /* dummy fd */
-							  BLOCK_CACHE_PAGE_IDLETIME << 1,
-							  block_cache_prune_event,
-							  cache);
-	if (cache->timeout_id < 0)
-		goto fail;
-
 	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
-		"tree: %p, height: %d\n",
-		cache->name, cache->sectors, tree, tree->height);
-
-	if (mlockall(MCL_CURRENT | MCL_FUTURE))
-		DPRINTF("mlockall failed: %d\n", -errno);
+		"image: %u, gen: %u, blocks: %u\n",
+		cache->name, cache->sectors, cache->image, cache->gen,
+		cache->shm->blocks);
 
 	return 0;
 
 fail:
+	if (cache->shm)
+		block_cache_map_put(cache->shm);
+	cache->shm = NULL;
 	free(cache->name);
-	radix_tree_free(&cache->tree);
 	return err;
 }
 
 static int
 block_cache_close(td_driver_t *driver)
 {
-	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
 
 	DPRINTF("closing cache for %s\n", cache->name);
 
-	tapdisk_server_unregister_event(cache->timeout_id);
-	radix_tree_free(tree);
+	block_cache_map_put(cache->shm);
+	cache->shm = NULL;
 	free(cache->name);
 
 	return 0;
 }
 
-static inline uint64_t
-block_cache_hash(block_cache_t *cache, char *buf)
-{
-	int i, n;
-	uint64_t cksm, *data;
-
-	return 0;
-
-	cksm = 0;
-	data = (uint64_t *)buf;
-	n    = RADIX_TREE_NODE_SIZE / sizeof(uint64_t);
-
-	for (i = 0; i < n; i++)
-		cksm += data[i];
-
-	return ~cksm;
-}
-
-static void
-block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
-{
-	int i;
-	off_t off;
-
-	cache->stats.hits += treq.secs;
-
-	for (i = 0; i < treq.secs; i++) {
-		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
-		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
-
-		off = i << RADIX_TREE_NODE_SHIFT;
-		memcpy(treq.buf + off, iov[i], RADIX_TREE_NODE_SIZE);
-	}
-
-	td_complete_request(treq, 0);
-}
-
 static void
 block_cache_populate_cache(td_request_t clone, int err)
 {
-	int i;
-	radix_tree_t *tree;
 	block_cache_t *cache;
 	block_cache_request_t *breq;
 
 	breq        = (block_cache_request_t *)clone.cb_data;
 	cache       = breq->cache;
-	tree        = &cache->tree;
 	breq->secs -= clone.secs;
 	breq->err   = (breq->err ? breq->err : err);
 
 	if (breq->secs)
 		return;
 
-	if (breq->err) {
-		free(breq->buf);
-		goto out;
-	}
+	if (!breq->err)
+		block_cache_insert(cache,
+				   breq->treq.sec >> BLOCK_CACHE_BLOCK_SECS_SHIFT,
+				   breq->treq.secs >> BLOCK_CACHE_BLOCK_SECS_SHIFT,
+				   breq->treq.buf);
 
-	for (i = 0; i < breq->treq.secs; i++) {
-		off_t off = i << RADIX_TREE_NODE_SHIFT;
-		DBG("%s: populating sec 0x%08llx\n",
-		    cache->name, breq->treq.sec + i);
-		memcpy(breq->treq.buf + off,
-		       breq->buf + off, RADIX_TREE_NODE_SIZE);
-	}
-
-	if (radix_tree_add_leaves(tree, breq->buf,
-				  breq->treq.sec, breq->treq.secs))
-		free(breq->buf);
-
-out:
 	td_complete_request(breq->treq, breq->err);
 	block_cache_put_request(cache, breq);
 }
 
+/*
+ * Misses are read into the caller's buffer and copied into the cache
+ * on completion.
+ */
 static void
 block_cache_miss(block_cache_t *cache, td_request_t treq)
 {
-	char *buf;
-	size_t size;
 	td_request_t clone;
-	radix_tree_t *tree;
 	block_cache_request_t *breq;
 
-	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
+	DBG("%s: block cache miss: sec 0x%08"PRIx64"\n", cache->name, treq.sec);
 
 	clone = treq;
-	tree  = &cache->tree;
-	size  = treq.secs << RADIX_TREE_NODE_SHIFT;
 
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
-		goto out;
-
 	breq = block_cache_get_request(cache);
 	if (!breq)
 		goto out;
 
-	if (posix_memalign((void **)&buf, RADIX_TREE_NODE_SIZE, size)) {
-		block_cache_put_request(cache, breq);
-		goto out;
-	}
-
 	breq->treq    = treq;
 	breq->secs    = treq.secs;
 	breq->err     = 0;
-	breq->buf     = buf;
 	breq->cache   = cache;
 
-	clone.buf     = buf;
 	clone.cb      = block_cache_populate_cache;
 	clone.cb_data = breq;
 
@@ -709,26 +1059,31 @@ out:
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
-	int i;
-	radix_tree_t *tree;
 	block_cache_t *cache;
-	char *iov[BLOCK_CACHE_NODES_PER_PAGE];
+	uint64_t block;
+	int n;
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
 
 	cache->stats.reads += treq.secs;
 
-	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
+	/* only whole blocks are cached */
+	if ((treq.sec | treq.secs) & (BLOCK_CACHE_BLOCK_SECS - 1) ||
+	    treq.secs > BLOCK_CACHE_MAX_BLOCKS * BLOCK_CACHE_BLOCK_SECS) {
+		cache->stats.uncached += treq.secs;
 		return td_forward_request(treq);
-
-	for (i = 0; i < treq.secs; i++) {
-		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
-		if (!iov[i])
-			return block_cache_miss(cache, treq);
 	}
 
-	return block_cache_hit(cache, treq, iov);
+	block = treq.sec >> BLOCK_CACHE_BLOCK_SECS_SHIFT;
+	n     = treq.secs >> BLOCK_CACHE_BLOCK_SECS_SHIFT;
+
+	if (!block_cache_lookup(cache, block, n, treq.buf))
+		return block_cache_miss(cache, treq);
+
+	DBG("%s: block cache hit: sec 0x%08"PRIx64"\n", cache->name, treq.sec);
+
+	cache->stats.hits += treq.secs;
+	td_complete_request(treq, 0);
 }
 
 static void
@@ -764,13 +1119,25 @@ block_cache_debug(td_driver_t *driver)
 {
 	block_cache_t *cache;
 	block_cache_stats_t *stats;
+	block_cache_shm_t *shm;
 
 	cache = (block_cache_t *)driver->data;
 	stats = &cache->stats;
+	shm   = cache->shm;
 
 	WARN("BLOCK CACHE %s\n", cache->name);
-	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
-	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", "
+	     "uncached: %"PRIu64"\n",
+	     stats->reads, stats->hits, stats->misses, stats->uncached);
+	WARN("shared: blocks: %u, p: %u, t1: %u, t2: %u, b1: %u, b2: %u, "
+	     "hits: %"PRIu64", misses: %"PRIu64", inserts: %"PRIu64", "
+	     "evictions: %"PRIu64", ghost hits: %"PRIu64", "
+	     "resets: %"PRIu64"\n",
+	     shm->blocks, shm->p,
+	     shm->lists[BLOCK_CACHE_T1].size, shm->lists[BLOCK_CACHE_T2].size,
+	     shm->lists[BLOCK_CACHE_B1].size, shm->lists[BLOCK_CACHE_B2].size,
+	     shm->stats.hits, shm->stats.misses, shm->stats.inserts,
+	     shm->stats.evictions, shm->stats.ghost_hits, shm->stats.resets);
 }
 
 struct tap_disk tapdisk_block_cache = {
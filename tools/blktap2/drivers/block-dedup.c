@@ -0,0 +1,1877 @@
+/* 
+ * Copyright (c) 2010, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "md5.h"
+#include "list.h"
+#include "dedup.h"
+#include "tapdisk.h"
+#include "tapdisk-utils.h"
+#include "tapdisk-server.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+
+#ifdef DEBUG
+#define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
+#else
+#define DBG(_f, _a...) ((void)0)
+#endif
+
+#define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
+
+/*
+ * Writes are hashed a chunk at a time.  A chunk whose digest is in the
+ * index, and whose stored data compares equal, takes a reference on
+ * the stored copy instead of being written; anything else gets a new
+ * chunk.  Chunks of zeroes map to chunk 0 and are never stored.
+ *
+ * Every tapdisk using a store maps its index shared, so the hash index
+ * lives in memory once per host and lookups never touch the disk.
+ * Updates are serialized by a robust process-shared mutex in the index
+ * header between processes and by a mutex between the threads of one
+ * process; nothing does i/o under either.  The chunk data is read
+ * through the page cache, so guests booting from the same blocks share
+ * them there too.
+ *
+ * Writes to the same chunk are serialized, so the read-modify-write of
+ * a partial chunk sees the previous write.  The write path never waits
+ * for the disk: merge and compare reads and chunk writes are queued
+ * like any other i/o, and syncs are batched into commits, run by a
+ * helper thread per image, which sync the chunk data and the index and
+ * map pages dirtied since the previous commit.
+ *
+ * Metadata is ordered so that a crash can only leak chunks: a write
+ * updates the map once a commit has synced its chunks and references,
+ * completes once a second commit has synced the map, and only then
+ * drops the references on the chunks it replaced.
+ */
+#define DEDUP_MAX_CHUNKS          (MAX_SEGMENTS_PER_REQ + 1) /* per request */
+#define DEDUP_REQUESTS            TAPDISK_DATA_REQUESTS
+#define DEDUP_REFS_MAX            ((uint32_t)-1)
+
+#define DEDUP_WRITE_MERGE         1 /* reading partial chunks */
+#define DEDUP_WRITE_STORE         2 /* comparing and writing chunks */
+
+typedef struct dedup_store        dedup_store_t;
+typedef struct dedup_mapping      dedup_mapping_t;
+typedef struct dedup_op           dedup_op_t;
+typedef struct dedup_request      dedup_request_t;
+typedef struct dedup_commit       dedup_commit_t;
+typedef struct dedup_stats        dedup_stats_t;
+typedef struct tddedup_state      tddedup_state_t;
+
+/*
+ * Mappings replaced when the index grows are kept until the store is
+ * closed: a commit may still be syncing through them.
+ */
+struct dedup_mapping {
+	void                         *addr;
+	size_t                        size;
+	dedup_mapping_t              *next;
+};
+
+struct dedup_store {
+	char                         *path;
+	dev_t                         dev;
+	ino_t                         ino;
+	int                           refs;
+
+	int                           index_fd;
+	int                           chunks_fd;
+
+	pthread_mutex_t               lock;
+	struct dedup_index_header    *index;
+	struct dedup_index_header    *locked;     /* mapping locked through */
+	size_t                        index_size; /* mapped */
+	uint32_t                      chunks;     /* mapped */
+	dedup_mapping_t              *retired;
+
+	dedup_store_t                *next;
+};
+
+struct dedup_op {
+	uint64_t                      block;
+	uint32_t                      id;
+	uint32_t                      old;
+	int                           fresh;      /* new chunk, to write */
+	int                           verify;     /* digest hit, to compare */
+	uint8_t                       digest[DEDUP_DIGEST_SIZE];
+
+	char                         *buf;
+	char                         *bounce;     /* partial chunk write */
+	char                         *cmp;        /* stored copy of a hit */
+	size_t                        bytes;
+	uint64_t                      offset;     /* in the chunk file */
+
+	struct tiocb                  tiocb;
+	dedup_request_t              *req;
+};
+
+struct dedup_request {
+	td_request_t                  treq;
+	tddedup_state_t              *state;
+	int                           write;
+	int                           stage;
+	int                           err;
+	int                           pending;
+	int                           nr_ops;
+	dedup_op_t                    ops[DEDUP_MAX_CHUNKS];
+
+	struct list_head              inflight;   /* until the map is updated */
+	struct list_head              next;
+};
+
+struct dedup_commit {
+	pthread_t                     thread;
+	pthread_mutex_t               lock;
+	pthread_cond_t                cond;
+	int                           queued;
+	int                           stop;
+	int                           err;
+
+	int                           pipe[2];
+	event_id_t                    event;
+	int                           busy;
+
+	/* what the commit syncs */
+	int                           sync_chunks;
+	int                           index_all;
+	char                         *index;
+	size_t                        index_size;
+	uint8_t                      *index_dirty;
+	size_t                        index_pages;
+	uint8_t                      *map_dirty;
+
+	struct list_head              apply;      /* to map when synced */
+	struct list_head              complete;   /* to complete when synced */
+};
+
+struct dedup_stats {
+	uint64_t                      reads;
+	uint64_t                      writes;
+	uint64_t                      zero;
+	uint64_t                      shared;
+	uint64_t                      stored;
+	uint64_t                      mismatches;
+	uint64_t                      waits;
+	uint64_t                      commits;
+};
+
+struct tddedup_state {
+	char                         *name;
+	int                           fd;
+	int                           rdonly;
+	td_driver_t                  *driver;
+
+	struct dedup_vdi_header      *header;
+	uint32_t                     *map;
+	size_t                        map_size;   /* mapped, header included */
+	size_t                        map_pages;
+	uint8_t                      *map_dirty;
+
+	dedup_store_t                *store;
+	int                           chunks_dirty;
+	int                           index_all;
+	uint8_t                      *index_dirty; /* store locked */
+	size_t                        index_pages;
+
+	dedup_request_t               requests[DEDUP_REQUESTS];
+	dedup_request_t              *request_free_list[DEDUP_REQUESTS];
+	int                           requests_free;
+
+	struct list_head              writes;     /* in flight */
+	struct list_head              waiting;    /* on a chunk in flight */
+	struct list_head              written;    /* for the next commit */
+	struct list_head              mapped;     /* for the next commit */
+	dedup_commit_t                commit;
+
+	dedup_stats_t                 stats;
+};
+
+/* stores are shared by all images and threads of a process */
+static pthread_mutex_t dedup_stores_lock = PTHREAD_MUTEX_INITIALIZER;
+static dedup_store_t *dedup_stores;
+
+static inline size_t
+dedup_align(size_t size, size_t align)
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+static inline size_t
+dedup_index_bytes(uint64_t entries_off, uint32_t chunks)
+{
+	return entries_off + (size_t)chunks * sizeof(struct dedup_chunk);
+}
+
+static inline size_t
+dedup_pages(size_t bytes)
+{
+	return dedup_align(bytes, DEDUP_PAGE_SIZE) / DEDUP_PAGE_SIZE;
+}
+
+static inline size_t
+dedup_bitmap_size(size_t pages)
+{
+	return (pages + 7) >> 3;
+}
+
+static inline void
+dedup_set_dirty(uint8_t *dirty, size_t first, size_t last)
+{
+	for (; first <= last; first++)
+		dirty[first >> 3] |= 1 << (first & 7);
+}
+
+static inline int
+dedup_test_dirty(const uint8_t *dirty, size_t page)
+{
+	return dirty[page >> 3] & (1 << (page & 7));
+}
+
+static inline uint32_t *
+dedup_buckets(dedup_store_t *store)
+{
+	return (uint32_t *)((char *)store->index + store->index->buckets_off);
+}
+
+static inline struct dedup_chunk *
+dedup_chunk(dedup_store_t *store, uint32_t id)
+{
+	struct dedup_chunk *entries;
+
+	entries = (struct dedup_chunk *)
+		((char *)store->index + store->index->entries_off);
+
+	return entries + id;
+}
+
+static inline uint32_t *
+dedup_bucket(dedup_store_t *store, const uint8_t *digest)
+{
+	uint32_t hash;
+
+	memcpy(&hash, digest, sizeof(hash));
+	hash &= (1U << store->index->hash_bits) - 1;
+
+	return dedup_buckets(store) + hash;
+}
+
+static int
+dedup_chunk_is_zero(const char *buf)
+{
+	const uint64_t *p = (const uint64_t *)buf;
+	int i;
+
+	for (i = 0; i < DEDUP_CHUNK_SIZE / sizeof(*p); i++)
+		if (p[i])
+			return 0;
+
+	return 1;
+}
+
+static int
+dedup_store_file(char *name, size_t size, const char *path, const char *file)
+{
+	if (snprintf(name, size, "%s/%s", path, file) >= size)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+static int
+dedup_store_map(dedup_store_t *store)
+{
+	struct dedup_index_header hdr;
+	dedup_mapping_t *retired;
+	size_t size;
+	void *index;
+
+	if (pread(store->index_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return -EIO;
+
+	if (hdr.magic != DEDUP_INDEX_MAGIC || hdr.version != DEDUP_VERSION ||
+	    hdr.chunk_shift != DEDUP_CHUNK_SHIFT || hdr.hash_bits > 30)
+		return -EINVAL;
+
+	retired = NULL;
+	if (store->index) {
+		retired = malloc(sizeof(*retired));
+		if (!retired)
+			return -ENOMEM;
+	}
+
+	size  = dedup_index_bytes(hdr.entries_off, hdr.chunks);
+	index = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED, store->index_fd, 0);
+	if (index == MAP_FAILED) {
+		free(retired);
+		return -errno;
+	}
+
+	if (retired) {
+		retired->addr  = store->index;
+		retired->size  = store->index_size;
+		retired->next  = store->retired;
+		store->retired = retired;
+	}
+
+	store->index      = index;
+	store->index_size = size;
+	store->chunks     = hdr.chunks;
+
+	return 0;
+}
+
+static int
+dedup_store_lock(dedup_store_t *store)
+{
+	struct dedup_index_header *index;
+	int err;
+
+	pthread_mutex_lock(&store->lock);
+
+	index = store->index;
+
+	err = pthread_mutex_lock(&index->lock);
+	if (err == EOWNERDEAD) {
+		WARN("dedup store %s: a tapdisk died holding the index lock\n",
+		     store->path);
+		err = pthread_mutex_consistent(&index->lock);
+	}
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+
+	store->locked = index;
+
+	/* another tapdisk may have grown the index */
+	if (index->chunks != store->chunks) {
+		err = dedup_store_map(store);
+		if (err) {
+			pthread_mutex_unlock(&index->lock);
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	pthread_mutex_unlock(&store->lock);
+	return err;
+}
+
+static void
+dedup_store_unlock(dedup_store_t *store)
+{
+	pthread_mutex_unlock(&store->locked->lock);
+	pthread_mutex_unlock(&store->lock);
+}
+
+static int
+dedup_store_sync(dedup_store_t *store)
+{
+	if (msync(store->index, store->index_size, MS_SYNC))
+		return -errno;
+
+	return 0;
+}
+
+/* note index pages changed for the next commit of @s.  Called locked. */
+static void
+dedup_index_dirty(tddedup_state_t *s, const void *p, size_t len)
+{
+	dedup_store_t *store = s->store;
+	size_t first, last, pages, size;
+	uint8_t *dirty;
+
+	first = ((const char *)p - (char *)store->index) / DEDUP_PAGE_SIZE;
+	last  = ((const char *)p - (char *)store->index + len - 1) /
+		DEDUP_PAGE_SIZE;
+
+	if (last >= s->index_pages) {
+		pages = dedup_pages(store->index_size);
+		size  = dedup_bitmap_size(pages);
+		dirty = realloc(s->index_dirty, size);
+		if (!dirty) {
+			s->index_all = 1;
+			return;
+		}
+
+		memset(dirty + dedup_bitmap_size(s->index_pages), 0,
+		       size - dedup_bitmap_size(s->index_pages));
+		s->index_dirty = dirty;
+		s->index_pages = pages;
+	}
+
+	dedup_set_dirty(s->index_dirty, first, last);
+}
+
+static inline void
+dedup_chunk_dirty(tddedup_state_t *s, struct dedup_chunk *chunk)
+{
+	dedup_index_dirty(s, chunk, sizeof(*chunk));
+}
+
+static inline void
+dedup_header_dirty(tddedup_state_t *s)
+{
+	dedup_index_dirty(s, s->store->index, sizeof(*s->store->index));
+}
+
+static void
+dedup_map_dirty(tddedup_state_t *s, const uint32_t *entry)
+{
+	size_t page;
+
+	page = ((const char *)entry - (char *)s->header) / DEDUP_PAGE_SIZE;
+	dedup_set_dirty(s->map_dirty, page, page);
+}
+
+static int
+dedup_store_grow(dedup_store_t *store)
+{
+	uint32_t chunks;
+	size_t size;
+	int err;
+
+	chunks = store->index->chunks;
+	if (chunks >= (DEDUP_REFS_MAX >> 1))
+		return -ENOSPC;
+
+	chunks <<= 1;
+	size     = dedup_index_bytes(store->index->entries_off, chunks);
+
+	if (ftruncate(store->index_fd, size))
+		return -errno;
+
+	store->index->chunks = chunks;
+
+	err = dedup_store_map(store);
+	if (err)
+		return err;
+
+	DPRINTF("dedup store %s grown to %u chunks\n", store->path, chunks);
+	return 0;
+}
+
+static int
+dedup_store_alloc(tddedup_state_t *s, uint32_t *_id)
+{
+	dedup_store_t *store = s->store;
+	struct dedup_index_header *index;
+	uint32_t id;
+	int err;
+
+	index = store->index;
+
+	if (index->free) {
+		id          = index->free;
+		index->free = dedup_chunk(store, id)->hnext;
+	} else {
+		if (index->used == index->chunks) {
+			err = dedup_store_grow(store);
+			if (err)
+				return err;
+			index = store->index;
+		}
+		id = index->used++;
+	}
+
+	dedup_header_dirty(s);
+
+	*_id = id;
+	return 0;
+}
+
+/*
+ * Add a new chunk for @op, to be written.  It is hashed once written,
+ * so that nobody compares against data not yet there.  Called locked.
+ */
+static int
+dedup_store_add(tddedup_state_t *s, dedup_op_t *op)
+{
+	dedup_store_t *store = s->store;
+	struct dedup_chunk *chunk;
+	uint32_t id;
+	int err;
+
+	err = dedup_store_alloc(s, &id);
+	if (err)
+		return err;
+
+	chunk = dedup_chunk(store, id);
+
+	memcpy(chunk->digest, op->digest, DEDUP_DIGEST_SIZE);
+	chunk->refs  = 1;
+	chunk->hnext = 0;
+
+	store->index->live++;
+	store->index->refs++;
+	s->stats.stored++;
+
+	dedup_chunk_dirty(s, chunk);
+
+	op->id    = id;
+	op->fresh = 1;
+	return 0;
+}
+
+/* hash the new chunk of @op.  Called locked. */
+static void
+dedup_store_hash(tddedup_state_t *s, dedup_op_t *op)
+{
+	dedup_store_t *store = s->store;
+	struct dedup_chunk *chunk;
+	uint32_t *bucket;
+
+	bucket = dedup_bucket(store, op->digest);
+	chunk  = dedup_chunk(store, op->id);
+
+	chunk->hnext = *bucket;
+	*bucket      = op->id;
+
+	dedup_chunk_dirty(s, chunk);
+	dedup_index_dirty(s, bucket, sizeof(*bucket));
+}
+
+/*
+ * Take a reference on a chunk with the digest of @op, to be compared
+ * with it, or else add a new one.  Called locked.
+ */
+static int
+dedup_store_get(tddedup_state_t *s, dedup_op_t *op)
+{
+	dedup_store_t *store = s->store;
+	struct dedup_chunk *chunk;
+	uint32_t id;
+
+	for (id = *dedup_bucket(store, op->digest); id; id = chunk->hnext) {
+		chunk = dedup_chunk(store, id);
+		if (memcmp(chunk->digest, op->digest, DEDUP_DIGEST_SIZE) ||
+		    chunk->refs == DEDUP_REFS_MAX)
+			continue;
+
+		chunk->refs++;
+		store->index->refs++;
+
+		dedup_chunk_dirty(s, chunk);
+		dedup_header_dirty(s);
+
+		op->id     = id;
+		op->verify = 1;
+		return 0;
+	}
+
+	return dedup_store_add(s, op);
+}
+
+/* drop a reference on @id.  Called locked. */
+static void
+dedup_store_put(tddedup_state_t *s, uint32_t id)
+{
+	dedup_store_t *store = s->store;
+	struct dedup_chunk *chunk, *prev;
+	uint32_t *link;
+
+	if (!id)
+		return;
+
+	chunk = dedup_chunk(store, id);
+	if (!chunk->refs) {
+		WARN("dedup store %s: chunk %u has no references\n",
+		     store->path, id);
+		return;
+	}
+
+	dedup_chunk_dirty(s, chunk);
+	dedup_header_dirty(s);
+
+	store->index->refs--;
+	if (--chunk->refs)
+		return;
+
+	link = dedup_bucket(store, chunk->digest);
+	while (*link != id) {
+		if (!*link) {
+			WARN("dedup store %s: chunk %u not hashed\n",
+			     store->path, id);
+			goto free;
+		}
+		prev = dedup_chunk(store, *link);
+		link = &prev->hnext;
+	}
+	*link = chunk->hnext;
+	dedup_index_dirty(s, link, sizeof(*link));
+
+free:
+	memset(chunk->digest, 0, DEDUP_DIGEST_SIZE);
+	chunk->hnext       = store->index->free;
+	store->index->free = id;
+	store->index->live--;
+}
+
+static dedup_store_t *
+dedup_store_open(const char *path)
+{
+	char name[PATH_MAX];
+	dedup_store_t *store;
+	struct stat st;
+	int err;
+
+	store = calloc(1, sizeof(*store));
+	if (!store)
+		return NULL;
+
+	store->index_fd  = -1;
+	store->chunks_fd = -1;
+	pthread_mutex_init(&store->lock, NULL);
+
+	if (tapdisk_namedup(&store->path, path))
+		goto fail;
+
+	if (dedup_store_file(name, sizeof(name), path, DEDUP_STORE_INDEX))
+		goto fail;
+
+	store->index_fd = open(name, O_RDWR | O_LARGEFILE);
+	if (store->index_fd == -1) {
+		DPRINTF("failed to open %s: %d\n", name, -errno);
+		goto fail;
+	}
+
+	if (dedup_store_file(name, sizeof(name), path, DEDUP_STORE_CHUNKS))
+		goto fail;
+
+	store->chunks_fd = open(name, O_RDWR | O_LARGEFILE);
+	if (store->chunks_fd == -1) {
+		DPRINTF("failed to open %s: %d\n", name, -errno);
+		goto fail;
+	}
+
+	if (fstat(store->index_fd, &st))
+		goto fail;
+
+	store->dev = st.st_dev;
+	store->ino = st.st_ino;
+
+	flock(store->index_fd, LOCK_SH);
+	err = dedup_store_map(store);
+	flock(store->index_fd, LOCK_UN);
+	if (err) {
+		DPRINTF("bad dedup store %s: %d\n", path, err);
+		goto fail;
+	}
+
+	DPRINTF("opened dedup store %s: %u of %u chunks live, "
+		"%"PRIu64" references\n", path, store->index->live,
+		store->index->chunks, store->index->refs);
+
+	return store;
+
+fail:
+	if (store->index)
+		munmap(store->index, store->index_size);
+	if (store->chunks_fd != -1)
+		close(store->chunks_fd);
+	if (store->index_fd != -1)
+		close(store->index_fd);
+	pthread_mutex_destroy(&store->lock);
+	free(store->path);
+	free(store);
+	return NULL;
+}
+
+static void
+dedup_store_close(dedup_store_t *store)
+{
+	dedup_mapping_t *retired;
+
+	dedup_store_sync(store);
+	munmap(store->index, store->index_size);
+
+	while ((retired = store->retired)) {
+		store->retired = retired->next;
+		munmap(retired->addr, retired->size);
+		free(retired);
+	}
+
+	close(store->chunks_fd);
+	close(store->index_fd);
+	pthread_mutex_destroy(&store->lock);
+	free(store->path);
+	free(store);
+}
+
+static dedup_store_t *
+dedup_store_get_ref(const char *path)
+{
+	char name[PATH_MAX];
+	dedup_store_t *store;
+	struct stat st;
+
+	if (dedup_store_file(name, sizeof(name), path, DEDUP_STORE_INDEX))
+		return NULL;
+
+	if (stat(name, &st))
+		return NULL;
+
+	pthread_mutex_lock(&dedup_stores_lock);
+
+	for (store = dedup_stores; store; store = store->next)
+		if (store->dev == st.st_dev && store->ino == st.st_ino)
+			break;
+
+	if (!store) {
+		store = dedup_store_open(path);
+		if (store) {
+			store->next  = dedup_stores;
+			dedup_stores = store;
+		}
+	}
+
+	if (store)
+		store->refs++;
+
+	pthread_mutex_unlock(&dedup_stores_lock);
+
+	return store;
+}
+
+static void
+dedup_store_put_ref(dedup_store_t *store)
+{
+	dedup_store_t **link;
+
+	pthread_mutex_lock(&dedup_stores_lock);
+
+	if (!--store->refs) {
+		for (link = &dedup_stores; *link != store;
+		     link = &(*link)->next)
+			;
+		*link = store->next;
+		dedup_store_close(store);
+	}
+
+	pthread_mutex_unlock(&dedup_stores_lock);
+}
+
+/* format a new index, its lock last but for the magic */
+static int
+dedup_store_init_index(int fd)
+{
+	struct dedup_index_header *hdr;
+	pthread_mutexattr_t attr;
+	uint64_t entries_off;
+	int err;
+
+	entries_off = dedup_align(DEDUP_PAGE_SIZE +
+				  (sizeof(uint32_t) << DEDUP_HASH_BITS),
+				  DEDUP_PAGE_SIZE);
+
+	if (ftruncate(fd, dedup_index_bytes(entries_off, DEDUP_INITIAL_CHUNKS)))
+		return -errno;
+
+	hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		return -errno;
+
+	hdr->version     = DEDUP_VERSION;
+	hdr->chunk_shift = DEDUP_CHUNK_SHIFT;
+	hdr->hash_bits   = DEDUP_HASH_BITS;
+	hdr->chunks      = DEDUP_INITIAL_CHUNKS;
+	hdr->used        = 1; /* chunk 0 is the zero block */
+	hdr->buckets_off = DEDUP_PAGE_SIZE;
+	hdr->entries_off = entries_off;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	err = -pthread_mutex_init(&hdr->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	if (!err) {
+		hdr->magic = DEDUP_INDEX_MAGIC;
+		if (msync(hdr, sizeof(*hdr), MS_SYNC) || fsync(fd))
+			err = -errno;
+	}
+
+	munmap(hdr, sizeof(*hdr));
+	return err;
+}
+
+static int
+dedup_store_create(const char *path)
+{
+	char name[PATH_MAX];
+	int err, fd;
+
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return -errno;
+
+	err = dedup_store_file(name, sizeof(name), path, DEDUP_STORE_CHUNKS);
+	if (err)
+		return err;
+
+	fd = open(name, O_RDWR | O_CREAT | O_LARGEFILE, 0644);
+	if (fd == -1)
+		return -errno;
+	close(fd);
+
+	err = dedup_store_file(name, sizeof(name), path, DEDUP_STORE_INDEX);
+	if (err)
+		return err;
+
+	fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_LARGEFILE, 0644);
+	if (fd == -1)
+		return (errno == EEXIST ? 0 : -errno);
+
+	flock(fd, LOCK_EX);
+
+	err = dedup_store_init_index(fd);
+	if (err)
+		unlink(name);
+
+	flock(fd, LOCK_UN);
+	close(fd);
+	return err;
+}
+
+/*
+ * Create the dedup image @name of @bytes on the store @store, which is
+ * created if need be.  Without a store, one named DEDUP_STORE_DEFAULT
+ * next to the image is used.
+ */
+int
+dedup_create(const char *name, uint64_t bytes, const char *store)
+{
+	struct dedup_vdi_header hdr;
+	char *dir, *tmp, path[PATH_MAX];
+	uint64_t size;
+	int err, fd;
+
+	if (!store) {
+		tmp = strdup(name);
+		if (!tmp)
+			return -ENOMEM;
+		dir = dirname(tmp);
+		err = dedup_store_file(path, sizeof(path),
+				       dir, DEDUP_STORE_DEFAULT);
+		free(tmp);
+		if (err)
+			return err;
+		store = path;
+	}
+
+	err = dedup_store_create(store);
+	if (err)
+		return err;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic   = DEDUP_VDI_MAGIC;
+	hdr.version = DEDUP_VERSION;
+	hdr.size    = bytes >> SECTOR_SHIFT;
+	hdr.blocks  = (bytes + DEDUP_CHUNK_SIZE - 1) >> DEDUP_CHUNK_SHIFT;
+
+	if (!realpath(store, hdr.store))
+		return -errno;
+
+	size = DEDUP_MAP_OFFSET + dedup_align(hdr.blocks * sizeof(uint32_t),
+					      DEDUP_PAGE_SIZE);
+
+	fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_LARGEFILE, 0644);
+	if (fd == -1)
+		return -errno;
+
+	err = 0;
+	if (ftruncate(fd, size) ||
+	    pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    fsync(fd)) {
+		err = -errno ? : -EIO;
+		unlink(name);
+	}
+
+	close(fd);
+	return err;
+}
+
+static inline dedup_request_t *
+dedup_get_request(tddedup_state_t *s)
+{
+	if (!s->requests_free)
+		return NULL;
+
+	return s->request_free_list[--s->requests_free];
+}
+
+static void
+dedup_put_request(tddedup_state_t *s, dedup_request_t *req)
+{
+	int i;
+
+	for (i = 0; i < req->nr_ops; i++) {
+		free(req->ops[i].bounce);
+		free(req->ops[i].cmp);
+	}
+
+	memset(req, 0, sizeof(*req));
+	s->request_free_list[s->requests_free++] = req;
+}
+
+static void
+dedup_release(tddedup_state_t *s, dedup_request_t *req, int old)
+{
+	dedup_op_t *op;
+	int i;
+
+	if (dedup_store_lock(s->store)) {
+		WARN("%s: leaking chunks\n", s->name);
+		return;
+	}
+
+	for (i = 0; i < req->nr_ops; i++) {
+		op = req->ops + i;
+		if (old)
+			dedup_store_put(s, op->old);
+		else {
+			/* so that the put unhashes it */
+			if (op->fresh)
+				dedup_store_hash(s, op);
+			dedup_store_put(s, op->id);
+		}
+	}
+
+	dedup_store_unlock(s->store);
+}
+
+/* sync the pages of @base marked in @dirty */
+static int
+dedup_sync_pages(char *base, size_t size, const uint8_t *dirty, size_t pages)
+{
+	size_t first, last, len;
+
+	for (first = 0; first < pages; first = last) {
+		if (!dedup_test_dirty(dirty, first)) {
+			last = first + 1;
+			continue;
+		}
+
+		for (last = first + 1; last < pages; last++)
+			if (!dedup_test_dirty(dirty, last))
+				break;
+
+		if (first * DEDUP_PAGE_SIZE >= size)
+			break;
+
+		len = (last - first) * DEDUP_PAGE_SIZE;
+		if (len > size - first * DEDUP_PAGE_SIZE)
+			len = size - first * DEDUP_PAGE_SIZE;
+
+		if (msync(base + first * DEDUP_PAGE_SIZE, len, MS_SYNC))
+			return -errno;
+	}
+
+	return 0;
+}
+
+/* hand what @s dirtied since the last commit to the next one */
+static void
+dedup_commit_prepare(tddedup_state_t *s)
+{
+	dedup_commit_t *c = &s->commit;
+	dedup_store_t *store = s->store;
+	uint8_t *dirty;
+	size_t pages;
+
+	c->sync_chunks  = s->chunks_dirty;
+	s->chunks_dirty = 0;
+
+	dirty        = c->map_dirty;
+	c->map_dirty = s->map_dirty;
+	s->map_dirty = dirty;
+	memset(s->map_dirty, 0, dedup_bitmap_size(s->map_pages));
+
+	pthread_mutex_lock(&store->lock);
+
+	c->index      = (char *)store->index;
+	c->index_size = store->index_size;
+	c->index_all  = s->index_all;
+	s->index_all  = 0;
+
+	dirty          = c->index_dirty;
+	pages          = c->index_pages;
+	c->index_dirty = s->index_dirty;
+	c->index_pages = s->index_pages;
+	s->index_dirty = dirty;
+	s->index_pages = pages;
+	if (dirty)
+		memset(dirty, 0, dedup_bitmap_size(pages));
+
+	pthread_mutex_unlock(&store->lock);
+}
+
+static int
+dedup_commit_sync(tddedup_state_t *s)
+{
+	dedup_commit_t *c = &s->commit;
+	int err;
+
+	if (c->sync_chunks && fdatasync(s->store->chunks_fd))
+		return -errno;
+
+	if (c->index_all) {
+		if (msync(c->index, c->index_size, MS_SYNC))
+			return -errno;
+	} else if (c->index_dirty) {
+		err = dedup_sync_pages(c->index, c->index_size,
+				       c->index_dirty, c->index_pages);
+		if (err)
+			return err;
+	}
+
+	return dedup_sync_pages((char *)s->header, s->map_size,
+				c->map_dirty, s->map_pages);
+}
+
+static void *
+dedup_commit_thread(void *arg)
+{
+	tddedup_state_t *s = (tddedup_state_t *)arg;
+	dedup_commit_t *c = &s->commit;
+	char msg = 0;
+	int err;
+
+	pthread_mutex_lock(&c->lock);
+
+	for (;;) {
+		while (!c->queued && !c->stop)
+			pthread_cond_wait(&c->cond, &c->lock);
+
+		if (c->stop)
+			break;
+
+		c->queued = 0;
+		pthread_mutex_unlock(&c->lock);
+
+		err = dedup_commit_sync(s);
+
+		pthread_mutex_lock(&c->lock);
+		c->err = err;
+
+		while (write(c->pipe[1], &msg, 1) == -1 && errno == EINTR)
+			;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+/* start a commit of whatever was written or mapped since the last one */
+static void
+dedup_commit(tddedup_state_t *s)
+{
+	dedup_commit_t *c = &s->commit;
+
+	if (c->busy || (list_empty(&s->written) && list_empty(&s->mapped)))
+		return;
+
+	list_splice(&s->written, &c->apply);
+	INIT_LIST_HEAD(&s->written);
+	list_splice(&s->mapped, &c->complete);
+	INIT_LIST_HEAD(&s->mapped);
+
+	dedup_commit_prepare(s);
+
+	c->busy = 1;
+	s->stats.commits++;
+
+	pthread_mutex_lock(&c->lock);
+	c->queued = 1;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static int
+dedup_write_overlaps(dedup_request_t *a, dedup_request_t *b)
+{
+	return (a->ops[0].block <= b->ops[b->nr_ops - 1].block &&
+		b->ops[0].block <= a->ops[a->nr_ops - 1].block);
+}
+
+/* does @req share a chunk with a write in flight, or queued before it? */
+static int
+dedup_write_blocked(tddedup_state_t *s, dedup_request_t *req)
+{
+	dedup_request_t *w;
+
+	list_for_each_entry(w, &s->writes, inflight)
+		if (dedup_write_overlaps(w, req))
+			return 1;
+
+	list_for_each_entry(w, &s->waiting, next) {
+		if (w == req)
+			break;
+		if (dedup_write_overlaps(w, req))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void dedup_start_write(tddedup_state_t *, dedup_request_t *);
+
+static void
+dedup_kick_waiting(tddedup_state_t *s)
+{
+	dedup_request_t *req;
+
+again:
+	list_for_each_entry(req, &s->waiting, next) {
+		if (dedup_write_blocked(s, req))
+			continue;
+
+		list_del(&req->next);
+		dedup_start_write(s, req);
+		goto again;
+	}
+}
+
+/* fail a write whose map entries were not touched */
+static void
+dedup_fail_write(dedup_request_t *req)
+{
+	tddedup_state_t *s = req->state;
+
+	dedup_release(s, req, 0);
+	list_del(&req->inflight);
+
+	td_complete_request(req->treq, req->err);
+	dedup_put_request(s, req);
+}
+
+/* a commit synced the chunks and references of @req: point the map at them */
+static void
+dedup_apply_write(tddedup_state_t *s, dedup_request_t *req)
+{
+	dedup_op_t *op;
+	int i;
+
+	for (i = 0; i < req->nr_ops; i++) {
+		op                = req->ops + i;
+		op->old           = s->map[op->block];
+		s->map[op->block] = op->id;
+		dedup_map_dirty(s, s->map + op->block);
+	}
+
+	list_del(&req->inflight);
+	list_add_tail(&req->next, &s->mapped);
+}
+
+/* a commit synced the map entries of @req: drop the chunks they replaced */
+static void
+dedup_complete_write(tddedup_state_t *s, dedup_request_t *req, int err)
+{
+	if (err)
+		/* the old chunks may still be on disk: leak them */
+		WARN("%s: map sync failed: %d\n", s->name, err);
+	else
+		dedup_release(s, req, 1);
+
+	td_complete_request(req->treq, err);
+	dedup_put_request(s, req);
+}
+
+static void
+dedup_commit_event(event_id_t id, char mode, void *private)
+{
+	tddedup_state_t *s = (tddedup_state_t *)private;
+	dedup_commit_t *c = &s->commit;
+	dedup_request_t *req, *tmp;
+	char msg;
+	int err;
+
+	while (read(c->pipe[0], &msg, 1) == -1 && errno == EINTR)
+		;
+
+	pthread_mutex_lock(&c->lock);
+	err = c->err;
+	pthread_mutex_unlock(&c->lock);
+
+	if (err)
+		WARN("%s: commit failed: %d\n", s->name, err);
+
+	list_for_each_entry_safe(req, tmp, &c->complete, next) {
+		list_del(&req->next);
+		dedup_complete_write(s, req, err);
+	}
+
+	list_for_each_entry_safe(req, tmp, &c->apply, next) {
+		list_del(&req->next);
+		if (err) {
+			req->err = err;
+			dedup_fail_write(req);
+		} else
+			dedup_apply_write(s, req);
+	}
+
+	c->busy = 0;
+
+	dedup_kick_waiting(s);
+	dedup_commit(s);
+}
+
+static void
+dedup_finish_read(dedup_request_t *req)
+{
+	td_complete_request(req->treq, req->err);
+	dedup_put_request(req->state, req);
+}
+
+static void dedup_store_chunks(dedup_request_t *);
+static void tddedup_complete(void *, struct tiocb *, int);
+
+/* all chunks of @req are written: hash the new ones, wait for a commit */
+static void
+dedup_finish_write(dedup_request_t *req)
+{
+	tddedup_state_t *s = req->state;
+	int i, fresh;
+
+	if (req->err) {
+		dedup_fail_write(req);
+		dedup_kick_waiting(s);
+		return;
+	}
+
+	fresh = 0;
+	for (i = 0; i < req->nr_ops; i++)
+		fresh |= req->ops[i].fresh;
+
+	if (fresh) {
+		if (dedup_store_lock(s->store)) {
+			/* unhashed, they are never shared */
+			WARN("%s: failed to hash new chunks\n", s->name);
+		} else {
+			for (i = 0; i < req->nr_ops; i++)
+				if (req->ops[i].fresh)
+					dedup_store_hash(s, req->ops + i);
+			dedup_store_unlock(s->store);
+		}
+	}
+
+	list_add_tail(&req->next, &s->written);
+	dedup_commit(s);
+}
+
+static void
+dedup_drop_pending(dedup_request_t *req)
+{
+	if (--req->pending)
+		return;
+
+	if (!req->write)
+		dedup_finish_read(req);
+	else if (req->stage == DEDUP_WRITE_MERGE)
+		dedup_store_chunks(req);
+	else
+		dedup_finish_write(req);
+}
+
+static void
+dedup_queue_op(tddedup_state_t *s, dedup_op_t *op, int write, char *buf)
+{
+	op->req->pending++;
+
+	if (write)
+		td_prep_write(&op->tiocb, s->store->chunks_fd, buf,
+			      op->bytes, op->offset, tddedup_complete, op);
+	else
+		td_prep_read(&op->tiocb, s->store->chunks_fd, buf,
+			     op->bytes, op->offset, tddedup_complete, op);
+
+	td_queue_tiocb(s->driver, &op->tiocb);
+}
+
+static void
+dedup_queue_chunk_write(tddedup_state_t *s, dedup_op_t *op)
+{
+	op->offset      = (uint64_t)op->id << DEDUP_CHUNK_SHIFT;
+	s->chunks_dirty = 1;
+	dedup_queue_op(s, op, 1, op->buf);
+}
+
+/* the stored copy of a digest hit is in: share it, or write a new chunk */
+static void
+dedup_verify_chunk(tddedup_state_t *s, dedup_op_t *op)
+{
+	int err;
+
+	op->verify = 0;
+
+	if (!memcmp(op->cmp, op->buf, DEDUP_CHUNK_SIZE)) {
+		s->stats.shared++;
+		return;
+	}
+
+	s->stats.mismatches++;
+
+	err = dedup_store_lock(s->store);
+	if (err)
+		goto fail;
+
+	dedup_store_put(s, op->id);
+	op->id = 0;
+
+	err = dedup_store_add(s, op);
+	dedup_store_unlock(s->store);
+	if (err)
+		goto fail;
+
+	dedup_queue_chunk_write(s, op);
+	return;
+
+fail:
+	if (!op->req->err)
+		op->req->err = err;
+}
+
+static void
+tddedup_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	dedup_op_t *op = (dedup_op_t *)arg;
+	dedup_request_t *req = op->req;
+
+	if (err && !req->err)
+		req->err = err;
+
+	if (op->verify) {
+		if (req->err)
+			op->verify = 0;
+		else
+			dedup_verify_chunk(req->state, op);
+	}
+
+	dedup_drop_pending(req);
+}
+
+/* split @treq into per-chunk ops */
+static int
+dedup_init_request(tddedup_state_t *s, dedup_request_t *req, td_request_t treq)
+{
+	uint64_t sec, end;
+	dedup_op_t *op;
+	char *buf;
+	int secs;
+
+	req->treq  = treq;
+	req->state = s;
+
+	sec = treq.sec;
+	end = treq.sec + treq.secs;
+	buf = treq.buf;
+
+	while (sec < end) {
+		if (req->nr_ops == DEDUP_MAX_CHUNKS)
+			return -EINVAL;
+
+		op        = req->ops + req->nr_ops++;
+		op->req   = req;
+		op->block = sec >> DEDUP_CHUNK_SECS_SHIFT;
+
+		secs = DEDUP_CHUNK_SECS - (sec & (DEDUP_CHUNK_SECS - 1));
+		if (secs > end - sec)
+			secs = end - sec;
+
+		op->buf    = buf;
+		op->bytes  = secs << SECTOR_SHIFT;
+		op->offset = (sec & (DEDUP_CHUNK_SECS - 1)) << SECTOR_SHIFT;
+
+		sec += secs;
+		buf += op->bytes;
+	}
+
+	return 0;
+}
+
+static void
+tddedup_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	tddedup_state_t *s = (tddedup_state_t *)driver->data;
+	dedup_request_t *req;
+	dedup_op_t *op, *run;
+	uint32_t id;
+	int i, err;
+
+	req = dedup_get_request(s);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	err = dedup_init_request(s, req, treq);
+	if (err) {
+		td_complete_request(treq, err);
+		dedup_put_request(s, req);
+		return;
+	}
+
+	s->stats.reads++;
+
+	/* hold a reference on the request while queueing */
+	req->pending = 1;
+	run          = NULL;
+
+	for (i = 0; i < req->nr_ops; i++) {
+		op = req->ops + i;
+		id = s->map[op->block];
+
+		if (!id) {
+			memset(op->buf, 0, op->bytes);
+			continue;
+		}
+
+		op->offset += (uint64_t)id << DEDUP_CHUNK_SHIFT;
+
+		/* chunks written together are usually stored together */
+		if (run &&
+		    run->offset + run->bytes == op->offset &&
+		    run->buf + run->bytes == op->buf) {
+			run->bytes += op->bytes;
+			continue;
+		}
+
+		if (run)
+			dedup_queue_op(s, run, 0, run->buf);
+		run = op;
+	}
+
+	if (run)
+		dedup_queue_op(s, run, 0, run->buf);
+
+	dedup_drop_pending(req);
+}
+
+/* read the old data of the partial chunks of @req */
+static void
+dedup_start_write(tddedup_state_t *s, dedup_request_t *req)
+{
+	dedup_op_t *op;
+	uint32_t id;
+	int i;
+
+	list_add_tail(&req->inflight, &s->writes);
+
+	req->stage   = DEDUP_WRITE_MERGE;
+	req->pending = 1;
+
+	for (i = 0; i < req->nr_ops; i++) {
+		op = req->ops + i;
+		if (op->bytes == DEDUP_CHUNK_SIZE)
+			continue;
+
+		op->bounce = malloc(DEDUP_CHUNK_SIZE);
+		if (!op->bounce) {
+			req->err = -ENOMEM;
+			break;
+		}
+
+		id = s->map[op->block];
+		if (!id) {
+			memset(op->bounce, 0, DEDUP_CHUNK_SIZE);
+			continue;
+		}
+
+		td_prep_read(&op->tiocb, s->store->chunks_fd, op->bounce,
+			     DEDUP_CHUNK_SIZE, (uint64_t)id << DEDUP_CHUNK_SHIFT,
+			     tddedup_complete, op);
+		req->pending++;
+		td_queue_tiocb(s->driver, &op->tiocb);
+	}
+
+	dedup_drop_pending(req);
+}
+
+/* hash the chunks of @req, then compare digest hits and write the rest */
+static void
+dedup_store_chunks(dedup_request_t *req)
+{
+	tddedup_state_t *s = req->state;
+	char zero[DEDUP_MAX_CHUNKS];
+	dedup_op_t *op;
+	int i, err, dirty;
+
+	if (req->err) {
+		dedup_finish_write(req);
+		return;
+	}
+
+	req->stage   = DEDUP_WRITE_STORE;
+	req->pending = 1;
+
+	/* hash outside the lock */
+	dirty = 0;
+	for (i = 0; i < req->nr_ops; i++) {
+		op = req->ops + i;
+
+		if (op->bounce) {
+			memcpy(op->bounce + op->offset, op->buf, op->bytes);
+			op->buf    = op->bounce;
+			op->bytes  = DEDUP_CHUNK_SIZE;
+			op->offset = 0;
+		}
+
+		zero[i] = dedup_chunk_is_zero(op->buf);
+		if (zero[i]) {
+			s->stats.zero++;
+			continue;
+		}
+
+		md5_sum((uint8_t *)op->buf, DEDUP_CHUNK_SIZE, op->digest);
+		dirty = 1;
+	}
+
+	if (!dirty)
+		goto out;
+
+	err = dedup_store_lock(s->store);
+	if (err)
+		goto fail;
+
+	for (i = 0; i < req->nr_ops; i++) {
+		op = req->ops + i;
+		if (zero[i])
+			continue;
+
+		err = dedup_store_get(s, op);
+		if (err)
+			break;
+	}
+
+	dedup_store_unlock(s->store);
+
+	if (err) {
+		/* nothing is queued yet */
+		i = 0;
+		goto fail;
+	}
+
+	for (i = 0; i < req->nr_ops; i++) {
+		op = req->ops + i;
+
+		if (op->fresh)
+			dedup_queue_chunk_write(s, op);
+
+		else if (op->verify) {
+			op->cmp = malloc(DEDUP_CHUNK_SIZE);
+			if (!op->cmp) {
+				op->verify = 0;
+				err        = -ENOMEM;
+				goto fail;
+			}
+
+			op->offset = (uint64_t)op->id << DEDUP_CHUNK_SHIFT;
+			dedup_queue_op(s, op, 0, op->cmp);
+		}
+	}
+
+	goto out;
+
+fail:
+	req->err = err;
+	for (; i < req->nr_ops; i++)
+		req->ops[i].verify = 0;
+out:
+	dedup_drop_pending(req);
+}
+
+static void
+tddedup_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	tddedup_state_t *s = (tddedup_state_t *)driver->data;
+	dedup_request_t *req;
+	int err;
+
+	req = dedup_get_request(s);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	err = dedup_init_request(s, req, treq);
+	if (err) {
+		td_complete_request(treq, err);
+		dedup_put_request(s, req);
+		return;
+	}
+
+	req->write = 1;
+	s->stats.writes++;
+
+	if (dedup_write_blocked(s, req)) {
+		s->stats.waits++;
+		list_add_tail(&req->next, &s->waiting);
+		return;
+	}
+
+	dedup_start_write(s, req);
+}
+
+static int
+dedup_commit_init(tddedup_state_t *s)
+{
+	dedup_commit_t *c = &s->commit;
+	int err;
+
+	INIT_LIST_HEAD(&c->apply);
+	INIT_LIST_HEAD(&c->complete);
+	c->pipe[0] = c->pipe[1] = -1;
+	c->event   = -1;
+
+	c->map_dirty = calloc(1, dedup_bitmap_size(s->map_pages));
+	if (!c->map_dirty)
+		return -ENOMEM;
+
+	if (pipe(c->pipe))
+		return -errno;
+
+	c->event = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						 c->pipe[0], 0,
+						 dedup_commit_event, s);
+	if (c->event < 0)
+		return c->event;
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+
+	err = -pthread_create(&c->thread, NULL, dedup_commit_thread, s);
+	if (err) {
+		pthread_cond_destroy(&c->cond);
+		pthread_mutex_destroy(&c->lock);
+		return err;
+	}
+
+	return 0;
+}
+
+static void
+dedup_commit_stop(tddedup_state_t *s, int started)
+{
+	dedup_commit_t *c = &s->commit;
+
+	if (started) {
+		pthread_mutex_lock(&c->lock);
+		c->stop = 1;
+		pthread_cond_signal(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+
+		pthread_join(c->thread, NULL);
+		pthread_cond_destroy(&c->cond);
+		pthread_mutex_destroy(&c->lock);
+	}
+
+	if (c->event >= 0)
+		tapdisk_server_unregister_event(c->event);
+	if (c->pipe[0] != -1)
+		close(c->pipe[0]);
+	if (c->pipe[1] != -1)
+		close(c->pipe[1]);
+}
+
+static int
+tddedup_open(td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	tddedup_state_t *s = (tddedup_state_t *)driver->data;
+	struct dedup_vdi_header *hdr;
+	struct stat st;
+	int i, err, prot;
+
+	memset(s, 0, sizeof(*s));
+	s->fd     = -1;
+	s->rdonly = td_flag_test(flags, TD_OPEN_RDONLY);
+	s->driver = driver;
+
+	INIT_LIST_HEAD(&s->writes);
+	INIT_LIST_HEAD(&s->waiting);
+	INIT_LIST_HEAD(&s->written);
+	INIT_LIST_HEAD(&s->mapped);
+
+	err = tapdisk_namedup(&s->name, name);
+	if (err)
+		return -ENOMEM;
+
+	s->fd = open(name, (s->rdonly ? O_RDONLY : O_RDWR) | O_LARGEFILE);
+	if (s->fd == -1) {
+		err = -errno;
+		DPRINTF("failed to open %s: %d\n", name, err);
+		goto fail;
+	}
+
+	if (fstat(s->fd, &st)) {
+		err = -errno;
+		goto fail;
+	}
+
+	prot        = PROT_READ | (s->rdonly ? 0 : PROT_WRITE);
+	s->map_size = st.st_size;
+	s->header   = mmap(NULL, s->map_size, prot, MAP_SHARED, s->fd, 0);
+	if (s->header == MAP_FAILED) {
+		err       = -errno;
+		s->header = NULL;
+		goto fail;
+	}
+
+	hdr = s->header;
+	if (s->map_size < DEDUP_MAP_OFFSET ||
+	    hdr->magic != DEDUP_VDI_MAGIC || hdr->version != DEDUP_VERSION ||
+	    s->map_size < DEDUP_MAP_OFFSET + hdr->blocks * sizeof(uint32_t) ||
+	    hdr->blocks < (hdr->size + DEDUP_CHUNK_SECS - 1) >>
+	    DEDUP_CHUNK_SECS_SHIFT ||
+	    !memchr(hdr->store, '\0', DEDUP_STORE_MAX)) {
+		DPRINTF("%s is not a dedup image\n", name);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	s->map       = (uint32_t *)((char *)s->header + DEDUP_MAP_OFFSET);
+	s->map_pages = dedup_pages(s->map_size);
+	s->map_dirty = calloc(1, dedup_bitmap_size(s->map_pages));
+	if (!s->map_dirty) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	s->store = dedup_store_get_ref(hdr->store);
+	if (!s->store) {
+		DPRINTF("failed to open dedup store %s\n", hdr->store);
+		err = -EIO;
+		goto fail;
+	}
+
+	err = dedup_commit_init(s);
+	if (err) {
+		DPRINTF("failed to start commits for %s: %d\n", name, err);
+		dedup_commit_stop(s, 0);
+		dedup_store_put_ref(s->store);
+		goto fail;
+	}
+
+	s->requests_free = DEDUP_REQUESTS;
+	for (i = 0; i < DEDUP_REQUESTS; i++)
+		s->request_free_list[i] = s->requests + i;
+
+	driver->info.size        = hdr->size;
+	driver->info.sector_size = DEFAULT_SECTOR_SIZE;
+	driver->info.info        = 0;
+
+	DPRINTF("opened dedup image %s on %s, sectors: %"PRIu64"\n",
+		name, hdr->store, hdr->size);
+
+	return 0;
+
+fail:
+	if (s->header)
+		munmap(s->header, s->map_size);
+	if (s->fd != -1)
+		close(s->fd);
+	free(s->map_dirty);
+	free(s->commit.map_dirty);
+	free(s->name);
+	memset(s, 0, sizeof(*s));
+	return err;
+}
+
+static int
+tddedup_close(td_driver_t *driver)
+{
+	tddedup_state_t *s = (tddedup_state_t *)driver->data;
+	int err;
+
+	DPRINTF("closing dedup image %s: reads: %"PRIu64", writes: %"PRIu64
+		", zero: %"PRIu64", shared: %"PRIu64", stored: %"PRIu64
+		", mismatches: %"PRIu64", waits: %"PRIu64", commits: %"
+		PRIu64"\n", s->name, s->stats.reads, s->stats.writes,
+		s->stats.zero, s->stats.shared, s->stats.stored,
+		s->stats.mismatches, s->stats.waits, s->stats.commits);
+
+	dedup_commit_stop(s, 1);
+
+	/* the references dropped by the last writes */
+	dedup_commit_prepare(s);
+	err = dedup_commit_sync(s);
+	if (err)
+		WARN("%s: final commit failed: %d\n", s->name, err);
+
+	dedup_store_put_ref(s->store);
+	munmap(s->header, s->map_size);
+	close(s->fd);
+	free(s->map_dirty);
+	free(s->index_dirty);
+	free(s->commit.map_dirty);
+	free(s->commit.index_dirty);
+	free(s->name);
+
+	return 0;
+}
+
+static int
+tddedup_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	return TD_NO_PARENT;
+}
+
+static int
+tddedup_validate_parent(td_driver_t *driver,
+			td_driver_t *pdriver, td_flag_t flags)
+{
+	return -EINVAL;
+}
+
+struct tap_disk tapdisk_dedup = {
+	.disk_type          = "tapdisk_dedup",
+	.flags              = 0,
+	.private_data_size  = sizeof(tddedup_state_t),
+	.td_open            = tddedup_open,
+	.td_close           = tddedup_close,
+	.td_queue_read      = tddedup_queue_read,
+	.td_queue_write     = tddedup_queue_write,
+	.td_get_parent_id   = tddedup_get_parent_id,
+	.td_validate_parent = tddedup_validate_parent,
+	.td_debug           = NULL,
+};
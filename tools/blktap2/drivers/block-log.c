@@ -27,7 +27,8 @@
  */
 
 /* Driver to sit on top of another disk and log writes, in order
- * to synchronize two distinct disks
+ * to synchronize two distinct disks, and to track changed blocks for
+ * incremental backup (see 'changed block tracking' below)
  *
  * On receipt of a control request it can export a list of dirty
  * sectors in the following format:
@@ -45,22 +46,53 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 
 #include "xc_bitops.h"
 #include "log.h"
 #include "tapdisk.h"
+#include "tapdisk-message.h"
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 
 #define MAX_CONNECTIONS 1
 
+#define CBT_MAGIC            0x74646362 /* "tdcb" */
+#define CBT_VERSION          1
+#define CBT_BLOCK_SHIFT      16 /* 64K blocks */
+#define CBT_BLOCK_SECS_SHIFT (CBT_BLOCK_SHIFT - SECTOR_SHIFT)
+#define CBT_HEADER_SIZE      4096
+#define CBT_DEFAULT_EPOCHS   16
+#define CBT_MAX_EPOCHS       256
+#define CBT_REQUESTS         TAPDISK_DATA_REQUESTS
+
 typedef struct poll_fd {
   int          fd;
   event_id_t   id;
 } poll_fd_t;
 
+/* on-disk header of the cbt file, in host byte order */
+struct cbt_header {
+  uint32_t     magic;
+  uint32_t     version;
+  uint32_t     block_shift;
+  uint32_t     slots;    /* epochs kept */
+  uint64_t     sectors;
+  uint64_t     epoch;    /* current */
+  uint64_t     oldest;
+  uint32_t     clean;    /* closed cleanly */
+};
+
+struct cbt_request {
+  td_request_t treq;
+  uint64_t     epoch;    /* at submission */
+  int          secs;     /* outstanding */
+  int          err;
+  struct tdlog_state* s;
+};
+
 struct tdlog_state {
   uint64_t     size;
 
@@ -77,6 +109,18 @@ struct tdlog_state {
 
   log_sring_t* sring;
   log_back_ring_t bring;
+
+  int          cbt;
+  int          cbt_fd;
+  char*        cbt_path;
+  struct cbt_header cbt_hdr;
+  unsigned long* cbt_map;  /* current epoch */
+  uint64_t     cbt_blocks;
+  size_t       cbt_slot_size;
+
+  struct cbt_request cbt_requests[CBT_REQUESTS];
+  struct cbt_request* cbt_free_list[CBT_REQUESTS];
+  int          cbt_free;
 };
 
 #define BDPRINTF(_f, _a...) syslog (LOG_DEBUG, "log: " _f "\n", ## _a)
@@ -581,6 +625,364 @@ static void ctl_request(event_id_t id, char mode, void *private)
   ctl_do_request(s, fd, &msg);
 }
 
+/* -- changed block tracking -- */
+
+/* Writes mark the 64K blocks they touch in the bitmap of the current
+ * epoch.  A checkpoint saves that bitmap and starts the next epoch;
+ * the bitmaps of the last few epochs are kept in a file next to the
+ * image (<image>.cbt, or under TAPDISK2_CBT_DIR for devices), one slot
+ * per epoch, so any number of backup consumers can each ask for what
+ * changed since the epoch they last copied.  TAPDISK2_CBT_EPOCHS sets
+ * how many epochs are kept.
+ *
+ * Only the current bitmap is in memory, and it reaches the file on
+ * checkpoint and close.  The file is marked in use while open: after
+ * a crash the history cannot be trusted, so it is dropped and queries
+ * for older epochs fail with ESTALE, asking for a full copy. */
+
+static char* cbt_makepath(const char* name)
+{
+  const char* dir;
+  char* res;
+
+  dir = getenv("TAPDISK2_CBT_DIR");
+  if (!dir) {
+    if (asprintf(&res, "%s.cbt", name) < 0)
+      return NULL;
+    return res;
+  }
+
+  if (asprintf(&res, "%s/%s.cbt", dir, name) < 0)
+    return NULL;
+
+  path_escape(res + strlen(dir) + 1, strlen(name));
+
+  return res;
+}
+
+static inline off_t cbt_slot_offset(struct tdlog_state* s, uint64_t epoch)
+{
+  return CBT_HEADER_SIZE + (off_t)(epoch % s->cbt_hdr.slots) * s->cbt_slot_size;
+}
+
+static int cbt_write_header(struct tdlog_state* s)
+{
+  if (pwrite(s->cbt_fd, &s->cbt_hdr, sizeof(s->cbt_hdr), 0) !=
+      sizeof(s->cbt_hdr))
+    return errno ? -errno : -EIO;
+
+  if (fdatasync(s->cbt_fd))
+    return -errno;
+
+  return 0;
+}
+
+/* save the current bitmap in its slot */
+static int cbt_write_map(struct tdlog_state* s)
+{
+  size_t bytes = bitmap_size(s->cbt_blocks);
+
+  if (pwrite(s->cbt_fd, s->cbt_map, bytes,
+	     cbt_slot_offset(s, s->cbt_hdr.epoch)) != bytes)
+    return errno ? -errno : -EIO;
+
+  return 0;
+}
+
+static int cbt_read_map(struct tdlog_state* s, uint64_t epoch,
+			unsigned long* map)
+{
+  size_t bytes = bitmap_size(s->cbt_blocks);
+
+  if (pread(s->cbt_fd, map, bytes, cbt_slot_offset(s, epoch)) != bytes)
+    return errno ? -errno : -EIO;
+
+  return 0;
+}
+
+static void cbt_mark(struct tdlog_state* s, uint64_t sector, int count)
+{
+  uint64_t blk, end;
+
+  blk = sector >> CBT_BLOCK_SECS_SHIFT;
+  end = (sector + count - 1) >> CBT_BLOCK_SECS_SHIFT;
+
+  for (; blk <= end && blk < s->cbt_blocks; blk++)
+    set_bit(blk, s->cbt_map);
+}
+
+static int cbt_open(struct tdlog_state* s, const char* name)
+{
+  struct cbt_header hdr;
+  const char* env;
+  uint32_t slots;
+  int i, rc;
+
+  s->cbt_fd = -1;
+
+  slots = CBT_DEFAULT_EPOCHS;
+  env = getenv("TAPDISK2_CBT_EPOCHS");
+  if (env)
+    slots = strtoul(env, NULL, 0);
+  if (slots < 1 || slots > CBT_MAX_EPOCHS) {
+    BWPRINTF("invalid TAPDISK2_CBT_EPOCHS %s", env);
+    return -EINVAL;
+  }
+
+  s->cbt_blocks = (s->size + (1 << CBT_BLOCK_SECS_SHIFT) - 1) >>
+    CBT_BLOCK_SECS_SHIFT;
+  s->cbt_slot_size = (bitmap_size(s->cbt_blocks) + CBT_HEADER_SIZE - 1) &
+    ~(CBT_HEADER_SIZE - 1);
+
+  s->cbt_map = bitmap_alloc(s->cbt_blocks);
+  if (!s->cbt_map) {
+    BWPRINTF("could not allocate cbt bitmap of %"PRIu64" blocks",
+	     s->cbt_blocks);
+    return -ENOMEM;
+  }
+
+  if (!(s->cbt_path = cbt_makepath(name)))
+    return -ENOMEM;
+
+  s->cbt_fd = open(s->cbt_path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+  if (s->cbt_fd < 0) {
+    rc = -errno;
+    BWPRINTF("could not open %s: %s", s->cbt_path, strerror(errno));
+    return rc;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  rc = pread(s->cbt_fd, &hdr, sizeof(hdr), 0);
+  if (rc != sizeof(hdr) || hdr.magic != CBT_MAGIC)
+    memset(&hdr, 0, sizeof(hdr));
+
+  s->cbt_hdr = hdr;
+
+  if (hdr.clean && hdr.version == CBT_VERSION &&
+      hdr.block_shift == CBT_BLOCK_SHIFT && hdr.slots == slots &&
+      hdr.sectors == s->size) {
+    rc = cbt_read_map(s, hdr.epoch, s->cbt_map);
+    if (!rc)
+      goto out;
+  }
+
+  /* unclean, resized or new: start over past any epoch handed out */
+  BDPRINTF("%s: %s changed block history", s->cbt_path,
+	   hdr.magic ? "dropping" : "creating");
+
+  s->cbt_hdr.magic       = CBT_MAGIC;
+  s->cbt_hdr.version     = CBT_VERSION;
+  s->cbt_hdr.block_shift = CBT_BLOCK_SHIFT;
+  s->cbt_hdr.slots       = slots;
+  s->cbt_hdr.sectors     = s->size;
+  s->cbt_hdr.epoch       = hdr.epoch + 1;
+  s->cbt_hdr.oldest      = s->cbt_hdr.epoch;
+
+  if (ftruncate(s->cbt_fd, 0) ||
+      ftruncate(s->cbt_fd, CBT_HEADER_SIZE + (off_t)slots * s->cbt_slot_size)) {
+    rc = -errno;
+    BWPRINTF("could not size %s: %s", s->cbt_path, strerror(errno));
+    return rc;
+  }
+
+  bitmap_clear(s->cbt_map, s->cbt_blocks);
+
+out:
+  s->cbt_hdr.clean = 0;
+  rc = cbt_write_header(s);
+  if (rc) {
+    BWPRINTF("could not write %s: %d", s->cbt_path, rc);
+    return rc;
+  }
+
+  s->cbt_free = CBT_REQUESTS;
+  for (i = 0; i < CBT_REQUESTS; i++)
+    s->cbt_free_list[i] = s->cbt_requests + i;
+
+  s->cbt = 1;
+
+  BDPRINTF("%s: tracking changes, epoch %"PRIu64" (oldest %"PRIu64")",
+	   s->cbt_path, s->cbt_hdr.epoch, s->cbt_hdr.oldest);
+
+  return 0;
+}
+
+static void cbt_close(struct tdlog_state* s)
+{
+  int rc;
+
+  if (s->cbt) {
+    rc = cbt_write_map(s);
+    if (!rc) {
+      s->cbt_hdr.clean = 1;
+      rc = cbt_write_header(s);
+    }
+    if (rc)
+      BWPRINTF("could not save %s, history will be dropped: %d",
+	       s->cbt_path, rc);
+    s->cbt = 0;
+  }
+
+  if (s->cbt_fd >= 0)
+    close(s->cbt_fd);
+  s->cbt_fd = -1;
+
+  free(s->cbt_path);
+  s->cbt_path = NULL;
+  free(s->cbt_map);
+  s->cbt_map = NULL;
+}
+
+/* close the current epoch, returning it */
+static int cbt_checkpoint(struct tdlog_state* s, uint64_t* epoch)
+{
+  struct cbt_header* hdr = &s->cbt_hdr;
+  uint64_t oldest = hdr->oldest;
+  int rc;
+
+  rc = cbt_write_map(s);
+  if (rc)
+    return rc;
+
+  *epoch = hdr->epoch++;
+  if (hdr->epoch - hdr->oldest >= hdr->slots)
+    hdr->oldest = hdr->epoch - hdr->slots + 1;
+
+  /* the header syncs the map with it */
+  rc = cbt_write_header(s);
+  if (rc) {
+    hdr->epoch--;
+    hdr->oldest = oldest;
+    return rc;
+  }
+
+  bitmap_clear(s->cbt_map, s->cbt_blocks);
+
+  BDPRINTF("%s: closed epoch %"PRIu64, s->cbt_path, *epoch);
+
+  return 0;
+}
+
+/* write the extents changed since @since to @path */
+static int cbt_query(struct tdlog_state* s, uint64_t since, const char* path,
+		     uint64_t* extents)
+{
+  unsigned long *map, *tmp;
+  uint64_t e, i, n, start, count;
+  FILE* f;
+  int rc;
+
+  if (since < s->cbt_hdr.oldest)
+    return -ESTALE;
+  if (since > s->cbt_hdr.epoch)
+    return -EINVAL;
+
+  map = bitmap_alloc(s->cbt_blocks);
+  tmp = bitmap_alloc(s->cbt_blocks);
+  if (!map || !tmp) {
+    rc = -ENOMEM;
+    goto out;
+  }
+
+  n = bitmap_size(s->cbt_blocks) / sizeof(unsigned long);
+  memcpy(map, s->cbt_map, n * sizeof(unsigned long));
+
+  for (e = since; e < s->cbt_hdr.epoch; e++) {
+    rc = cbt_read_map(s, e, tmp);
+    if (rc)
+      goto out;
+    for (i = 0; i < n; i++)
+      map[i] |= tmp[i];
+  }
+
+  f = fopen(path, "w");
+  if (!f) {
+    rc = -errno;
+    goto out;
+  }
+
+  *extents = 0;
+  for (i = 0; i < s->cbt_blocks; i++) {
+    if (!test_bit(i, map))
+      continue;
+
+    start = i;
+    while (i < s->cbt_blocks && test_bit(i, map))
+      i++;
+
+    count = (i - start) << CBT_BLOCK_SECS_SHIFT;
+    start <<= CBT_BLOCK_SECS_SHIFT;
+    if (start + count > s->size)
+      count = s->size - start;
+
+    fprintf(f, "%"PRIu64" %"PRIu64"\n", start, count);
+    (*extents)++;
+  }
+
+  rc = 0;
+  if (fclose(f))
+    rc = -errno;
+
+  BDPRINTF("%s: %"PRIu64" extents changed since epoch %"PRIu64,
+	   s->cbt_path, *extents, since);
+
+out:
+  free(tmp);
+  free(map);
+  return rc;
+}
+
+/* a checkpoint may have closed the epoch a write was marked in while
+ * it was in flight: mark it again on completion */
+static void cbt_complete(td_request_t clone, int err)
+{
+  struct cbt_request* req = (struct cbt_request*)clone.cb_data;
+  struct tdlog_state* s = req->s;
+
+  if (req->epoch != s->cbt_hdr.epoch)
+    cbt_mark(s, clone.sec, clone.secs);
+
+  req->secs -= clone.secs;
+  req->err = req->err ? req->err : err;
+  if (req->secs)
+    return;
+
+  td_complete_request(req->treq, req->err);
+  s->cbt_free_list[s->cbt_free++] = req;
+}
+
+int tdlog_cbt_control(td_driver_t* driver, tapdisk_message_cbt_t* cbt)
+{
+  struct tdlog_state* s = (struct tdlog_state*)driver->data;
+  int rc;
+
+  if (!s->cbt)
+    return -ENOENT;
+
+  switch (cbt->op) {
+  case TAPDISK_MESSAGE_CBT_INFO:
+    rc = 0;
+    break;
+  case TAPDISK_MESSAGE_CBT_CHECKPOINT:
+    rc = cbt_checkpoint(s, &cbt->epoch);
+    break;
+  case TAPDISK_MESSAGE_CBT_QUERY:
+    if (!memchr(cbt->path, 0, sizeof(cbt->path)) || cbt->path[0] != '/')
+      return -EINVAL;
+    rc = cbt_query(s, cbt->epoch, cbt->path, &cbt->extents);
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  if (cbt->op != TAPDISK_MESSAGE_CBT_CHECKPOINT)
+    cbt->epoch = s->cbt_hdr.epoch;
+  cbt->oldest = s->cbt_hdr.oldest;
+  cbt->block_size = 1 << CBT_BLOCK_SHIFT;
+
+  return rc;
+}
+
 /* -- interface -- */
 
 static int tdlog_close(td_driver_t*);
@@ -593,6 +995,18 @@ static int tdlog_open(td_driver_t* driver, const char* name, td_flag_t flags)
   memset(s, 0, sizeof(*s));
 
   s->size = driver->info.size;
+  s->ctl.fd = -1;
+  s->cbt_fd = -1;
+
+  if (td_flag_test(flags, TD_OPEN_CBT)) {
+    if ((rc = cbt_open(s, name))) {
+      tdlog_close(driver);
+      return rc;
+    }
+  }
+
+  if (!td_flag_test(flags, TD_OPEN_LOG_DIRTY))
+    return 0;
 
   if ((rc = writelog_create(s))) {
     tdlog_close(driver);
@@ -623,6 +1037,7 @@ static int tdlog_close(td_driver_t* driver)
   ctl_close(s);
   shmem_close(s);
   writelog_free(s);
+  cbt_close(s);
 
   return 0;
 }
@@ -635,10 +1050,32 @@ static void tdlog_queue_read(td_driver_t* driver, td_request_t treq)
 static void tdlog_queue_write(td_driver_t* driver, td_request_t treq)
 {
   struct tdlog_state* s = (struct tdlog_state*)driver->data;
-  int rc;
+  struct cbt_request* req;
+  td_request_t clone;
 
-  writelog_set(s, treq.sec, treq.secs);
-  td_forward_request(treq);
+  if (s->writelog)
+    writelog_set(s, treq.sec, treq.secs);
+
+  if (!s->cbt)
+    return td_forward_request(treq);
+
+  if (!s->cbt_free)
+    return td_complete_request(treq, -EBUSY);
+
+  req = s->cbt_free_list[--s->cbt_free];
+  req->treq  = treq;
+  req->epoch = s->cbt_hdr.epoch;
+  req->secs  = treq.secs;
+  req->err   = 0;
+  req->s     = s;
+
+  cbt_mark(s, treq.sec, treq.secs);
+
+  clone         = treq;
+  clone.cb      = cbt_complete;
+  clone.cb_data = req;
+
+  td_forward_request(clone);
 }
 
 static int tdlog_get_parent_id(td_driver_t* driver, td_disk_id_t* id)
@@ -77,9 +77,18 @@ struct qcow_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdqcow_state  *state;
+	uint64_t             sector;   /* guest sector, for the crypt IV */
+	uint8_t              *bounce;  /* encrypted copy of a write, kept
+					* with the slot for reuse */
+	size_t               bounce_size;
+	int                  decrypt;
 };
 
 static int decompress_cluster(struct tdqcow_state *s, uint64_t cluster_offset);
+static void encrypt_sectors(struct tdqcow_state *s, int64_t sector_num,
+                            uint8_t *out_buf, const uint8_t *in_buf,
+                            int nb_sectors, int enc,
+                            const AES_KEY *key);
 
 uint32_t gen_cksum(char *ptr, int len)
 {
@@ -94,6 +103,12 @@ uint32_t gen_cksum(char *ptr, int len)
 
 static void free_aio_state(struct tdqcow_state* s)
 {
+	int i;
+
+	if (s->aio_requests)
+		for (i = 0; i < s->max_aio_reqs; i++)
+			free(s->aio_requests[i].bounce);
+
 	free(s->aio_requests);
 	free(s->aio_free_list);
 }
@@ -209,12 +224,18 @@ void tdqcow_complete(void *arg, struct tiocb *tiocb, int err)
 	struct qcow_request *aio = (struct qcow_request *)arg;
 	struct tdqcow_state *s = aio->state;
 
+	if (aio->decrypt && !err)
+		encrypt_sectors(s, aio->sector, (uint8_t *)aio->treq.buf,
+				(uint8_t *)aio->treq.buf, aio->treq.secs, 0,
+				&s->aes_decrypt_key);
+
 	td_complete_request(aio->treq, err);
 
 	s->aio_free_list[s->aio_free_count++] = aio;
 }
 
-static void async_read(td_driver_t *driver, td_request_t treq)
+static void async_read(td_driver_t *driver, td_request_t treq,
+		       uint64_t sector)
 {
 	int size;
 	uint64_t offset;
@@ -228,9 +249,11 @@ static void async_read(td_driver_t *driver, td_request_t treq)
 	if (prv->aio_free_count == 0)
 		goto fail;
 
-	aio        = prv->aio_free_list[--prv->aio_free_count];
-	aio->treq  = treq;
-	aio->state = prv;
+	aio          = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq    = treq;
+	aio->state   = prv;
+	aio->sector  = sector;
+	aio->decrypt = !!prv->crypt_method;
 
 	td_prep_read(&aio->tiocb, prv->fd, treq.buf,
 		     size, offset, tdqcow_complete, aio);
@@ -242,10 +265,12 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
-static void async_write(td_driver_t *driver, td_request_t treq)
+static void async_write(td_driver_t *driver, td_request_t treq,
+			uint64_t sector)
 {
-	int size;
+	int size, err;
 	uint64_t offset;
+	char *data;
 	struct qcow_request *aio;
 	struct tdqcow_state *prv;
 
@@ -256,11 +281,37 @@ static void async_write(td_driver_t *driver, td_request_t treq)
 	if (prv->aio_free_count == 0)
 		goto fail;
 
-	aio        = prv->aio_free_list[--prv->aio_free_count];
-	aio->treq  = treq;
-	aio->state = prv;
+	aio          = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq    = treq;
+	aio->state   = prv;
+	aio->sector  = sector;
+	aio->decrypt = 0;
+	data         = treq.buf;
+
+	/* the guest buffer must not be modified: encrypt into a copy */
+	if (prv->crypt_method) {
+		if (aio->bounce_size < size) {
+			free(aio->bounce);
+			aio->bounce_size = 0;
+
+			err = posix_memalign((void **)&aio->bounce, 4096, size);
+			if (err) {
+				aio->bounce = NULL;
+				prv->aio_free_list[prv->aio_free_count++] = aio;
+				td_complete_request(treq, -err);
+				return;
+			}
+
+			aio->bounce_size = size;
+		}
+
+		encrypt_sectors(prv, sector, aio->bounce,
+				(uint8_t *)treq.buf, treq.secs, 1,
+				&prv->aes_encrypt_key);
+		data = (char *)aio->bounce;
+	}
 
-	td_prep_write(&aio->tiocb, prv->fd, treq.buf,
+	td_prep_write(&aio->tiocb, prv->fd, data,
 		      size, offset, tdqcow_complete, aio);
 	td_queue_tiocb(driver, &aio->tiocb);
 
@@ -273,28 +324,16 @@ fail:
 /* 
  * The crypt function is compatible with the linux cryptoloop
  * algorithm for < 4 GB images. NOTE: out_buf == in_buf is
- * supported .
+ * supported. The whole run is handed to AES in one go so it
+ * can work on several sectors at once.
  */
 static void encrypt_sectors(struct tdqcow_state *s, int64_t sector_num,
                             uint8_t *out_buf, const uint8_t *in_buf,
                             int nb_sectors, int enc,
                             const AES_KEY *key)
 {
-	union {
-		uint64_t ll[2];
-		uint8_t b[16];
-	} ivec;
-	int i;
-	
-	for (i = 0; i < nb_sectors; i++) {
-		ivec.ll[0] = cpu_to_le64(sector_num);
-		ivec.ll[1] = 0;
-		AES_cbc_encrypt(in_buf, out_buf, 512, key, 
-				ivec.b, enc);
-		sector_num++;
-		in_buf += 512;
-		out_buf += 512;
-	}
+	AES_cbc_encrypt_sectors(in_buf, out_buf, sector_num,
+				nb_sectors, key, enc);
 }
 
 int qtruncate(int fd, off_t length, int sparse)
@@ -364,6 +403,146 @@ int qtruncate(int fd, off_t length, int sparse)
 	return 0;
 }
 
+/*
+ * L2 tables are cached in a hash keyed by table offset, with clock
+ * (second chance) replacement. The cache is sized in bytes by
+ * TAPDISK2_QCOW_L2_CACHE_SIZE but holds at least L2_CACHE_SIZE tables,
+ * and never more than the image has.
+ */
+static int l2_cache_init(struct tdqcow_state *s)
+{
+	const char *env;
+	uint64_t bytes, tables, table_size;
+	int i;
+
+	env        = getenv("TAPDISK2_QCOW_L2_CACHE_SIZE");
+	bytes      = (env ? strtoull(env, NULL, 0) : L2_CACHE_DEFAULT_BYTES);
+	table_size = s->l2_size * sizeof(uint64_t);
+
+	tables = bytes / table_size;
+	if (tables > s->l1_size)
+		tables = s->l1_size;
+	if (tables > INT_MAX / 2)
+		tables = INT_MAX / 2;
+	if (tables < L2_CACHE_SIZE)
+		tables = L2_CACHE_SIZE;
+
+	s->l2_cache_size = tables;
+	for (s->l2_cache_hash_bits = 0;
+	     (1 << s->l2_cache_hash_bits) < s->l2_cache_size;
+	     s->l2_cache_hash_bits++)
+		;
+
+	if (posix_memalign((void **)&s->l2_cache, 4096, tables * table_size)) {
+		s->l2_cache = NULL;
+		return -1;
+	}
+
+	s->l2_cache_entries = calloc(tables, sizeof(struct qcow_l2_entry));
+	s->l2_cache_buckets = malloc((1 << s->l2_cache_hash_bits) *
+				     sizeof(int));
+	if (!s->l2_cache_entries || !s->l2_cache_buckets)
+		return -1;
+
+	for (i = 0; i < s->l2_cache_size; i++)
+		s->l2_cache_entries[i].next = -1;
+	for (i = 0; i < (1 << s->l2_cache_hash_bits); i++)
+		s->l2_cache_buckets[i] = -1;
+	s->l2_cache_hand = 0;
+
+	DPRINTF("L2 cache: %d tables of %"PRIu64" bytes\n",
+		s->l2_cache_size, table_size);
+
+	return 0;
+}
+
+static void l2_cache_free(struct tdqcow_state *s)
+{
+	free(s->l2_cache);
+	free(s->l2_cache_entries);
+	free(s->l2_cache_buckets);
+	s->l2_cache = NULL;
+	s->l2_cache_entries = NULL;
+	s->l2_cache_buckets = NULL;
+}
+
+static void l2_cache_reset(struct tdqcow_state *s)
+{
+	int i;
+
+	for (i = 0; i < s->l2_cache_size; i++) {
+		s->l2_cache_entries[i].offset = 0;
+		s->l2_cache_entries[i].next = -1;
+		s->l2_cache_entries[i].referenced = 0;
+	}
+	for (i = 0; i < (1 << s->l2_cache_hash_bits); i++)
+		s->l2_cache_buckets[i] = -1;
+	s->l2_cache_hand = 0;
+}
+
+static inline int l2_cache_bucket(struct tdqcow_state *s, uint64_t offset)
+{
+	/* tables are cluster aligned */
+	return (int)(((offset >> s->cluster_bits) * 0x9e3779b97f4a7c15ULL) >>
+		     (64 - s->l2_cache_hash_bits));
+}
+
+static uint64_t *l2_cache_lookup(struct tdqcow_state *s, uint64_t offset)
+{
+	struct qcow_l2_entry *e;
+	int i;
+
+	i = s->l2_cache_buckets[l2_cache_bucket(s, offset)];
+	for (; i != -1; i = e->next) {
+		e = s->l2_cache_entries + i;
+		if (e->offset == offset) {
+			e->referenced = 1;
+			return s->l2_cache + ((uint64_t)i << s->l2_bits);
+		}
+	}
+
+	return NULL;
+}
+
+/* pick a slot to load a new table into; it is unhashed until inserted */
+static int l2_cache_evict(struct tdqcow_state *s)
+{
+	struct qcow_l2_entry *e;
+	int i, *p;
+
+	for (;;) {
+		i = s->l2_cache_hand;
+		s->l2_cache_hand = (i + 1) % s->l2_cache_size;
+		e = s->l2_cache_entries + i;
+		if (!e->offset || !e->referenced)
+			break;
+		e->referenced = 0;
+	}
+
+	if (e->offset) {
+		p = s->l2_cache_buckets + l2_cache_bucket(s, e->offset);
+		while (*p != i)
+			p = &s->l2_cache_entries[*p].next;
+		*p = e->next;
+
+		e->offset = 0;
+		e->next = -1;
+	}
+
+	return i;
+}
+
+static void l2_cache_insert(struct tdqcow_state *s, int i, uint64_t offset)
+{
+	struct qcow_l2_entry *e = s->l2_cache_entries + i;
+	int b = l2_cache_bucket(s, offset);
+
+	e->offset = offset;
+	e->referenced = 1;
+	e->next = s->l2_cache_buckets[b];
+	s->l2_cache_buckets[b] = i;
+}
+
 /* 'allocate' is:
  *
  * 0 to not allocate.
@@ -382,11 +561,10 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
                                    int compressed_size,
                                    int n_start, int n_end)
 {
-	int min_index, i, j, l1_index, l2_index, l2_sector, l1_sector;
+	int cache_index, i, l1_index, l2_index, l2_sector, l1_sector;
 	char *tmp_ptr2, *l2_ptr, *l1_ptr;
 	uint64_t *tmp_ptr;
 	uint64_t l2_offset, *l2_table, cluster_offset, tmp;
-	uint32_t min_count;
 	int new_l2_table;
 
 	/*Check L1 table for the extent offset*/
@@ -457,30 +635,14 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
 	}
 
 	/*Check to see if L2 entry is already cached*/
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (l2_offset == s->l2_cache_offsets[i]) {
-			/* increment the hit count */
-			if (++s->l2_cache_counts[i] == 0xffffffff) {
-				for (j = 0; j < L2_CACHE_SIZE; j++) {
-					s->l2_cache_counts[j] >>= 1;
-				}
-			}
-			l2_table = s->l2_cache + (i << s->l2_bits);
-			goto found;
-		}
-	}
+	l2_table = l2_cache_lookup(s, l2_offset);
+	if (l2_table)
+		goto found;
 
 cache_miss:
-	/* not found: load a new entry in the least used one */
-	min_index = 0;
-	min_count = 0xffffffff;
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (s->l2_cache_counts[i] < min_count) {
-			min_count = s->l2_cache_counts[i];
-			min_index = i;
-		}
-	}
-	l2_table = s->l2_cache + (min_index << s->l2_bits);
+	/* not found: load it in place of one not recently used */
+	cache_index = l2_cache_evict(s);
+	l2_table = s->l2_cache + ((uint64_t)cache_index << s->l2_bits);
 
 	/*If extent pre-allocated, read table from disk, 
 	 *otherwise write new table to disk*/
@@ -517,8 +679,7 @@ cache_miss:
 	}
 	
 	/*Update the cache entries*/ 
-	s->l2_cache_offsets[min_index] = l2_offset;
-	s->l2_cache_counts[min_index] = 1;
+	l2_cache_insert(s, cache_index, l2_offset);
 
 found:
 	/*The extent is split into 's->l2_size' blocks of 
@@ -928,9 +1089,8 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 		goto fail;
 
 	/* alloc L2 cache */
-	size = s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t);
-	ret = posix_memalign((void **)&s->l2_cache, 4096, size);
-	if(ret != 0) goto fail;
+	if (l2_cache_init(s))
+		goto fail;
 
 	size = s->cluster_size;
 	ret = posix_memalign((void **)&s->cluster_cache, 4096, size);
@@ -972,7 +1132,7 @@ fail:
 
 	free_aio_state(s);
 	free(s->l1_table);
-	free(s->l2_cache);
+	l2_cache_free(s);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(fd);
@@ -1038,7 +1198,7 @@ coalesce_failed:
 		  clone.buf  = buf;
 		  clone.sec  = (cluster_offset>>9)+index_in_cluster;
 		  clone.secs = n;
-		  async_read(driver, clone);
+		  async_read(driver, clone, sector);
 		}
 		nb_sectors -= n;
 		sector += n;
@@ -1082,22 +1242,11 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 			return;
 		}
 
-		if (s->crypt_method) {
-			encrypt_sectors(s, sector, s->cluster_data, 
-					(unsigned char *)buf, n, 1,
-					&s->aes_encrypt_key);
-
-			clone.buf  = buf;
-			clone.sec  = (cluster_offset>>9) + index_in_cluster;
-			clone.secs = n;
-			async_write(driver, clone);
-		} else {
-		  clone.buf  = buf;
-		  clone.sec  = (cluster_offset>>9) + index_in_cluster;
-		  clone.secs = n;
-
-		  async_write(driver, clone);
-		}
+		/* async_write() encrypts if needed */
+		clone.buf  = buf;
+		clone.sec  = (cluster_offset>>9) + index_in_cluster;
+		clone.secs = n;
+		async_write(driver, clone, sector);
 		
 		nb_sectors -= n;
 		sector += n;
@@ -1167,7 +1316,7 @@ int tdqcow_close(td_driver_t *driver)
 	free_aio_state(s);
 	free(s->name);
 	free(s->l1_table);
-	free(s->l2_cache);
+	l2_cache_free(s);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(s->fd);	
@@ -1330,9 +1479,7 @@ static int qcow_make_empty(struct tdqcow_state *s)
 		return -1;
 	}
 
-	memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
+	l2_cache_reset(s);
 
 	return 0;
 }
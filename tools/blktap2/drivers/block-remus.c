@@ -37,9 +37,6 @@
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
-#include "hashtable.h"
-#include "hashtable_itr.h"
-#include "hashtable_utility.h"
 
 #include <errno.h>
 #include <inttypes.h>
@@ -60,7 +57,8 @@
 
 /* timeout for reads and writes in ms */
 #define HEARTBEAT_MS 1000
-#define RAMDISK_HASHSIZE 128
+/* largest extent built up from buffered writes, in sectors */
+#define RAMDISK_EXTENT_MAX 2048
 
 /* connect retry timeout (seconds) */
 #define REMUS_CONNRETRY_TIMEOUT 10
@@ -99,20 +97,40 @@ td_vbd_t *device_vbd = NULL;
 td_image_t *remus_image = NULL;
 struct tap_disk tapdisk_remus;
 
+/* Buffered writes are held as extents: runs of consecutive sectors and
+ * their data, kept sorted by start sector and never overlapping within a
+ * map. A write over buffered sectors updates them in place and a write
+ * that continues an extent grows it, so a large write costs a few extents
+ * rather than one hash entry per sector, and a flush is a walk over
+ * already sorted runs.
+ */
+struct ramdisk_extent {
+	uint64_t sector;
+	uint32_t secs;
+	uint32_t cap;	/* sectors allocated in buf */
+	char* buf;
+};
+
+struct ramdisk_map {
+	struct ramdisk_extent* extents;
+	int count;
+	int size;
+};
+
 struct ramdisk {
 	size_t sector_size;
-	struct hashtable* h;
-	/* when a ramdisk is flushed, h is given a new empty hash for writes
+	struct ramdisk_map* h;
+	/* when a ramdisk is flushed, h is given a new empty map for writes
 	 * while the old ramdisk (prev) is drained asynchronously.
 	 */
-	struct hashtable* prev;
+	struct ramdisk_map* prev;
 	/* count of outstanding requests to the base driver */
 	size_t inflight;
-	/* prev holds the requests to be flushed, while inprogress holds
-	 * requests being flushed. When requests complete, they are removed
+	/* prev holds the extents to be flushed, while inprogress holds
+	 * extents being flushed. When requests complete, they are removed
 	 * from inprogress.
 	 * Whenever a new flush is merged with ongoing flush (i.e, prev),
-	 * we have to make sure that none of the new requests overlap with
+	 * we have to make sure that none of the new extents overlap with
 	 * ones in "inprogress". If it does, keep it back in prev and dont issue
 	 * IO until the current one finishes. If we allow this IO to proceed,
 	 * we might end up with two "overlapping" requests in the disk's queue and
@@ -120,7 +138,7 @@ struct ramdisk {
 	 * IOW, make sure we dont create a write-after-write time ordering constraint.
 	 * 
 	 */
-	struct hashtable* inprogress;
+	struct ramdisk_map* inprogress;
 };
 
 /* the ramdisk intercepts the original callback for reads and writes.
@@ -231,6 +249,7 @@ static inline int ring_isfull(struct req_ring* ring)
 }
 /* Prototype declarations */
 static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s);
+static void ramdisk_map_remove(struct ramdisk_map* map, uint64_t sector);
 
 /* functions to create and sumbit treq's */
 
@@ -239,8 +258,6 @@ replicated_write_callback(td_request_t treq, int err)
 {
 	struct tdremus_state *s = (struct tdremus_state *) treq.cb_data;
 	td_vbd_request_t *vreq;
-	int i;
-	uint64_t start;
 	vreq = (td_vbd_request_t *) treq.private;
 
 	/* the write failed for now, lets panic. this is very bad */
@@ -254,13 +271,9 @@ replicated_write_callback(td_request_t treq, int err)
 	list_del(&vreq->next);
 	free(vreq);
 
+	/* treq.buf belongs to the extent and goes with it */
 	s->ramdisk.inflight--;
-	start = treq.sec;
-	for (i = 0; i < treq.secs; i++) {
-		hashtable_remove(s->ramdisk.inprogress, &start);
-		start++;
-	}
-	free(treq.buf);
+	ramdisk_map_remove(s->ramdisk.inprogress, treq.sec);
 
 	if (!s->ramdisk.inflight && !s->ramdisk.prev) {
 		/* TODO: the ramdisk has been flushed */
@@ -303,199 +316,244 @@ create_write_request(struct tdremus_state *state, td_sector_t sec, int secs, cha
 }
 
 
-/* http://www.concentric.net/~Ttwang/tech/inthash.htm */
-static unsigned int uint64_hash(void* k)
+static struct ramdisk_map* ramdisk_map_create(void)
 {
-	uint64_t key = *(uint64_t*)k;
+	return calloc(1, sizeof(struct ramdisk_map));
+}
+
+static void ramdisk_map_destroy(struct ramdisk_map* map)
+{
+	int i;
 
-	key = (~key) + (key << 18);
-	key = key ^ (key >> 31);
-	key = key * 21;
-	key = key ^ (key >> 11);
-	key = key + (key << 6);
-	key = key ^ (key >> 22);
+	if (!map)
+		return;
 
-	return (unsigned int)key;
+	for (i = 0; i < map->count; i++)
+		free(map->extents[i].buf);
+	free(map->extents);
+	free(map);
 }
 
-static int rd_hash_equal(void* k1, void* k2)
+/* index of the first extent ending after sector */
+static int ramdisk_map_find(struct ramdisk_map* map, uint64_t sector)
 {
-	uint64_t key1, key2;
-
-	key1 = *(uint64_t*)k1;
-	key2 = *(uint64_t*)k2;
+	int lo = 0, hi = map->count, mid;
+	struct ramdisk_extent* e;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = map->extents + mid;
+		if (e->sector + e->secs <= sector)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	return key1 == key2;
+	return lo;
 }
 
-static int ramdisk_read(struct ramdisk* ramdisk, uint64_t sector,
-			int nb_sectors, char* buf)
+/* return the extent holding sector, or NULL with next set to the first
+ * buffered sector beyond it */
+static struct ramdisk_extent* ramdisk_map_lookup(struct ramdisk_map* map,
+						 uint64_t sector,
+						 uint64_t* next)
 {
+	struct ramdisk_extent* e;
 	int i;
-	char* v;
-	uint64_t key;
 
-	for (i = 0; i < nb_sectors; i++) {
-		key = sector + i;
-		/* check whether it is queued in a previous flush request */
-		if (!(ramdisk->prev && (v = hashtable_search(ramdisk->prev, &key)))) {
-			/* check whether it is an ongoing flush */
-			if (!(ramdisk->inprogress && (v = hashtable_search(ramdisk->inprogress, &key))))
-				return -1;
-		}
-		memcpy(buf + i * ramdisk->sector_size, v, ramdisk->sector_size);
-	}
+	*next = UINT64_MAX;
+	if (!map)
+		return NULL;
 
-	return 0;
+	i = ramdisk_map_find(map, sector);
+	if (i == map->count)
+		return NULL;
+
+	e = map->extents + i;
+	if (e->sector <= sector)
+		return e;
+
+	*next = e->sector;
+	return NULL;
 }
 
-static int ramdisk_write_hash(struct hashtable* h, uint64_t sector, char* buf,
-			      size_t len)
+static int ramdisk_map_overlaps(struct ramdisk_map* map, uint64_t sector,
+				uint32_t secs)
 {
-	char* v;
-	uint64_t* key;
+	int i;
 
-	if ((v = hashtable_search(h, &sector))) {
-		memcpy(v, buf, len);
+	if (!map)
 		return 0;
-	}
 
-	if (!(v = malloc(len))) {
-		DPRINTF("ramdisk_write_hash: malloc failed\n");
-		return -1;
-	}
-	memcpy(v, buf, len);
-	if (!(key = malloc(sizeof(*key)))) {
-		DPRINTF("ramdisk_write_hash: error allocating key\n");
-		free(v);
-		return -1;
-	}
-	*key = sector;
-	if (!hashtable_insert(h, key, v)) {
-		DPRINTF("ramdisk_write_hash failed on sector %" PRIu64 "\n", sector);
-		free(key);
-		free(v);
-		return -1;
+	i = ramdisk_map_find(map, sector);
+	return i < map->count && map->extents[i].sector < sector + secs;
+}
+
+static int ramdisk_map_insert(struct ramdisk_map* map, int idx,
+			      struct ramdisk_extent* extent)
+{
+	struct ramdisk_extent* e;
+	int size;
+
+	if (map->count == map->size) {
+		size = map->size ? map->size * 2 : 64;
+		if (!(e = realloc(map->extents, size * sizeof(*e)))) {
+			DPRINTF("ramdisk_map_insert: error growing map\n");
+			return -1;
+		}
+		map->extents = e;
+		map->size = size;
 	}
 
+	e = map->extents + idx;
+	memmove(e + 1, e, (map->count - idx) * sizeof(*e));
+	*e = *extent;
+	map->count++;
+
 	return 0;
 }
 
-static inline int ramdisk_write(struct ramdisk* ramdisk, uint64_t sector,
-				int nb_sectors, char* buf)
+static void ramdisk_map_remove(struct ramdisk_map* map, uint64_t sector)
 {
-	int i, rc;
+	struct ramdisk_extent* e;
+	int i;
 
-	for (i = 0; i < nb_sectors; i++) {
-		rc = ramdisk_write_hash(ramdisk->h, sector + i,
-					buf + i * ramdisk->sector_size,
-					ramdisk->sector_size);
-		if (rc)
-			return rc;
+	i = ramdisk_map_find(map, sector);
+	if (i == map->count || map->extents[i].sector != sector) {
+		DPRINTF("ramdisk_map_remove: no extent at %"PRIu64"\n", sector);
+		return;
 	}
 
-	return 0;
+	e = map->extents + i;
+	free(e->buf);
+	memmove(e, e + 1, (map->count - i - 1) * sizeof(*e));
+	map->count--;
 }
 
-static int uint64_compare(const void* k1, const void* k2)
+/* buffers are handed to the base driver as is, so keep them aligned */
+static char* ramdisk_alloc_buf(uint32_t secs, size_t sector_size)
 {
-	uint64_t u1 = *(uint64_t*)k1;
-	uint64_t u2 = *(uint64_t*)k2;
+	void* buf;
 
-	/* u1 - u2 is unsigned */
-	return u1 < u2 ? -1 : u1 > u2 ? 1 : 0;
+	if (posix_memalign(&buf, getpagesize(), secs * sector_size))
+		return NULL;
+
+	return buf;
 }
 
-/* set psectors to an array of the sector numbers in the hash, returning
- * the number of entries (or -1 on error) */
-static int ramdisk_get_sectors(struct hashtable* h, uint64_t** psectors)
+static int ramdisk_extent_grow(struct ramdisk_extent* e, uint32_t secs,
+			       size_t sector_size)
 {
-	struct hashtable_itr* itr;
-	uint64_t* sectors;
-	int count;
-
-	if (!(count = hashtable_count(h)))
-		return 0;
+	uint32_t cap;
+	char* buf;
 
-	if (!(*psectors = malloc(count * sizeof(uint64_t)))) {
-		DPRINTF("ramdisk_get_sectors: error allocating sector map\n");
-		return -1;
+	if (e->secs + secs > e->cap) {
+		cap = MAX(e->secs + secs, MIN(e->cap * 2, RAMDISK_EXTENT_MAX));
+		if (!(buf = ramdisk_alloc_buf(cap, sector_size))) {
+			DPRINTF("ramdisk_extent_grow: allocation failed\n");
+			return -1;
+		}
+		memcpy(buf, e->buf, e->secs * sector_size);
+		free(e->buf);
+		e->buf = buf;
+		e->cap = cap;
 	}
-	sectors = *psectors;
-
-	itr = hashtable_iterator(h);
-	count = 0;
-	do {
-		sectors[count++] = *(uint64_t*)hashtable_iterator_key(itr);
-	} while (hashtable_iterator_advance(itr));
-	free(itr);
 
-	return count;
+	e->secs += secs;
+	return 0;
 }
 
-/*
-  return -1 for OOM
-  return -2 for merge lookup failure
-  return -3 for WAW race
-  return 0 on success.
-*/
-static int merge_requests(struct ramdisk* ramdisk, uint64_t start,
-			size_t count, char **mergedbuf)
+static int ramdisk_map_write(struct ramdisk_map* map, uint64_t sector,
+			     uint32_t nb_sectors, char* buf,
+			     size_t sector_size)
 {
-	char* buf;
-	char* sector;
+	struct ramdisk_extent *e, *p, new;
+	uint64_t end = sector + nb_sectors, n;
 	int i;
-	uint64_t *key;
-	int rc = 0;
 
-	if (!(buf = valloc(count * ramdisk->sector_size))) {
-		DPRINTF("merge_request: allocation failed\n");
-		return -1;
-	}
+	i = ramdisk_map_find(map, sector);
 
-	for (i = 0; i < count; i++) {
-		if (!(sector = hashtable_search(ramdisk->prev, &start))) {
-			DPRINTF("merge_request: lookup failed on %"PRIu64"\n", start);
-			free(buf);
-			rc = -2;
-			goto fail;
+	while (sector < end) {
+		e = i < map->count ? map->extents + i : NULL;
+
+		if (e && e->sector <= sector) {
+			/* already buffered: overwrite in place */
+			n = MIN(end, e->sector + e->secs) - sector;
+			memcpy(e->buf + (sector - e->sector) * sector_size,
+			       buf, n * sector_size);
+			i++;
+			goto next;
 		}
 
-		/* Check inprogress requests to avoid waw non-determinism */
-		if (hashtable_search(ramdisk->inprogress, &start)) {
-			DPRINTF("merge_request: WAR RACE on %"PRIu64"\n", start);
-			free(buf);
-			rc = -3;
-			goto fail;
+		/* a gap, up to the next extent */
+		n = (e ? MIN(end, e->sector) : end) - sector;
+		p = i > 0 ? map->extents + i - 1 : NULL;
+
+		if (p && p->sector + p->secs == sector &&
+		    p->secs + n <= RAMDISK_EXTENT_MAX) {
+			if (ramdisk_extent_grow(p, n, sector_size))
+				return -1;
+			memcpy(p->buf + (sector - p->sector) * sector_size,
+			       buf, n * sector_size);
+			goto next;
 		}
-		/* Insert req into inprogress (brief period of duplication of hash entries until
-		 * they are removed from prev. Read tracking would not be reading wrong entries)
-		 */
-		if (!(key = malloc(sizeof(*key)))) {
-			DPRINTF("%s: error allocating key\n", __FUNCTION__);
-			free(buf);			
-			rc = -1;
-			goto fail;
+
+		n = MIN(n, RAMDISK_EXTENT_MAX);
+		new.sector = sector;
+		new.secs   = n;
+		new.cap    = n;
+		if (!(new.buf = ramdisk_alloc_buf(n, sector_size))) {
+			DPRINTF("ramdisk_map_write: allocation failed\n");
+			return -1;
 		}
-		*key = start;
-		if (!hashtable_insert(ramdisk->inprogress, key, NULL)) {
-			DPRINTF("%s failed to insert sector %" PRIu64 " into inprogress hash\n", 
-				__FUNCTION__, start);
-			free(key);
-			free(buf);
-			rc = -1;
-			goto fail;
+		memcpy(new.buf, buf, n * sector_size);
+
+		if (ramdisk_map_insert(map, i, &new)) {
+			free(new.buf);
+			return -1;
 		}
-		memcpy(buf + i * ramdisk->sector_size, sector, ramdisk->sector_size);
-		start++;
+		i++;
+
+	next:
+		sector += n;
+		buf += n * sector_size;
 	}
 
-	*mergedbuf = buf;
 	return 0;
-fail:
-	for (start--; i >0; i--, start--)
-		hashtable_remove(ramdisk->inprogress, &start);
-	return rc;
+}
+
+static int ramdisk_read(struct ramdisk* ramdisk, uint64_t sector,
+			int nb_sectors, char* buf)
+{
+	struct ramdisk_extent* e;
+	uint64_t end = sector + nb_sectors, next, unused, n;
+	size_t sector_size = ramdisk->sector_size;
+
+	while (sector < end) {
+		/* check whether it is queued in a previous flush request */
+		if ((e = ramdisk_map_lookup(ramdisk->prev, sector, &next)))
+			n = MIN(end, e->sector + e->secs) - sector;
+		/* check whether it is an ongoing flush */
+		else if ((e = ramdisk_map_lookup(ramdisk->inprogress, sector,
+						 &unused)))
+			n = MIN(MIN(end, next), e->sector + e->secs) - sector;
+		else
+			return -1;
+
+		memcpy(buf, e->buf + (sector - e->sector) * sector_size,
+		       n * sector_size);
+		sector += n;
+		buf += n * sector_size;
+	}
+
+	return 0;
+}
+
+static inline int ramdisk_write(struct ramdisk* ramdisk, uint64_t sector,
+				int nb_sectors, char* buf)
+{
+	return ramdisk_map_write(ramdisk->h, sector, nb_sectors, buf,
+				 ramdisk->sector_size);
 }
 
 /* The underlying driver may not handle having the whole ramdisk queued at
@@ -504,112 +562,105 @@ fail:
  * the underlying driver */
 static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s)
 {
-	uint64_t* sectors;
-	char* buf = NULL;
-	uint64_t base, batchlen;
-	int i, j, count = 0;
+	struct ramdisk_map* prev = s->ramdisk.prev;
+	struct ramdisk_extent e;
+	int i, j, kept, rc = 0;
 
-	// RPRINTF("ramdisk flush\n");
+	if (!prev || !prev->count)
+		return 0;
 
-	if ((count = ramdisk_get_sectors(s->ramdisk.prev, &sectors)) <= 0)
-		return count;
+	/* Create the inprogress map if empty */
+	if (!s->ramdisk.inprogress &&
+	    !(s->ramdisk.inprogress = ramdisk_map_create()))
+		return -1;
 
-	/* Create the inprogress table if empty */
-	if (!s->ramdisk.inprogress)
-		s->ramdisk.inprogress = create_hashtable(RAMDISK_HASHSIZE,
-							uint64_hash,
-							rd_hash_equal);
-	
-	/*
-	  RPRINTF("ramdisk: flushing %d sectors\n", count);
-	*/
+	/* extents are already sorted and merged; each becomes one write.
+	 * Anything not issued is compacted back into prev. */
+	for (i = 0, kept = 0; i < prev->count; i++) {
+		e = prev->extents[i];
 
-	/* sort and merge sectors to improve disk performance */
-	qsort(sectors, count, sizeof(*sectors), uint64_compare);
+		/* Check inprogress requests to avoid waw non-determinism */
+		if (rc || ramdisk_map_overlaps(s->ramdisk.inprogress,
+					       e.sector, e.secs)) {
+			prev->extents[kept++] = e;
+			continue;
+		}
 
-	for (i = 0; i < count;) {
-		base = sectors[i++];
-		while (i < count && sectors[i] == sectors[i-1] + 1)
-			i++;
-		batchlen = sectors[i-1] - base + 1;
-
-		j = merge_requests(&s->ramdisk, base, batchlen, &buf);
-			
-		if (j) {
-			RPRINTF("ramdisk_flush: merge_requests failed:%s\n",
-				j == -1? "OOM": (j==-2? "missing sector" : "WAW race"));
-			if (j == -3) continue;
-			free(sectors);
-			return -1;
+		if (ramdisk_map_insert(s->ramdisk.inprogress,
+				       ramdisk_map_find(s->ramdisk.inprogress,
+							e.sector), &e)) {
+			RPRINTF("ramdisk_flush: OOM\n");
+			prev->extents[kept++] = e;
+			rc = -1;
+			continue;
 		}
 
 		/* NOTE: create_write_request() creates a treq AND forwards it down
-		 * the driver chain */
-		// RPRINTF("forwarding write request at %" PRIu64 ", length: %" PRIu64 "\n", base, batchlen);
-		create_write_request(s, base, batchlen, buf);
-		//RPRINTF("write request at %" PRIu64 ", length: %" PRIu64 " forwarded\n", base, batchlen);
-
+		 * the driver chain, and may complete it before returning */
 		s->ramdisk.inflight++;
-
-		for (j = 0; j < batchlen; j++) {
-			buf = hashtable_search(s->ramdisk.prev, &base);
-			free(buf);
-			hashtable_remove(s->ramdisk.prev, &base);
-			base++;
+		if (create_write_request(s, e.sector, e.secs, e.buf)) {
+			RPRINTF("ramdisk_flush: OOM\n");
+			s->ramdisk.inflight--;
+			/* hand the buffer back to prev rather than freeing it */
+			j = ramdisk_map_find(s->ramdisk.inprogress, e.sector);
+			memmove(s->ramdisk.inprogress->extents + j,
+				s->ramdisk.inprogress->extents + j + 1,
+				(--s->ramdisk.inprogress->count - j) *
+				sizeof(e));
+			prev->extents[kept++] = e;
+			rc = -1;
 		}
 	}
+	prev->count = kept;
 
-	if (!hashtable_count(s->ramdisk.prev)) {
+	if (!prev->count) {
 		/* everything is in flight */
-		hashtable_destroy(s->ramdisk.prev, 0);
+		ramdisk_map_destroy(prev);
 		s->ramdisk.prev = NULL;
 	}
 
-	free(sectors);
-
-	// RPRINTF("ramdisk flush done\n");
-	return 0;
+	return rc;
 }
 
 /* flush ramdisk contents to disk */
 static int ramdisk_start_flush(td_driver_t *driver)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
-	uint64_t* key;
-	char* buf;
-	int rc = 0;
-	int i, j, count, batchlen;
-	uint64_t* sectors;
+	struct ramdisk_map* map;
+	struct ramdisk_extent* e;
+	int i;
 
-	if (!hashtable_count(s->ramdisk.h)) {
+	if (!s->ramdisk.h->count) {
 		/*
 		  RPRINTF("Nothing to flush\n");
 		*/
 		return 0;
 	}
 
+	/* We create a new map so that new writes can be performed before
+	 * the old map is completely drained. */
+	if (!(map = ramdisk_map_create()))
+		return -1;
+
 	if (s->ramdisk.prev) {
 		/* a flush request issued while a previous flush is still in progress
 		 * will merge with the previous request. If you want the previous
 		 * request to be consistent, wait for it to complete. */
-		if ((count = ramdisk_get_sectors(s->ramdisk.h, &sectors)) < 0)
-			return count;
-
-		for (i = 0; i < count; i++) {
-			buf = hashtable_search(s->ramdisk.h, sectors + i);
-			ramdisk_write_hash(s->ramdisk.prev, sectors[i], buf,
-					   s->ramdisk.sector_size);
+		for (i = 0; i < s->ramdisk.h->count; i++) {
+			e = s->ramdisk.h->extents + i;
+			if (ramdisk_map_write(s->ramdisk.prev, e->sector,
+					      e->secs, e->buf,
+					      s->ramdisk.sector_size)) {
+				ramdisk_map_destroy(map);
+				return -1;
+			}
 		}
-		free(sectors);
 
-		hashtable_destroy (s->ramdisk.h, 0);
+		ramdisk_map_destroy(s->ramdisk.h);
 	} else
 		s->ramdisk.prev = s->ramdisk.h;
 
-	/* We create a new hashtable so that new writes can be performed before
-	 * the old hashtable is completely drained. */
-	s->ramdisk.h = create_hashtable(RAMDISK_HASHSIZE, uint64_hash,
-					rd_hash_equal);
+	s->ramdisk.h = map;
 
 	return ramdisk_flush(driver, s);
 }
@@ -625,8 +676,8 @@ static int ramdisk_start(td_driver_t *driver)
 	}
 
 	s->ramdisk.sector_size = driver->info.sector_size;
-	s->ramdisk.h = create_hashtable(RAMDISK_HASHSIZE, uint64_hash,
-					rd_hash_equal);
+	if (!(s->ramdisk.h = ramdisk_map_create()))
+		return -1;
 
 	DPRINTF("Ramdisk started, %zu bytes/sector\n", s->ramdisk.sector_size);
 
@@ -1689,8 +1740,14 @@ static int tdremus_close(td_driver_t *driver)
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
 
 	RPRINTF("closing\n");
-	if (s->ramdisk.inprogress)
-		hashtable_destroy(s->ramdisk.inprogress, 0);
+	ramdisk_map_destroy(s->ramdisk.h);
+	ramdisk_map_destroy(s->ramdisk.prev);
+	s->ramdisk.h = s->ramdisk.prev = NULL;
+	/* in-flight writes still own their buffers */
+	if (!s->ramdisk.inflight) {
+		ramdisk_map_destroy(s->ramdisk.inprogress);
+		s->ramdisk.inprogress = NULL;
+	}
 	
 	if (s->driver_data) {
 		free(s->driver_data);
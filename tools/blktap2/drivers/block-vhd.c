@@ -50,6 +50,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <string.h>    /* for memset.                                 */
 #include <libaio.h>
 #include <sys/mman.h>
@@ -72,10 +73,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%lu, BBLK: 0x%04x\n",				\
+		    "%lu, ALLOCATING: %d\n",				\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.allocating);					\
 	} while(0)
 
 #define __ASSERT(_p)							\
@@ -110,9 +111,13 @@ unsigned int SPB;
 
 /******VHD DEFINES******/
 #define VHD_CACHE_SIZE               32
+#define VHD_BAT_WRITES               8     /* bat sectors in flight */
+#define VHD_BAT_SECTOR_ENTRIES       (VHD_SECTOR_SIZE / sizeof(uint32_t))
+#define VHD_MAX_ALLOCATIONS          (VHD_CACHE_SIZE / 2)
+#define VHD_PREALLOCATE_RUN          8     /* blocks zeroed per write */
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
+#define VHD_REQS_META                (2 * VHD_CACHE_SIZE + VHD_BAT_WRITES)
 #define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
 #define VHD_OP_BAT_WRITE             0
@@ -121,6 +126,7 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_READ           3
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
+#define VHD_OP_ZERO_RUN_WRITE        6
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -136,9 +142,6 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_QUERY          16
 #define VHD_FLAG_OPEN_PREALLOCATE    32
 
-#define VHD_FLAG_BAT_LOCKED          1
-#define VHD_FLAG_BAT_WRITE_STARTED   2
-
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
@@ -151,6 +154,7 @@ unsigned int SPB;
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
+#define VHD_FLAG_TX_BAT_WAIT         4
 
 typedef uint8_t vhd_flag_t;
 
@@ -182,21 +186,40 @@ struct vhd_request {
 	struct vhd_transaction   *tx;
 };
 
+struct vhd_bitmap;
+
+struct vhd_bat_write {
+	uint32_t                  sector;      /* bat sector being written */
+	struct vhd_bitmap        *bitmaps;     /* blocks committed by write */
+	struct vhd_request        req;
+	char                     *buf;
+};
+
+struct vhd_zero_run {
+	uint64_t                  end;         /* end of run being zeroed */
+	int                       pending;     /* zero writes in flight */
+	int                       error;
+	struct vhd_req_list       waiting;     /* writes needing the run */
+	struct vhd_request        reqs[VHD_PREALLOCATE_RUN + 1];
+};
+
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
-	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
-	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
-	char                     *bat_buf;
+	int                       allocating;  /* blocks awaiting bat update */
+	uint64_t                  zeroed;      /* end of preallocated run */
+	struct vhd_zero_run       zero_run;
+	struct vhd_bitmap        *pending;     /* blocks awaiting bat write */
+	struct vhd_bat_write      writes[VHD_BAT_WRITES];
 };
 
 struct vhd_bitmap {
 	u32                       blk;
 	u64                       seqno;       /* lru sequence number */
 	vhd_flag_t                status;
+	u64                       pbw_offset;  /* file offset of block while
+						* its bat entry is pending */
+	struct vhd_bitmap        *bat_next;    /* next block in bat write */
 
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
@@ -213,6 +236,7 @@ struct vhd_bitmap {
 					        * be serviced until this bitmap
 					        * is read from disk */
 	struct vhd_request        req;
+	struct vhd_request        zero_req;    /* for initializing bitmap */
 };
 
 struct vhd_state {
@@ -224,6 +248,8 @@ struct vhd_state {
         u32                       spb;         /* sectors per block */
         u64                       next_db;     /* pointer to the next 
 						* (unallocated) datablock */
+	u64                       eof;         /* nothing past here has been
+						* written since open */
 
 	struct vhd_bat_state      bat;
 
@@ -259,9 +285,13 @@ struct vhd_state {
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
 
-static struct vhd_state  *_vhd_master;
-static unsigned long      _vhd_zsize;
-static char              *_vhd_zeros;
+/*
+ * Per thread: an image is opened, used and closed by the event loop
+ * thread serving its VBD, so each loop keeps its own zero buffer.
+ */
+static __thread struct vhd_state  *_vhd_master;
+static __thread unsigned long      _vhd_zsize;
+static __thread char              *_vhd_zeros;
 
 static int
 vhd_initialize(struct vhd_state *s)
@@ -389,18 +419,22 @@ find_next_free_block(struct vhd_state *s)
 static void
 vhd_free_bat(struct vhd_state *s)
 {
+	int i;
+
 	free(s->bat.bat.bat);
 	free(s->bat.batmap.map);
-	free(s->bat.bat_buf);
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	for (i = 0; i < VHD_BAT_WRITES; i++)
+		free(s->bat.writes[i].buf);
+	memset(&s->bat, 0, sizeof(s->bat));
 }
 
 static int
 vhd_initialize_bat(struct vhd_state *s)
 {
+	off_t end;
 	int err, psize, batmap_required, i;
 
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	memset(&s->bat, 0, sizeof(s->bat));
 
 	psize = getpagesize();
 
@@ -417,6 +451,14 @@ vhd_initialize_bat(struct vhd_state *s)
 		err = find_next_free_block(s);
 		if (err)
 			goto fail;
+
+		end = lseek(s->vhd.fd, 0, SEEK_END);
+		if (end == (off_t)-1) {
+			err = -errno;
+			goto fail;
+		}
+
+		s->eof = secs_round_up(end);
 	}
 
 	if (vhd_has_batmap(&s->vhd)) {
@@ -436,11 +478,16 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
-	err = posix_memalign((void **)&s->bat.bat_buf,
-			     VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
-	if (err) {
-		s->bat.bat_buf = NULL;
-		goto fail;
+	for (i = 0; i < VHD_BAT_WRITES; i++) {
+		struct vhd_bat_write *w = s->bat.writes + i;
+
+		err = posix_memalign((void **)&w->buf,
+				     VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+		if (err) {
+			w->buf = NULL;
+			err    = -err;
+			goto fail;
+		}
 	}
 
 	return 0;
@@ -721,6 +768,37 @@ vhd_log_close(struct vhd_state *s)
 		s->vhd.file, s->bat.bat.entries, allocated, full, s->next_db);
 }
 
+/* 
+ * blocks reserved or preallocated past the last allocated one
+ * would otherwise be left behind the footer.
+ */
+static void
+vhd_truncate_tail(struct vhd_state *s)
+{
+	int err;
+	off_t end;
+
+	if (s->vhd.is_block || !vhd_type_dynamic(&s->vhd))
+		return;
+
+	err = vhd_end_of_data(&s->vhd, &end);
+	if (err)
+		goto fail;
+
+	if (vhd_sectors_to_bytes(MAX(s->next_db, s->bat.zeroed)) <= end)
+		return;
+
+	if (ftruncate(s->vhd.fd, end + sizeof(vhd_footer_t)) == -1) {
+		err = -errno;
+		goto fail;
+	}
+
+	return;
+
+ fail:
+	EPRINTF("truncating %s: %d\n", s->vhd.file, err);
+}
+
 static int
 _vhd_close(td_driver_t *driver)
 {
@@ -743,6 +821,8 @@ _vhd_close(td_driver_t *driver)
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_STRICT) || s->writes) {
 		memcpy(&s->vhd.bat, &s->bat.bat, sizeof(vhd_bat_t));
 		err = vhd_write_footer(&s->vhd, &s->vhd.footer);
+		if (!err)
+			vhd_truncate_tail(s);
 		memset(&s->vhd.bat, 0, sizeof(vhd_bat_t));
 
 		if (err)
@@ -925,47 +1005,21 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
-{
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
-}
-
-static inline void
-lock_bat(struct vhd_state *s)
-{
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
-static inline void
-unlock_bat(struct vhd_state *s)
-{
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
-static inline int
-bat_locked(struct vhd_state *s)
-{
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->blk    = 0;
-	bm->seqno  = 0;
-	bm->status = 0;
+	bm->blk        = 0;
+	bm->seqno      = 0;
+	bm->status     = 0;
+	bm->pbw_offset = 0;
+	bm->bat_next   = NULL;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
 	clear_req_list(&bm->waiting);
 	memset(bm->map, 0, vhd_sectors_to_bytes(s->bm_secs));
 	memset(bm->shadow, 0, vhd_sectors_to_bytes(s->bm_secs));
 	init_vhd_request(s, &bm->req);
+	init_vhd_request(s, &bm->zero_req);
 }
 
 static inline struct vhd_bitmap *
@@ -1007,11 +1061,18 @@ bitmap_valid(struct vhd_bitmap *bm)
 	return !test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
 }
 
+static inline int
+block_allocating(struct vhd_bitmap *bm)
+{
+	return bm && test_vhd_flag(bm->status, VHD_FLAG_BM_UPDATE_BAT);
+}
+
 static inline int
 bitmap_in_use(struct vhd_bitmap *bm)
 {
 	return (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING)  ||
 		test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING) ||
+		test_vhd_flag(bm->status, VHD_FLAG_BM_UPDATE_BAT)    ||
 		test_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT) ||
 		bm->waiting.head || bm->tx.requests.head || bm->queue.head);
 }
@@ -1156,7 +1217,8 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
 		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		    s->bat.allocating >= VHD_MAX_ALLOCATIONS &&
+		    !block_allocating(get_bitmap(s, blk)))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1264,59 +1326,225 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
+/* where the next block reserved will start */
 static inline uint64_t
-reserve_new_block(struct vhd_state *s, uint32_t blk)
+new_block_offset(struct vhd_state *s)
 {
 	int gap = 0;
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
-
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	return s->next_db + gap;
+}
+
+static inline uint64_t
+reserve_new_block(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	uint64_t lb_end = s->next_db;
+
+	/* 
+	 * next_db moves on reservation so that several blocks can be
+	 * allocated at once; a block whose bat write fails is leaked.
+	 */
+	bm->pbw_offset = new_block_offset(s);
+	s->next_db     = bm->pbw_offset + s->bm_secs + s->spb;
+
+	return lb_end;
+}
+
+static inline int
+preallocation_needed(struct vhd_state *s)
+{
+	return (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE) &&
+		new_block_offset(s) + s->bm_secs + s->spb > s->bat.zeroed);
+}
+
+/* 
+ * zero a run of blocks past next_db through the aio queue, so only
+ * one in VHD_PREALLOCATE_RUN allocations has to wait for it.  the
+ * run is split in VHD_BLOCK_SIZE writes of the shared zero buffer.
+ */
+static void
+preallocate_blocks(struct vhd_state *s)
+{
+	int cnt;
+	char *zeros;
+	uint64_t start, size, total, secs;
+	struct vhd_request *req;
+	struct vhd_zero_run *run = &s->bat.zero_run;
+
+	if (run->pending)
+		return;
+
+	start = MAX(s->next_db, s->bat.zeroed);
+	size  = VHD_PREALLOCATE_RUN * (s->spp + s->bm_secs + s->spb);
+	zeros = vhd_zeros(VHD_BLOCK_SIZE);
+	total = 0;
+
+	for (cnt = 0; total < size && cnt < VHD_PREALLOCATE_RUN + 1; cnt++) {
+		secs = MIN(size - total, VHD_BLOCK_SIZE >> VHD_SECTOR_SHIFT);
+
+		req = run->reqs + cnt;
+		init_vhd_request(s, req);
+
+		req->op        = VHD_OP_ZERO_RUN_WRITE;
+		req->treq.secs = secs;
+		req->treq.buf  = zeros;
+		req->next      = NULL;
 
-	return s->next_db;
+		aio_write(s, req, vhd_sectors_to_bytes(start + total));
+		total += secs;
+	}
+
+	ASSERT(start + total >= new_block_offset(s) + s->bm_secs + s->spb);
+
+	DBG(TLOG_DBG, "zeroing 0x%08"PRIx64" - 0x%08"PRIx64"\n",
+	    start, start + total);
+
+	run->end     = start + total;
+	run->error   = 0;
+	run->pending = cnt;
 }
 
+/* 
+ * hold a write allocating a block until the preallocated run covers
+ * it; it is issued again when the run completes.
+ */
 static int
-schedule_bat_write(struct vhd_state *s)
+wait_for_preallocation(struct vhd_state *s, td_request_t treq)
+{
+	struct vhd_request *req;
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq = treq;
+	req->op   = VHD_OP_DATA_WRITE;
+	req->next = NULL;
+
+	preallocate_blocks(s);
+	add_to_tail(&s->bat.zero_run.waiting, req);
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", waiting for run to "
+	    "0x%08"PRIx64"\n", s->vhd.file, treq.sec, s->bat.zero_run.end);
+
+	return 0;
+}
+
+static inline int
+bat_sector_busy(struct vhd_state *s, uint32_t sector)
+{
+	int i;
+
+	for (i = 0; i < VHD_BAT_WRITES; i++)
+		if (s->bat.writes[i].bitmaps &&
+		    s->bat.writes[i].sector == sector)
+			return 1;
+
+	return 0;
+}
+
+static inline struct vhd_bat_write *
+alloc_bat_write(struct vhd_state *s)
+{
+	int i;
+
+	for (i = 0; i < VHD_BAT_WRITES; i++)
+		if (!s->bat.writes[i].bitmaps)
+			return s->bat.writes + i;
+
+	return NULL;
+}
+
+/* 
+ * write out pending bat entries.  all entries pending for a bat
+ * sector go out in one write, and only one write per sector is in
+ * flight at a time; entries arriving meanwhile are picked up when
+ * it completes.
+ */
+static void
+schedule_bat_writes(struct vhd_state *s)
 {
 	int i;
-	u32 blk;
-	char *buf;
 	u64 offset;
+	u32 sector, *entries;
 	struct vhd_request *req;
+	struct vhd_bat_write *w;
+	struct vhd_bitmap *bm, **pbm, **next;
 
-	ASSERT(bat_locked(s));
+	pbm = &s->bat.pending;
+	while ((bm = *pbm)) {
+		sector = bm->blk / VHD_BAT_SECTOR_ENTRIES;
 
-	req = &s->bat.req;
-	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+		if (bat_sector_busy(s, sector)) {
+			pbm = &bm->bat_next;
+			continue;
+		}
 
-	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+		w = alloc_bat_write(s);
+		if (!w)
+			break;
 
-	((u32 *)buf)[blk % 128] = s->bat.pbw_offset;
+		w->sector  = sector;
+		w->bitmaps = NULL;
+		entries    = (u32 *)w->buf;
 
-	for (i = 0; i < 128; i++)
-		BE32_OUT(&((u32 *)buf)[i]);
+		memcpy(entries,
+		       &bat_entry(s, sector * VHD_BAT_SECTOR_ENTRIES),
+		       VHD_SECTOR_SIZE);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
-	req->treq.secs = 1;
-	req->treq.buf  = buf;
-	req->op        = VHD_OP_BAT_WRITE;
-	req->next      = NULL;
+		next = pbm;
+		while ((bm = *next)) {
+			if (bm->blk / VHD_BAT_SECTOR_ENTRIES != sector) {
+				next = &bm->bat_next;
+				continue;
+			}
 
-	aio_write(s, req, offset);
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+			*next        = bm->bat_next;
+			bm->bat_next = w->bitmaps;
+			w->bitmaps   = bm;
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+			entries[bm->blk % VHD_BAT_SECTOR_ENTRIES] =
+				bm->pbw_offset;
+		}
 
-	return 0;
+		for (i = 0; i < VHD_BAT_SECTOR_ENTRIES; i++)
+			BE32_OUT(&entries[i]);
+
+		offset = s->vhd.header.table_offset +
+			vhd_sectors_to_bytes(sector);
+
+		req = &w->req;
+		init_vhd_request(s, req);
+
+		req->treq.secs = 1;
+		req->treq.buf  = w->buf;
+		req->op        = VHD_OP_BAT_WRITE;
+		req->next      = NULL;
+
+		aio_write(s, req, offset);
+
+		DBG(TLOG_DBG, "bat sector: 0x%04x, table_offset: "
+		    "0x%08"PRIx64"\n", sector, offset);
+	}
+}
+
+static void
+queue_bat_update(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pbm;
+
+	pbm = &s->bat.pending;
+	while (*pbm)
+		pbm = &(*pbm)->bat_next;
+
+	bm->bat_next = NULL;
+	*pbm         = bm;
+
+	schedule_bat_writes(s);
 }
 
 static void
@@ -1324,21 +1552,20 @@ schedule_zero_bm_write(struct vhd_state *s,
 		       struct vhd_bitmap *bm, uint64_t lb_end)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &bm->zero_req;
 
 	init_vhd_request(s, req);
 
 	offset         = vhd_sectors_to_bytes(lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = bm->blk * s->spb;
+	req->treq.secs = (bm->pbw_offset - lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    bm->blk, offset);
 
-	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
 	aio_write(s, req, offset);
 }
@@ -1351,80 +1578,21 @@ update_bat(struct vhd_state *s, uint32_t blk)
 	struct vhd_bitmap *bm;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		return 0;
-	}
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
 	bm = get_bitmap(s, blk);
-	if (!bm) {
-		/* install empty bitmap in cache */
-		err = alloc_vhd_bitmap(s, &bm, blk);
-		if (err) 
-			return err;
-
-		install_bitmap(s, bm);
-	}
-
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
-	schedule_zero_bm_write(s, bm, lb_end);
-	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
-
-	return 0;
-}
-
-static int
-allocate_block(struct vhd_state *s, uint32_t blk)
-{
-	char *zeros;
-	int err, gap;
-	uint64_t offset, size;
-	struct vhd_bitmap *bm;
-
-	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
+	if (block_allocating(bm)) {
+		/* retry once a failed allocation has drained */
+		if (!test_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT))
 			return -EBUSY;
 		return 0;
 	}
 
-	gap            = 0;
-	s->bat.pbw_blk = blk;
-	offset         = vhd_sectors_to_bytes(s->next_db);
-
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
-		s->next_db += gap;
-	}
-
-	s->bat.pbw_offset = s->next_db;
+	/* the caller waits for the zeroed run to grow */
+	if (preallocation_needed(s))
+		return -EAGAIN;
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
-
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(errno, "lseek failed\n");
-		return -errno;
-	}
-
-	size = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	err  = write(s->vhd.fd, vhd_zeros(size), size);
-	if (err != size) {
-		err = (err == -1 ? -errno : -EIO);
-		ERR(err, "write failed");
-		return err;
-	}
-
-	/* empty bitmap could already be in
-	 * cache if earlier bat update failed */
-	bm = get_bitmap(s, blk);
 	if (!bm) {
 		/* install empty bitmap in cache */
 		err = alloc_vhd_bitmap(s, &bm, blk);
@@ -1434,10 +1602,27 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
+	lb_end = reserve_new_block(s, bm);
+
+	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
+	    blk, bm->pbw_offset);
+
 	lock_bitmap(bm);
-	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
+	s->bat.allocating++;
+	set_vhd_flag(bm->status, VHD_FLAG_BM_UPDATE_BAT);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+
+	/* 
+	 * the bat entry may only hit the disk once the bitmap it points
+	 * to reads as zero.  nothing past the end of file at open has
+	 * been written, so only the block overlapping the old footer
+	 * needs zeroing before its bat write.
+	 */
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE) &&
+	    lb_end < s->eof)
+		schedule_zero_bm_write(s, bm, lb_end);
+	else
+		queue_bat_update(s, bm);
 
 	return 0;
 }
@@ -1505,15 +1690,14 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	offset = bat_entry(s, blk);
 
 	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BAT)) {
-		if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-			err = allocate_block(s, blk);
-		else
-			err = update_bat(s, blk);
-
+		err = update_bat(s, blk);
+		if (err == -EAGAIN)
+			return wait_for_preallocation(s, treq);
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		bm     = get_bitmap(s, blk);
+		offset = bm->pbw_offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1608,8 +1792,8 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		ASSERT(block_allocating(bm));
+		offset = bm->pbw_offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1904,13 +2088,14 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	struct vhd_transaction *tx = &bm->tx;
 
-	if (!bat_locked(s))
+	if (!block_allocating(bm))
 		return;
 
-	if (s->bat.pbw_blk != bm->blk)
+	/* bat write still outstanding */
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT))
 		return;
 
-	if (!s->bat.req.error)
+	if (bat_entry(s, bm->blk) != DD_BLK_UNUSED)
 		goto release;
 
 	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
@@ -1921,8 +2106,12 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 
  release:
 	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_UPDATE_BAT);
+	bm->pbw_offset = 0;
+	s->bat.allocating--;
+
+	if (!bitmap_in_use(bm))
+		unlock_bitmap(bm);
 }
 
 static void
@@ -1936,15 +2125,11 @@ finish_bitmap_transaction(struct vhd_state *s,
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
-			return;
-		}
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
+		/* still waiting for bat write */
+		ASSERT(block_allocating(bm));
+		set_vhd_flag(tx->status, VHD_FLAG_TX_BAT_WAIT);
+		return;
 	}
 
 	if (tx->error) {
@@ -1983,45 +2168,65 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 	return finish_bitmap_transaction(s, bm, 0);
 }
 
+static void
+finish_bat_update(struct vhd_state *s, struct vhd_bitmap *bm, int error)
+{
+	struct vhd_transaction *tx = &bm->tx;
+
+	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
+	    bm->blk, bm->pbw_offset, error);
+	ASSERT(bitmap_valid(bm) && block_allocating(bm));
+	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT));
+
+	if (error && test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
+		tx->error = error;
+
+	clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_BAT_WAIT))
+		finish_bitmap_transaction(s, bm, error);
+
+	finish_bat_transaction(s, bm);
+}
+
 static void
 finish_bat_write(struct vhd_request *req)
 {
-	struct vhd_bitmap *bm;
-	struct vhd_transaction *tx;
+	int i, err;
+	struct vhd_bat_write *w;
+	struct vhd_bitmap *bm, *next;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	for (i = 0; i < VHD_BAT_WRITES; i++)
+		if (&s->bat.writes[i].req == req)
+			break;
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	ASSERT(i < VHD_BAT_WRITES);
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+	w   = s->bat.writes + i;
+	bm  = w->bitmaps;
+	err = req->error;
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+	DBG(TLOG_DBG, "bat sector: 0x%04x, err %d\n", w->sector, err);
+	ASSERT(bm);
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
-		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
-			finish_bitmap_transaction(s, bm, req->error);
+	/* the sector may be rewritten as soon as the slot is free */
+	if (!err)
+		for (next = bm; next; next = next->bat_next)
+			bat_entry(s, next->blk) = next->pbw_offset;
+
+	w->bitmaps = NULL;
+
+	while (bm) {
+		next         = bm->bat_next;
+		bm->bat_next = NULL;
+		finish_bat_update(s, bm, err);
+		bm           = next;
 	}
 
-	finish_bat_transaction(s, bm);
+	schedule_bat_writes(s);
 }
 
 static void
@@ -2039,25 +2244,63 @@ finish_zero_bm_write(struct vhd_request *req)
 	bm  = get_bitmap(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
+	ASSERT(block_allocating(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
 		tx->error = req->error;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
+		finish_bat_transaction(s, bm);
 	} else
-		schedule_bat_write(s);
+		queue_bat_update(s, bm);
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
 }
 
+static void
+finish_zero_run_write(struct vhd_request *req)
+{
+	struct vhd_request *r, *next;
+	struct vhd_state *s = req->state;
+	struct vhd_zero_run *run = &s->bat.zero_run;
+
+	s->returned++;
+	TRACE(s);
+
+	ASSERT(run->pending > 0);
+
+	run->error = (run->error ? : req->error);
+	if (--run->pending)
+		return;
+
+	DBG(TLOG_DBG, "zeroed to 0x%08"PRIx64", err: %d\n",
+	    run->end, run->error);
+
+	r = run->waiting.head;
+	clear_req_list(&run->waiting);
+
+	if (run->error)
+		return signal_completion(r, run->error);
+
+	s->bat.zeroed = MAX(s->bat.zeroed, run->end);
+
+	while (r) {
+		struct vhd_request tmp;
+
+		tmp  = *r;
+		next =  r->next;
+		free_vhd_request(s, r);
+
+		vhd_queue_write(s->driver, tmp.treq);
+
+		r = next;
+	}
+}
+
 static void
 finish_bitmap_read(struct vhd_request *req)
 {
@@ -2226,6 +2469,10 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_zero_bm_write(req);
 		break;
 
+	case VHD_OP_ZERO_RUN_WRITE:
+		finish_zero_run_write(req);
+		break;
+
 	case VHD_OP_BAT_WRITE:
 		finish_bat_write(req);
 		break;
@@ -2298,9 +2545,24 @@ vhd_debug(td_driver_t *driver)
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: allocating: %d, pending: %p, next_db: 0x%08"PRIx64
+	    ", zeroed: 0x%08"PRIx64"\n", s->bat.allocating, s->bat.pending,
+	    s->next_db, s->bat.zeroed);
+	DBG(TLOG_WARN, "ZERO RUN: end: 0x%08"PRIx64", pending: %d, err: %d, "
+	    "waiting: %p\n", s->bat.zero_run.end, s->bat.zero_run.pending,
+	    s->bat.zero_run.error, s->bat.zero_run.waiting.head);
+	for (i = 0; i < VHD_BAT_WRITES; i++) {
+		struct vhd_bat_write *w = s->bat.writes + i;
+		struct vhd_bitmap *bm;
+		int n = 0;
+
+		for (bm = w->bitmaps; bm; bm = bm->bat_next)
+			n++;
+
+		if (n)
+			DBG(TLOG_WARN, "%d: bat sector: 0x%04x, blocks: %d\n",
+			    i, w->sector, n);
+	}
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
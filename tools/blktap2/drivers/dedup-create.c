@@ -0,0 +1,86 @@
+/* 
+ * Copyright (c) 2010, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "dedup.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: dedup-create [-h help] [-s store] "
+		"<SIZE(MB)> <FILENAME>\n");
+	exit(EINVAL);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, err;
+	uint64_t size;
+	const char *name, *store;
+
+	store = NULL;
+
+	while ((c = getopt(argc, argv, "hs:")) != -1) {
+		switch (c) {
+		case 's':
+			store = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 2)
+		usage();
+
+	size = strtoull(argv[optind++], NULL, 10) << 20;
+	name = argv[optind];
+
+	if (strnlen(name, DEDUP_STORE_MAX) == DEDUP_STORE_MAX ||
+	    (store && strnlen(store, DEDUP_STORE_MAX) == DEDUP_STORE_MAX)) {
+		fprintf(stderr, "Name too long\n");
+		return ENAMETOOLONG;
+	}
+
+	err = dedup_create(name, size, store);
+	if (err) {
+		fprintf(stderr, "Failed to create %s: %s\n",
+			name, strerror(-err));
+		return -err;
+	}
+
+	return 0;
+}
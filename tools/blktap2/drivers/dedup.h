@@ -0,0 +1,93 @@
+/* 
+ * Copyright (c) 2010, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * A dedup image is a map file of chunk ids, one per 4K block of the
+ * virtual disk, pointing into a chunk store shared by many images.
+ * The store is a directory holding the chunk data ('chunks', chunk n
+ * at n << DEDUP_CHUNK_SHIFT) and an index ('index') of the digest and
+ * reference count of every chunk, hashed by digest.  Chunk 0 is the
+ * zero block and is never stored.  Everything is in host byte order.
+ */
+#define DEDUP_VDI_MAGIC           0x74646476 /* "tddv" */
+#define DEDUP_INDEX_MAGIC         0x74646469 /* "tddi" */
+#define DEDUP_VERSION             2
+
+#define DEDUP_CHUNK_SHIFT         12 /* 4K chunks */
+#define DEDUP_CHUNK_SIZE          (1 << DEDUP_CHUNK_SHIFT)
+#define DEDUP_CHUNK_SECS_SHIFT    (DEDUP_CHUNK_SHIFT - 9)
+#define DEDUP_CHUNK_SECS          (1 << DEDUP_CHUNK_SECS_SHIFT)
+
+#define DEDUP_PAGE_SIZE           4096
+#define DEDUP_MAP_OFFSET          DEDUP_PAGE_SIZE
+#define DEDUP_STORE_MAX           1024
+#define DEDUP_STORE_DEFAULT       "dedup-store"
+#define DEDUP_STORE_INDEX         "index"
+#define DEDUP_STORE_CHUNKS        "chunks"
+
+#define DEDUP_HASH_BITS           22
+#define DEDUP_INITIAL_CHUNKS      (1 << 16)
+#define DEDUP_DIGEST_SIZE         16 /* md5 */
+
+struct dedup_vdi_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;                   /* sectors */
+	uint64_t blocks;                 /* map entries */
+	char     store[DEDUP_STORE_MAX]; /* absolute path */
+};
+
+struct dedup_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t chunk_shift;
+	uint32_t hash_bits;
+	uint32_t chunks;                 /* entries in the index */
+	uint32_t used;                   /* entries ever handed out */
+	uint32_t free;                   /* free list head, 0: empty */
+	uint32_t live;                   /* referenced chunks */
+	uint64_t refs;                   /* references to all chunks */
+	uint64_t buckets_off;
+	uint64_t entries_off;
+	pthread_mutex_t lock;            /* robust, process-shared */
+};
+
+struct dedup_chunk {
+	uint8_t  digest[DEDUP_DIGEST_SIZE];
+	uint32_t hnext;                  /* hash chain, or free list */
+	uint32_t refs;
+};
+
+int dedup_create(const char *name, uint64_t bytes, const char *store);
+
+#endif
@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
 
@@ -61,6 +62,34 @@ opio_free(struct opioctx *ctx)
 
 	free(ctx->event_queue);
 	ctx->event_queue = NULL;
+
+	free(ctx->iovecs);
+	ctx->iovecs = NULL;
+
+	free(ctx->gap_buf);
+	ctx->gap_buf = NULL;
+}
+
+/*
+ * Not to be changed while merged reads are in flight: they may still
+ * be using the old gap buffer.  A max_bytes of 0 leaves merged
+ * requests unbounded, a max_gap of 0 disables gap filling.
+ */
+int
+opio_set_limits(struct opioctx *ctx,
+		unsigned long max_bytes, unsigned long max_gap)
+{
+	char *buf = NULL;
+
+	if (max_gap && posix_memalign((void **)&buf, 4096, max_gap))
+		return -ENOMEM;
+
+	free(ctx->gap_buf);
+	ctx->gap_buf   = buf;
+	ctx->max_gap   = max_gap;
+	ctx->max_bytes = max_bytes;
+
+	return 0;
 }
 
 int
@@ -76,14 +105,19 @@ opio_init(struct opioctx *ctx, int num_iocbs)
 	ctx->free_opios    = calloc(1, sizeof(struct opio *) * num_iocbs);
 	ctx->iocb_queue    = calloc(1, sizeof(struct iocb *) * num_iocbs);
 	ctx->event_queue   = calloc(1, sizeof(struct io_event) * num_iocbs);
+	ctx->iovecs        = calloc(1, sizeof(struct iovec) *
+				    num_iocbs * OPIO_MAX_IOVS);
 
 	if (!ctx->opios || !ctx->free_opios ||
-	    !ctx->iocb_queue || !ctx->event_queue)
+	    !ctx->iocb_queue || !ctx->event_queue || !ctx->iovecs)
 		goto fail;
 
 	for (i = 0; i < num_iocbs; i++)
 		ctx->free_opios[i] = &ctx->opios[i];
 
+	if (opio_set_limits(ctx, OPIO_DEFAULT_MAX_BYTES, OPIO_DEFAULT_MAX_GAP))
+		goto fail;
+
 	return 0;
 
  fail:
@@ -111,9 +145,10 @@ restore_iocb(struct opio *op)
 {
 	struct iocb *io = op->iocb;
 
-	io->data        = op->data;
-	io->u.c.buf     = op->buf;
-	io->u.c.nbytes  = op->nbytes;
+	io->data           = op->data;
+	io->aio_lio_opcode = op->opcode;
+	io->u.c.buf        = op->buf;
+	io->u.c.nbytes     = op->nbytes;
 }
 
 static inline int
@@ -127,9 +162,27 @@ iocb_optimized(struct opioctx *ctx, struct iocb *io)
 }
 
 static inline int
-contiguous_sectors(struct iocb *l, struct iocb *r)
+iocb_vectored(struct iocb *io)
+{
+	return (io->aio_lio_opcode == IO_CMD_PREADV ||
+		io->aio_lio_opcode == IO_CMD_PWRITEV);
+}
+
+/* opcode and size as queued, before any merging */
+static inline short
+iocb_opcode(struct opioctx *ctx, struct iocb *io)
+{
+	if (iocb_optimized(ctx, io))
+		return ((struct opio *)io->data)->opcode;
+	return io->aio_lio_opcode;
+}
+
+static inline unsigned long
+iocb_bytes(struct opioctx *ctx, struct iocb *io)
 {
-	return (l->u.c.offset + l->u.c.nbytes == r->u.c.offset);
+	if (iocb_optimized(ctx, io))
+		return ((struct opio *)io->data)->total;
+	return io->u.c.nbytes;
 }
 
 static inline int
@@ -139,11 +192,32 @@ contiguous_buffers(struct iocb *l, struct iocb *r)
 }
 
 static inline int
-contiguous_iocbs(struct iocb *l, struct iocb *r)
+iocb_before(struct iocb *l, struct iocb *r)
 {
-	return ((l->aio_fildes == r->aio_fildes) &&
-		contiguous_sectors(l, r) &&
-		contiguous_buffers(l, r));
+	if (l->aio_fildes != r->aio_fildes)
+		return l->aio_fildes < r->aio_fildes;
+	if (l->aio_lio_opcode != r->aio_lio_opcode)
+		return l->aio_lio_opcode < r->aio_lio_opcode;
+	return l->u.c.offset < r->u.c.offset;
+}
+
+/*
+ * Batches are short and mostly in order already, which insertion sort
+ * handles in linear time.  It is also stable, so overlapping requests
+ * keep their relative order.
+ */
+static void
+sort_iocbs(struct iocb **q, int num)
+{
+	int i, j;
+	struct iocb *io;
+
+	for (i = 1; i < num; i++) {
+		io = q[i];
+		for (j = i; j > 0 && iocb_before(io, q[j - 1]); j--)
+			q[j] = q[j - 1];
+		q[j] = io;
+	}
 }
 
 static inline void
@@ -164,8 +238,11 @@ opio_iocb_init(struct opioctx *ctx, struct iocb *io)
 	op->buf    = io->u.c.buf;
 	op->nbytes = io->u.c.nbytes;
 	op->offset = io->u.c.offset;
+	op->opcode = io->aio_lio_opcode;
 	op->data   = io->data;
 	op->iocb   = io;
+	op->total  = io->u.c.nbytes;
+	op->iovs   = ctx->iovecs + (op - ctx->opios) * OPIO_MAX_IOVS;
 	io->data   = op;
 
 	init_opio_list(op);
@@ -197,21 +274,121 @@ merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 
 	opio->head        = ophead;
 	head->u.c.nbytes += io->u.c.nbytes;
+	ophead->total    += io->u.c.nbytes;
 	ophead->list.tail = ophead->list.tail->next = opio;
 	
 	return 0;
 }
 
+/*
+ * Append io to head as an iovec, preceded by a read into the gap
+ * buffer if they are not adjacent on disk.  head turns into a vectored
+ * request the first time.
+ */
+static int
+merge_vector(struct opioctx *ctx,
+	     struct iocb *head, struct iocb *io, unsigned long gap)
+{
+	struct opio *ophead, *opio;
+	struct iovec *iov;
+	int nr_iovs, join;
+
+	ophead = opio_get(ctx, head);
+	if (!ophead)
+		return -ENOMEM;
+
+	if (ophead->nr_iovs) {
+		iov     = &ophead->iovs[ophead->nr_iovs - 1];
+		nr_iovs = ophead->nr_iovs;
+		join    = (!gap && (char *)iov->iov_base + iov->iov_len ==
+			   (char *)io->u.c.buf);
+	} else {
+		nr_iovs = 1;
+		join    = 0;
+	}
+
+	if (nr_iovs + !!gap + !join > OPIO_MAX_IOVS)
+		return -EINVAL;
+
+	opio = opio_get(ctx, io);
+	if (!opio)
+		return -ENOMEM;
+
+	if (!ophead->nr_iovs) {
+		ophead->iovs[0].iov_base = head->u.c.buf;
+		ophead->iovs[0].iov_len  = ophead->total;
+		ophead->nr_iovs          = 1;
+
+		head->aio_lio_opcode = (ophead->opcode == IO_CMD_PREAD ?
+					IO_CMD_PREADV : IO_CMD_PWRITEV);
+		head->u.c.buf        = ophead->iovs;
+		ctx->stats.vectored++;
+	}
+
+	if (gap) {
+		iov = &ophead->iovs[ophead->nr_iovs++];
+		iov->iov_base  = ctx->gap_buf;
+		iov->iov_len   = gap;
+		ophead->total += gap;
+		ctx->stats.gaps++;
+		ctx->stats.gap_bytes += gap;
+	}
+
+	if (join)
+		ophead->iovs[ophead->nr_iovs - 1].iov_len += io->u.c.nbytes;
+	else {
+		iov = &ophead->iovs[ophead->nr_iovs++];
+		iov->iov_base = io->u.c.buf;
+		iov->iov_len  = io->u.c.nbytes;
+	}
+
+	head->u.c.nbytes  = ophead->nr_iovs;
+	ophead->total    += io->u.c.nbytes;
+	opio->head        = ophead;
+	ophead->list.tail = ophead->list.tail->next = opio;
+
+	return 0;
+}
+
 static int
 merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
-	if (head->aio_lio_opcode != io->aio_lio_opcode)
+	unsigned long long start, end, max;
+	unsigned long gap;
+	short opcode;
+
+	opcode = iocb_opcode(ctx, head);
+	if (opcode != io->aio_lio_opcode)
+		return -EINVAL;
+
+	if (opcode != IO_CMD_PREAD && opcode != IO_CMD_PWRITE)
 		return -EINVAL;
 
-	if (!contiguous_iocbs(head, io))
+	if (head->aio_fildes != io->aio_fildes || !io->u.c.nbytes)
 		return -EINVAL;
 
-	return merge_tail(ctx, head, io);		
+	start = head->u.c.offset;
+	end   = start + iocb_bytes(ctx, head);
+	if (end == start || io->u.c.offset < end)
+		return -EINVAL;
+
+	/* never write across a gap */
+	gap = io->u.c.offset - end;
+	if (gap && (opcode != IO_CMD_PREAD || gap > ctx->max_gap))
+		return -EINVAL;
+
+	/* cut at the next max_bytes boundary */
+	max = ctx->max_bytes;
+	if (max && (end - 1) / max !=
+	    (io->u.c.offset + io->u.c.nbytes - 1) / max) {
+		ctx->stats.cuts++;
+		return -EINVAL;
+	}
+
+	if (!gap && !iocb_vectored(head) && contiguous_buffers(head, io))
+		return merge_tail(ctx, head, io);
+
+	return merge_vector(ctx, head, io, gap);
 }
 
 int
@@ -227,13 +404,19 @@ io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 	on_queue = 0;
 	q = ctx->iocb_queue;
 	memcpy(q, queue, num * sizeof(struct iocb *));
+	sort_iocbs(q, num);
 
+	queue[0] = q[0];
 	for (i = 1; i < num; i++) {
 		io = q[i];
 		if (merge(ctx, queue[on_queue], io) != 0)
 			queue[++on_queue] = io;
 	}
 
+	ctx->stats.batches++;
+	ctx->stats.iocbs  += num;
+	ctx->stats.merged += on_queue + 1;
+
 #if (defined(TEST) || defined(DEBUG))
 	print_merged_iocbs(ctx, queue, on_queue + 1);
 #endif
@@ -297,7 +480,7 @@ expand_event(struct opioctx *ctx,
 	ophead = (struct opio *)io->data;
 	op     = ophead;
 
-	if (event->res == io->u.c.nbytes)
+	if (event->res == ophead->total)
 		err = 0;
 	else if ((int)event->res < 0)
 		err = (int)event->res;
@@ -516,7 +699,8 @@ randomize_iocbs(struct iocb **iocbs, int num_iocbs, int num_secs)
 }
 
 static int
-simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
+simulate_io(struct opioctx *ctx,
+	    struct iocb **iocbs, struct io_event *events, int num_iocbs)
 {
 	int i, done;
 	struct iocb *io;
@@ -531,7 +715,7 @@ simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
 		io      = iocbs[i];
 		ep      = &events[i];
 		ep->obj = io;
-		ep->res = (random() % 10 < 8 ? io->u.c.nbytes : 0);
+		ep->res = (random() % 10 < 8 ? iocb_bytes(ctx, io) : 0);
 	}
 
 	return done;
@@ -639,7 +823,8 @@ main(int argc, char **argv)
 			DBG(&ctx, "optimized remaining: %d\n", op_rem);
 
 			DBG(&ctx, "simulating\n");
-			num_events = simulate_io(ioqueue + op_done, events, op_rem);
+			num_events = simulate_io(&ctx, ioqueue + op_done,
+					 events, op_rem);
 			print_events(&ctx, events, num_events);
 
 			DBG(&ctx, "splitting %d\n", num_events);
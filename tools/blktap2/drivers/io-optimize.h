@@ -29,8 +29,21 @@
 #ifndef __IO_OPTIMIZE_H__
 #define __IO_OPTIMIZE_H__
 
+#include <stdint.h>
+#include <sys/uio.h>
 #include <libaio.h>
 
+/*
+ * Requests are sorted by offset and merged when adjacent on disk.  A
+ * merged request which joins non-contiguous buffers, or reads across a
+ * gap of at most max_gap bytes (into a scratch buffer), is issued
+ * vectored.  Merged requests are cut where they would cross a max_bytes
+ * aligned boundary.
+ */
+#define OPIO_MAX_IOVS            32
+#define OPIO_DEFAULT_MAX_BYTES   (512 << 10)
+#define OPIO_DEFAULT_MAX_GAP     (8 << 10)
+
 struct opio;
 
 struct opio_list {
@@ -42,12 +55,28 @@ struct opio {
 	char               *buf;
 	unsigned long       nbytes;
 	long long           offset;
+	short               opcode;
 	void               *data;
 	struct iocb        *iocb;
 	struct io_event     event;
 	struct opio        *head;
 	struct opio        *next;
 	struct opio_list    list;
+
+	/* head only */
+	unsigned long       total;
+	int                 nr_iovs;
+	struct iovec       *iovs;
+};
+
+struct opio_stats {
+	uint64_t            batches;
+	uint64_t            iocbs;     /* requests passed to io_merge */
+	uint64_t            merged;    /* requests left after merging */
+	uint64_t            vectored;  /* merged requests issued vectored */
+	uint64_t            gaps;      /* read gaps filled */
+	uint64_t            gap_bytes;
+	uint64_t            cuts;      /* merges refused at max_bytes */
 };
 
 struct opioctx {
@@ -57,10 +86,19 @@ struct opioctx {
 	struct opio       **free_opios;
 	struct iocb       **iocb_queue;
 	struct io_event    *event_queue;
+
+	unsigned long       max_bytes;
+	unsigned long       max_gap;
+	char               *gap_buf;
+	struct iovec       *iovecs;
+
+	struct opio_stats   stats;
 };
 
 int opio_init(struct opioctx *ctx, int num_iocbs);
 void opio_free(struct opioctx *ctx);
+int opio_set_limits(struct opioctx *ctx,
+		    unsigned long max_bytes, unsigned long max_gap);
 int io_merge(struct opioctx *ctx, struct iocb **queue, int num);
 int io_split(struct opioctx *ctx, struct io_event *events, int num);
 int io_expand_iocbs(struct opioctx *ctx, struct iocb **queue, int idx, int num);
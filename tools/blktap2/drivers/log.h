@@ -120,4 +120,10 @@ DEFINE_RING_TYPES(log, log_request_t, log_response_t);
 
 #define LOG_HEADER_PAGES 4
 
+/* changed block tracking requests from tap-ctl */
+struct td_driver_handle;
+struct tapdisk_message_cbt;
+int tdlog_cbt_control(struct td_driver_handle *,
+		      struct tapdisk_message_cbt *);
+
 #endif
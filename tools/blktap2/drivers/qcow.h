@@ -79,7 +79,14 @@ uint32_t gen_cksum(char *ptr, int len);
 int get_filesize(char *filename, uint64_t *size, struct stat *st);
 int qtruncate(int fd, off_t length, int sparse);
 
-#define L2_CACHE_SIZE 16  /*Fixed allocation in Qemu*/
+#define L2_CACHE_SIZE 16  /*Minimum number of cached L2 tables*/
+#define L2_CACHE_DEFAULT_BYTES (4 << 20) /*TAPDISK2_QCOW_L2_CACHE_SIZE*/
+
+struct qcow_l2_entry {
+	uint64_t offset;               /*L2 table offset, 0 if unused*/
+	int next;                      /*Hash chain, -1 terminated*/
+	int referenced;                /*Second chance for the clock*/
+};
 
 struct tdqcow_state {
         int fd;                        /*Main Qcow file descriptor */
@@ -104,10 +111,12 @@ struct tdqcow_state {
 	uint64_t l1_table_offset;      /*L1 table offset from beginning of 
 					*file*/
 	uint64_t *l1_table;            /*L1 table entries*/
-	uint64_t *l2_cache;            /*We maintain a cache of size 
-					*L2_CACHE_SIZE of most read entries*/
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];     /*L2 cache entries*/
-	uint32_t l2_cache_counts[L2_CACHE_SIZE];      /*Cache access record*/
+	uint64_t *l2_cache;            /*l2_cache_size cached L2 tables*/
+	struct qcow_l2_entry *l2_cache_entries; /*One per cached table*/
+	int *l2_cache_buckets;         /*Hash of table offset to entry*/
+	int l2_cache_size;             /*Number of cached tables*/
+	int l2_cache_hash_bits;        /*log2 of the number of buckets*/
+	int l2_cache_hand;             /*Clock hand for eviction*/
 	uint8_t *cluster_cache;          
 	uint8_t *cluster_data;
 	uint64_t cluster_cache_offset; /**/
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Scheduler microbenchmark: times scheduler_wait_for_events() with one
+ * busy pipe among N idle ones, each also having a timeout event, the
+ * way a tapdisk serving N VBDs looks to the scheduler.  Then times
+ * registering and unregistering events with N of them in place.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "scheduler.h"
+
+#define MIN(a, b)                        ((a) < (b) ? (a) : (b))
+
+#define DEFAULT_EVENTS                   1000
+#define DEFAULT_ITERATIONS               20000
+
+static unsigned long callbacks;
+
+static void
+bench_cb(event_id_t id, char mode, void *private)
+{
+	callbacks++;
+}
+
+static double
+bench_elapsed_us(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000.0 +
+		(now.tv_usec - start->tv_usec);
+}
+
+static void
+usage(const char *prog, int code)
+{
+	fprintf(stderr, "usage: %s [-n events] [-i iterations]\n", prog);
+	exit(code);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, i, err, nr_events, iterations, (*pipes)[2];
+	event_id_t *ids;
+	struct timeval start;
+	struct rlimit rlim;
+	scheduler_t sched;
+
+	nr_events  = DEFAULT_EVENTS;
+	iterations = DEFAULT_ITERATIONS;
+
+	while ((c = getopt(argc, argv, "n:i:h")) != -1) {
+		switch (c) {
+		case 'n':
+			nr_events = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'h':
+			usage(argv[0], 0);
+		default:
+			usage(argv[0], EINVAL);
+		}
+	}
+
+	if (nr_events <= 0 || iterations <= 0)
+		usage(argv[0], EINVAL);
+
+	/* Two fds per pipe, plus some to spare. */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 &&
+	    rlim.rlim_cur < 2 * nr_events + 64) {
+		rlim.rlim_cur = MIN(rlim.rlim_max,
+				    (rlim_t)(2 * nr_events + 64));
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	pipes = calloc(nr_events, sizeof(*pipes));
+	ids   = calloc(nr_events, sizeof(*ids));
+	if (!pipes || !ids) {
+		fprintf(stderr, "out of memory\n");
+		return ENOMEM;
+	}
+
+	err = scheduler_initialize(&sched);
+	if (err) {
+		fprintf(stderr, "scheduler_initialize: %d\n", err);
+		return -err;
+	}
+
+	for (i = 0; i < nr_events; i++) {
+		if (pipe(pipes[i])) {
+			err = errno;
+			perror("pipe");
+			return err;
+		}
+
+		err = scheduler_register_event(&sched, SCHEDULER_POLL_TIMEOUT,
+					       -1, 30 + i % 500,
+					       bench_cb, NULL);
+		if (err < 0)
+			goto fail;
+
+		err = scheduler_register_event(&sched, SCHEDULER_POLL_READ_FD,
+					       pipes[i][0], 0,
+					       bench_cb, NULL);
+		if (err < 0)
+			goto fail;
+		ids[i] = err;
+	}
+
+	if (write(pipes[0][1], "x", 1) != 1) {
+		err = errno;
+		perror("write");
+		return err;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iterations; i++)
+		scheduler_wait_for_events(&sched);
+	printf("%d events: %.2fus per scheduler_wait_for_events\n",
+	       nr_events, bench_elapsed_us(&start) / iterations);
+
+	/* Unregister and register again the fd events, oldest first. */
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iterations; i++) {
+		int n = i % nr_events;
+
+		scheduler_unregister_event(&sched, ids[n]);
+		err = scheduler_register_event(&sched, SCHEDULER_POLL_READ_FD,
+					       pipes[n][0], 0,
+					       bench_cb, NULL);
+		if (err < 0)
+			goto fail;
+		ids[n] = err;
+	}
+	printf("%d events: %.2fus per unregister and register\n",
+	       nr_events, bench_elapsed_us(&start) / iterations);
+
+	return 0;
+
+fail:
+	fprintf(stderr, "scheduler_register_event: %d\n", err);
+	return -err;
+}
@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 
 #include "scheduler.h"
 #include "tapdisk-log.h"
@@ -40,123 +41,310 @@
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
+#define SCHEDULER_MAX_EPOLL_EVENTS   64
+
+#define WHEEL_MASK                  (SCHEDULER_WHEEL_SLOTS - 1)
+#define WHEEL_SPAN                  (1L << (2 * SCHEDULER_WHEEL_BITS))
 
 #define MIN(a, b)                   ((a) <= (b) ? (a) : (b))
 #define MAX(a, b)                   ((a) >= (b) ? (a) : (b))
 
-#define scheduler_for_each_event(s, event, tmp)	\
-	list_for_each_entry_safe(event, tmp, &(s)->events, next)
+#define scheduler_event_bucket(s, id)				\
+	(&(s)->events[(id) & (SCHEDULER_HASH_SIZE - 1)])
 
 typedef struct event {
 	char                         mode;
+	char                         ready;
 	event_id_t                   id;
 
 	int                          fd;
 	int                          timeout;
-	int                          deadline;
+	long                         deadline;
 
 	event_cb_t                   cb;
 	void                        *private;
 
 	struct list_head             next;
+	struct list_head             fd_next;
+	struct list_head             timer;
+	struct list_head             pending;
 } event_t;
 
-static void
-scheduler_prepare_events(scheduler_t *s)
+/* All events registered on one file descriptor */
+struct scheduler_fd {
+	struct list_head             events;
+	uint32_t                     mask;
+	int                          registered;  /* in the epoll set */
+};
+
+static long
+scheduler_now(void)
 {
-	int diff;
 	struct timeval now;
-	event_t *event, *tmp;
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	gettimeofday(&now, NULL);
+	return now.tv_sec;
+}
 
-	s->max_fd  = 0;
-	s->timeout = SCHEDULER_MAX_TIMEOUT;
+static void
+scheduler_timer_add(scheduler_t *s, event_t *event)
+{
+	long delta = event->deadline - s->wheel_time;
+	struct list_head *head;
+
+	if (delta < 0)
+		head = &s->expired;
+	else if (delta < SCHEDULER_WHEEL_SLOTS)
+		head = &s->wheel[0][event->deadline & WHEEL_MASK];
+	else if (delta < WHEEL_SPAN)
+		head = &s->wheel[1][(event->deadline >> SCHEDULER_WHEEL_BITS) &
+				    WHEEL_MASK];
+	else
+		head = &s->overflow;
+
+	list_add_tail(&event->timer, head);
+}
 
-	gettimeofday(&now, NULL);
+static void
+scheduler_timer_cascade(scheduler_t *s, struct list_head *head)
+{
+	event_t *event, *tmp;
+	LIST_HEAD(list);
 
-	scheduler_for_each_event(s, event, tmp) {
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	list_splice(head, &list);
+	INIT_LIST_HEAD(head);
 
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	list_for_each_entry_safe(event, tmp, &list, timer) {
+		list_del(&event->timer);
+		scheduler_timer_add(s, event);
+	}
+}
 
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
+/*
+ * Move every timer whose deadline has passed onto the expired list.
+ * Each tick only touches its own slot; the upper level and the overflow
+ * list are redistributed as the wheel wraps.
+ */
+static void
+scheduler_advance_timers(scheduler_t *s, long now)
+{
+	int i;
+
+	if (now - s->wheel_time >= WHEEL_SPAN) {
+		/* We slept through a whole revolution: rehash everything. */
+		s->wheel_time = now;
+		for (i = 0; i < SCHEDULER_WHEEL_SLOTS; i++) {
+			scheduler_timer_cascade(s, &s->wheel[0][i]);
+			scheduler_timer_cascade(s, &s->wheel[1][i]);
 		}
+		scheduler_timer_cascade(s, &s->overflow);
+	}
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
-		}
+	for (; s->wheel_time <= now; s->wheel_time++) {
+		long t = s->wheel_time;
+
+		if (!(t & (WHEEL_SPAN - 1)))
+			scheduler_timer_cascade(s, &s->overflow);
+
+		if (!(t & WHEEL_MASK))
+			scheduler_timer_cascade(s,
+				&s->wheel[1][(t >> SCHEDULER_WHEEL_BITS) &
+					     WHEEL_MASK]);
+
+		list_splice(&s->wheel[0][t & WHEEL_MASK], s->expired.prev);
+		INIT_LIST_HEAD(&s->wheel[0][t & WHEEL_MASK]);
 	}
+}
+
+/* Seconds until the next timer may expire, at most 'limit' */
+static int
+scheduler_next_timeout(scheduler_t *s, long now, int limit)
+{
+	long t, next;
+
+	if (!list_empty(&s->expired))
+		return 0;
+
+	next = ((s->wheel_time >> SCHEDULER_WHEEL_BITS) + 1) <<
+		SCHEDULER_WHEEL_BITS;
+
+	for (t = s->wheel_time; t < next; t++)
+		if (!list_empty(&s->wheel[0][t & WHEEL_MASK]))
+			break;
 
-	s->timeout = MIN(s->timeout, s->max_timeout);
+	return MAX(0, MIN(t - now, limit));
 }
 
-static void
-scheduler_event_callback(event_t *event, char mode)
+static struct scheduler_fd *
+scheduler_get_fd(scheduler_t *s, int fd)
 {
-	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		event->deadline = now.tv_sec + event->timeout;
+	struct scheduler_fd **fds;
+	int nr;
+
+	if (fd < s->nr_fds && s->fds[fd])
+		return s->fds[fd];
+
+	if (fd >= s->nr_fds) {
+		nr  = MAX(fd + 1, 2 * s->nr_fds);
+		fds = realloc(s->fds, nr * sizeof(*fds));
+		if (!fds)
+			return NULL;
+		memset(fds + s->nr_fds, 0, (nr - s->nr_fds) * sizeof(*fds));
+		s->fds    = fds;
+		s->nr_fds = nr;
 	}
 
-	event->cb(event->id, mode, event->private);
+	s->fds[fd] = calloc(1, sizeof(struct scheduler_fd));
+	if (s->fds[fd])
+		INIT_LIST_HEAD(&s->fds[fd]->events);
+
+	return s->fds[fd];
+}
+
+/*
+ * Bring the epoll set in line with the events registered on 'fd'.
+ *
+ * Closing an fd drops it from the epoll set behind our back, and the
+ * number may since have been reused for another file, which must be
+ * added afresh even though the mask we want for it is unchanged.  So
+ * 'sync' makes us tell the kernel even when nothing changed here: new
+ * registrations do that.
+ */
+static int
+scheduler_update_fd(scheduler_t *s, int fd, int sync)
+{
+	struct scheduler_fd *sfd = s->fds[fd];
+	struct epoll_event ev;
+	uint32_t mask = 0;
+	event_t *event;
+	int op, err;
+
+	list_for_each_entry(event, &sfd->events, fd_next) {
+		if (event->mode & SCHEDULER_POLL_READ_FD)
+			mask |= EPOLLIN;
+		if (event->mode & SCHEDULER_POLL_WRITE_FD)
+			mask |= EPOLLOUT;
+		if (event->mode & SCHEDULER_POLL_EXCEPT_FD)
+			mask |= EPOLLPRI;
+	}
+
+	if (mask == sfd->mask && !sync)
+		goto out;
+
+	if (!mask) {
+		if (!sfd->registered)
+			goto out;
+		op = EPOLL_CTL_DEL;
+	} else if (!sfd->registered)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events  = mask;
+	ev.data.fd = fd;
+
+	err = epoll_ctl(s->epoll_fd, op, fd, &ev);
+	if (err) {
+		if (op == EPOLL_CTL_DEL && (errno == EBADF || errno == ENOENT))
+			err = 0;
+		else if (op == EPOLL_CTL_MOD && errno == ENOENT)
+			err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+			err = epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+	}
+	if (err)
+		return -errno;
+
+	sfd->mask       = mask;
+	sfd->registered = !!mask;
+
+out:
+	if (!mask) {
+		free(sfd);
+		s->fds[fd] = NULL;
+	}
+
+	return 0;
 }
 
 static void
-scheduler_run_events(scheduler_t *s)
+scheduler_mark_ready(scheduler_t *s, event_t *event, char mode)
 {
-	struct timeval now;
+	if (event->ready)
+		return;
+
+	event->ready = mode;
+	list_add_tail(&event->pending, &s->pending);
+}
+
+static void
+scheduler_prepare_events(scheduler_t *s, struct epoll_event *evs, int n)
+{
+	struct scheduler_fd *sfd;
 	event_t *event, *tmp;
+	uint32_t revents;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		revents = evs[i].events;
+		sfd     = evs[i].data.fd < s->nr_fds ?
+			s->fds[evs[i].data.fd] : NULL;
+		if (!sfd)
+			continue;
+
+		list_for_each_entry(event, &sfd->events, fd_next) {
+			if ((event->mode & SCHEDULER_POLL_READ_FD) &&
+			    (revents & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+				scheduler_mark_ready(s, event,
+						     SCHEDULER_POLL_READ_FD);
+			else if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
+				 (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+				scheduler_mark_ready(s, event,
+						     SCHEDULER_POLL_WRITE_FD);
+			else if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
+				 (revents & (EPOLLPRI | EPOLLHUP | EPOLLERR)))
+				scheduler_mark_ready(s, event,
+						     SCHEDULER_POLL_EXCEPT_FD);
+		}
+	}
 
-	gettimeofday(&now, NULL);
+	list_for_each_entry_safe(event, tmp, &s->expired, timer) {
+		list_del_init(&event->timer);
+		scheduler_mark_ready(s, event, SCHEDULER_POLL_TIMEOUT);
+	}
+}
 
- again:
-	s->restart = 0;
+static void
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
+{
+	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
+		list_del(&event->timer);
+		event->deadline = scheduler_now() + event->timeout;
+		scheduler_timer_add(s, event);
+	}
 
-	scheduler_for_each_event(s, event, tmp) {
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_READ_FD);
-			goto next;
-		}
+	event->cb(event->id, mode, event->private);
+}
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_WRITE_FD);
-			goto next;
-		}
+static void
+scheduler_run_events(scheduler_t *s)
+{
+	event_t *event;
+	char mode;
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_EXCEPT_FD);
-			goto next;
-		}
+	/*
+	 * Callbacks may unregister any event, which also takes it off
+	 * the pending list, so always restart from the head.
+	 */
+	while (!list_empty(&s->pending)) {
+		event = list_entry(s->pending.next, event_t, pending);
+		list_del_init(&event->pending);
 
-		if ((event->mode & SCHEDULER_POLL_TIMEOUT) &&
-		    (event->deadline <= now.tv_sec))
-		    scheduler_event_callback(event, SCHEDULER_POLL_TIMEOUT);
+		mode = event->ready;
+		event->ready = 0;
 
-	next:
-		if (s->restart)
-			goto again;
+		scheduler_event_callback(s, event, mode);
 	}
 }
 
@@ -164,8 +352,9 @@ int
 scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 int timeout, event_cb_t cb, void *private)
 {
+	struct scheduler_fd *sfd = NULL;
 	event_t *event;
-	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -173,26 +362,54 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!(mode & SCHEDULER_POLL_TIMEOUT) && !(mode & SCHEDULER_POLL_FD))
 		return -EINVAL;
 
+	if ((mode & SCHEDULER_POLL_FD) && fd < 0)
+		return -EINVAL;
+
 	event = calloc(1, sizeof(event_t));
 	if (!event)
 		return -ENOMEM;
 
-	gettimeofday(&now, NULL);
-
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->fd_next);
+	INIT_LIST_HEAD(&event->timer);
+	INIT_LIST_HEAD(&event->pending);
 
 	event->mode     = mode;
 	event->fd       = fd;
 	event->timeout  = timeout;
-	event->deadline = now.tv_sec + timeout;
+	event->deadline = scheduler_now() + timeout;
 	event->cb       = cb;
 	event->private  = private;
-	event->id       = s->uuid++;
+
+	if (mode & SCHEDULER_POLL_FD) {
+		sfd = scheduler_get_fd(s, fd);
+		if (!sfd) {
+			free(event);
+			return -ENOMEM;
+		}
+
+		list_add_tail(&event->fd_next, &sfd->events);
+		err = scheduler_update_fd(s, fd, 1);
+		if (err) {
+			list_del(&event->fd_next);
+			if (list_empty(&sfd->events) && !sfd->registered) {
+				free(sfd);
+				s->fds[fd] = NULL;
+			}
+			free(event);
+			return err;
+		}
+	}
+
+	if (mode & SCHEDULER_POLL_TIMEOUT)
+		scheduler_timer_add(s, event);
+
+	event->id = s->uuid++;
 
 	if (!s->uuid)
 		s->uuid++;
 
-	list_add_tail(&event->next, &s->events);
+	list_add_tail(&event->next, scheduler_event_bucket(s, event->id));
 
 	return event->id;
 }
@@ -200,16 +417,25 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 void
 scheduler_unregister_event(scheduler_t *s, event_id_t id)
 {
-	event_t *event, *tmp;
+	event_t *event;
 
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event, tmp)
+	list_for_each_entry(event, scheduler_event_bucket(s, id), next)
 		if (event->id == id) {
 			list_del(&event->next);
+			list_del(&event->timer);
+			list_del(&event->pending);
+
+			if (event->mode & SCHEDULER_POLL_FD) {
+				list_del(&event->fd_next);
+				if (scheduler_update_fd(s, event->fd, 0))
+					DBG("failed to remove fd %d\n",
+					    event->fd);
+			}
+
 			free(event);
-			s->restart = 1;
 			break;
 		}
 }
@@ -224,42 +450,61 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
+	struct epoll_event evs[SCHEDULER_MAX_EPOLL_EVENTS];
 	int ret;
-	struct timeval tv;
+	long now;
 
-	scheduler_prepare_events(s);
+	now = scheduler_now();
+	scheduler_advance_timers(s, now);
 
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
+	s->timeout = scheduler_next_timeout(s, now,
+					    MIN(SCHEDULER_MAX_TIMEOUT,
+						s->max_timeout));
 
 	DBG("timeout: %d, max_timeout: %d\n",
 	    s->timeout, s->max_timeout);
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
+	ret = epoll_wait(s->epoll_fd, evs, SCHEDULER_MAX_EPOLL_EVENTS,
+			 s->timeout * 1000);
 
-	s->restart     = 0;
 	s->timeout     = SCHEDULER_MAX_TIMEOUT;
 	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
 	if (ret < 0)
-		return ret;
+		return -errno;
 
+	scheduler_advance_timers(s, scheduler_now());
+	scheduler_prepare_events(s, evs, ret);
 	scheduler_run_events(s);
 
 	return ret;
 }
 
-void
+int
 scheduler_initialize(scheduler_t *s)
 {
+	int i;
+
 	memset(s, 0, sizeof(scheduler_t));
 
-	s->uuid = 1;
+	s->uuid        = 1;
+	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
+
+	INIT_LIST_HEAD(&s->pending);
+	INIT_LIST_HEAD(&s->expired);
+	INIT_LIST_HEAD(&s->overflow);
+	for (i = 0; i < SCHEDULER_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&s->events[i]);
+	for (i = 0; i < SCHEDULER_WHEEL_SLOTS; i++) {
+		INIT_LIST_HEAD(&s->wheel[0][i]);
+		INIT_LIST_HEAD(&s->wheel[1][i]);
+	}
+
+	s->wheel_time = scheduler_now();
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	s->epoll_fd = epoll_create(SCHEDULER_MAX_EPOLL_EVENTS);
+	if (s->epoll_fd < 0)
+		return -errno;
 
-	INIT_LIST_HEAD(&s->events);
+	return 0;
 }
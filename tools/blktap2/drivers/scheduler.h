@@ -40,21 +40,40 @@
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+/*
+ * Timeouts are kept in a two level timer wheel with one second ticks:
+ * deadlines up to SCHEDULER_WHEEL_SLOTS seconds out go in the first
+ * level, up to SCHEDULER_WHEEL_SLOTS^2 seconds in the second, anything
+ * further in an overflow list.
+ */
+#define SCHEDULER_WHEEL_BITS         6
+#define SCHEDULER_WHEEL_SLOTS        (1 << SCHEDULER_WHEEL_BITS)
+
+/* Events are found by id through a hash table of this many buckets */
+#define SCHEDULER_HASH_BITS          10
+#define SCHEDULER_HASH_SIZE          (1 << SCHEDULER_HASH_BITS)
+
+struct scheduler_fd;
+
 typedef struct scheduler {
-	fd_set                       read_fds;
-	fd_set                       write_fds;
-	fd_set                       except_fds;
+	int                          epoll_fd;
+	struct scheduler_fd        **fds;
+	int                          nr_fds;
+
+	struct list_head             events[SCHEDULER_HASH_SIZE];
+	struct list_head             pending;
+	struct list_head             expired;
 
-	struct list_head             events;
+	long                         wheel_time;
+	struct list_head             wheel[2][SCHEDULER_WHEEL_SLOTS];
+	struct list_head             overflow;
 
 	int                          uuid;
-	int                          max_fd;
 	int                          timeout;
-	int                          restart;
 	int                          max_timeout;
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+int scheduler_initialize(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
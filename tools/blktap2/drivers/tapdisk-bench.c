@@ -0,0 +1,621 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Write benchmark: drives an image through the full tapdisk request
+ * path, writing every slot of a sector range exactly once.  Run against
+ * a freshly created sparse image it measures first-write (allocation)
+ * throughput.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "list.h"
+#include "scheduler.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-utils.h"
+
+#define POLL_READ                        0
+#define POLL_WRITE                       1
+
+#define MIN(a, b)                        ((a) < (b) ? (a) : (b))
+
+struct tapdisk_bench_poll {
+	int                              pipe[2];
+	int                              set;
+};
+
+struct tapdisk_bench_request {
+	uint64_t                         sec;
+	blkif_request_t                  blkif_req;
+	struct list_head                 next;
+};
+
+struct tapdisk_bench {
+	td_vbd_t                        *vbd;
+
+	unsigned int                     id;
+	int                              err;
+
+	uint64_t                         start;
+	uint64_t                         end;
+
+	uint32_t                         secs;     /* sectors per write */
+	uint32_t                         stride;   /* sectors between slots */
+	uint64_t                         slots;
+	uint64_t                        *order;    /* slot order, for -r */
+
+	int                              depth;
+	uint64_t                         started;
+	uint64_t                         completed;
+
+	struct timeval                   ts_start;
+	struct timeval                   ts_end;
+
+	struct tapdisk_bench_poll        poll;
+	event_id_t                       enqueue_event_id;
+
+	struct list_head                 free_list;
+	struct list_head                 pending_list;
+
+	struct tapdisk_bench_request     requests[MAX_REQUESTS];
+};
+
+static void tapdisk_bench_close_image(struct tapdisk_bench *);
+
+static void
+usage(const char *app, int err)
+{
+	printf("usage: %s <-n type:/path/to/image> [-b write size (bytes)] "
+	       "[-q queue depth] [-S stride (bytes)] [-c sector count] "
+	       "[-s skip sectors] [-r random order] [-P no preallocation]\n",
+	       app);
+	exit(err);
+}
+
+static inline void
+tapdisk_bench_poll_initialize(struct tapdisk_bench_poll *p)
+{
+	p->set = 0;
+	p->pipe[POLL_READ] = p->pipe[POLL_WRITE] = -1;
+}
+
+static int
+tapdisk_bench_poll_open(struct tapdisk_bench_poll *p)
+{
+	int err;
+
+	tapdisk_bench_poll_initialize(p);
+
+	err = pipe(p->pipe);
+	if (err)
+		return -errno;
+
+	err = fcntl(p->pipe[POLL_READ], F_SETFL, O_NONBLOCK);
+	if (err)
+		goto out;
+
+	err = fcntl(p->pipe[POLL_WRITE], F_SETFL, O_NONBLOCK);
+	if (err)
+		goto out;
+
+	return 0;
+
+out:
+	close(p->pipe[POLL_READ]);
+	close(p->pipe[POLL_WRITE]);
+	tapdisk_bench_poll_initialize(p);
+	return -errno;
+}
+
+static void
+tapdisk_bench_poll_close(struct tapdisk_bench_poll *p)
+{
+	if (p->pipe[POLL_READ] != -1)
+		close(p->pipe[POLL_READ]);
+	if (p->pipe[POLL_WRITE] != -1)
+		close(p->pipe[POLL_WRITE]);
+	tapdisk_bench_poll_initialize(p);
+}
+
+static inline void
+tapdisk_bench_poll_clear(struct tapdisk_bench_poll *p)
+{
+	int dummy;
+
+	read_exact(p->pipe[POLL_READ], &dummy, sizeof(dummy));
+	p->set = 0;
+}
+
+static inline void
+tapdisk_bench_poll_set(struct tapdisk_bench_poll *p)
+{
+	int dummy = 0;
+
+	if (!p->set) {
+		write_exact(p->pipe[POLL_WRITE], &dummy, sizeof(dummy));
+		p->set = 1;
+	}
+}
+
+static inline int
+tapdisk_bench_stop(struct tapdisk_bench *s)
+{
+	return (list_empty(&s->pending_list) &&
+		(s->started == s->slots || s->err));
+}
+
+static inline int
+tapdisk_bench_request_idx(struct tapdisk_bench *s,
+			  struct tapdisk_bench_request *req)
+{
+	return (req - s->requests);
+}
+
+static inline struct tapdisk_bench_request *
+tapdisk_bench_get_request(struct tapdisk_bench *s)
+{
+	struct tapdisk_bench_request *req;
+
+	if (list_empty(&s->free_list))
+		return NULL;
+
+	req = list_entry(s->free_list.next,
+			 struct tapdisk_bench_request, next);
+
+	list_del_init(&req->next);
+	memset(req, 0, sizeof(*req));
+	INIT_LIST_HEAD(&req->next);
+
+	return req;
+}
+
+static void
+tapdisk_bench_dequeue(void *arg, blkif_response_t *rsp)
+{
+	struct tapdisk_bench *s = (struct tapdisk_bench *)arg;
+	struct tapdisk_bench_request *sreq = s->requests + rsp->id;
+
+	list_del_init(&sreq->next);
+	list_add_tail(&sreq->next, &s->free_list);
+	s->completed++;
+
+	if (rsp->status != BLKIF_RSP_OKAY) {
+		s->err = EIO;
+		fprintf(stderr, "error writing sector 0x%"PRIx64"\n", sreq->sec);
+	}
+
+	tapdisk_bench_poll_set(&s->poll);
+}
+
+static void
+tapdisk_bench_enqueue(event_id_t id, char mode, void *arg)
+{
+	td_vbd_t *vbd;
+	int i, idx, psize, pending;
+	struct tapdisk_bench *s = (struct tapdisk_bench *)arg;
+
+	vbd = s->vbd;
+	tapdisk_bench_poll_clear(&s->poll);
+
+	if (tapdisk_bench_stop(s)) {
+		gettimeofday(&s->ts_end, NULL);
+		tapdisk_bench_close_image(s);
+		return;
+	}
+
+	psize   = getpagesize();
+	pending = s->started - s->completed;
+
+	while (s->started < s->slots && !s->err && pending < s->depth) {
+		uint64_t slot;
+		uint32_t secs;
+		blkif_request_t *breq;
+		td_vbd_request_t *vreq;
+		struct tapdisk_bench_request *sreq;
+
+		sreq = tapdisk_bench_get_request(s);
+		if (!sreq)
+			break;
+
+		idx  = tapdisk_bench_request_idx(s, sreq);
+		slot = (s->order ? s->order[s->started] : s->started);
+
+		sreq->sec           = s->start + slot * s->stride;
+		secs                = MIN(s->secs, s->end - sreq->sec);
+
+		breq                = &sreq->blkif_req;
+		breq->id            = idx;
+		breq->nr_segments   = 0;
+		breq->sector_number = sreq->sec;
+		breq->operation     = BLKIF_OP_WRITE;
+
+		for (i = 0; i < BLKIF_MAX_SEGMENTS_PER_REQUEST && secs; i++) {
+			uint32_t n = MIN(secs, psize >> SECTOR_SHIFT);
+			struct blkif_request_segment *seg = breq->seg + i;
+
+			seg->first_sect = 0;
+			seg->last_sect  = n - 1;
+			breq->nr_segments++;
+			secs -= n;
+		}
+
+		vreq = vbd->request_list + idx;
+
+		assert(list_empty(&vreq->next));
+		assert(vreq->secs_pending == 0);
+
+		memcpy(&vreq->req, breq, sizeof(*breq));
+		vbd->received++;
+		vreq->vbd = vbd;
+
+		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
+		list_add_tail(&sreq->next, &s->pending_list);
+
+		s->started++;
+		pending++;
+	}
+
+	tapdisk_vbd_issue_requests(vbd);
+}
+
+/* open the stack the way tapdisk-control does for a new vbd */
+static int
+tapdisk_bench_open_image(struct tapdisk_bench *s,
+			 const char *params, int storage)
+{
+	int err;
+
+	err = tapdisk_server_initialize();
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_initialize(s->id);
+	if (err)
+		goto out;
+
+	s->vbd = tapdisk_server_get_vbd(s->id);
+	if (!s->vbd) {
+		err = ENODEV;
+		goto out;
+	}
+
+	tapdisk_vbd_set_callback(s->vbd, tapdisk_bench_dequeue, s);
+
+	err = tapdisk_namedup(&s->vbd->name, params);
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_parse_stack(s->vbd, params);
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_open_stack(s->vbd, storage, 0);
+	if (err)
+		goto out;
+
+	s->vbd->reopened = 1;
+	err = 0;
+
+out:
+	if (err)
+		fprintf(stderr, "failed to open %s: %d\n", params, err);
+	return err;
+}
+
+static void
+tapdisk_bench_close_image(struct tapdisk_bench *s)
+{
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(s->id);
+	if (vbd) {
+		tapdisk_vbd_close_vdi(vbd);
+		tapdisk_server_remove_vbd(vbd);
+		free((void *)vbd->ring.vstart);
+		free(vbd->name);
+		free(vbd);
+		s->vbd = NULL;
+	}
+}
+
+static int
+tapdisk_bench_set_range(struct tapdisk_bench *s,
+			uint64_t count, uint64_t skip, int shuffle)
+{
+	int err;
+	uint64_t i, j, tmp;
+	image_t image;
+
+	err = tapdisk_vbd_get_image_info(s->vbd, &image);
+	if (err) {
+		fprintf(stderr, "failed getting image size: %d\n", err);
+		return err;
+	}
+
+	if (count == (uint64_t)-1)
+		count = image.size - skip;
+
+	if (count + skip > image.size) {
+		fprintf(stderr, "0x%"PRIx64" past end of image 0x%"PRIx64"\n",
+			(uint64_t) (count + skip), (uint64_t) image.size);
+		return -EINVAL;
+	}
+
+	s->start = skip;
+	s->end   = skip + count;
+	s->slots = (count + s->stride - 1) / s->stride;
+
+	if (!shuffle || !s->slots)
+		return 0;
+
+	s->order = malloc(s->slots * sizeof(uint64_t));
+	if (!s->order)
+		return -ENOMEM;
+
+	for (i = 0; i < s->slots; i++)
+		s->order[i] = i;
+
+	for (i = s->slots - 1; i > 0; i--) {
+		j           = random() % (i + 1);
+		tmp         = s->order[i];
+		s->order[i] = s->order[j];
+		s->order[j] = tmp;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_bench_initialize_requests(struct tapdisk_bench *s)
+{
+	size_t size;
+	td_ring_t *ring;
+	int err, i, psize;
+
+	ring  = &s->vbd->ring;
+	psize = getpagesize();
+	size  = psize * BLKTAP_MMAP_REGION_SIZE;
+
+	/* as in tapdisk-stream, have tapdisk_vbd use our buffers */
+	err = posix_memalign((void **)&ring->vstart, psize, size);
+	if (err) {
+		fprintf(stderr, "failed to allocate buffers: %d\n", err);
+		ring->vstart = 0;
+		return err;
+	}
+
+	memset((void *)ring->vstart, 0x5a, size);
+
+	for (i = 0; i < MAX_REQUESTS; i++) {
+		struct tapdisk_bench_request *req = s->requests + i;
+		INIT_LIST_HEAD(&req->next);
+		list_add_tail(&req->next, &s->free_list);
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_bench_register_enqueue_event(struct tapdisk_bench *s)
+{
+	int err;
+	struct tapdisk_bench_poll *p = &s->poll;
+
+	err = tapdisk_bench_poll_open(p);
+	if (err)
+		goto out;
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    p->pipe[POLL_READ], 0,
+					    tapdisk_bench_enqueue, s);
+	if (err < 0)
+		goto out;
+
+	s->enqueue_event_id = err;
+	err = 0;
+
+out:
+	if (err)
+		fprintf(stderr, "failed to register event: %d\n", err);
+	return err;
+}
+
+static void
+tapdisk_bench_unregister_enqueue_event(struct tapdisk_bench *s)
+{
+	if (s->enqueue_event_id) {
+		tapdisk_server_unregister_event(s->enqueue_event_id);
+		s->enqueue_event_id = 0;
+	}
+	tapdisk_bench_poll_close(&s->poll);
+}
+
+static void
+tapdisk_bench_release(struct tapdisk_bench *s)
+{
+	tapdisk_bench_close_image(s);
+	tapdisk_bench_unregister_enqueue_event(s);
+	free(s->order);
+}
+
+static int
+tapdisk_bench_run(struct tapdisk_bench *s)
+{
+	int err;
+
+	/*
+	 * kick the enqueue event rather than calling it directly: tiocbs
+	 * are only submitted after the loop wakes, so queueing ahead of
+	 * tapdisk_server_run() would stall the first batch until timeout.
+	 */
+	gettimeofday(&s->ts_start, NULL);
+	tapdisk_bench_poll_set(&s->poll);
+
+	err = tapdisk_server_run();
+	if (err) {
+		fprintf(stderr, "failed to run server: %d\n", err);
+		return err;
+	}
+
+	return s->err;
+}
+
+static void
+tapdisk_bench_report(struct tapdisk_bench *s)
+{
+	double secs, bytes;
+
+	secs  = (s->ts_end.tv_sec - s->ts_start.tv_sec) +
+		(s->ts_end.tv_usec - s->ts_start.tv_usec) / 1000000.0;
+	bytes = (double)s->completed * (s->secs << SECTOR_SHIFT);
+
+	if (secs <= 0)
+		secs = 1e-6;
+
+	printf("writes: %"PRIu64", size: %u, depth: %d, time: %.3fs, "
+	       "%.1f MB/s, %.0f iops\n", s->completed,
+	       s->secs << SECTOR_SHIFT, s->depth, secs,
+	       bytes / secs / (1 << 20), s->completed / secs);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, err, type, shuffle, storage;
+	const char *params;
+	const char *path;
+	uint64_t count, skip, bsize, stride;
+	struct tapdisk_bench bench;
+
+	err     = 0;
+	skip    = 0;
+	shuffle  = 0;
+	stride  = 0;
+	bsize   = 4096;
+	count   = (uint64_t)-1;
+	params  = NULL;
+	storage = TAPDISK_STORAGE_TYPE_DEFAULT;
+
+	memset(&bench, 0, sizeof(bench));
+	INIT_LIST_HEAD(&bench.free_list);
+	INIT_LIST_HEAD(&bench.pending_list);
+	tapdisk_bench_poll_initialize(&bench.poll);
+	bench.depth = 32;
+
+	while ((c = getopt(argc, argv, "n:b:q:S:c:s:rPh")) != -1) {
+		switch (c) {
+		case 'n':
+			params = optarg;
+			break;
+		case 'b':
+			bsize = strtoull(optarg, NULL, 10);
+			break;
+		case 'q':
+			bench.depth = atoi(optarg);
+			break;
+		case 'S':
+			stride = strtoull(optarg, NULL, 10);
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			skip = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			shuffle = 1;
+			break;
+		case 'P':
+			/* the vhd driver does not preallocate on nfs */
+			storage = TAPDISK_STORAGE_TYPE_NFS;
+			break;
+		default:
+			err = EINVAL;
+		case 'h':
+			usage(argv[0], err);
+		}
+	}
+
+	if (!params)
+		usage(argv[0], EINVAL);
+
+	if (!stride)
+		stride = bsize;
+
+	if (!bsize || bsize % DEFAULT_SECTOR_SIZE ||
+	    bsize > BLKIF_MAX_SEGMENTS_PER_REQUEST * getpagesize() ||
+	    stride % DEFAULT_SECTOR_SIZE || stride < bsize ||
+	    bench.depth < 1 || bench.depth > MAX_REQUESTS)
+		usage(argv[0], EINVAL);
+
+	bench.secs   = bsize >> SECTOR_SHIFT;
+	bench.stride = stride >> SECTOR_SHIFT;
+
+	type = tapdisk_disktype_parse_params(params, &path);
+	if (type < 0) {
+		err = type;
+		fprintf(stderr, "invalid argument %s: %d\n", params, err);
+		return err;
+	}
+
+	tapdisk_start_logging("tapdisk-bench");
+
+	err = tapdisk_bench_open_image(&bench, params, storage);
+	if (err)
+		goto out;
+
+	err = tapdisk_bench_set_range(&bench, count, skip, shuffle);
+	if (err)
+		goto out;
+
+	err = tapdisk_bench_initialize_requests(&bench);
+	if (err)
+		goto out;
+
+	err = tapdisk_bench_register_enqueue_event(&bench);
+	if (err)
+		goto out;
+
+	err = tapdisk_bench_run(&bench);
+	if (!err)
+		tapdisk_bench_report(&bench);
+
+out:
+	tapdisk_bench_release(&bench);
+	tapdisk_stop_logging();
+	return err;
+}
@@ -39,6 +39,7 @@
 #include <sys/socket.h>
 
 #include "list.h"
+#include "log.h"
 #include "tapdisk.h"
 #include "blktap2.h"
 #include "blktaplib.h"
@@ -59,6 +60,13 @@ struct tapdisk_control_connection {
 	event_id_t         event_id;
 };
 
+struct tapdisk_control_call {
+	struct tapdisk_control_connection *connection;
+	tapdisk_message_t                  message;
+	void (*handler)(struct tapdisk_control_connection *,
+			tapdisk_message_t *);
+};
+
 static struct tapdisk_control td_control;
 
 static void
@@ -231,6 +239,7 @@ tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
 
 	head = tapdisk_server_get_all_vbds();
 
+	tapdisk_server_lock_vbds();
 	list_for_each_entry(vbd, head, next) {
 		response.u.minors.list[i++] = vbd->minor;
 		if (i >= TAPDISK_MESSAGE_MAX_MINORS) {
@@ -239,6 +248,7 @@ tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
 			break;
 		}
 	}
+	tapdisk_server_unlock_vbds();
 
 	response.u.minors.count = i;
 	tapdisk_control_write_message(connection->socket, &response, 2);
@@ -260,6 +270,8 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 
 	head = tapdisk_server_get_all_vbds();
 
+	tapdisk_server_lock_vbds();
+
 	count = 0;
 	list_for_each_entry(vbd, head, next)
 		count++;
@@ -283,6 +295,8 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 		tapdisk_control_write_message(connection->socket, &response, 2);
 	}
 
+	tapdisk_server_unlock_vbds();
+
 	response.u.list.count   = count;
 	response.u.list.minor   = -1;
 	response.u.list.path[0] = 0;
@@ -440,6 +454,11 @@ tapdisk_control_open_image(struct tapdisk_control_connection *connection,
 		flags |= TD_OPEN_VHD_INDEX;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_LOG_DIRTY)
 		flags |= TD_OPEN_LOG_DIRTY;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_CBT ||
+	    getenv("TAPDISK2_CBT"))
+		flags |= TD_OPEN_CBT;
+	if (flags & TD_OPEN_RDONLY)
+		flags &= ~TD_OPEN_CBT;
 
 	vbd->name = strndup(request->u.params.path,
 			    sizeof(request->u.params.path));
@@ -627,6 +646,92 @@ out:
 	tapdisk_control_close_connection(connection);
 }
 
+static void
+tapdisk_control_cbt(struct tapdisk_control_connection *connection,
+		    tapdisk_message_t *request)
+{
+	int err;
+	td_vbd_t *vbd;
+	td_image_t *image, *tmp;
+	tapdisk_message_t response;
+
+	memset(&response, 0, sizeof(response));
+	response.u.cbt = request->u.cbt;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	/* tracking is done by the log driver on top of the chain */
+	err = -ENOENT;
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		if (image->type == DISK_TYPE_LOG) {
+			err = tdlog_cbt_control(image->driver,
+						&response.u.cbt);
+			break;
+		}
+
+out:
+	response.cookie = request->cookie;
+	if (err) {
+		response.type             = TAPDISK_MESSAGE_ERROR;
+		response.u.response.error = -err;
+	} else
+		response.type             = TAPDISK_MESSAGE_CBT_RSP;
+
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+static void
+tapdisk_control_call_handler(void *private)
+{
+	struct tapdisk_control_call *call = private;
+
+	call->handler(call->connection, &call->message);
+	free(call);
+}
+
+/*
+ * Requests on a VBD run on the thread owning it (a new VBD goes to the
+ * least loaded one), so that everything it registers ends up on that
+ * thread's scheduler.  The connection event lives on ours: drop it
+ * first, the connection belongs to the handler from then on.
+ */
+static void
+tapdisk_control_call_vbd(struct tapdisk_control_connection *connection,
+			 tapdisk_message_t *message,
+			 void (*handler)(struct tapdisk_control_connection *,
+					 tapdisk_message_t *))
+{
+	struct tapdisk_control_call *call;
+	int err = -ENOMEM;
+
+	call = malloc(sizeof(*call));
+	if (!call)
+		goto fail;
+
+	call->connection = connection;
+	call->message    = *message;
+	call->handler    = handler;
+
+	tapdisk_server_unregister_event(connection->event_id);
+	connection->event_id = 0;
+
+	err = tapdisk_server_call_vbd(message->cookie,
+				      tapdisk_control_call_handler, call);
+	if (!err)
+		return;
+
+	free(call);
+fail:
+	EPRINTF("failed to dispatch '%s' message: %d\n",
+		tapdisk_message_name(message->type), err);
+	tapdisk_control_close_connection(connection);
+}
+
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 {
@@ -653,17 +758,26 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 	case TAPDISK_MESSAGE_LIST:
 		return tapdisk_control_list(connection, &message);
 	case TAPDISK_MESSAGE_ATTACH:
-		return tapdisk_control_attach_vbd(connection, &message);
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_attach_vbd);
 	case TAPDISK_MESSAGE_DETACH:
-		return tapdisk_control_detach_vbd(connection, &message);
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_detach_vbd);
 	case TAPDISK_MESSAGE_OPEN:
-		return tapdisk_control_open_image(connection, &message);
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_open_image);
 	case TAPDISK_MESSAGE_PAUSE:
-		return tapdisk_control_pause_vbd(connection, &message);
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_pause_vbd);
 	case TAPDISK_MESSAGE_RESUME:
-		return tapdisk_control_resume_vbd(connection, &message);
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_resume_vbd);
 	case TAPDISK_MESSAGE_CLOSE:
-		return tapdisk_control_close_image(connection, &message);
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_close_image);
+	case TAPDISK_MESSAGE_CBT:
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_cbt);
 	default: {
 		tapdisk_message_t response;
 	fail:
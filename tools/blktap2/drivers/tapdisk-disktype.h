@@ -39,7 +39,9 @@
 #define DISK_TYPE_BLOCK_CACHE 7
 #define DISK_TYPE_LOG         8
 #define DISK_TYPE_REMUS       9
-#define DISK_TYPE_VINDEX      10
+#define DISK_TYPE_VINDEX      10 /* no driver */
+#define DISK_TYPE_DEDUP       11
+#define DISK_TYPE_MAX         12
 
 #define DISK_TYPE_NAME_MAX    32
 
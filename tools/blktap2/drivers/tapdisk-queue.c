@@ -29,10 +29,13 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <libaio.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "tapdisk.h"
 #include "tapdisk-log.h"
@@ -44,6 +47,12 @@
 #include "libaio-compat.h"
 #include "atomicio.h"
 
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H)
+#define TAPDISK_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
@@ -135,7 +144,7 @@ complete_tiocb(struct tqueue *queue, struct tiocb *tiocb, unsigned long res)
 static int
 cancel_tiocbs(struct tqueue *queue, int err)
 {
-	int queued;
+	int i, queued;
 	struct tiocb *tiocb;
 
 	if (!queue->queued)
@@ -145,8 +154,15 @@ cancel_tiocbs(struct tqueue *queue, int err)
 	 * td_complete may queue more tiocbs, which
 	 * will overwrite the contents of queue->iocbs.
 	 * use a private linked list to keep track
-	 * of the tiocbs we're cancelling. 
+	 * of the tiocbs we're cancelling. merging
+	 * reorders the queue, so relink it first.
 	 */
+	for (i = 0; i < queue->queued; i++) {
+		tiocb = queue->iocbs[i]->data;
+		tiocb->next = (i + 1 < queue->queued ?
+			       queue->iocbs[i + 1]->data : NULL);
+	}
+
 	tiocb  = queue->iocbs[0]->data;
 	queued = queue->queued;
 	queue->queued = 0;
@@ -213,6 +229,19 @@ tapdisk_rwio_rw(const struct iocb *iocb)
 	ssize_t (*func)(int, void *, size_t) = 
 		(iocb->aio_lio_opcode == IO_CMD_PWRITE ? vwrite : read);
 
+	if (iocb->aio_lio_opcode == IO_CMD_PREADV ||
+	    iocb->aio_lio_opcode == IO_CMD_PWRITEV) {
+		const struct iovec *iov = iocb->u.c.buf;
+		ssize_t ret;
+
+		if (iocb->aio_lio_opcode == IO_CMD_PWRITEV)
+			ret = pwritev(fd, iov, iocb->u.c.nbytes, off);
+		else
+			ret = preadv(fd, iov, iocb->u.c.nbytes, off);
+
+		return (ret < 0 ? -errno : ret);
+	}
+
 	if (lseek(fd, off, SEEK_SET) == (off_t)-1)
 		return -errno;
 
@@ -262,9 +291,9 @@ tapdisk_rwio_submit(struct tqueue *queue)
 
 static const struct tio td_tio_rwio = {
 	.name        = "rwio",
-	.data_size   = 0,
-	.tio_setup   = NULL,
-	.tio_destroy = NULL,
+	.data_size   = sizeof(struct rwio),
+	.tio_setup   = tapdisk_rwio_setup,
+	.tio_destroy = tapdisk_rwio_destroy,
 	.tio_submit  = tapdisk_rwio_submit
 };
 
@@ -547,6 +576,373 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef TAPDISK_URING
+/*
+ * io_uring
+ *
+ * Talks to the kernel directly rather than through liburing.  Requests
+ * are batched into the submission ring and handed over with a single
+ * io_uring_enter per submit; completions are reaped in bulk when the
+ * ring fd polls readable.
+ *
+ * Fixed buffers are not used: the blkif data pages are grant mappings
+ * which blktap remaps for every request, so a registration would pin
+ * whatever happened to back the area at registration time.
+ */
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup     425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter     426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register  427
+#endif
+
+struct uring_slot {
+	struct iocb     *iocb;
+	struct iovec     iov;
+};
+
+struct uring {
+	int                  ring_fd;
+	int                  event_id;
+
+	unsigned            *sq_head;
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void                *sq_ring;
+	size_t               sq_ring_size;
+	void                *cq_ring;
+	size_t               cq_ring_size;
+	size_t               sqes_size;
+
+	/* one per request in flight; indexed by sqe user_data */
+	struct uring_slot   *slots;
+	int                 *free_slots;
+	int                  nr_free_slots;
+
+	struct io_event     *aio_events;
+};
+
+static inline int
+__uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int
+__uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (!uring)
+		return;
+
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
+	}
+
+	if (uring->sqes)
+		munmap(uring->sqes, uring->sqes_size);
+	if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	if (uring->sq_ring)
+		munmap(uring->sq_ring, uring->sq_ring_size);
+	uring->sqes    = NULL;
+	uring->cq_ring = NULL;
+	uring->sq_ring = NULL;
+
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+		uring->ring_fd = -1;
+	}
+
+	free(uring->slots);
+	uring->slots = NULL;
+	free(uring->free_slots);
+	uring->free_slots = NULL;
+	free(uring->aio_events);
+	uring->aio_events = NULL;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *uring = queue->tio_data;
+	struct uring_slot *slot;
+	struct io_uring_cqe *cqe;
+	struct io_event *ep;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	unsigned head, tail;
+	int i, ret, split;
+
+	head = *uring->cq_head;
+	tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (ret = 0; head != tail; head++, ret++) {
+		cqe  = &uring->cqes[head & *uring->cq_mask];
+		slot = &uring->slots[cqe->user_data];
+
+		ep      = uring->aio_events + ret;
+		ep->obj = slot->iocb;
+		ep->res = (long)cqe->res;
+
+		uring->free_slots[uring->nr_free_slots++] = cqe->user_data;
+	}
+
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+	split = io_split(&queue->opioctx, uring->aio_events, ret);
+	tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static int
+tapdisk_uring_map_rings(struct tqueue *queue, struct io_uring_params *p)
+{
+	struct uring *uring = queue->tio_data;
+	char *sq, *cq;
+
+	uring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	uring->cq_ring_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+	uring->sqes_size    = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_ring_size > uring->sq_ring_size)
+			uring->sq_ring_size = uring->cq_ring_size;
+		uring->cq_ring_size = uring->sq_ring_size;
+	}
+
+	sq = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -errno;
+	uring->sq_ring = sq;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+			  IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -errno;
+	}
+	uring->cq_ring = cq;
+
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+			   IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		return -errno;
+	}
+
+	uring->sq_head  = (unsigned *)(sq + p->sq_off.head);
+	uring->sq_tail  = (unsigned *)(sq + p->sq_off.tail);
+	uring->sq_mask  = (unsigned *)(sq + p->sq_off.ring_mask);
+	uring->sq_array = (unsigned *)(sq + p->sq_off.array);
+
+	uring->cq_head  = (unsigned *)(cq + p->cq_off.head);
+	uring->cq_tail  = (unsigned *)(cq + p->cq_off.tail);
+	uring->cq_mask  = (unsigned *)(cq + p->cq_off.ring_mask);
+	uring->cqes     = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params params;
+	int i, err;
+
+	uring->ring_fd  = -1;
+	uring->event_id = -1;
+
+	memset(&params, 0, sizeof(params));
+
+	uring->ring_fd = __uring_setup(qlen, &params);
+	if (uring->ring_fd < 0) {
+		err = -errno;
+		DPRINTF("io_uring_setup failed: %d\n", err);
+		goto fail;
+	}
+
+	err = tapdisk_uring_map_rings(queue, &params);
+	if (err)
+		goto fail;
+
+	uring->slots      = calloc(qlen, sizeof(struct uring_slot));
+	uring->free_slots = calloc(qlen, sizeof(int));
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->slots || !uring->free_slots || !uring->aio_events) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < qlen; i++)
+		uring->free_slots[i] = qlen - 1 - i;
+	uring->nr_free_slots = qlen;
+
+	/* the ring fd polls readable while completions are pending */
+	uring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      uring->ring_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = uring->event_id;
+	if (err < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static void
+tapdisk_uring_prep(struct uring *uring, struct io_uring_sqe *sqe,
+		   struct iocb *iocb)
+{
+	struct iovec *iov;
+	int slot, write;
+
+	slot  = uring->free_slots[--uring->nr_free_slots];
+	write = (iocb->aio_lio_opcode == IO_CMD_PWRITE ||
+		 iocb->aio_lio_opcode == IO_CMD_PWRITEV);
+
+	uring->slots[slot].iocb = iocb;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd        = iocb->aio_fildes;
+	sqe->off       = iocb->u.c.offset;
+	sqe->user_data = slot;
+
+	if (iocb->aio_lio_opcode == IO_CMD_PREADV ||
+	    iocb->aio_lio_opcode == IO_CMD_PWRITEV) {
+		/* merged by io_merge, the iovecs live as long as the iocb */
+		sqe->opcode    = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr      = (unsigned long)iocb->u.c.buf;
+		sqe->len       = iocb->u.c.nbytes;
+		return;
+	}
+
+	iov = &uring->slots[slot].iov;
+	iov->iov_base  = iocb->u.c.buf;
+	iov->iov_len   = iocb->u.c.nbytes;
+	sqe->opcode    = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->addr      = (unsigned long)iov;
+	sqe->len       = 1;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, merged, submitted, err = 0;
+	unsigned tail, idx;
+
+	if (!queue->queued)
+		return 0;
+
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	tail = *uring->sq_tail;
+	for (i = 0; i < merged; i++, tail++) {
+		idx = tail & *uring->sq_mask;
+		tapdisk_uring_prep(uring, &uring->sqes[idx], queue->iocbs[i]);
+		uring->sq_array[idx] = idx;
+	}
+	__atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	submitted = __uring_enter(uring->ring_fd, merged, 0, 0);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = -errno;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	if (submitted < merged) {
+		/* take back what the kernel did not consume */
+		__atomic_store_n(uring->sq_tail,
+				 __atomic_load_n(uring->sq_head,
+						 __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELEASE);
+		for (i = merged; i-- > submitted; )
+			uring->free_slots[uring->nr_free_slots++] =
+				uring->sqes[(tail - merged + i) &
+					    *uring->sq_mask].user_data;
+	}
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static const struct tio td_tio_uring = {
+	.name                  = "uring",
+	.data_size             = sizeof(struct uring),
+	.tio_setup             = tapdisk_uring_setup,
+	.tio_destroy           = tapdisk_uring_destroy,
+	.tio_submit            = tapdisk_uring_submit,
+};
+#endif /* TAPDISK_URING */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +971,11 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef TAPDISK_URING
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -660,6 +1061,14 @@ tapdisk_debug_queue(struct tqueue *queue)
 	     "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %"PRIx64"\n",
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
 	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
+	WARN("merging: max bytes: %lu, max gap: %lu, batches: %"PRIu64", "
+	     "iocbs: %"PRIu64", merged: %"PRIu64", vectored: %"PRIu64", "
+	     "gaps: %"PRIu64" (%"PRIu64" bytes), cuts: %"PRIu64"\n",
+	     queue->opioctx.max_bytes, queue->opioctx.max_gap,
+	     queue->opioctx.stats.batches, queue->opioctx.stats.iocbs,
+	     queue->opioctx.stats.merged, queue->opioctx.stats.vectored,
+	     queue->opioctx.stats.gaps, queue->opioctx.stats.gap_bytes,
+	     queue->opioctx.stats.cuts);
 
 	if (tiocb) {
 		WARN("deferred:\n");
@@ -690,6 +1099,20 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 	tiocb->next = NULL;
 }
 
+/*
+ * Largest request merging may produce, and largest hole a merged read
+ * may span.  Only while the queue is idle.
+ */
+int
+tapdisk_queue_set_merge_limits(struct tqueue *queue,
+			       size_t max_bytes, size_t max_gap)
+{
+	if (queue->iocbs_pending)
+		return -EBUSY;
+
+	return opio_set_limits(&queue->opioctx, max_bytes, max_gap);
+}
+
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
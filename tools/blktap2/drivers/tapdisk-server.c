@@ -27,8 +27,11 @@
  */
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
 
@@ -42,8 +45,27 @@
 
  tapdisk_server_t server;
 
+/* the loop run by the calling thread */
+static __thread tapdisk_loop_t *td_loop;
+
+struct tapdisk_call {
+	td_uuid_t                    uuid;
+	void                       (*fn)(void *);
+	void                        *arg;
+	int                          running;
+	struct list_head             next;
+};
+
+#define tapdisk_server_running()				\
+	__atomic_load_n(&server.run, __ATOMIC_ACQUIRE)
+#define tapdisk_server_set_running(_run)				\
+	__atomic_store_n(&server.run, _run, __ATOMIC_RELEASE)
+
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
-	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
+	list_for_each_entry_safe(vbd, tmp, &td_loop->vbds, loop_next)
+
+#define tapdisk_server_for_each_loop(loop)				\
+	for (loop = server.loops; loop < server.loops + server.nr_loops; loop++)
 
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
@@ -54,6 +76,7 @@ tapdisk_server_get_shared_image(td_image_t *image)
 	if (!td_flag_test(image->flags, TD_OPEN_SHAREABLE))
 		return NULL;
 
+	/* images are only shared between VBDs on the same loop */
 	tapdisk_server_for_each_vbd(vbd, tmpv)
 		tapdisk_vbd_for_each_image(vbd, img, tmpi)
 			if (img->type == image->type &&
@@ -69,6 +92,23 @@ tapdisk_server_get_all_vbds(void)
 	return &server.vbds;
 }
 
+void
+tapdisk_server_lock_vbds(void)
+{
+	pthread_mutex_lock(&server.lock);
+}
+
+void
+tapdisk_server_unlock_vbds(void)
+{
+	pthread_mutex_unlock(&server.lock);
+}
+
+/*
+ * Only VBDs served by the calling thread are found.  A VBD is freed by
+ * no one but its own loop, so the pointer returned stays valid for as
+ * long as the caller does not drop it itself.
+ */
 td_vbd_t *
 tapdisk_server_get_vbd(uint16_t uuid)
 {
@@ -84,29 +124,51 @@ tapdisk_server_get_vbd(uint16_t uuid)
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
+	pthread_mutex_lock(&server.lock);
+
 	list_add_tail(&vbd->next, &server.vbds);
+	list_add_tail(&vbd->loop_next, &td_loop->vbds);
+	td_loop->nr_vbds++;
+	vbd->loop = td_loop;
+
+	pthread_mutex_unlock(&server.lock);
+}
+
+void
+tapdisk_server_unlink_vbd(td_vbd_t *vbd)
+{
+	pthread_mutex_lock(&server.lock);
+
+	list_del_init(&vbd->next);
+	if (vbd->loop) {
+		list_del_init(&vbd->loop_next);
+		vbd->loop->nr_vbds--;
+		vbd->loop = NULL;
+	}
+
+	pthread_mutex_unlock(&server.lock);
 }
 
 void
 tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
-	list_del(&vbd->next);
-	INIT_LIST_HEAD(&vbd->next);
+	tapdisk_server_unlink_vbd(vbd);
 	tapdisk_server_check_state();
 }
 
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(&td_loop->aio_queue, tiocb);
 }
 
+/* dumps the state of the calling thread's loop */
 void
 tapdisk_server_debug(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	tapdisk_debug_queue(&td_loop->aio_queue);
 
 	tapdisk_server_for_each_vbd(vbd, tmp)
 		tapdisk_vbd_debug(vbd);
@@ -114,31 +176,177 @@ tapdisk_server_debug(void)
 	tlog_flush();
 }
 
+/*
+ * Every byte written to a loop's wake pipe is a message for it: a
+ * signal number for signals to handle on its VBDs, or 0 for queued
+ * calls.  Safe to use from a signal handler.
+ */
+static void
+tapdisk_server_wake_loop(tapdisk_loop_t *loop, char msg)
+{
+	int saved = errno;
+
+	if (write(loop->wake_fd[1], &msg, 1) < 0 && errno != EAGAIN)
+		DBG(TLOG_WARN, "failed to wake loop: %d\n", errno);
+
+	errno = saved;
+}
+
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
-		server.run = 0;
+	tapdisk_loop_t *loop;
+	int empty;
+
+	pthread_mutex_lock(&server.lock);
+	empty = list_empty(&server.vbds);
+	pthread_mutex_unlock(&server.lock);
+
+	if (empty) {
+		tapdisk_server_set_running(0);
+		tapdisk_server_for_each_loop(loop)
+			if (loop != td_loop)
+				tapdisk_server_wake_loop(loop, 0);
+	}
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      int timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&td_loop->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&td_loop->scheduler, event);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, seconds);
+	scheduler_set_max_timeout(&td_loop->scheduler, seconds);
+}
+
+static void tapdisk_server_handle_signal(int);
+
+static struct tapdisk_call *
+tapdisk_server_next_call(tapdisk_loop_t *loop)
+{
+	struct tapdisk_call *call, *found = NULL;
+
+	pthread_mutex_lock(&server.lock);
+
+	/* skip calls still running further up our stack, e.g. a pause
+	 * iterating the loop until its requests drained */
+	list_for_each_entry(call, &loop->calls, next)
+		if (!call->running) {
+			call->running = 1;
+			found = call;
+			break;
+		}
+
+	pthread_mutex_unlock(&server.lock);
+
+	return found;
+}
+
+static void
+tapdisk_server_run_calls(tapdisk_loop_t *loop)
+{
+	struct tapdisk_call *call;
+
+	while ((call = tapdisk_server_next_call(loop))) {
+		call->fn(call->arg);
+
+		/* dequeued only now: see tapdisk_server_call_vbd */
+		pthread_mutex_lock(&server.lock);
+		list_del(&call->next);
+		pthread_mutex_unlock(&server.lock);
+
+		free(call);
+	}
+}
+
+static void
+tapdisk_server_wake_event(event_id_t id, char mode, void *private)
+{
+	tapdisk_loop_t *loop = private;
+	unsigned char buf[64];
+	int i, n;
+
+	while ((n = read(loop->wake_fd[0], buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i++)
+			if (buf[i])
+				tapdisk_server_handle_signal(buf[i]);
+
+	tapdisk_server_run_calls(loop);
+}
+
+/*
+ * Run fn(arg) on the thread owning VBD uuid, or on the least loaded
+ * loop if there is no such VBD yet.  Calls to other threads are queued
+ * and this returns right away; fn is responsible for arg.  A call stays
+ * queued until fn has returned, so that a VBD being created by it
+ * cannot have a later call for the same uuid routed elsewhere.  Only
+ * the main thread (tapdisk-control) makes such calls.
+ */
+int
+tapdisk_server_call_vbd(td_uuid_t uuid, void (*fn)(void *), void *arg)
+{
+	struct tapdisk_call *call;
+	tapdisk_loop_t *loop, *target = NULL;
+	td_vbd_t *vbd;
+
+	call = malloc(sizeof(*call));
+	if (!call)
+		return -ENOMEM;
+
+	call->uuid    = uuid;
+	call->fn      = fn;
+	call->arg     = arg;
+	call->running = 0;
+
+	pthread_mutex_lock(&server.lock);
+
+	list_for_each_entry(vbd, &server.vbds, next)
+		if (vbd->uuid == uuid) {
+			target = vbd->loop;
+			goto found;
+		}
+
+	tapdisk_server_for_each_loop(loop) {
+		struct tapdisk_call *c;
+
+		list_for_each_entry(c, &loop->calls, next)
+			if (c->uuid == uuid) {
+				target = loop;
+				goto found;
+			}
+	}
+
+	target = server.loops;
+	tapdisk_server_for_each_loop(loop)
+		if (loop->nr_vbds < target->nr_vbds)
+			target = loop;
+
+found:
+	if (target != td_loop)
+		list_add_tail(&call->next, &target->calls);
+
+	pthread_mutex_unlock(&server.lock);
+
+	if (target == td_loop) {
+		free(call);
+		fn(arg);
+		return 0;
+	}
+
+	tapdisk_server_wake_loop(target, 0);
+
+	return 0;
 }
 
 static void
@@ -174,7 +382,7 @@ tapdisk_server_check_progress(void)
 static void
 tapdisk_server_submit_tiocbs(void)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	tapdisk_submit_all_tiocbs(&td_loop->aio_queue);
 }
 
 static void
@@ -205,23 +413,70 @@ tapdisk_server_stop_vbds(void)
 		tapdisk_vbd_kill_queue(vbd);
 }
 
+/*
+ * The I/O engine may be picked through the environment tapdisk is
+ * spawned with: TAPDISK2_TIO=lio|rwio|uring.  io_uring falls back to
+ * libaio if the kernel does not support it.
+ *
+ * TAPDISK2_MERGE_SIZE and TAPDISK2_MERGE_GAP (bytes) override the
+ * request merging limits, see io-optimize.h.
+ */
 static int
 tapdisk_server_init_aio(void)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	const char *tio = getenv("TAPDISK2_TIO");
+	const char *size = getenv("TAPDISK2_MERGE_SIZE");
+	const char *gap = getenv("TAPDISK2_MERGE_GAP");
+	int drv = TIO_DRV_LIO, err;
+
+	if (tio) {
+		if (!strcmp(tio, "rwio"))
+			drv = TIO_DRV_RWIO;
+		else if (!strcmp(tio, "uring"))
+			drv = TIO_DRV_URING;
+		else if (strcmp(tio, "lio"))
+			DBG(TLOG_WARN, "unknown TAPDISK2_TIO %s, "
+			    "using lio\n", tio);
+	}
+
+	err = tapdisk_init_queue(&td_loop->aio_queue, TAPDISK_TIOCBS,
+				 drv, NULL);
+	if (err && drv == TIO_DRV_URING) {
+		DBG(TLOG_WARN, "io_uring unavailable (%d), using lio\n", err);
+		err = tapdisk_init_queue(&td_loop->aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_LIO, NULL);
+	}
+
+	if (!err && (size || gap)) {
+		struct opioctx *ctx = &td_loop->aio_queue.opioctx;
+
+		err = tapdisk_queue_set_merge_limits(&td_loop->aio_queue,
+			size ? strtoul(size, NULL, 0) : ctx->max_bytes,
+			gap ? strtoul(gap, NULL, 0) : ctx->max_gap);
+		if (err)
+			tapdisk_free_queue(&td_loop->aio_queue);
+	}
+
+	return err;
 }
 
 static void
 tapdisk_server_close_aio(void)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	tapdisk_free_queue(&td_loop->aio_queue);
 }
 
 static void
 tapdisk_server_close(void)
 {
-	tapdisk_server_close_aio();
+	tapdisk_loop_t *loop, *self = td_loop;
+
+	tapdisk_server_for_each_loop(loop) {
+		td_loop = loop;
+		tapdisk_server_close_aio();
+	}
+
+	td_loop = self;
 }
 
 void
@@ -233,7 +488,7 @@ tapdisk_server_iterate(void)
 	tapdisk_server_set_retry_timeout();
 	tapdisk_server_check_progress();
 
-	ret = scheduler_wait_for_events(&server.scheduler);
+	ret = scheduler_wait_for_events(&td_loop->scheduler);
 	if (ret < 0)
 		DBG(TLOG_WARN, "server wait returned %d\n", ret);
 
@@ -245,15 +500,23 @@ tapdisk_server_iterate(void)
 static void
 __tapdisk_server_run(void)
 {
-	while (server.run)
+	while (tapdisk_server_running())
 		tapdisk_server_iterate();
 }
 
+static void *
+tapdisk_server_loop_thread(void *arg)
+{
+	td_loop = arg;
+	__tapdisk_server_run();
+	return NULL;
+}
+
+/* runs on every loop, for the VBDs it owns */
 static void
-tapdisk_server_signal_handler(int signal)
+tapdisk_server_handle_signal(int signal)
 {
 	td_vbd_t *vbd, *tmp;
-	static int xfsz_error_sent = 0;
 
 	switch (signal) {
 	case SIGBUS:
@@ -261,29 +524,103 @@ tapdisk_server_signal_handler(int signal)
 		tapdisk_server_for_each_vbd(vbd, tmp)
 			tapdisk_vbd_close(vbd);
 		break;
-
 	case SIGXFSZ:
-		ERR(EFBIG, "received SIGXFSZ");
 		tapdisk_server_stop_vbds();
-		if (xfsz_error_sent)
-			break;
-
-		xfsz_error_sent = 1;
 		break;
-
 	case SIGUSR1:
 		tapdisk_server_debug();
 		break;
 	}
 }
 
+/*
+ * Signals are delivered to the main thread only.  VBDs belong to their
+ * loop threads: pass the signal on to every loop, including our own,
+ * and let each deal with its VBDs from its event loop.
+ */
+static void
+tapdisk_server_signal_handler(int signal)
+{
+	tapdisk_loop_t *loop;
+	static int xfsz_error_sent = 0;
+
+	if (signal == SIGXFSZ && !xfsz_error_sent) {
+		ERR(EFBIG, "received SIGXFSZ");
+		xfsz_error_sent = 1;
+	}
+
+	tapdisk_server_for_each_loop(loop)
+		tapdisk_server_wake_loop(loop, signal);
+}
+
+static int
+tapdisk_server_init_loop(tapdisk_loop_t *loop)
+{
+	int err;
+
+	INIT_LIST_HEAD(&loop->vbds);
+	INIT_LIST_HEAD(&loop->calls);
+
+	err = scheduler_initialize(&loop->scheduler);
+	if (err) {
+		ERR(err, "failed to initialize scheduler\n");
+		return err;
+	}
+
+	if (pipe(loop->wake_fd)) {
+		err = -errno;
+		ERR(err, "failed to create wakeup pipe\n");
+		return err;
+	}
+
+	fcntl(loop->wake_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(loop->wake_fd[1], F_SETFL, O_NONBLOCK);
+	fcntl(loop->wake_fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(loop->wake_fd[1], F_SETFD, FD_CLOEXEC);
+
+	loop->wake_event =
+		scheduler_register_event(&loop->scheduler,
+					 SCHEDULER_POLL_READ_FD,
+					 loop->wake_fd[0], 0,
+					 tapdisk_server_wake_event, loop);
+	if (loop->wake_event < 0)
+		return loop->wake_event;
+
+	return 0;
+}
+
+/*
+ * The number of event loop threads is taken from TAPDISK2_THREADS in
+ * the environment (default 1, i.e. everything on the main thread).
+ * New VBDs go to the loop serving the fewest.
+ */
 int
 tapdisk_server_init(void)
 {
+	const char *threads = getenv("TAPDISK2_THREADS");
+	int i, err;
+
 	memset(&server, 0, sizeof(server));
 	INIT_LIST_HEAD(&server.vbds);
+	pthread_mutex_init(&server.lock, NULL);
+
+	server.nr_loops = threads ? atoi(threads) : 1;
+	if (server.nr_loops < 1)
+		server.nr_loops = 1;
+	if (server.nr_loops > TAPDISK_MAX_LOOPS)
+		server.nr_loops = TAPDISK_MAX_LOOPS;
+
+	server.loops = calloc(server.nr_loops, sizeof(tapdisk_loop_t));
+	if (!server.loops)
+		return -ENOMEM;
+
+	for (i = 0; i < server.nr_loops; i++) {
+		err = tapdisk_server_init_loop(&server.loops[i]);
+		if (err)
+			return err;
+	}
 
-	scheduler_initialize(&server.scheduler);
+	td_loop = &server.loops[0];
 
 	return 0;
 }
@@ -291,18 +628,28 @@ tapdisk_server_init(void)
 int
 tapdisk_server_complete(void)
 {
-	int err;
+	tapdisk_loop_t *loop;
+	int err = 0;
+
+	/* the queues register their events with the current loop */
+	tapdisk_server_for_each_loop(loop) {
+		td_loop = loop;
+		err = tapdisk_server_init_aio();
+		if (err)
+			break;
+	}
+
+	td_loop = &server.loops[0];
 
-	err = tapdisk_server_init_aio();
 	if (err)
 		goto fail;
 
-	server.run = 1;
+	tapdisk_server_set_running(1);
 
 	return 0;
 
 fail:
-	tapdisk_server_close_aio();
+	tapdisk_server_close();
 	return err;
 }
 
@@ -311,7 +658,9 @@ tapdisk_server_initialize(void)
 {
 	int err;
 
-	tapdisk_server_init();
+	err = tapdisk_server_init();
+	if (err)
+		return err;
 
 	err = tapdisk_server_complete();
 	if (err)
@@ -324,6 +673,55 @@ fail:
 	return err;
 }
 
+/* Start a thread for every loop but the main one; signals stay on main */
+static int
+tapdisk_server_start_loops(void)
+{
+	sigset_t set, old;
+	int i, err = 0;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 1; i < server.nr_loops; i++) {
+		err = -pthread_create(&server.loops[i].thread, NULL,
+				      tapdisk_server_loop_thread,
+				      &server.loops[i]);
+		if (err) {
+			ERR(err, "failed to start loop %d\n", i);
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return err;
+}
+
+static void
+tapdisk_server_stop_loops(void)
+{
+	tapdisk_loop_t *loop;
+	struct tapdisk_call *call, *tmp;
+
+	tapdisk_server_set_running(0);
+
+	tapdisk_server_for_each_loop(loop) {
+		if (loop == td_loop || !loop->thread)
+			continue;
+		tapdisk_server_wake_loop(loop, 0);
+		pthread_join(loop->thread, NULL);
+		loop->thread = 0;
+	}
+
+	/* the loops are gone, nobody will run what is left */
+	tapdisk_server_for_each_loop(loop)
+		list_for_each_entry_safe(call, tmp, &loop->calls, next) {
+			list_del(&call->next);
+			free(call);
+		}
+}
+
 int
 tapdisk_server_run()
 {
@@ -338,8 +736,12 @@ tapdisk_server_run()
 	signal(SIGUSR1, tapdisk_server_signal_handler);
 	signal(SIGXFSZ, tapdisk_server_signal_handler);
 
-	__tapdisk_server_run();
+	err = tapdisk_server_start_loops();
+	if (!err)
+		__tapdisk_server_run();
+
+	tapdisk_server_stop_loops();
 	tapdisk_server_close();
 
-	return 0;
+	return err;
 }
@@ -28,6 +28,8 @@
 #ifndef _TAPDISK_SERVER_H_
 #define _TAPDISK_SERVER_H_
 
+#include <pthread.h>
+
 #include "list.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-queue.h"
@@ -37,9 +39,13 @@ struct tap_disk *tapdisk_server_find_driver_interface(int);
 td_image_t *tapdisk_server_get_shared_image(td_image_t *);
 
 struct list_head *tapdisk_server_get_all_vbds(void);
+void tapdisk_server_lock_vbds(void);
+void tapdisk_server_unlock_vbds(void);
 td_vbd_t *tapdisk_server_get_vbd(td_uuid_t);
 void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
+void tapdisk_server_unlink_vbd(td_vbd_t *);
+int tapdisk_server_call_vbd(td_uuid_t, void (*)(void *), void *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
 
@@ -56,12 +62,40 @@ int tapdisk_server_run(void);
 void tapdisk_server_iterate(void);
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
+#define TAPDISK_MAX_LOOPS           64
+
+struct tapdisk_call;
+
+/*
+ * One event loop, run by one thread.  Every VBD belongs to exactly one
+ * loop, and all its events and I/O are handled by that loop's thread.
+ */
+typedef struct tapdisk_loop {
+	scheduler_t                  scheduler;
+	struct tqueue                aio_queue;
+	struct list_head             vbds;
+	int                          nr_vbds;
+
+	pthread_t                    thread;
+
+	/* signals and cross thread calls, see tapdisk_server_call_vbd;
+	 * calls are queued with the server lock held */
+	int                          wake_fd[2];
+	event_id_t                   wake_event;
+	struct list_head             calls;
+} tapdisk_loop_t;
 
 typedef struct tapdisk_server {
+	/* accessed atomically, loop threads poll it */
 	int                          run;
+
+	/* all VBDs; modified with the lock held */
 	struct list_head             vbds;
-	scheduler_t                  scheduler;
-	struct tqueue                aio_queue;
+	pthread_mutex_t              lock;
+
+	/* loops[0] is run by the main thread, along with tapdisk-control */
+	int                          nr_loops;
+	tapdisk_loop_t              *loops;
 } tapdisk_server_t;
 
 #endif
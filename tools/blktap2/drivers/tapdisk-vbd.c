@@ -86,7 +86,7 @@ tapdisk_vbd_free(td_vbd_t *vbd)
 {
 	if (vbd) {
 		tapdisk_vbd_free_stack(vbd);
-		list_del_init(&vbd->next);
+		tapdisk_server_unlink_vbd(vbd);
 		free(vbd->name);
 		free(vbd);
 	}
@@ -123,6 +123,7 @@ tapdisk_vbd_create(uint16_t uuid)
 	INIT_LIST_HEAD(&vbd->failed_requests);
 	INIT_LIST_HEAD(&vbd->completed_requests);
 	INIT_LIST_HEAD(&vbd->next);
+	INIT_LIST_HEAD(&vbd->loop_next);
 	gettimeofday(&vbd->ts, NULL);
 
 	for (i = 0; i < MAX_REQUESTS; i++)
@@ -416,7 +417,7 @@ __tapdisk_vbd_open_vdi(td_vbd_t *vbd, td_flag_t extra_flags)
 		parent_info = &tmp->info;
 	}
 
-	if (td_flag_test(vbd->flags, TD_OPEN_LOG_DIRTY)) {
+	if (td_flag_test(vbd->flags, TD_OPEN_LOG_DIRTY | TD_OPEN_CBT)) {
 		err = tapdisk_vbd_add_dirty_log(vbd);
 		if (err)
 			goto fail;
@@ -1361,10 +1362,11 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	td_request_t treq;
 	uint64_t sector_nr;
 	blkif_request_t *req;
-	int i, err, id, nsects;
+	int i, next, err, id, nsects, page_secs;
 
 	req       = &vreq->req;
 	id        = req->id;
+	page_secs = getpagesize() >> SECTOR_SHIFT;
 	ring      = &vbd->ring;
 	sector_nr = req->sector_number;
 	image     = tapdisk_vbd_first_image(vbd);
@@ -1384,12 +1386,28 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	if (err)
 		goto fail;
 
-	for (i = 0; i < req->nr_segments; i++) {
+	for (i = 0; i < req->nr_segments; i = next) {
 		nsects = req->seg[i].last_sect - req->seg[i].first_sect + 1;
 		page   = (char *)MMAP_VADDR(ring->vstart, 
 					   (unsigned long)req->id, i);
 		page  += (req->seg[i].first_sect << SECTOR_SHIFT);
 
+		/*
+		 * The segments of a request are mapped back to back:
+		 * issue a run of them which is contiguous on the page
+		 * boundaries as one request, straight from the mapping.
+		 * memshr tracks reads segment by segment.
+		 */
+		for (next = i + 1; next < req->nr_segments; next++) {
+#ifndef MEMSHR
+			if (req->seg[next - 1].last_sect != page_secs - 1 ||
+			    req->seg[next].first_sect != 0)
+#endif
+				break;
+
+			nsects += req->seg[next].last_sect + 1;
+		}
+
 		treq.id             = id;
 		treq.sidx           = i;
 		treq.blocked        = 0;
@@ -1401,9 +1419,9 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		treq.cb_data        = NULL;
 		treq.private        = vreq;
 
-		DBG(TLOG_DBG, "%s: req %d seg %d sec 0x%08"PRIx64" secs 0x%04x "
-		    "buf %p op %d\n", image->name, id, i, treq.sec, treq.secs,
-		    treq.buf, (int)req->operation);
+		DBG(TLOG_DBG, "%s: req %d seg %d-%d sec 0x%08"PRIx64" secs "
+		    "0x%04x buf %p op %d\n", image->name, id, i, next - 1,
+		    treq.sec, treq.secs, treq.buf, (int)req->operation);
 
 		vreq->secs_pending += nsects;
 		vbd->secs_pending  += nsects;
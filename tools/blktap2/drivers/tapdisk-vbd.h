@@ -116,6 +116,8 @@ struct td_vbd_handle {
 	void                       *argument;
 
 	struct list_head            next;
+	struct list_head            loop_next;
+	struct tapdisk_loop        *loop;
 
 	struct timeval              ts;
 
@@ -41,6 +41,11 @@
 #define TAPDISK_MESSAGE_FLAG_ADD_CACHE   0x04
 #define TAPDISK_MESSAGE_FLAG_VHD_INDEX   0x08
 #define TAPDISK_MESSAGE_FLAG_LOG_DIRTY   0x10
+#define TAPDISK_MESSAGE_FLAG_CBT         0x20
+
+#define TAPDISK_MESSAGE_CBT_INFO         0
+#define TAPDISK_MESSAGE_CBT_CHECKPOINT   1
+#define TAPDISK_MESSAGE_CBT_QUERY        2
 
 typedef struct tapdisk_message           tapdisk_message_t;
 typedef uint8_t                          tapdisk_message_flag_t;
@@ -50,6 +55,7 @@ typedef struct tapdisk_message_string    tapdisk_message_string_t;
 typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
+typedef struct tapdisk_message_cbt       tapdisk_message_cbt_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -88,6 +94,21 @@ struct tapdisk_message_list {
 	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
 };
 
+/*
+ * Changed block tracking.  CHECKPOINT closes the current epoch and
+ * returns it; QUERY writes the extents changed since @epoch, one
+ * "<sector> <count>" line each, to @path.  Every reply carries the
+ * current and oldest epoch still known.
+ */
+struct tapdisk_message_cbt {
+	uint32_t                         op;
+	uint32_t                         block_size;
+	uint64_t                         epoch;
+	uint64_t                         oldest;
+	uint64_t                         extents;
+	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+};
+
 struct tapdisk_message {
 	uint16_t                         type;
 	uint16_t                         cookie;
@@ -100,6 +121,7 @@ struct tapdisk_message {
 		tapdisk_message_minors_t minors;
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t   list;
+		tapdisk_message_cbt_t    cbt;
 	} u;
 };
 
@@ -126,6 +148,8 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_LIST_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_CBT,
+	TAPDISK_MESSAGE_CBT_RSP,
 };
 
 static inline char *
@@ -195,6 +219,12 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_CBT:
+		return "cbt";
+
+	case TAPDISK_MESSAGE_CBT_RSP:
+		return "cbt response";
+
 	default:
 		return "unknown";
 	}
@@ -28,70 +28,113 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "libvhd.h"
 
+#define VHD_COALESCE_DEPTH             4
+#define VHD_COALESCE_MAX_DEPTH         64
+#define VHD_COALESCE_CHECKPOINT_BLOCKS 256
+#define VHD_COALESCE_CHECKPOINT_MAGIC  "vhd-coalesce-v1"
+
+struct vhd_coalesce_extent {
+	uint32_t                   offset;
+	uint32_t                   block;
+};
+
+/*
+ * Allocated child blocks are copied in order of their physical offset
+ * in the child by up to @depth workers.  Everything below @done has
+ * reached the parent; that index is what gets checkpointed.
+ */
+struct vhd_coalesce {
+	vhd_context_t             *vhd;
+	vhd_context_t             *parent;     /* NULL if the parent is raw */
+	int                        parent_fd;
+
+	struct vhd_coalesce_extent *extents;
+	char                      *completed;
+	uint32_t                   nr_extents;
+	uint32_t                   next;
+	uint32_t                   done;
+	uint32_t                   saved;
+	int                        err;
+
+	const char                *checkpoint;
+	char                       uuid[37];
+
+	pthread_mutex_t            lock;
+	pthread_mutex_t            parent_lock;
+	pthread_mutex_t            checkpoint_lock;
+};
+
 static int
 __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 {
-	off_t off;
-	size_t ret;
+	ssize_t ret;
 
 	errno = 0;
-	off = lseek(fd, vhd_sectors_to_bytes(sec), SEEK_SET);
-	if (off == (off_t)-1) {
-		printf("raw parent: seek(0x%08"PRIx64") failed: %d\n",
-		       vhd_sectors_to_bytes(sec), -errno);
-		return -errno;
-	}
-
-	ret = write(fd, buf, vhd_sectors_to_bytes(secs));
+	ret = pwrite(fd, buf, vhd_sectors_to_bytes(secs),
+		     vhd_sectors_to_bytes(sec));
 	if (ret == vhd_sectors_to_bytes(secs))
 		return 0;
 
-	printf("raw parent: write of 0x%"PRIx64" returned %zd, errno: %d\n",
-	       vhd_sectors_to_bytes(secs), ret, -errno);
+	printf("raw parent: write of 0x%"PRIx64" at 0x%08"PRIx64" "
+	       "returned %zd, errno: %d\n", vhd_sectors_to_bytes(secs),
+	       vhd_sectors_to_bytes(sec), ret, -errno);
 	return (errno ? -errno : -EIO);
 }
 
+static int
+vhd_util_coalesce_write(struct vhd_coalesce *c,
+			char *buf, uint64_t sec, uint32_t secs)
+{
+	int err;
+
+	if (!c->parent)
+		return __raw_io_write(c->parent_fd, buf, sec, secs);
+
+	/* libvhd allocates parent blocks and updates bitmaps unlocked */
+	pthread_mutex_lock(&c->parent_lock);
+	err = vhd_io_write(c->parent, buf, sec, secs);
+	pthread_mutex_unlock(&c->parent_lock);
+
+	return err;
+}
+
 /*
- * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
+ * @buf holds room for the block's bitmap followed by its data, which is
+ * how they sit on disk, so both are fetched with a single read.
  */
 static int
-vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-		int parent_fd, uint64_t block)
+vhd_util_coalesce_block(struct vhd_coalesce *c, uint32_t block, char *buf)
 {
 	int i, err;
-	char *buf, *map;
+	char *map, *data;
 	uint64_t sec, secs;
+	size_t size;
+	ssize_t ret;
+	vhd_context_t *vhd;
 
-	buf = NULL;
-	map = NULL;
-	sec = block * vhd->spb;
-
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
-		return 0;
-
-	err = posix_memalign((void **)&buf, 4096, vhd->header.block_size);
-	if (err)
-		return -err;
-
-	err = vhd_io_read(vhd, buf, sec, vhd->spb);
-	if (err)
-		goto done;
+	vhd  = c->vhd;
+	sec  = (uint64_t)block * vhd->spb;
+	map  = buf;
+	data = buf + vhd_sectors_to_bytes(vhd->bm_secs);
+	size = vhd_sectors_to_bytes(vhd->bm_secs + vhd->spb);
 
-	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
-		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
-		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
-		goto done;
+	errno = 0;
+	ret = pread(vhd->fd, buf, size,
+		    vhd_sectors_to_bytes(vhd->bat.bat[block]));
+	if (ret != size) {
+		err = (errno ? -errno : -EIO);
+		printf("error reading block 0x%x: %d\n", block, err);
+		return err;
 	}
 
-	err = vhd_read_bitmap(vhd, block, &map);
-	if (err)
-		goto done;
+	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block))
+		return vhd_util_coalesce_write(c, data, sec, vhd->spb);
 
 	for (i = 0; i < vhd->spb; i++) {
 		if (!vhd_bitmap_test(vhd, map, i))
@@ -101,50 +144,310 @@ vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
 			if (!vhd_bitmap_test(vhd, map, i + secs))
 				break;
 
-		if (parent->file)
-			err = vhd_io_write(parent,
-					   buf + vhd_sectors_to_bytes(i),
-					   sec + i, secs);
-		else
-			err = __raw_io_write(parent_fd,
-					     buf + vhd_sectors_to_bytes(i),
-					     sec + i, secs);
+		err = vhd_util_coalesce_write(c,
+					      data + vhd_sectors_to_bytes(i),
+					      sec + i, secs);
 		if (err)
-			goto done;
+			return err;
 
 		i += secs;
 	}
 
-	err = 0;
+	return 0;
+}
+
+static int
+vhd_util_coalesce_sync(struct vhd_coalesce *c)
+{
+	int fd;
+
+	fd = (c->parent ? c->parent->fd : c->parent_fd);
+	if (fsync(fd))
+		return -errno;
+
+	return 0;
+}
+
+static int
+vhd_util_coalesce_read_checkpoint(struct vhd_coalesce *c)
+{
+	FILE *f;
+	char magic[32], uuid[37];
+	uint32_t entries, done;
+	int n;
+
+	f = fopen(c->checkpoint, "r");
+	if (!f)
+		return (errno == ENOENT ? 0 : -errno);
+
+	n = fscanf(f, "%31s %36s %u %u", magic, uuid, &entries, &done);
+	fclose(f);
+
+	if (n != 4 || strcmp(magic, VHD_COALESCE_CHECKPOINT_MAGIC) ||
+	    strcmp(uuid, c->uuid) || entries != c->nr_extents ||
+	    done > c->nr_extents) {
+		printf("ignoring stale checkpoint %s\n", c->checkpoint);
+		return 0;
+	}
+
+	c->next  = done;
+	c->done  = done;
+	c->saved = done;
+	memset(c->completed, 1, done);
+
+	printf("resuming coalesce at %u of %u blocks\n", done, entries);
+	return 0;
+}
+
+/*
+ * The parent is flushed before the new index is recorded, and the record
+ * is replaced atomically, so a checkpoint never claims more than is on
+ * stable storage.
+ */
+static int
+vhd_util_coalesce_write_checkpoint(struct vhd_coalesce *c, uint32_t done)
+{
+	FILE *f;
+	int err;
+	char *tmp;
+
+	if (asprintf(&tmp, "%s.tmp", c->checkpoint) == -1)
+		return -ENOMEM;
+
+	err = vhd_util_coalesce_sync(c);
+	if (err)
+		goto out;
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		err = -errno;
+		goto out;
+	}
+
+	fprintf(f, "%s %s %u %u\n", VHD_COALESCE_CHECKPOINT_MAGIC,
+		c->uuid, c->nr_extents, done);
+
+	err = (fflush(f) || fsync(fileno(f))) ? -errno : 0;
+	if (fclose(f) && !err)
+		err = -errno;
+	if (err)
+		goto out;
+
+	if (rename(tmp, c->checkpoint))
+		err = -errno;
+
+out:
+	if (err) {
+		printf("error writing checkpoint %s: %d\n", c->checkpoint, err);
+		unlink(tmp);
+	}
+	free(tmp);
+	return err;
+}
+
+static void
+vhd_util_coalesce_checkpoint(struct vhd_coalesce *c)
+{
+	int err;
+	uint32_t done;
+
+	pthread_mutex_lock(&c->checkpoint_lock);
+
+	pthread_mutex_lock(&c->lock);
+	done = c->done;
+	pthread_mutex_unlock(&c->lock);
+
+	if (done > c->saved) {
+		err = vhd_util_coalesce_write_checkpoint(c, done);
+		if (!err)
+			c->saved = done;
+	}
+
+	pthread_mutex_unlock(&c->checkpoint_lock);
+}
+
+static void *
+vhd_util_coalesce_worker(void *arg)
+{
+	int err;
+	char *buf;
+	uint32_t idx;
+	vhd_context_t *vhd;
+	struct vhd_coalesce *c;
+
+	c   = arg;
+	vhd = c->vhd;
+
+	err = posix_memalign((void **)&buf, 4096,
+			     vhd_sectors_to_bytes(vhd->bm_secs + vhd->spb));
+	if (err) {
+		pthread_mutex_lock(&c->lock);
+		if (!c->err)
+			c->err = -err;
+		pthread_mutex_unlock(&c->lock);
+		return NULL;
+	}
+
+	for (;;) {
+		int checkpoint;
+
+		pthread_mutex_lock(&c->lock);
+		if (c->err || c->next == c->nr_extents) {
+			pthread_mutex_unlock(&c->lock);
+			break;
+		}
+		idx = c->next++;
+		pthread_mutex_unlock(&c->lock);
+
+		err = vhd_util_coalesce_block(c, c->extents[idx].block, buf);
+
+		pthread_mutex_lock(&c->lock);
+		if (err) {
+			if (!c->err)
+				c->err = err;
+		} else {
+			c->completed[idx] = 1;
+			while (c->done < c->nr_extents && c->completed[c->done])
+				c->done++;
+		}
+		checkpoint = (c->checkpoint && !c->err &&
+			      c->done - c->saved >=
+			      VHD_COALESCE_CHECKPOINT_BLOCKS);
+		pthread_mutex_unlock(&c->lock);
+
+		if (checkpoint)
+			vhd_util_coalesce_checkpoint(c);
+	}
 
-done:
 	free(buf);
-	free(map);
+	return NULL;
+}
+
+static int
+vhd_util_coalesce_extent_compare(const void *a, const void *b)
+{
+	const struct vhd_coalesce_extent *x = a, *y = b;
+
+	if (x->offset < y->offset)
+		return -1;
+	return (x->offset > y->offset);
+}
+
+static int
+vhd_util_coalesce_init(struct vhd_coalesce *c)
+{
+	uint32_t i, n;
+	vhd_context_t *vhd = c->vhd;
+
+	c->extents = malloc(vhd->bat.entries * sizeof(*c->extents));
+	if (!c->extents)
+		return -ENOMEM;
+
+	for (i = 0, n = 0; i < vhd->bat.entries; i++) {
+		if (vhd->bat.bat[i] == DD_BLK_UNUSED)
+			continue;
+
+		c->extents[n].offset = vhd->bat.bat[i];
+		c->extents[n].block  = i;
+		n++;
+	}
+
+	qsort(c->extents, n, sizeof(*c->extents),
+	      vhd_util_coalesce_extent_compare);
+	c->nr_extents = n;
+
+	c->completed = calloc(n ? n : 1, 1);
+	if (!c->completed)
+		return -ENOMEM;
+
+	vhd_uuid_to_string(&vhd->footer.uuid, c->uuid, sizeof(c->uuid));
+
+	if (c->checkpoint)
+		return vhd_util_coalesce_read_checkpoint(c);
+
+	return 0;
+}
+
+static int
+vhd_util_coalesce_run(struct vhd_coalesce *c, int depth)
+{
+	int i, err, started;
+	pthread_t threads[VHD_COALESCE_MAX_DEPTH];
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_mutex_init(&c->parent_lock, NULL);
+	pthread_mutex_init(&c->checkpoint_lock, NULL);
+
+	err = 0;
+	depth = MIN(depth, c->nr_extents - c->next);
+
+	for (started = 0; started < depth; started++) {
+		err = pthread_create(&threads[started], NULL,
+				     vhd_util_coalesce_worker, c);
+		if (err) {
+			err = -err;
+			break;
+		}
+	}
+
+	/* without any threads at all, do the work here */
+	if (!started && err) {
+		err = 0;
+		vhd_util_coalesce_worker(c);
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (c->err)
+		err = c->err;
+	else if (!err)
+		err = vhd_util_coalesce_sync(c);
+
+	if (c->checkpoint) {
+		if (!err)
+			unlink(c->checkpoint);
+		else if (c->done > c->saved)
+			vhd_util_coalesce_write_checkpoint(c, c->done);
+	}
+
+	pthread_mutex_destroy(&c->checkpoint_lock);
+	pthread_mutex_destroy(&c->parent_lock);
+	pthread_mutex_destroy(&c->lock);
+
 	return err;
 }
 
 int
 vhd_util_coalesce(int argc, char **argv)
 {
-	int err, c;
-	uint64_t i;
+	int err, c, depth;
 	char *name, *pname;
 	vhd_context_t vhd, parent;
+	struct vhd_coalesce coalesce;
 	int parent_fd = -1;
 
 	name  = NULL;
 	pname = NULL;
+	depth = VHD_COALESCE_DEPTH;
 	parent.file = NULL;
+	memset(&coalesce, 0, sizeof(coalesce));
 
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:q:c:h")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
 			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'c':
+			coalesce.checkpoint = optarg;
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -154,6 +457,12 @@ vhd_util_coalesce(int argc, char **argv)
 	if (!name || optind != argc)
 		goto usage;
 
+	if (depth < 1 || depth > VHD_COALESCE_MAX_DEPTH) {
+		printf("queue depth must be between 1 and %d\n",
+		       VHD_COALESCE_MAX_DEPTH);
+		return -EINVAL;
+	}
+
 	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
 	if (err) {
 		printf("error opening %s: %d\n", name, err);
@@ -172,6 +481,7 @@ vhd_util_coalesce(int argc, char **argv)
 		if (parent_fd == -1) {
 			err = -errno;
 			printf("failed to open parent %s: %d\n", pname, err);
+			free(pname);
 			vhd_close(&vhd);
 			return err;
 		}
@@ -195,15 +505,19 @@ vhd_util_coalesce(int argc, char **argv)
 			goto done;
 	}
 
-	for (i = 0; i < vhd.bat.entries; i++) {
-		err = vhd_util_coalesce_block(&vhd, &parent, parent_fd, i);
-		if (err)
-			goto done;
-	}
+	coalesce.vhd       = &vhd;
+	coalesce.parent    = (parent.file ? &parent : NULL);
+	coalesce.parent_fd = parent_fd;
 
-	err = 0;
+	err = vhd_util_coalesce_init(&coalesce);
+	if (err)
+		goto done;
+
+	err = vhd_util_coalesce_run(&coalesce, depth);
 
  done:
+	free(coalesce.extents);
+	free(coalesce.completed);
 	free(pname);
 	vhd_close(&vhd);
 	if (parent.file)
@@ -213,6 +527,7 @@ vhd_util_coalesce(int argc, char **argv)
 	return err;
 
 usage:
-	printf("options: <-n name> [-h help]\n");
+	printf("options: <-n name> [-q queue depth] "
+	       "[-c checkpoint file] [-h help]\n");
 	return -EINVAL;
 }
@@ -66,8 +66,9 @@
 #include "xc_dom.h"
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
-/* number of pages to write at a time */
+/* number of pages to map and write at a time */
 #define DUMP_INCREMENT (4 * 1024)
 
 /* string table */
@@ -417,6 +418,77 @@ elfnote_dump_format_version(xc_interface *xch,
     return dump_rtn(xch, args, (char*)&format_version, sizeof(format_version));
 }
 
+/*
+ * Map a batch of guest frames with a single foreign mapping call, copy
+ * the ones which could be mapped into dump_mem and hand them to dump_rtn.
+ * If the batch cannot be mapped at all, its frames are mapped one at a
+ * time instead.  Individual frames which fail to map are skipped, exactly
+ * as a failed per-page mapping used to be.  *nr_dumped is advanced by the
+ * number of pages written, and the corresponding p2m/pfn table entries
+ * are filled in.
+ */
+static int
+dump_page_batch(xc_interface *xch, uint32_t domid,
+                void *args, dumpcore_rtn_t dump_rtn,
+                int auto_translated_physmap, char *dump_mem,
+                const xen_pfn_t *pfns, const xen_pfn_t *gmfns, int *errs,
+                unsigned int nr, struct xen_dumpcore_p2m *p2m_array,
+                uint64_t *pfn_array, unsigned long *nr_dumped)
+{
+    char *vaddr, *page;
+    unsigned int k, copied = 0;
+    unsigned long j = *nr_dumped;
+    int sts;
+
+    if ( nr == 0 )
+        return 0;
+
+    vaddr = xc_map_foreign_bulk(xch, domid, PROT_READ, gmfns, errs, nr);
+    if ( vaddr == NULL )
+        PERROR("Could not map %u frames in one batch, mapping them singly",
+               nr);
+
+    for ( k = 0; k < nr; k++ )
+    {
+        if ( vaddr != NULL )
+        {
+            if ( errs[k] )
+                continue;
+            page = vaddr + k * PAGE_SIZE;
+        }
+        else
+        {
+            page = xc_map_foreign_range(xch, domid, PAGE_SIZE, PROT_READ,
+                                        gmfns[k]);
+            if ( page == NULL )
+                continue;
+        }
+
+        if ( !auto_translated_physmap )
+        {
+            p2m_array[j].pfn = pfns[k];
+            p2m_array[j].gmfn = gmfns[k];
+        }
+        else
+            pfn_array[j] = pfns[k];
+
+        memcpy(dump_mem + copied * PAGE_SIZE, page, PAGE_SIZE);
+        if ( vaddr == NULL )
+            munmap(page, PAGE_SIZE);
+        copied++;
+        j++;
+    }
+    if ( vaddr != NULL )
+        munmap(vaddr, (unsigned long)nr * PAGE_SIZE);
+
+    sts = dump_rtn(xch, args, dump_mem, copied * PAGE_SIZE);
+    if ( sts != 0 )
+        return sts;
+
+    *nr_dumped = j;
+    return 0;
+}
+
 int
 xc_domain_dumpcore_via_callback(xc_interface *xch,
                                 uint32_t domid,
@@ -429,7 +501,11 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     struct domain_info_context *dinfo = &_dinfo;
 
     int nr_vcpus = 0;
-    char *dump_mem, *dump_mem_start = NULL;
+    char *dump_mem_start = NULL;
+    xen_pfn_t *batch_pfns = NULL;
+    xen_pfn_t *batch_gmfns = NULL;
+    int *batch_errs = NULL;
+    unsigned int batch_nr;
     vcpu_guest_context_any_t *ctxt = NULL;
     struct xc_core_arch_context arch_ctxt;
     char dummy[PAGE_SIZE];
@@ -472,6 +548,14 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
         PERROR("Could not allocate dump_mem");
         goto out;
     }
+    batch_pfns = malloc(DUMP_INCREMENT * sizeof(*batch_pfns));
+    batch_gmfns = malloc(DUMP_INCREMENT * sizeof(*batch_gmfns));
+    batch_errs = malloc(DUMP_INCREMENT * sizeof(*batch_errs));
+    if ( batch_pfns == NULL || batch_gmfns == NULL || batch_errs == NULL )
+    {
+        PERROR("Could not allocate page batch arrays");
+        goto out;
+    }
 
     if ( xc_domain_getinfo(xch, domid, 1, &info) != 1 )
     {
@@ -778,7 +862,7 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
 
     /* dump pages: .xen_pages */
     j = 0;
-    dump_mem = dump_mem_start;
+    batch_nr = 0;
     for ( map_idx = 0; map_idx < nr_memory_map; map_idx++ )
     {
         uint64_t pfn_start;
@@ -789,8 +873,18 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
         for ( i = pfn_start; i < pfn_end; i++ )
         {
             uint64_t gmfn;
-            void *vaddr;
-            
+
+            if ( j + batch_nr >= nr_pages )
+            {
+                sts = dump_page_batch(xch, domid, args, dump_rtn,
+                                      auto_translated_physmap, dump_mem_start,
+                                      batch_pfns, batch_gmfns, batch_errs,
+                                      batch_nr, p2m_array, pfn_array, &j);
+                if ( sts != 0 )
+                    goto out;
+                batch_nr = 0;
+            }
+
             if ( j >= nr_pages )
             {
                 /*
@@ -818,9 +912,6 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
                     if ( gmfn == (uint32_t)INVALID_P2M_ENTRY )
                        continue;
                 }
-
-                p2m_array[j].pfn = i;
-                p2m_array[j].gmfn = gmfn;
             }
             else
             {
@@ -828,31 +919,28 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
                     continue;
 
                 gmfn = i;
-                pfn_array[j] = i;
             }
 
-            vaddr = xc_map_foreign_range(
-                xch, domid, PAGE_SIZE, PROT_READ, gmfn);
-            if ( vaddr == NULL )
-                continue;
-            memcpy(dump_mem, vaddr, PAGE_SIZE);
-            munmap(vaddr, PAGE_SIZE);
-            dump_mem += PAGE_SIZE;
-            if ( (j + 1) % DUMP_INCREMENT == 0 )
+            batch_pfns[batch_nr] = i;
+            batch_gmfns[batch_nr] = gmfn;
+            batch_nr++;
+            if ( batch_nr == DUMP_INCREMENT )
             {
-                sts = dump_rtn(
-                    xch, args, dump_mem_start, dump_mem - dump_mem_start);
+                sts = dump_page_batch(xch, domid, args, dump_rtn,
+                                      auto_translated_physmap, dump_mem_start,
+                                      batch_pfns, batch_gmfns, batch_errs,
+                                      batch_nr, p2m_array, pfn_array, &j);
                 if ( sts != 0 )
                     goto out;
-                dump_mem = dump_mem_start;
+                batch_nr = 0;
             }
-
-            j++;
         }
     }
 
 copy_done:
-    sts = dump_rtn(xch, args, dump_mem_start, dump_mem - dump_mem_start);
+    sts = dump_page_batch(xch, domid, args, dump_rtn, auto_translated_physmap,
+                          dump_mem_start, batch_pfns, batch_gmfns, batch_errs,
+                          batch_nr, p2m_array, pfn_array, &j);
     if ( sts != 0 )
         goto out;
     if ( j < nr_pages )
@@ -910,6 +998,9 @@ out:
         free(ctxt);
     if ( dump_mem_start != NULL )
         free(dump_mem_start);
+    free(batch_pfns);
+    free(batch_gmfns);
+    free(batch_errs);
     if ( live_shinfo != NULL )
         munmap(live_shinfo, PAGE_SIZE);
     xc_core_arch_context_free(&arch_ctxt);
@@ -920,15 +1011,82 @@ out:
 /* Callback args for writing to a local dump file. */
 struct dump_args {
     int     fd;
+    int     sparse;     /* regular file: seek over zero pages */
+    off_t   offset;     /* logical end of the dump written so far */
 };
 
+static int page_is_zero(const char *page)
+{
+    const unsigned long *p = (const unsigned long *)page;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i++ )
+        if ( p[i] )
+            return 0;
+    return 1;
+}
+
+/* Write out length bytes of buffer at the logical end of the dump. */
+static int sparse_file_write(struct dump_args *da,
+                             char *buffer, unsigned int length)
+{
+    if ( length == 0 )
+        return 0;
+    if ( lseek(da->fd, da->offset, SEEK_SET) == (off_t)-1 ||
+         write_exact(da->fd, buffer, length) == -1 )
+        return -1;
+    da->offset += length;
+    return 0;
+}
+
+/*
+ * Write out a buffer, leaving holes in place of whole zero pages.
+ * Unmapped or unused guest memory is mostly zero, so on a regular file
+ * this saves both the write bandwidth and the disk space for it.  Holes
+ * read back as zeroes, so the resulting core file is unchanged.  Each
+ * run of data between holes goes out in a single write.
+ */
+static int sparse_file_dump(struct dump_args *da,
+                            char *buffer, unsigned int length)
+{
+    unsigned int done = 0, run = 0, chunk;
+
+    while ( done < length )
+    {
+        chunk = length - done;
+        if ( chunk > PAGE_SIZE )
+            chunk = PAGE_SIZE;
+
+        if ( chunk == PAGE_SIZE &&
+             !((da->offset + done - run) & (PAGE_SIZE - 1)) &&
+             page_is_zero(buffer + done) )
+        {
+            if ( sparse_file_write(da, buffer + run, done - run) == -1 )
+                return -1;
+            done += PAGE_SIZE;
+            da->offset += PAGE_SIZE;
+            run = done;
+            continue;
+        }
+
+        done += chunk;
+    }
+
+    return sparse_file_write(da, buffer + run, done - run);
+}
+
 /* Callback routine for writing to a local dump file. */
 static int local_file_dump(xc_interface *xch,
                            void *args, char *buffer, unsigned int length)
 {
     struct dump_args *da = args;
+    int rc;
 
-    if ( write_exact(da->fd, buffer, length) == -1 )
+    if ( da->sparse )
+        rc = sparse_file_dump(da, buffer, length);
+    else
+        rc = write_exact(da->fd, buffer, length);
+    if ( rc == -1 )
     {
         PERROR("Failed to write buffer");
         return -errno;
@@ -950,6 +1108,7 @@ xc_domain_dumpcore(xc_interface *xch,
                    const char *corename)
 {
     struct dump_args da;
+    struct stat st;
     int sts;
 
     if ( (da.fd = open(corename, O_CREAT|O_RDWR|O_TRUNC, S_IWUSR|S_IRUSR)) < 0 )
@@ -957,10 +1116,19 @@ xc_domain_dumpcore(xc_interface *xch,
         PERROR("Could not open corefile %s", corename);
         return -errno;
     }
+    da.sparse = fstat(da.fd, &st) == 0 && S_ISREG(st.st_mode);
+    da.offset = 0;
 
     sts = xc_domain_dumpcore_via_callback(
         xch, domid, &da, &local_file_dump);
 
+    /* a trailing hole still has to be accounted for in the file size */
+    if ( sts == 0 && da.sparse && ftruncate(da.fd, da.offset) != 0 )
+    {
+        PERROR("Could not extend corefile %s", corename);
+        sts = -errno;
+    }
+
     /* flush and discard any remaining portion of the file from cache */
     discard_file_cache(xch, da.fd, 1/* flush first*/);
 
@@ -39,6 +39,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
@@ -61,6 +62,11 @@ struct restore_ctx {
     int completed; /* Set when a consistent image is available */
     int last_checkpoint; /* Set when we should commit to the current checkpoint when it completes. */
     int compressing; /* Set when sender signals that pages would be sent compressed (for Remus) */
+    int prefetch; /* Stream is a regular file: ask the kernel to read ahead */
+    uint32_t *pfn_iter; /* Iteration of each pfn's data, with data streams */
+    off_t stream_base; /* Position of the stream in index_fd, or -1 */
+    int index_fd; /* The main stream, which page_offset describes */
+    uint64_t *page_offset; /* From a page index: each pfn's last copy */
     struct domain_info_context dinfo;
 };
 
@@ -121,6 +127,9 @@ static ssize_t rdexact(xc_interface *xch, struct restore_ctx *ctx,
 #define SUPERPAGE(_pfn) ((_pfn) & (~(SUPERPAGE_NR_PFNS-1)))
 #define SUPER_PAGE_START(pfn)    (((pfn) & (SUPERPAGE_NR_PFNS-1)) == 0 )
 
+/* How far ahead of the current position to read a file-backed stream. */
+#define RESTORE_PREFETCH_BYTES (8 * MAX_BATCH_SIZE * PAGE_SIZE)
+
 /*
 ** When we're restoring into a pv superpage-allocated guest, we take
 ** a copy of the p2m_batch array to preserve the pfn, then allocate the
@@ -728,6 +737,9 @@ typedef struct {
     unsigned long* pfn_types;
 
     int verify;
+    unsigned int verify_from; /* first pfn_types entry received in verify mode */
+
+    uint32_t iteration; /* sender iteration of the pages, on a data stream */
 
     int new_ctxt_format;
     int max_vcpu_id;
@@ -769,6 +781,148 @@ static void pagebuf_free(pagebuf_t* buf)
     }
 }
 
+/* Moves fd on by len bytes, by seeking if it can. */
+static int skip_bytes(xc_interface *xch, struct restore_ctx *ctx, int fd,
+                      uint64_t len)
+{
+    char buf[PAGE_SIZE];
+    size_t n;
+
+    if ( lseek(fd, len, SEEK_CUR) != (off_t)-1 )
+        return 0;
+
+    while ( len )
+    {
+        n = len < sizeof(buf) ? len : sizeof(buf);
+        if ( RDEXACT(fd, buf, n) )
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Reads the XC_SAVE_ID_PAGE_INDEX_TABLE at stream position pos, see
+ * xg_save_restore.h.  Failing is not fatal: without the index, the
+ * stream is simply restored in full.
+ */
+static void load_page_index(xc_interface *xch, struct restore_ctx *ctx,
+                            int fd, uint64_t pos)
+{
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    struct xc_save_page_index_entry entries[256];
+    uint64_t *page_offset = NULL;
+    uint32_t nr_entries, nr, i;
+    off_t off = ctx->stream_base + pos;
+    int id;
+
+    /* Not of use with data streams, where each page comes only once */
+    if ( !pos || ctx->stream_base == (off_t)-1 || fd != ctx->index_fd ||
+         ctx->pfn_iter || ctx->page_offset )
+        return;
+
+    if ( pread(fd, &id, sizeof(id), off) != sizeof(id) ||
+         id != XC_SAVE_ID_PAGE_INDEX_TABLE ||
+         pread(fd, &nr_entries, sizeof(nr_entries), off + sizeof(id)) !=
+         sizeof(nr_entries) )
+        goto bad;
+    off += sizeof(id) + sizeof(nr_entries);
+
+    page_offset = calloc(dinfo->p2m_size, sizeof(*page_offset));
+    if ( !page_offset )
+        goto bad;
+
+    while ( nr_entries )
+    {
+        nr = nr_entries < ARRAY_SIZE(entries) ?
+            nr_entries : ARRAY_SIZE(entries);
+        if ( pread(fd, entries, nr * sizeof(entries[0]), off) !=
+             nr * sizeof(entries[0]) )
+            goto bad;
+        for ( i = 0; i < nr; i++ )
+        {
+            if ( entries[i].pfn >= dinfo->p2m_size )
+                goto bad;
+            page_offset[entries[i].pfn] = entries[i].offset;
+        }
+        off += nr * sizeof(entries[0]);
+        nr_entries -= nr;
+    }
+
+    DPRINTF("using the page index\n");
+    ctx->page_offset = page_offset;
+    return;
+
+ bad:
+    DPRINTF("cannot read the page index, restoring without it\n");
+    free(page_offset);
+}
+
+/*
+ * Reads the data of the pages of the batch at pfn_types[first..nr_pages)
+ * into the page buffer, which must have room for all of it.  A copy
+ * which the page index says is superseded later in the stream is seeked
+ * over, and its entry turned into an XEN_DOMCTL_PFINFO_XALLOC one so that
+ * apply_batch only allocates the page.
+ */
+static int pagebuf_read_indexed(xc_interface *xch, struct restore_ctx *ctx,
+                                pagebuf_t *buf, int fd, int first)
+{
+    unsigned long pfn, pagetype;
+    uint64_t pos, last;
+    int i, nread = 0, nskip = 0;
+    off_t cur;
+
+    if ( (cur = lseek(fd, 0, SEEK_CUR)) == (off_t)-1 )
+        return -1;
+    pos = cur - ctx->stream_base;
+
+    /* Read, or skip, runs of pages at a time */
+    for ( i = first; i < buf->nr_pages; i++ )
+    {
+        pfn      = buf->pfn_types[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = buf->pfn_types[i] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB ||
+             pagetype == XEN_DOMCTL_PFINFO_BROKEN ||
+             pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+            continue;
+
+        /* apply_batch rejects out of range pfns */
+        last = pfn < ctx->dinfo.p2m_size ? ctx->page_offset[pfn] : 0;
+        if ( !last || last == pos )
+        {
+            if ( nskip &&
+                 lseek(fd, nskip * PAGE_SIZE, SEEK_CUR) == (off_t)-1 )
+                return -1;
+            nskip = 0;
+            nread++;
+        }
+        else
+        {
+            if ( nread &&
+                 RDEXACT(fd, buf->pages + buf->nr_physpages * PAGE_SIZE,
+                         nread * PAGE_SIZE) )
+                return -1;
+            buf->nr_physpages += nread;
+            nread = 0;
+            nskip++;
+            buf->pfn_types[i] = pfn | XEN_DOMCTL_PFINFO_XALLOC;
+        }
+        pos += PAGE_SIZE;
+    }
+
+    if ( nread &&
+         RDEXACT(fd, buf->pages + buf->nr_physpages * PAGE_SIZE,
+                 nread * PAGE_SIZE) )
+        return -1;
+    buf->nr_physpages += nread;
+    if ( nskip && lseek(fd, nskip * PAGE_SIZE, SEEK_CUR) == (off_t)-1 )
+        return -1;
+
+    return 0;
+}
+
 static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
                            pagebuf_t* buf, int fd, uint32_t dom)
 {
@@ -793,6 +947,15 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
     case XC_SAVE_ID_ENABLE_VERIFY_MODE:
         DPRINTF("Entering page verify mode\n");
         buf->verify = 1;
+        buf->verify_from = buf->nr_pages;
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_ITERATION:
+        if ( RDEXACT(fd, &buf->iteration, sizeof(buf->iteration)) )
+        {
+            PERROR("Error when reading data stream iteration");
+            return -1;
+        }
         return pagebuf_get_one(xch, ctx, buf, fd, dom);
 
     case XC_SAVE_ID_VCPU_INFO:
@@ -982,6 +1145,36 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         }
         return compbuf_size;
 
+    case XC_SAVE_ID_PAGE_INDEX:
+        /* Skip padding 4 bytes then read the page index table position. */
+        {
+            uint64_t pos;
+
+            if ( RDEXACT(fd, &pos, sizeof(uint32_t)) ||
+                 RDEXACT(fd, &pos, sizeof(uint64_t)) )
+            {
+                PERROR("Error when reading page index position");
+                return -1;
+            }
+            load_page_index(xch, ctx, fd, pos);
+        }
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_PAGE_INDEX_TABLE:
+        /* Read, if of use, at XC_SAVE_ID_PAGE_INDEX: skip it. */
+        {
+            uint32_t nr_entries;
+
+            if ( RDEXACT(fd, &nr_entries, sizeof(nr_entries)) ||
+                 skip_bytes(xch, ctx, fd, (uint64_t)nr_entries *
+                            sizeof(struct xc_save_page_index_entry)) )
+            {
+                PERROR("Error when skipping page index");
+                return -1;
+            }
+        }
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
     case XC_SAVE_ID_HVM_GENERATION_ID_ADDR:
         /* Skip padding 4 bytes then read the generation id buffer location. */
         if ( RDEXACT(fd, &buf->vm_generationid_addr, sizeof(uint32_t)) ||
@@ -1077,7 +1270,16 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         }
         buf->pages = ptmp;
     }
-    if ( RDEXACT(fd, buf->pages + oldcount * PAGE_SIZE, countpages * PAGE_SIZE) ) {
+    if ( ctx->page_offset && fd == ctx->index_fd && !buf->verify )
+    {
+        buf->nr_physpages = oldcount;
+        if ( pagebuf_read_indexed(xch, ctx, buf, fd, buf->nr_pages - count) )
+        {
+            PERROR("Error when reading pages");
+            return -1;
+        }
+    }
+    else if ( RDEXACT(fd, buf->pages + oldcount * PAGE_SIZE, countpages * PAGE_SIZE) ) {
         PERROR("Error when reading pages");
         return -1;
     }
@@ -1092,6 +1294,7 @@ static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
 
     buf->nr_physpages = buf->nr_pages = 0;
     buf->compbuf_pos = buf->compbuf_size = 0;
+    buf->verify_from = 0;
 
     do {
         rc = pagebuf_get_one(xch, ctx, buf, fd, dom);
@@ -1103,6 +1306,83 @@ static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
     return rc;
 }
 
+/*
+ * A superpage candidate which is still open at the end of a batch may be
+ * completed by pfns which have already been read into the pagebuf for the
+ * following batch.  Look ahead from entry 'next', and if the whole 2MB run
+ * is there allocate the superpage now, rather than falling back to 4k
+ * pages just because the run straddles a batch boundary.
+ *
+ * Returns 1 if the superpage was allocated and the p2m updated.
+ */
+static int superpage_lookahead(xc_interface *xch, uint32_t dom,
+                               struct restore_ctx *ctx, pagebuf_t *pagebuf,
+                               unsigned int next, unsigned long superpage_start,
+                               unsigned long scount)
+{
+    unsigned long pfn, pagetype, supermfn, k;
+    unsigned int i;
+
+    for ( i = next; i < pagebuf->nr_pages && scount < SUPERPAGE_NR_PFNS; i++ )
+    {
+        pfn      = pagebuf->pfn_types[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = pagebuf->pfn_types[i] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB )
+            continue;
+
+        if ( pfn != superpage_start + scount ||
+             ctx->p2m[pfn] != INVALID_P2M_ENTRY )
+            return 0;
+
+        scount++;
+    }
+
+    if ( scount != SUPERPAGE_NR_PFNS )
+        return 0;
+
+    supermfn = superpage_start;
+    if ( xc_domain_populate_physmap_exact(xch, dom, 1, SUPERPAGE_PFN_SHIFT,
+                                          0, &supermfn) != 0 )
+    {
+        DPRINTF("No 2M page available for pfn 0x%lx, fall back to 4K page.\n",
+                superpage_start);
+        return 0;
+    }
+
+    DPRINTF("Mapping superpage (lookahead) pfn %lx, mfn %lx\n",
+            superpage_start, supermfn);
+    for ( k = 0; k < SUPERPAGE_NR_PFNS; k++ )
+    {
+        ctx->p2m[superpage_start + k] = supermfn + k;
+        ctx->nr_pfns++;
+    }
+
+    return 1;
+}
+
+/*
+ * Does the pagebuf end part way through an unallocated run which could
+ * become a superpage?  If so, it is worth reading the next batch as well
+ * before applying this one.
+ */
+static int superpage_run_split(struct restore_ctx *ctx, pagebuf_t *pagebuf)
+{
+    unsigned long pfn, pagetype;
+
+    if ( !ctx->hvm || !ctx->superpages || pagebuf->compressing ||
+         pagebuf->nr_pages == 0 )
+        return 0;
+
+    pfn      = pagebuf->pfn_types[pagebuf->nr_pages - 1] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+    pagetype = pagebuf->pfn_types[pagebuf->nr_pages - 1] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+    return pagetype != XEN_DOMCTL_PFINFO_XTAB &&
+           !SUPER_PAGE_START(pfn + 1) &&
+           pfn < ctx->dinfo.p2m_size &&
+           ctx->p2m[pfn] == INVALID_P2M_ENTRY;
+}
+
 static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
                        xen_pfn_t* region_mfn, unsigned long* pfn_type, int pae_extended_cr3,
                        struct xc_mmu* mmu,
@@ -1123,6 +1403,7 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
     int rc = -1;
 
     unsigned long mfn, pfn, pagetype;
+    int verify;
 
     j = pagebuf->nr_pages - curbatch;
     if (j > MAX_BATCH_SIZE)
@@ -1215,6 +1496,15 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         }
     }
 
+    /* Complete a candidate from the following batch if possible */
+    if ( superpage_start != INVALID_P2M_ENTRY &&
+         superpage_lookahead(xch, dom, ctx, pagebuf, curbatch + j,
+                             superpage_start, scount) )
+    {
+        superpage_start = INVALID_P2M_ENTRY;
+        scount = 0;
+    }
+
     /* Clean up any partial superpage candidates */
     if ( superpage_start != INVALID_P2M_ENTRY )
     {
@@ -1318,18 +1608,27 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
 
         ++curpage;
 
-        if ( pfn > dinfo->p2m_size )
+        if ( pfn >= dinfo->p2m_size )
         {
             ERROR("pfn out of range");
             goto err_mapped;
         }
 
+        /* A newer copy already arrived on another data stream? */
+        if ( ctx->pfn_iter )
+        {
+            if ( pagebuf->iteration < ctx->pfn_iter[pfn] )
+                continue;
+            ctx->pfn_iter[pfn] = pagebuf->iteration;
+        }
+
         pfn_type[pfn] = pagetype;
 
         mfn = ctx->p2m[pfn];
 
         /* In verify mode, we use a copy; otherwise we work in place */
-        page = pagebuf->verify ? (void *)buf : (region_base + i*PAGE_SIZE);
+        verify = pagebuf->verify && (i + curbatch) >= pagebuf->verify_from;
+        page = verify ? (void *)buf : (region_base + i*PAGE_SIZE);
 
         /* Remus - page decompression */
         if (pagebuf->compressing)
@@ -1385,7 +1684,7 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
             goto err_mapped;
         }
 
-        if ( pagebuf->verify )
+        if ( verify )
         {
             int res = memcmp(buf, (region_base + i*PAGE_SIZE), PAGE_SIZE);
             if ( res )
@@ -1426,14 +1725,237 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
     return rc;
 }
 
-int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
-                      unsigned int store_evtchn, unsigned long *store_mfn,
-                      domid_t store_domid, unsigned int console_evtchn,
-                      unsigned long *console_mfn, domid_t console_domid,
-                      unsigned int hvm, unsigned int pae, int superpages,
-                      int no_incr_generationid, int checkpointed_stream,
-                      unsigned long *vm_generationid_addr,
-                      struct restore_callbacks *callbacks)
+/*
+ * Each data stream of a multi-stream migration has a reader thread, which
+ * reads batches off the stream into one of two page buffers while the
+ * restore thread applies batches from whichever stream has one ready.
+ */
+#define DATA_STREAM_BUFS 2
+
+enum {
+    DS_FREE,        /* Buffer can be read into */
+    DS_READING,     /* Reader thread is filling the buffer */
+    DS_FULL,        /* Buffer holds a batch to be applied */
+    DS_APPLYING,    /* Restore thread is applying the buffer */
+};
+
+struct data_streams;
+
+struct data_stream {
+    struct data_streams *all;
+    int fd;
+    unsigned int id;
+    pthread_t thread;
+    int started;
+    pagebuf_t buf[DATA_STREAM_BUFS];
+    int state[DATA_STREAM_BUFS];
+};
+
+struct data_streams {
+    xc_interface *xch;
+    struct restore_ctx *ctx;
+    uint32_t dom;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int live;  /* Readers which have not seen their terminator */
+    int failed;
+    struct data_stream *stream;
+    unsigned int nr;
+};
+
+static void data_stream_unlock(void *arg)
+{
+    pthread_mutex_unlock(arg);
+}
+
+static void *data_stream_reader(void *arg)
+{
+    struct data_stream *ds = arg;
+    struct data_streams *dss = ds->all;
+    xc_interface *xch = dss->xch;
+    uint32_t iteration = 0;
+    pagebuf_t *buf;
+    int i, frc;
+
+    pthread_mutex_lock(&dss->lock);
+    for ( ; ; )
+    {
+        for ( i = 0; i < DATA_STREAM_BUFS; i++ )
+            if ( ds->state[i] == DS_FREE )
+                break;
+        if ( i == DATA_STREAM_BUFS )
+        {
+            /* Only cancelled when the restore has failed. */
+            pthread_cleanup_push(data_stream_unlock, &dss->lock);
+            pthread_cond_wait(&dss->cond, &dss->lock);
+            pthread_cleanup_pop(0);
+            continue;
+        }
+        ds->state[i] = DS_READING;
+        pthread_mutex_unlock(&dss->lock);
+
+        /* The iteration tag persists over the batches of a stream. */
+        buf = &ds->buf[i];
+        buf->nr_physpages = buf->nr_pages = 0;
+        buf->iteration = iteration;
+        frc = pagebuf_get_one(xch, dss->ctx, buf, ds->fd, dss->dom);
+        iteration = buf->iteration;
+        if ( frc < 0 )
+            PERROR("Error when reading batch from data stream %u", ds->id);
+
+        pthread_mutex_lock(&dss->lock);
+        if ( frc <= 0 )
+        {
+            ds->state[i] = DS_FREE;
+            if ( frc < 0 )
+                dss->failed = 1;
+            dss->live--;
+            pthread_cond_broadcast(&dss->cond);
+            break;
+        }
+        ds->state[i] = DS_FULL;
+        pthread_cond_broadcast(&dss->cond);
+    }
+    pthread_mutex_unlock(&dss->lock);
+
+    return NULL;
+}
+
+/*
+ * Read and apply page batches from the data streams of a multi-stream
+ * migration until every one of them has been terminated.
+ *
+ * Returns the number of races on success, -1 on error.
+ */
+static int restore_data_streams(xc_interface *xch, uint32_t dom,
+                                struct restore_ctx *ctx,
+                                const int *data_fds, unsigned int nr_data_fds,
+                                xen_pfn_t *region_mfn, unsigned long *pfn_type,
+                                int pae_extended_cr3, struct xc_mmu *mmu)
+{
+    struct data_streams dss = {
+        .xch = xch,
+        .ctx = ctx,
+        .dom = dom,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    struct data_stream *ds;
+    pagebuf_t *buf;
+    unsigned int i;
+    int b, brc, curbatch, nraces = 0, rc = -1;
+
+    dss.stream = calloc(nr_data_fds, sizeof(*dss.stream));
+    if ( dss.stream == NULL )
+    {
+        ERROR("Failed to allocate data stream buffers");
+        return -1;
+    }
+    dss.nr = nr_data_fds;
+
+    for ( i = 0; i < nr_data_fds; i++ )
+    {
+        ds = &dss.stream[i];
+        ds->all = &dss;
+        ds->fd = data_fds[i];
+        ds->id = i;
+        for ( b = 0; b < DATA_STREAM_BUFS; b++ )
+            pagebuf_init(&ds->buf[b]);
+
+        pthread_mutex_lock(&dss.lock);
+        dss.live++;
+        pthread_mutex_unlock(&dss.lock);
+        errno = pthread_create(&ds->thread, NULL, data_stream_reader, ds);
+        if ( errno )
+        {
+            PERROR("Failed to start reader for data stream %u", i);
+            pthread_mutex_lock(&dss.lock);
+            dss.live--;
+            dss.failed = 1;
+            pthread_mutex_unlock(&dss.lock);
+            goto out;
+        }
+        ds->started = 1;
+    }
+
+    pthread_mutex_lock(&dss.lock);
+    for ( ; ; )
+    {
+        ds = NULL;
+        for ( i = 0; i < nr_data_fds && !ds; i++ )
+            for ( b = 0; b < DATA_STREAM_BUFS; b++ )
+                if ( dss.stream[i].state[b] == DS_FULL )
+                {
+                    ds = &dss.stream[i];
+                    break;
+                }
+
+        if ( !ds )
+        {
+            if ( dss.failed || !dss.live )
+                break;
+            pthread_cond_wait(&dss.cond, &dss.lock);
+            continue;
+        }
+
+        ds->state[b] = DS_APPLYING;
+        pthread_mutex_unlock(&dss.lock);
+
+        buf = &ds->buf[b];
+        brc = 0;
+        for ( curbatch = 0; curbatch < buf->nr_pages;
+              curbatch += MAX_BATCH_SIZE )
+        {
+            brc = apply_batch(xch, dom, ctx, region_mfn, pfn_type,
+                              pae_extended_cr3, mmu, buf, curbatch);
+            if ( brc < 0 )
+                break;
+            nraces += brc;
+        }
+
+        pthread_mutex_lock(&dss.lock);
+        ds->state[b] = DS_FREE;
+        if ( brc < 0 )
+            dss.failed = 1;
+        pthread_cond_broadcast(&dss.cond);
+    }
+    if ( !dss.failed )
+        rc = nraces;
+    pthread_mutex_unlock(&dss.lock);
+
+ out:
+    /*
+     * On success every reader has seen its terminator and exited.  On
+     * failure the others may be blocked reading their streams.
+     */
+    for ( i = 0; i < nr_data_fds; i++ )
+    {
+        ds = &dss.stream[i];
+        if ( !ds->started )
+            continue;
+        if ( rc < 0 )
+            pthread_cancel(ds->thread);
+        pthread_join(ds->thread, NULL);
+    }
+    for ( i = 0; i < nr_data_fds; i++ )
+        for ( b = 0; b < DATA_STREAM_BUFS; b++ )
+            pagebuf_free(&dss.stream[i].buf[b]);
+    free(dss.stream);
+    return rc;
+}
+
+int xc_domain_restore_streams(xc_interface *xch, int io_fd,
+                              const int *data_fds, unsigned int nr_data_fds,
+                              uint32_t dom, unsigned int store_evtchn,
+                              unsigned long *store_mfn, domid_t store_domid,
+                              unsigned int console_evtchn,
+                              unsigned long *console_mfn,
+                              domid_t console_domid, unsigned int hvm,
+                              unsigned int pae, int superpages,
+                              int no_incr_generationid,
+                              int checkpointed_stream,
+                              unsigned long *vm_generationid_addr,
+                              struct restore_callbacks *callbacks)
 {
     DECLARE_DOMCTL;
     xc_dominfo_t info;
@@ -1486,6 +2008,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     uint64_t console_pfn = 0;
 
     int orig_io_fd_flags;
+    struct stat io_fd_stat;
+    int pages_done = 0;
 
     struct restore_ctx _ctx;
     struct restore_ctx *ctx = &_ctx;
@@ -1518,6 +2042,18 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         goto out;
     }
 
+    /*
+     * Restoring from a file: have the kernel read the stream ahead of us
+     * while we populate and copy the previous batch.
+     */
+    ctx->prefetch = fstat(io_fd, &io_fd_stat) == 0 &&
+                    S_ISREG(io_fd_stat.st_mode);
+
+    /* Where the stream starts, for a page index to refer to */
+    ctx->index_fd = io_fd;
+    ctx->stream_base = checkpointed_stream ? (off_t)-1 :
+                       lseek(io_fd, 0, SEEK_CUR);
+
     if ( RDEXACT(io_fd, &dinfo->p2m_size, sizeof(unsigned long)) )
     {
         PERROR("read: p2m_size");
@@ -1613,6 +2149,30 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
 
     xc_report_progress_start(xch, "Reloading memory pages", dinfo->p2m_size);
 
+    if ( nr_data_fds )
+    {
+        if ( checkpointed_stream )
+        {
+            ERROR("Data streams are not supported for checkpointed streams");
+            errno = EINVAL;
+            goto out;
+        }
+
+        ctx->pfn_iter = calloc(dinfo->p2m_size, sizeof(*ctx->pfn_iter));
+        if ( ctx->pfn_iter == NULL )
+        {
+            ERROR("pfn iteration table alloc failed");
+            errno = ENOMEM;
+            goto out;
+        }
+
+        frc = restore_data_streams(xch, dom, ctx, data_fds, nr_data_fds,
+                                   region_mfn, pfn_type, pae_extended_cr3, mmu);
+        if ( frc < 0 )
+            goto out;
+        nraces += frc;
+    }
+
     /*
      * Now simply read each saved frame into its new machine frame.
      * We uncanonicalise page tables as we go.
@@ -1629,9 +2189,25 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         if ( !ctx->completed ) {
             pagebuf.nr_physpages = pagebuf.nr_pages = 0;
             pagebuf.compbuf_pos = pagebuf.compbuf_size = 0;
-            if ( pagebuf_get_one(xch, ctx, &pagebuf, io_fd, dom) < 0 ) {
-                PERROR("Error when reading batch");
-                goto out;
+            pagebuf.verify_from = 0;
+            if ( !pages_done ) {
+                if ( ctx->prefetch )
+                    prefetch_file_cache(xch, io_fd, RESTORE_PREFETCH_BYTES);
+                frc = pagebuf_get_one(xch, ctx, &pagebuf, io_fd, dom);
+                if ( frc > 0 && superpage_run_split(ctx, &pagebuf) )
+                {
+                    /*
+                     * Pull in the next batch too, so that a superpage
+                     * straddling the two can be allocated in one go.
+                     */
+                    frc = pagebuf_get_one(xch, ctx, &pagebuf, io_fd, dom);
+                    if ( frc == 0 )
+                        pages_done = 1;
+                }
+                if ( frc < 0 ) {
+                    PERROR("Error when reading batch");
+                    goto out;
+                }
             }
         }
         j = pagebuf.nr_pages;
@@ -2387,6 +2963,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     free(pfn_type);
     free(region_mfn);
     free(ctx->p2m_batch);
+    free(ctx->pfn_iter);
+    free(ctx->page_offset);
     pagebuf_free(&pagebuf);
     tailbuf_free(&tailbuf);
 
@@ -2399,6 +2977,23 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
 
     return rc;
 }
+
+int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
+                      unsigned int store_evtchn, unsigned long *store_mfn,
+                      domid_t store_domid, unsigned int console_evtchn,
+                      unsigned long *console_mfn, domid_t console_domid,
+                      unsigned int hvm, unsigned int pae, int superpages,
+                      int no_incr_generationid, int checkpointed_stream,
+                      unsigned long *vm_generationid_addr,
+                      struct restore_callbacks *callbacks)
+{
+    return xc_domain_restore_streams(xch, io_fd, NULL, 0, dom, store_evtchn,
+                                     store_mfn, store_domid, console_evtchn,
+                                     console_mfn, console_domid, hvm, pae,
+                                     superpages, no_incr_generationid,
+                                     checkpointed_stream, vm_generationid_addr,
+                                     callbacks);
+}
 /*
  * Local variables:
  * mode: C
@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "xc_private.h"
 #include "xc_bitops.h"
@@ -216,6 +217,17 @@ static inline int write_buffer(xc_interface *xch,
         return write_exact(fd, buf, len);
 }
 
+/* Offset in the save file at which the next byte of the stream will land */
+static off_t stream_offset(int dobuf, struct outbuf *ob, int fd)
+{
+    off_t cur = lseek(fd, 0, SEEK_CUR);
+
+    if ( cur == (off_t)-1 )
+        return cur;
+
+    return dobuf ? cur + ob->pos : cur;
+}
+
 /* like write_buffer for noncached, which returns number of bytes written */
 static inline int write_uncached(xc_interface *xch,
                                    int dobuf, struct outbuf* ob, int fd,
@@ -800,10 +812,187 @@ static int save_tsc_info(xc_interface *xch, uint32_t dom, int io_fd)
     return 0;
 }
 
-int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
-                   uint32_t max_factor, uint32_t flags,
-                   struct save_callbacks* callbacks, int hvm,
-                   unsigned long vm_generationid_addr)
+/*
+ * With xc_domain_save_streams(), each data stream has a writer thread.
+ * The save loop copies a whole batch into an idle stream's buffer and
+ * hands it over, so that it can map and copy the next batch while the
+ * previous ones are still being written out.
+ */
+#define DATA_STREAM_BUF_SIZE                                    \
+    (sizeof(int) + sizeof(uint32_t) + sizeof(unsigned int) +    \
+     MAX_BATCH_SIZE * (sizeof(unsigned long) + PAGE_SIZE))
+
+struct data_stream {
+    int fd;
+    uint32_t iter;          /* Iteration last tagged on this stream */
+    pthread_t thread;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *buf;
+    size_t len;
+    int busy;               /* buf belongs to the writer thread */
+    int quit;
+    int err;                /* errno of the first failed write */
+};
+
+static void *data_stream_writer(void *arg)
+{
+    struct data_stream *ds = arg;
+    int err;
+
+    pthread_mutex_lock(&ds->lock);
+    for ( ; ; )
+    {
+        while ( !ds->busy && !ds->quit )
+            pthread_cond_wait(&ds->cond, &ds->lock);
+        if ( !ds->busy )
+            break;
+
+        err = ds->err;
+        pthread_mutex_unlock(&ds->lock);
+
+        if ( !err && write_exact(ds->fd, ds->buf, ds->len) )
+            err = errno ?: EIO;
+
+        pthread_mutex_lock(&ds->lock);
+        ds->err = err;
+        ds->len = 0;
+        ds->busy = 0;
+        pthread_cond_signal(&ds->cond);
+    }
+    pthread_mutex_unlock(&ds->lock);
+
+    return NULL;
+}
+
+/* Wait for the writer to be done with ds->buf; returns its errno, if any. */
+static int data_stream_wait(struct data_stream *ds)
+{
+    int err;
+
+    pthread_mutex_lock(&ds->lock);
+    while ( ds->busy )
+        pthread_cond_wait(&ds->cond, &ds->lock);
+    err = ds->err;
+    pthread_mutex_unlock(&ds->lock);
+
+    return err;
+}
+
+static void data_stream_append(struct data_stream *ds,
+                               const void *buf, size_t len)
+{
+    assert(ds->len + len <= DATA_STREAM_BUF_SIZE);
+    memcpy(ds->buf + ds->len, buf, len);
+    ds->len += len;
+}
+
+static void data_stream_submit(struct data_stream *ds)
+{
+    pthread_mutex_lock(&ds->lock);
+    ds->busy = 1;
+    pthread_cond_signal(&ds->cond);
+    pthread_mutex_unlock(&ds->lock);
+}
+
+/*
+ * Get the next stream to put a batch on: the first idle one, or else the
+ * one which has been busy the longest.  *next is the stream after the
+ * last one handed out.  Returns NULL, with errno set, if the chosen
+ * stream has failed.
+ */
+static struct data_stream *data_stream_get(struct data_stream *streams,
+                                           unsigned int nr,
+                                           unsigned int *next)
+{
+    unsigned int i, s = *next;
+    int busy;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        s = (*next + i) % nr;
+        pthread_mutex_lock(&streams[s].lock);
+        busy = streams[s].busy;
+        pthread_mutex_unlock(&streams[s].lock);
+        if ( !busy )
+            break;
+    }
+    if ( i == nr )
+        s = *next % nr;
+    *next = s + 1;
+
+    errno = data_stream_wait(&streams[s]);
+    return errno ? NULL : &streams[s];
+}
+
+static int data_streams_start(xc_interface *xch, struct data_stream *streams,
+                              const int *data_fds, unsigned int nr)
+{
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct data_stream *ds = &streams[i];
+
+        ds->fd = data_fds[i];
+        pthread_mutex_init(&ds->lock, NULL);
+        pthread_cond_init(&ds->cond, NULL);
+        ds->buf = malloc(DATA_STREAM_BUF_SIZE);
+        if ( !ds->buf )
+        {
+            ERROR("Failed to allocate buffer for data stream %u", i);
+            return -1;
+        }
+        rc = pthread_create(&ds->thread, NULL, data_stream_writer, ds);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Failed to start writer for data stream %u", i);
+            return -1;
+        }
+        ds->started = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write out whatever the streams still hold and stop their writers.
+ * Returns the errno of the first stream which failed, or 0.
+ */
+static int data_streams_stop(struct data_stream *streams, unsigned int nr)
+{
+    unsigned int i;
+    int err = 0;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct data_stream *ds = &streams[i];
+
+        if ( ds->started )
+        {
+            pthread_mutex_lock(&ds->lock);
+            ds->quit = 1;
+            pthread_cond_signal(&ds->cond);
+            pthread_mutex_unlock(&ds->lock);
+            pthread_join(ds->thread, NULL);
+            if ( ds->err && !err )
+                err = ds->err;
+        }
+        free(ds->buf);
+    }
+
+    return err;
+}
+
+int xc_domain_save_streams(xc_interface *xch, int io_fd,
+                           const int *data_fds, unsigned int nr_data_fds,
+                           uint32_t dom, uint32_t max_iters,
+                           uint32_t max_factor, uint32_t flags,
+                           struct save_callbacks* callbacks, int hvm,
+                           unsigned long vm_generationid_addr)
 {
     xc_dominfo_t info;
     DECLARE_DOMCTL;
@@ -827,6 +1016,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     unsigned long *pfn_batch = NULL;
     int *pfn_err = NULL;
 
+    /* Data streams, and the one the current batch goes to, if any. */
+    struct data_stream *streams = NULL, *batch_stream = NULL;
+    unsigned int next_stream = 0;
+
+    /* XCFLAGS_PAGE_INDEX: where the stream starts in the file, where in
+     * the stream the last copy of each pfn's data is, and where the
+     * XC_SAVE_ID_PAGE_INDEX position field to fill in at the end is. */
+    off_t index_base = -1, page_offset = 0, index_field = 0;
+    uint64_t *page_index = NULL, index_table = 0;
+
     /* A copy of one frame of guest memory. */
     char page[PAGE_SIZE];
 
@@ -904,6 +1103,15 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         goto exit;
     }
 
+    if ( nr_data_fds && (callbacks->checkpoint || debug ||
+                         (flags & XCFLAGS_CHECKPOINT_COMPRESS)) )
+    {
+        ERROR("Multiple data streams are not supported for checkpointed"
+              " or debug saves");
+        errno = EINVAL;
+        goto exit;
+    }
+
     outbuf_init(xch, &ob_pagebuf, OUTBUF_SIZE);
 
     memset(ctx, 0, sizeof(*ctx));
@@ -1003,6 +1211,30 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         outbuf_init(xch, &ob_tailbuf, OUTBUF_SIZE/4);
     }
 
+    if ( nr_data_fds )
+    {
+        streams = calloc(nr_data_fds, sizeof(*streams));
+        if ( !streams )
+        {
+            ERROR("Failed to allocate data stream state");
+            goto out;
+        }
+        if ( data_streams_start(xch, streams, data_fds, nr_data_fds) )
+            goto out;
+    }
+
+    if ( (flags & XCFLAGS_PAGE_INDEX) && !callbacks->checkpoint &&
+         !(flags & XCFLAGS_CHECKPOINT_COMPRESS) && !nr_data_fds && !debug )
+    {
+        if ( (index_base = lseek(io_fd, 0, SEEK_CUR)) == (off_t)-1 )
+            DPRINTF("Save fd is not seekable, not writing a page index\n");
+        else if ( !(page_index = calloc(dinfo->p2m_size, sizeof(*page_index))) )
+        {
+            ERROR("Failed to allocate page index");
+            goto out;
+        }
+    }
+
     last_iter = !live;
 
     /* pretend we sent all the pages last iteration */
@@ -1105,6 +1337,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         PERROR("Error when writing to state file (tmem)");
         goto out;
     }
+    if ( tmem_saved > 0 && nr_data_fds )
+    {
+        /*
+         * tmem data is unbounded and goes down the control stream, which
+         * the receiver only reads once the data streams have finished.
+         */
+        ERROR("Multiple data streams are not supported with tmem");
+        errno = EINVAL;
+        goto out;
+    }
 
     if ( !live && save_tsc_info(xch, dom, io_fd) < 0 )
     {
@@ -1116,8 +1358,34 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 #define wrexact(fd, buf, len) write_buffer(xch, last_iter, ob, (fd), (buf), (len))
 #define wruncached(fd, live, buf, len) write_uncached(xch, last_iter, ob, (fd), (buf), (len))
 #define wrcompressed(fd) write_compressed(xch, compress_ctx, last_iter, ob, (fd))
+/* Page batches go to batch_stream, if there is one, else to io_fd */
+#define wrbatch(buf, len)                                               \
+    (!batch_stream ? wrexact(io_fd, (buf), (len))                       \
+     : (data_stream_append(batch_stream, (buf), (len)), 0))
+#define wrbatchuncached(buf, len)                                       \
+    (!batch_stream ? wruncached(io_fd, live, (buf), (len))              \
+     : (data_stream_append(batch_stream, (buf), (len)), (int)(len)))
 
     ob = &ob_pagebuf; /* Holds pfn_types, pages/compressed pages */
+
+    if ( page_index )
+    {
+        struct {
+            int id;
+            uint32_t pad;
+            uint64_t data;
+        } chunk = { XC_SAVE_ID_PAGE_INDEX, 0, 0 };
+
+        /* The position is filled in once the table has been written. */
+        index_field = stream_offset(last_iter, ob, io_fd);
+        if ( index_field == (off_t)-1 ||
+             wrexact(io_fd, &chunk, sizeof(chunk)) )
+        {
+            PERROR("Error when writing page index position");
+            goto out;
+        }
+        index_field += offsetof(typeof(chunk), data);
+    }
     /* Now write out each data page, canonicalising page tables as we go... */
     for ( ; ; )
     {
@@ -1335,7 +1603,34 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 continue; /* bail on this batch: no valid pages */
             }
 
-            if ( wrexact(io_fd, &batch, sizeof(unsigned int)) )
+            /*
+             * Spread batches over the data streams.  A pfn is sent at most
+             * once per iteration, so tagging each stream with the
+             * iteration is enough for the receiver to discard stale
+             * copies which overtake newer ones on another stream.
+             */
+            if ( nr_data_fds )
+            {
+                batch_stream = data_stream_get(streams, nr_data_fds,
+                                               &next_stream);
+                if ( !batch_stream )
+                {
+                    PERROR("Error when writing to data stream");
+                    goto out;
+                }
+                if ( batch_stream->iter != iter )
+                {
+                    struct {
+                        int id;
+                        uint32_t iter;
+                    } chunk = { XC_SAVE_ID_ITERATION, iter };
+
+                    data_stream_append(batch_stream, &chunk, sizeof(chunk));
+                    batch_stream->iter = iter;
+                }
+            }
+
+            if ( wrbatch(&batch, sizeof(unsigned int)) )
             {
                 PERROR("Error when writing to state file (2)");
                 goto out;
@@ -1344,7 +1639,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             if ( sizeof(unsigned long) < sizeof(*pfn_type) )
                 for ( j = 0; j < batch; j++ )
                     ((unsigned long *)pfn_type)[j] = pfn_type[j];
-            if ( wrexact(io_fd, pfn_type, sizeof(unsigned long)*batch) )
+            if ( wrbatch(pfn_type, sizeof(unsigned long)*batch) )
             {
                 PERROR("Error when writing to state file (3)");
                 goto out;
@@ -1353,6 +1648,14 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 while ( --j >= 0 )
                     pfn_type[j] = ((unsigned long *)pfn_type)[j];
 
+            /* page data for this batch follows the pfn array directly */
+            if ( page_index &&
+                 (page_offset = stream_offset(last_iter, ob, io_fd)) == (off_t)-1 )
+            {
+                PERROR("Error when finding page data offset");
+                goto out;
+            }
+
             /* entering this loop, pfn_type is now in pfns (Not mfns) */
             run = 0;
             for ( j = 0; j < batch; j++ )
@@ -1369,9 +1672,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                        run of pages we may have previously acumulated */
                     if ( !compressing && run )
                     {
-                        if ( wruncached(io_fd, live,
-                                       (char*)region_base+(PAGE_SIZE*(j-run)), 
-                                       PAGE_SIZE*run) != PAGE_SIZE*run )
+                        if ( wrbatchuncached((char*)region_base+(PAGE_SIZE*(j-run)),
+                                             PAGE_SIZE*run) != PAGE_SIZE*run )
                         {
                             PERROR("Error when writing to state file (4a)"
                                   " (errno %d)", errno);
@@ -1390,6 +1692,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
                     continue;
 
+                if ( page_index )
+                {
+                    page_index[pfn] = page_offset - index_base;
+                    page_offset += PAGE_SIZE;
+                }
+
                 pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
 
                 if ( (pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
@@ -1439,8 +1747,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                             }
                         }
                     }
-                    else if ( wruncached(io_fd, live, page,
-                                         PAGE_SIZE) != PAGE_SIZE )
+                    else if ( wrbatchuncached(page, PAGE_SIZE) != PAGE_SIZE )
                     {
                         PERROR("Error when writing to state file (4b)"
                               " (errno %d)", errno);
@@ -1484,9 +1791,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             if ( run )
             {
                 /* write out the last accumulated run of pages */
-                if ( wruncached(io_fd, live,
-                               (char*)region_base+(PAGE_SIZE*(j-run)), 
-                               PAGE_SIZE*run) != PAGE_SIZE*run )
+                if ( wrbatchuncached((char*)region_base+(PAGE_SIZE*(j-run)),
+                                     PAGE_SIZE*run) != PAGE_SIZE*run )
                 {
                     PERROR("Error when writing to state file (4c)"
                           " (errno %d)", errno);
@@ -1498,6 +1804,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
             munmap(region_base, batch*PAGE_SIZE);
 
+            if ( batch_stream )
+            {
+                data_stream_submit(batch_stream);
+                batch_stream = NULL;
+            }
+
         } /* end of this while loop for this iteration */
 
       skip:
@@ -1585,6 +1897,32 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     DPRINTF("All memory is saved\n");
 
+    /* Terminate the data streams; the rest goes down the control stream. */
+    if ( streams )
+    {
+        int err = 0;
+
+        for ( i = 0; i < nr_data_fds && !err; i++ )
+        {
+            j = 0;
+            err = data_stream_wait(&streams[i]);
+            if ( !err )
+            {
+                data_stream_append(&streams[i], &j, sizeof(j));
+                data_stream_submit(&streams[i]);
+            }
+        }
+        frc = data_streams_stop(streams, nr_data_fds);
+        free(streams);
+        streams = NULL;
+        if ( err || frc )
+        {
+            errno = err ?: frc;
+            PERROR("Error when writing to data stream");
+            goto out;
+        }
+    }
+
     /* After last_iter, buffer the rest of pagebuf & tailbuf data into a
      * separate output buffer and flush it after the compressed page chunks.
      */
@@ -1813,6 +2151,48 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         }
     }
 
+    if ( page_index )
+    {
+        struct xc_save_page_index_entry entries[256];
+        uint32_t nr_entries = 0;
+        unsigned long pfn;
+        off_t pos;
+
+        for ( pfn = 0; pfn < dinfo->p2m_size; pfn++ )
+            if ( page_index[pfn] )
+                nr_entries++;
+
+        i = XC_SAVE_ID_PAGE_INDEX_TABLE;
+        if ( (pos = stream_offset(last_iter, ob, io_fd)) == (off_t)-1 ||
+             wrexact(io_fd, &i, sizeof(int)) ||
+             wrexact(io_fd, &nr_entries, sizeof(nr_entries)) )
+        {
+            PERROR("Error when writing page index chunk");
+            goto out;
+        }
+        index_table = pos - index_base;
+
+        for ( pfn = 0, j = 0; pfn < dinfo->p2m_size; pfn++ )
+        {
+            if ( !page_index[pfn] )
+                continue;
+
+            entries[j].pfn = pfn;
+            entries[j].offset = page_index[pfn];
+            j++;
+            nr_entries--;
+            if ( j == ARRAY_SIZE(entries) || nr_entries == 0 )
+            {
+                if ( wrexact(io_fd, entries, j * sizeof(entries[0])) )
+                {
+                    PERROR("Error when writing page index");
+                    goto out;
+                }
+                j = 0;
+            }
+        }
+    }
+
     /* Zero terminate */
     i = 0;
     if ( wrexact(io_fd, &i, sizeof(int)) )
@@ -2119,6 +2499,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             rc = errno;
     }
 
+    /* Point the restorer at the page index, now that it is complete.
+     * Without this the image is still good, just restored in full. */
+    if ( !rc && index_table &&
+         pwrite(io_fd, &index_table, sizeof(index_table),
+                index_field) != sizeof(index_table) )
+        PERROR("Error when writing page index position");
+
     discard_file_cache(xch, io_fd, 1 /* flush */);
 
     /* Enable compression now, finally */
@@ -2182,6 +2569,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     free(pfn_type);
     free(pfn_batch);
     free(pfn_err);
+    free(page_index);
+    if ( streams )
+    {
+        data_streams_stop(streams, nr_data_fds);
+        free(streams);
+    }
     free(to_fix);
     free(hvm_buf);
     outbuf_free(&ob_pagebuf);
@@ -2193,6 +2586,16 @@ exit:
     return !!errno;
 }
 
+int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
+                   uint32_t max_factor, uint32_t flags,
+                   struct save_callbacks* callbacks, int hvm,
+                   unsigned long vm_generationid_addr)
+{
+    return xc_domain_save_streams(xch, io_fd, NULL, 0, dom, max_iters,
+                                  max_factor, flags, callbacks, hvm,
+                                  vm_generationid_addr);
+}
+
 /*
  * Local variables:
  * mode: C
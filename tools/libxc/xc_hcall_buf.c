@@ -29,45 +29,71 @@ xc_hypercall_buffer_t XC__HYPERCALL_BUFFER_NAME(HYPERCALL_BUFFER_NULL) = {
     HYPERCALL_BUFFER_INIT_NO_BOUNCE
 };
 
-pthread_mutex_t hypercall_buffer_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 static void hypercall_buffer_cache_lock(xc_interface *xch)
 {
     if ( xch->flags & XC_OPENFLAG_NON_REENTRANT )
         return;
-    pthread_mutex_lock(&hypercall_buffer_cache_mutex);
+    pthread_mutex_lock(&xch->hypercall_buffer_cache_mutex);
 }
 
 static void hypercall_buffer_cache_unlock(xc_interface *xch)
 {
     if ( xch->flags & XC_OPENFLAG_NON_REENTRANT )
         return;
-    pthread_mutex_unlock(&hypercall_buffer_cache_mutex);
+    pthread_mutex_unlock(&xch->hypercall_buffer_cache_mutex);
+}
+
+/*
+ * Returns the cache size class for a buffer of nr_pages, or -1 if it is
+ * too big to be cached.  Buffers are always allocated with the full size
+ * of their class, see hypercall_buffer_class_pages().
+ */
+static int hypercall_buffer_class(int nr_pages)
+{
+    int class = 0;
+
+    if ( nr_pages > HYPERCALL_BUFFER_CACHE_MAX_PAGES )
+        return -1;
+
+    while ( (1 << class) < nr_pages )
+        class++;
+
+    return class;
+}
+
+static int hypercall_buffer_class_pages(int nr_pages)
+{
+    int class = hypercall_buffer_class(nr_pages);
+
+    return class < 0 ? nr_pages : 1 << class;
 }
 
 static void *hypercall_buffer_cache_alloc(xc_interface *xch, int nr_pages)
 {
+    xc_hypercall_buffer_stats_t *stats = &xch->hypercall_buffer_stats;
+    int class = hypercall_buffer_class(nr_pages);
     void *p = NULL;
 
     hypercall_buffer_cache_lock(xch);
 
-    xch->hypercall_buffer_total_allocations++;
-    xch->hypercall_buffer_current_allocations++;
-    if ( xch->hypercall_buffer_current_allocations > xch->hypercall_buffer_maximum_allocations )
-        xch->hypercall_buffer_maximum_allocations = xch->hypercall_buffer_current_allocations;
+    stats->total_allocations++;
+    stats->current_allocations++;
+    if ( stats->current_allocations > stats->maximum_allocations )
+        stats->maximum_allocations = stats->current_allocations;
 
-    if ( nr_pages > 1 )
+    if ( class < 0 )
     {
-        xch->hypercall_buffer_cache_toobig++;
+        stats->cache_toobig++;
     }
-    else if ( xch->hypercall_buffer_cache_nr > 0 )
+    else if ( xch->hypercall_buffer_cache_nr[class] > 0 )
     {
-        p = xch->hypercall_buffer_cache[--xch->hypercall_buffer_cache_nr];
-        xch->hypercall_buffer_cache_hits++;
+        p = xch->hypercall_buffer_cache[class][--xch->hypercall_buffer_cache_nr[class]];
+        stats->cache_current_pages -= 1 << class;
+        stats->cache_hits++;
     }
     else
     {
-        xch->hypercall_buffer_cache_misses++;
+        stats->cache_misses++;
     }
 
     hypercall_buffer_cache_unlock(xch);
@@ -77,16 +103,20 @@ static void *hypercall_buffer_cache_alloc(xc_interface *xch, int nr_pages)
 
 static int hypercall_buffer_cache_free(xc_interface *xch, void *p, int nr_pages)
 {
+    xc_hypercall_buffer_stats_t *stats = &xch->hypercall_buffer_stats;
+    int class = hypercall_buffer_class(nr_pages);
     int rc = 0;
 
     hypercall_buffer_cache_lock(xch);
 
-    xch->hypercall_buffer_total_releases++;
-    xch->hypercall_buffer_current_allocations--;
+    stats->total_releases++;
+    stats->current_allocations--;
 
-    if ( nr_pages == 1 && xch->hypercall_buffer_cache_nr < HYPERCALL_BUFFER_CACHE_SIZE )
+    if ( class >= 0 &&
+         xch->hypercall_buffer_cache_nr[class] < HYPERCALL_BUFFER_CACHE_SIZE )
     {
-        xch->hypercall_buffer_cache[xch->hypercall_buffer_cache_nr++] = p;
+        xch->hypercall_buffer_cache[class][xch->hypercall_buffer_cache_nr[class]++] = p;
+        stats->cache_current_pages += 1 << class;
         rc = 1;
     }
 
@@ -95,30 +125,43 @@ static int hypercall_buffer_cache_free(xc_interface *xch, void *p, int nr_pages)
     return rc;
 }
 
+int xc_hypercall_buffer_get_stats(xc_interface *xch,
+                                  xc_hypercall_buffer_stats_t *stats)
+{
+    hypercall_buffer_cache_lock(xch);
+    *stats = xch->hypercall_buffer_stats;
+    hypercall_buffer_cache_unlock(xch);
+
+    return 0;
+}
+
 void xc__hypercall_buffer_cache_release(xc_interface *xch)
 {
+    xc_hypercall_buffer_stats_t *stats = &xch->hypercall_buffer_stats;
     void *p;
+    int class;
 
     hypercall_buffer_cache_lock(xch);
 
-    DBGPRINTF("hypercall buffer: total allocations:%d total releases:%d",
-              xch->hypercall_buffer_total_allocations,
-              xch->hypercall_buffer_total_releases);
-    DBGPRINTF("hypercall buffer: current allocations:%d maximum allocations:%d",
-              xch->hypercall_buffer_current_allocations,
-              xch->hypercall_buffer_maximum_allocations);
-    DBGPRINTF("hypercall buffer: cache current size:%d",
-              xch->hypercall_buffer_cache_nr);
-    DBGPRINTF("hypercall buffer: cache hits:%d misses:%d toobig:%d",
-              xch->hypercall_buffer_cache_hits,
-              xch->hypercall_buffer_cache_misses,
-              xch->hypercall_buffer_cache_toobig);
-
-    while ( xch->hypercall_buffer_cache_nr > 0 )
+    DBGPRINTF("hypercall buffer: total allocations:%lu total releases:%lu",
+              stats->total_allocations, stats->total_releases);
+    DBGPRINTF("hypercall buffer: current allocations:%lu maximum allocations:%lu",
+              stats->current_allocations, stats->maximum_allocations);
+    DBGPRINTF("hypercall buffer: cache current size:%lu pages",
+              stats->cache_current_pages);
+    DBGPRINTF("hypercall buffer: cache hits:%lu misses:%lu toobig:%lu",
+              stats->cache_hits, stats->cache_misses, stats->cache_toobig);
+
+    for ( class = 0; class < HYPERCALL_BUFFER_CACHE_CLASSES; class++ )
     {
-        p = xch->hypercall_buffer_cache[--xch->hypercall_buffer_cache_nr];
-        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle, p, 1);
+        while ( xch->hypercall_buffer_cache_nr[class] > 0 )
+        {
+            p = xch->hypercall_buffer_cache[class][--xch->hypercall_buffer_cache_nr[class]];
+            xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle,
+                                                      p, 1 << class);
+        }
     }
+    stats->cache_current_pages = 0;
 
     hypercall_buffer_cache_unlock(xch);
 }
@@ -128,7 +171,8 @@ void *xc__hypercall_buffer_alloc_pages(xc_interface *xch, xc_hypercall_buffer_t
     void *p = hypercall_buffer_cache_alloc(xch, nr_pages);
 
     if ( !p )
-        p = xch->ops->u.privcmd.alloc_hypercall_buffer(xch, xch->ops_handle, nr_pages);
+        p = xch->ops->u.privcmd.alloc_hypercall_buffer(xch, xch->ops_handle,
+                                                       hypercall_buffer_class_pages(nr_pages));
 
     if (!p)
         return NULL;
@@ -146,7 +190,8 @@ void xc__hypercall_buffer_free_pages(xc_interface *xch, xc_hypercall_buffer_t *b
         return;
 
     if ( !hypercall_buffer_cache_free(xch, b->hbuf, nr_pages) )
-        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle, b->hbuf, nr_pages);
+        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle, b->hbuf,
+                                                  hypercall_buffer_class_pages(nr_pages));
 }
 
 struct allocation_header {
@@ -432,6 +432,10 @@ void discard_file_cache(xc_interface *xch, int fd, int flush)
         fsync(fd);
 }
 
+void prefetch_file_cache(xc_interface *xch, int fd, off_t len)
+{
+}
+
 void *xc_memalign(xc_interface *xch, size_t alignment, size_t size)
 {
     return memalign(alignment, size);
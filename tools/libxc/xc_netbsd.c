@@ -385,6 +385,21 @@ void discard_file_cache(xc_interface *xch, int fd, int flush)
     errno = saved_errno;
 }
 
+/* Start reading the next len bytes of a file into the page cache */
+void prefetch_file_cache(xc_interface *xch, int fd, off_t len)
+{
+    off_t cur;
+    int saved_errno = errno;
+
+    if ( (cur = lseek(fd, 0, SEEK_CUR)) == (off_t)-1 )
+        goto out;
+
+    posix_fadvise(fd, cur, len, POSIX_FADV_WILLNEED);
+
+ out:
+    errno = saved_errno;
+}
+
 void *xc_memalign(xc_interface *xch, size_t alignment, size_t size)
 {
     return valloc(size);
@@ -21,6 +21,17 @@
 #include <xenctrl.h>
 #include <xenguest.h>
 
+int xc_domain_save_streams(xc_interface *xch, int io_fd,
+                           const int *data_fds, unsigned int nr_data_fds,
+                           uint32_t dom, uint32_t max_iters,
+                           uint32_t max_factor, uint32_t flags,
+                           struct save_callbacks* callbacks, int hvm,
+                           unsigned long vm_generationid_addr)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
                    uint32_t max_factor, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
@@ -43,6 +54,23 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     return -1;
 }
 
+int xc_domain_restore_streams(xc_interface *xch, int io_fd,
+                              const int *data_fds, unsigned int nr_data_fds,
+                              uint32_t dom, unsigned int store_evtchn,
+                              unsigned long *store_mfn, domid_t store_domid,
+                              unsigned int console_evtchn,
+                              unsigned long *console_mfn,
+                              domid_t console_domid, unsigned int hvm,
+                              unsigned int pae, int superpages,
+                              int no_incr_generationid,
+                              int checkpointed_stream,
+                              unsigned long *vm_generationid_addr,
+                              struct restore_callbacks *callbacks)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 /*
  * Local variables:
  * mode: C
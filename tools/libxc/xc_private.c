@@ -138,15 +138,10 @@ static struct xc_interface_core *xc_interface_open_common(xentoollog_logger *log
     xch->error_handler   = logger;           xch->error_handler_tofree   = 0;
     xch->dombuild_logger = dombuild_logger;  xch->dombuild_logger_tofree = 0;
 
-    xch->hypercall_buffer_cache_nr = 0;
-
-    xch->hypercall_buffer_total_allocations = 0;
-    xch->hypercall_buffer_total_releases = 0;
-    xch->hypercall_buffer_current_allocations = 0;
-    xch->hypercall_buffer_maximum_allocations = 0;
-    xch->hypercall_buffer_cache_hits = 0;
-    xch->hypercall_buffer_cache_misses = 0;
-    xch->hypercall_buffer_cache_toobig = 0;
+    memset(xch->hypercall_buffer_cache_nr, 0,
+           sizeof(xch->hypercall_buffer_cache_nr));
+    memset(&xch->hypercall_buffer_stats, 0,
+           sizeof(xch->hypercall_buffer_stats));
 
     xch->ops_handle = XC_OSDEP_OPEN_ERROR;
     xch->ops = NULL;
@@ -166,6 +161,7 @@ static struct xc_interface_core *xc_interface_open_common(xentoollog_logger *log
         goto err;
     }
     *xch = xch_buf;
+    pthread_mutex_init(&xch->hypercall_buffer_cache_mutex, NULL);
 
     if (!(open_flags & XC_OPENFLAG_DUMMY)) {
         if ( xc_osdep_get_info(xch, &xch->osdep) < 0 )
@@ -190,7 +186,10 @@ err_put_iface:
     xc_osdep_put(&xch->osdep);
  err:
     xtl_logger_destroy(xch->error_handler_tofree);
-    if (xch != &xch_buf) free(xch);
+    if (xch != &xch_buf) {
+        pthread_mutex_destroy(&xch->hypercall_buffer_cache_mutex);
+        free(xch);
+    }
     return NULL;
 }
 
@@ -205,6 +204,7 @@ static int xc_interface_close_common(xc_interface *xch)
     if (rc) PERROR("Could not close hypervisor interface");
 
     xc__hypercall_buffer_cache_release(xch);
+    pthread_mutex_destroy(&xch->hypercall_buffer_cache_mutex);
 
     xtl_logger_destroy(xch->dombuild_logger_tofree);
     xtl_logger_destroy(xch->error_handler_tofree);
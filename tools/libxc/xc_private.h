@@ -28,6 +28,7 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
 
 #include "xenctrl.h"
 #include "xenctrlosdep.h"
@@ -83,25 +84,26 @@ struct xc_interface_core {
     const char *currently_progress_reporting;
 
     /*
-     * A simple cache of unused, single page, hypercall buffers
+     * A cache of unused hypercall buffers, bucketed by size class.
+     * Class n holds buffers of (1 << n) pages; requests of up to
+     * HYPERCALL_BUFFER_CACHE_MAX_PAGES pages are rounded up to the
+     * next class so that they can be recycled rather than mapped and
+     * locked afresh on every call.
      *
-     * Protected by a global lock.
+     * Protected by hypercall_buffer_cache_mutex.
      */
 #define HYPERCALL_BUFFER_CACHE_SIZE 4
-    int hypercall_buffer_cache_nr;
-    void *hypercall_buffer_cache[HYPERCALL_BUFFER_CACHE_SIZE];
+#define HYPERCALL_BUFFER_CACHE_CLASSES 5
+#define HYPERCALL_BUFFER_CACHE_MAX_PAGES (1 << (HYPERCALL_BUFFER_CACHE_CLASSES - 1))
+    pthread_mutex_t hypercall_buffer_cache_mutex;
+    int hypercall_buffer_cache_nr[HYPERCALL_BUFFER_CACHE_CLASSES];
+    void *hypercall_buffer_cache[HYPERCALL_BUFFER_CACHE_CLASSES][HYPERCALL_BUFFER_CACHE_SIZE];
 
     /*
-     * Hypercall buffer statistics. All protected by the global
-     * hypercall_buffer_cache lock.
+     * Hypercall buffer statistics. All protected by
+     * hypercall_buffer_cache_mutex.
      */
-    int hypercall_buffer_total_allocations;
-    int hypercall_buffer_total_releases;
-    int hypercall_buffer_current_allocations;
-    int hypercall_buffer_maximum_allocations;
-    int hypercall_buffer_cache_hits;
-    int hypercall_buffer_cache_misses;
-    int hypercall_buffer_cache_toobig;
+    xc_hypercall_buffer_stats_t hypercall_buffer_stats;
 
     /* Low lovel OS interface */
     xc_osdep_info_t  osdep;
@@ -325,6 +327,9 @@ void bitmap_byte_to_64(uint64_t *lp, const uint8_t *bp, int nbits);
 /* Optionally flush file to disk and discard page cache */
 void discard_file_cache(xc_interface *xch, int fd, int flush);
 
+/* Start reading the next len bytes of a file into the page cache */
+void prefetch_file_cache(xc_interface *xch, int fd, off_t len);
+
 int xc_domain_cacheflush(xc_interface *xch, uint32_t domid,
 			 xen_pfn_t start_pfn, xen_pfn_t nr_pfns);
 
@@ -366,6 +366,26 @@ void *xc__hypercall_buffer_array_get(xc_interface *xch, xc_hypercall_buffer_arra
     xc__hypercall_buffer_array_get(_xch, _array, _index, HYPERCALL_BUFFER(_name))
 void xc_hypercall_buffer_array_destroy(xc_interface *xc, xc_hypercall_buffer_array_t *array);
 
+/*
+ * Hypercall buffer allocation statistics for an interface handle.
+ *
+ * Buffers of up to a few pages are recycled through a per-handle cache;
+ * larger ones (toobig) are always mapped and locked afresh.
+ */
+typedef struct xc_hypercall_buffer_stats {
+    unsigned long total_allocations;
+    unsigned long total_releases;
+    unsigned long current_allocations;
+    unsigned long maximum_allocations;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long cache_toobig;
+    unsigned long cache_current_pages; /* pages currently held in the cache */
+} xc_hypercall_buffer_stats_t;
+
+int xc_hypercall_buffer_get_stats(xc_interface *xch,
+                                  xc_hypercall_buffer_stats_t *stats);
+
 /*
  * CPUMAP handling
  */
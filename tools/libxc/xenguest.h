@@ -28,6 +28,7 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+#define XCFLAGS_PAGE_INDEX (1 << 5) /* index the pages, see xg_save_restore.h */
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -89,6 +90,22 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                    struct save_callbacks* callbacks, int hvm,
                    unsigned long vm_generationid_addr);
 
+/**
+ * As xc_domain_save(), but spreads page data over @nr_data_fds additional
+ * streams (e.g. separate TCP connections) to make use of more than one
+ * sender and receiver thread or network path.  All other records still
+ * go to @io_fd.  The receiver must be given the same number of data
+ * streams via xc_domain_restore_streams().
+ *
+ * Not supported for checkpointed (Remus) or debug saves.
+ */
+int xc_domain_save_streams(xc_interface *xch, int io_fd,
+                           const int *data_fds, unsigned int nr_data_fds,
+                           uint32_t dom, uint32_t max_iters,
+                           uint32_t max_factor, uint32_t flags /* XCFLAGS_xxx */,
+                           struct save_callbacks* callbacks, int hvm,
+                           unsigned long vm_generationid_addr);
+
 
 /* callbacks provided by xc_domain_restore */
 struct restore_callbacks {
@@ -128,6 +145,23 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       int no_incr_generationid, int checkpointed_stream,
                       unsigned long *vm_generationid_addr,
                       struct restore_callbacks *callbacks);
+
+/**
+ * As xc_domain_restore(), receiving page data from @nr_data_fds streams
+ * in addition to @io_fd.  See xc_domain_save_streams().
+ */
+int xc_domain_restore_streams(xc_interface *xch, int io_fd,
+                              const int *data_fds, unsigned int nr_data_fds,
+                              uint32_t dom, unsigned int store_evtchn,
+                              unsigned long *store_mfn, domid_t store_domid,
+                              unsigned int console_evtchn,
+                              unsigned long *console_mfn,
+                              domid_t console_domid, unsigned int hvm,
+                              unsigned int pae, int superpages,
+                              int no_incr_generationid,
+                              int checkpointed_stream,
+                              unsigned long *vm_generationid_addr,
+                              struct restore_callbacks *callbacks);
 /**
  * xc_domain_restore writes a file to disk that contains the device
  * model saved state.
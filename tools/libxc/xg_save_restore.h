@@ -87,6 +87,39 @@
  *
  * If chunk type is 0 then body phase is complete.
  *
+ * With xc_domain_save_streams(), page data chunks are instead spread over
+ * a number of additional data streams, each made up of:
+ *
+ *     XC_SAVE_ID_ITERATION : uint32_t iteration the following batches
+ *                            belong to
+ *     +ve page data chunks, as above
+ *     0                    : end of this data stream
+ *
+ * All other chunks, including the terminating 0, stay on the main stream.
+ * The receiver reads the data streams to completion first.  As batches
+ * from different streams may arrive in any order, a page is only
+ * applied if it is from the same or a later iteration than the copy
+ * already received.
+ *
+ * When saving to a seekable file with XCFLAGS_PAGE_INDEX (and neither
+ * checkpoints nor data streams), the page data chunks are preceded by
+ *
+ *     XC_SAVE_ID_PAGE_INDEX       : uint32_t padding, then uint64_t
+ *                                   position of the page index table
+ *
+ * and the last chunk before the terminating 0 is that table:
+ *
+ *     XC_SAVE_ID_PAGE_INDEX_TABLE : uint32_t number of entries, then
+ *                                   struct xc_save_page_index_entry[]
+ *
+ * Positions are byte offsets from the start of this stream (the
+ * p2m_size field).  The table lists, for every page with data in the
+ * stream, where its last copy is.  The position in XC_SAVE_ID_PAGE_INDEX
+ * is filled in once the stream has been written, so it is 0 in an
+ * incomplete image.  When it is not 0 and the stream is seekable, the
+ * receiver seeks over the copies of each page which a later one
+ * supersedes, instead of reading them.
+ *
  *
  * BODY PHASE - Format B (for Remus with compression)
  * ----------
@@ -262,6 +295,14 @@
 /* These are a pair; it is an error for one to exist without the other */
 #define XC_SAVE_ID_HVM_IOREQ_SERVER_PFN -19
 #define XC_SAVE_ID_HVM_NR_IOREQ_SERVER_PAGES -20
+#define XC_SAVE_ID_ITERATION          -21 /* data stream iteration tag */
+#define XC_SAVE_ID_PAGE_INDEX         -22 /* position of the page index */
+#define XC_SAVE_ID_PAGE_INDEX_TABLE   -23 /* pfn -> last copy position */
+
+struct xc_save_page_index_entry {
+    uint64_t pfn;
+    uint64_t offset;
+};
 
 /*
 ** We process save/restore/migrate in batches of pages; the below
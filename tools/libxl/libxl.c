@@ -54,7 +54,9 @@ int libxl_ctx_alloc(libxl_ctx **pctx, int version,
     LIBXL_LIST_INIT(&ctx->pollers_idle);
 
     LIBXL_LIST_INIT(&ctx->efds);
-    LIBXL_TAILQ_INIT(&ctx->etimes);
+    ctx->etimes = 0;
+    ctx->etimes_used = ctx->etimes_allocd = 0;
+    ctx->epoll_fd = -1;
 
     ctx->watch_slots = 0;
     LIBXL_SLIST_INIT(&ctx->watch_freeslots);
@@ -73,6 +75,17 @@ int libxl_ctx_alloc(libxl_ctx **pctx, int version,
     ctx->sigchld_selfpipe[0] = -1;
     libxl__ev_fd_init(&ctx->sigchld_selfpipe_efd);
 
+    ctx->hotplug_running = 0;
+    ctx->hotplug_max = LIBXL_HOTPLUG_CONCURRENCY;
+    if (getenv("LIBXL_HOTPLUG_CONCURRENCY"))
+        ctx->hotplug_max = atoi(getenv("LIBXL_HOTPLUG_CONCURRENCY"));
+    LIBXL_TAILQ_INIT(&ctx->hotplug_waiting);
+
+    LIBXL_TAILQ_INIT(&ctx->ao_traces);
+    ctx->ao_traces_count = 0;
+
+    ctx->devindex = NULL;
+
     /* The mutex is special because we can't idempotently destroy it */
 
     if (libxl__init_recursive_mutex(ctx, &ctx->lock) < 0) {
@@ -159,11 +172,13 @@ int libxl_ctx_free(libxl_ctx *ctx)
     /* Now there should be no more events requested from the application: */
 
     assert(LIBXL_LIST_EMPTY(&ctx->efds));
-    assert(LIBXL_TAILQ_EMPTY(&ctx->etimes));
+    assert(!ctx->etimes_used);
     assert(LIBXL_LIST_EMPTY(&ctx->evtchns_waiting));
+    assert(LIBXL_TAILQ_EMPTY(&ctx->hotplug_waiting));
 
     if (ctx->xch) xc_interface_close(ctx->xch);
     libxl_version_info_dispose(&ctx->version_info);
+    libxl__devindex_free(ctx);
     if (ctx->xsh) xs_daemon_close(ctx->xsh);
     if (ctx->xce) xc_evtchn_close(ctx->xce);
 
@@ -176,6 +191,10 @@ int libxl_ctx_free(libxl_ctx *ctx)
     }
 
     free(ctx->watch_slots);
+    free(ctx->etimes);
+    libxl__ao_traces_free(ctx);
+    if (ctx->epoll_fd >= 0) close(ctx->epoll_fd);
+    free(ctx->epoll_efds);
 
     discard_events(&ctx->occurred);
 
@@ -784,11 +803,24 @@ static void domain_suspend_cb(libxl__egc *egc,
 
 }
 
-int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
-                         const libxl_asyncop_how *ao_how)
+static int do_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
+                             const int *data_fds, int nr_data_fds,
+                             int flags, const libxl_asyncop_how *ao_how)
 {
     AO_CREATE(ctx, domid, ao_how);
-    int rc;
+    int i, rc;
+
+    if (nr_data_fds < 0 || (nr_data_fds && (flags & LIBXL_SUSPEND_DEBUG))) {
+        rc = ERROR_INVAL;
+        goto out_err;
+    }
+    for (i = 0; i < nr_data_fds; i++) {
+        if (data_fds[i] <= 2) {
+            LOG(ERROR, "data stream fd %d may not be 0, 1 or 2", data_fds[i]);
+            rc = ERROR_INVAL;
+            goto out_err;
+        }
+    }
 
     libxl_domain_type type = libxl__domain_type(gc, domid);
     if (type == LIBXL_DOMAIN_TYPE_INVALID) {
@@ -804,9 +836,17 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
 
     dss->domid = domid;
     dss->fd = fd;
+    if (nr_data_fds) {
+        int *fds;
+        GCNEW_ARRAY(fds, nr_data_fds);
+        memcpy(fds, data_fds, sizeof(*fds) * nr_data_fds);
+        dss->data_fds = fds;
+        dss->nr_data_fds = nr_data_fds;
+    }
     dss->type = type;
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
+    dss->page_index = flags & LIBXL_SUSPEND_PAGE_INDEX;
 
     libxl__domain_suspend(egc, dss);
     return AO_INPROGRESS;
@@ -815,6 +855,20 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     return AO_ABORT(rc);
 }
 
+int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
+                         const libxl_asyncop_how *ao_how)
+{
+    return do_domain_suspend(ctx, domid, fd, NULL, 0, flags, ao_how);
+}
+
+int libxl_domain_suspend_streams(libxl_ctx *ctx, uint32_t domid, int fd,
+                                 const int *data_fds, int nr_data_fds,
+                                 int flags, const libxl_asyncop_how *ao_how)
+{
+    return do_domain_suspend(ctx, domid, fd, data_fds, nr_data_fds, flags,
+                             ao_how);
+}
+
 int libxl_domain_pause(libxl_ctx *ctx, uint32_t domid)
 {
     int ret;
@@ -1487,6 +1541,7 @@ static void devices_destroy_cb(libxl__egc *egc,
 
     if (!xs_rm(ctx->xsh, XBT_NULL, dom_path))
         LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR, "xs_rm failed for %s", dom_path);
+    libxl__devindex_invalidate(gc, XBT_NULL, dom_path);
 
     xs_rm(ctx->xsh, XBT_NULL, libxl__xs_libxl_path(gc, domid));
     xs_rm(ctx->xsh, XBT_NULL, libxl__sprintf(gc,
@@ -1886,15 +1941,15 @@ libxl_device_vtpm *libxl_device_vtpm_list(libxl_ctx *ctx, uint32_t domid, int *n
 
     *num = 0;
 
-    fe_path = libxl__sprintf(gc, "%s/device/vtpm", libxl__xs_get_dompath(gc, domid));
-    dir = libxl__xs_directory(gc, XBT_NULL, fe_path, &ndirs);
+    fe_path = GCSPRINTF("/local/domain/%"PRIu32"/device/vtpm", domid);
+    dir = libxl__devindex_directory(gc, fe_path, &ndirs);
     if (dir && ndirs) {
        vtpms = malloc(sizeof(*vtpms) * ndirs);
        libxl_device_vtpm* vtpm;
        libxl_device_vtpm* end = vtpms + ndirs;
        for(vtpm = vtpms; vtpm < end; ++vtpm, ++dir) {
           char* tmp;
-          const char* be_path = libxl__xs_read(gc, XBT_NULL,
+          const char* be_path = libxl__devindex_read(gc,
                 GCSPRINTF("%s/%s/backend",
                    fe_path, *dir));
 
@@ -1902,12 +1957,12 @@ libxl_device_vtpm *libxl_device_vtpm_list(libxl_ctx *ctx, uint32_t domid, int *n
 
           vtpm->devid = atoi(*dir);
 
-          tmp = libxl__xs_read(gc, XBT_NULL,
+          tmp = libxl__devindex_read(gc,
                 GCSPRINTF("%s/%s/backend-id",
                    fe_path, *dir));
           vtpm->backend_domid = atoi(tmp);
 
-          tmp = libxl__xs_read(gc, XBT_NULL, GCSPRINTF("%s/uuid", be_path));
+          tmp = libxl__devindex_read(gc, GCSPRINTF("%s/uuid", be_path));
           if (tmp) {
               if(libxl_uuid_from_string(&(vtpm->uuid), tmp)) {
                   LOG(ERROR, "%s/uuid is a malformed uuid?? (%s) Probably a bug!!\n", be_path, tmp);
@@ -2286,7 +2341,6 @@ static int libxl__device_disk_from_xs_be(libxl__gc *gc,
                                          libxl_device_disk *disk)
 {
     libxl_ctx *ctx = libxl__gc_owner(gc);
-    unsigned int len;
     char *tmp;
     int rc;
 
@@ -2299,8 +2353,8 @@ static int libxl__device_disk_from_xs_be(libxl__gc *gc,
     }
 
     /* "params" may not be present; but everything else must be. */
-    tmp = xs_read(ctx->xsh, XBT_NULL,
-                  libxl__sprintf(gc, "%s/params", be_path), &len);
+    tmp = libxl__devindex_read(NOGC,
+                               libxl__sprintf(gc, "%s/params", be_path));
     if (tmp && strchr(tmp, ':')) {
         disk->pdev_path = strdup(strchr(tmp, ':') + 1);
         free(tmp);
@@ -2309,30 +2363,30 @@ static int libxl__device_disk_from_xs_be(libxl__gc *gc,
     }
 
 
-    tmp = libxl__xs_read(gc, XBT_NULL,
-                         libxl__sprintf(gc, "%s/type", be_path));
+    tmp = libxl__devindex_read(gc,
+                               libxl__sprintf(gc, "%s/type", be_path));
     if (!tmp) {
         LOG(ERROR, "Missing xenstore node %s/type", be_path);
         goto cleanup;
     }
     libxl_string_to_backend(ctx, tmp, &(disk->backend));
 
-    disk->vdev = xs_read(ctx->xsh, XBT_NULL,
-                         libxl__sprintf(gc, "%s/dev", be_path), &len);
+    disk->vdev = libxl__devindex_read(NOGC,
+                                      libxl__sprintf(gc, "%s/dev", be_path));
     if (!disk->vdev) {
         LOG(ERROR, "Missing xenstore node %s/dev", be_path);
         goto cleanup;
     }
 
-    tmp = libxl__xs_read(gc, XBT_NULL, libxl__sprintf
-                         (gc, "%s/removable", be_path));
+    tmp = libxl__devindex_read(gc, libxl__sprintf
+                               (gc, "%s/removable", be_path));
     if (!tmp) {
         LOG(ERROR, "Missing xenstore node %s/removable", be_path);
         goto cleanup;
     }
     disk->removable = atoi(tmp);
 
-    tmp = libxl__xs_read(gc, XBT_NULL, libxl__sprintf(gc, "%s/mode", be_path));
+    tmp = libxl__devindex_read(gc, libxl__sprintf(gc, "%s/mode", be_path));
     if (!tmp) {
         LOG(ERROR, "Missing xenstore node %s/mode", be_path);
         goto cleanup;
@@ -2342,8 +2396,8 @@ static int libxl__device_disk_from_xs_be(libxl__gc *gc,
     else
         disk->readwrite = 0;
 
-    tmp = libxl__xs_read(gc, XBT_NULL,
-                         libxl__sprintf(gc, "%s/device-type", be_path));
+    tmp = libxl__devindex_read(gc,
+                               libxl__sprintf(gc, "%s/device-type", be_path));
     if (!tmp) {
         LOG(ERROR, "Missing xenstore node %s/device-type", be_path);
         goto cleanup;
@@ -2401,9 +2455,8 @@ static int libxl__append_disk_list_of_type(libxl__gc *gc,
     int rc=0;
     int initial_disks = *ndisks;
 
-    be_path = libxl__sprintf(gc, "%s/backend/%s/%d",
-                             libxl__xs_get_dompath(gc, 0), type, domid);
-    dir = libxl__xs_directory(gc, XBT_NULL, be_path, &n);
+    be_path = GCSPRINTF("/local/domain/0/backend/%s/%"PRIu32, type, domid);
+    dir = libxl__devindex_directory(gc, be_path, &n);
     if (dir && n) {
         libxl_device_disk *tmp;
         tmp = realloc(*disks, sizeof (libxl_device_disk) * (*ndisks + n));
@@ -3022,9 +3075,8 @@ static int libxl__device_nic_from_xs_be(libxl__gc *gc,
     libxl_device_nic_init(nic);
 
 #define READ_BACKEND(tgc, subpath) ({                                   \
-        rc = libxl__xs_read_checked(tgc, XBT_NULL,                      \
-                                    GCSPRINTF("%s/" subpath, be_path),  \
-                                    &tmp);                              \
+        rc = libxl__devindex_read_checked(tgc,                          \
+                GCSPRINTF("%s/" subpath, be_path), &tmp);               \
         if (rc) goto out;                                               \
         (char*)tmp;                                                     \
     });
@@ -3098,9 +3150,8 @@ static int libxl__append_nic_list_of_type(libxl__gc *gc,
     libxl_device_nic *pnic = NULL, *pnic_end = NULL;
     int rc;
 
-    be_path = libxl__sprintf(gc, "%s/backend/%s/%d",
-                             libxl__xs_get_dompath(gc, 0), type, domid);
-    dir = libxl__xs_directory(gc, XBT_NULL, be_path, &n);
+    be_path = GCSPRINTF("/local/domain/0/backend/%s/%"PRIu32, type, domid);
+    dir = libxl__devindex_directory(gc, be_path, &n);
     if (dir && n) {
         libxl_device_nic *tmp;
         tmp = realloc(*nics, sizeof (libxl_device_nic) * (*nnics + n));
@@ -4571,53 +4622,148 @@ const libxl_version_info* libxl_get_version_info(libxl_ctx *ctx)
     return info;
 }
 
+/* Gets the vcpus of domid, which are 0..max_vcpu_id.  Returns
+ * ERROR_INVAL if the domain has gone away. */
+static int list_vcpus(libxl__gc *gc, uint32_t domid, uint32_t max_vcpu_id,
+                      libxl_vcpuinfo **vcpus_r, int *nr_vcpus_r)
+{
+    libxl_vcpuinfo *vcpus, *v;
+    xc_vcpuinfo_t vcpuinfo;
+    int i, nr = max_vcpu_id + 1, rc;
+
+    vcpus = libxl__calloc(NOGC, nr, sizeof(*vcpus));
+    for (i = 0; i < nr; i++)
+        libxl_vcpuinfo_init(&vcpus[i]);
+
+    for (i = 0; i < nr; i++) {
+        v = &vcpus[i];
+        rc = libxl_cpu_bitmap_alloc(CTX, &v->cpumap, 0);
+        if (rc) goto err;
+        if (xc_vcpu_getinfo(CTX->xch, domid, i, &vcpuinfo) == -1 ||
+            xc_vcpu_getaffinity(CTX->xch, domid, i, v->cpumap.map) == -1) {
+            if (errno == ESRCH) {
+                rc = ERROR_INVAL;
+                goto err;
+            }
+            LOGE(ERROR, "getting info for vcpu %d of domain %"PRIu32,
+                 i, domid);
+            rc = ERROR_FAIL;
+            goto err;
+        }
+        v->vcpuid = i;
+        v->cpu = vcpuinfo.cpu;
+        v->online = !!vcpuinfo.online;
+        v->blocked = !!vcpuinfo.blocked;
+        v->running = !!vcpuinfo.running;
+        v->vcpu_time = vcpuinfo.cpu_time;
+    }
+
+    *vcpus_r = vcpus;
+    *nr_vcpus_r = nr;
+    return 0;
+
+err:
+    libxl_vcpuinfo_list_free(vcpus, nr);
+    return rc;
+}
+
 libxl_vcpuinfo *libxl_list_vcpu(libxl_ctx *ctx, uint32_t domid,
                                        int *nr_vcpus_out, int *nr_cpus_out)
 {
     GC_INIT(ctx);
-    libxl_vcpuinfo *ptr, *ret;
+    libxl_vcpuinfo *ret = NULL;
     xc_domaininfo_t domaininfo;
-    xc_vcpuinfo_t vcpuinfo;
 
     if (xc_domain_getinfolist(ctx->xch, domid, 1, &domaininfo) != 1) {
         LOGE(ERROR, "getting infolist");
-        GC_FREE;
-        return NULL;
+        goto out;
     }
     *nr_cpus_out = libxl_get_max_cpus(ctx);
-    ret = ptr = libxl__calloc(NOGC, domaininfo.max_vcpu_id + 1,
-                              sizeof(libxl_vcpuinfo));
-
-    for (*nr_vcpus_out = 0;
-         *nr_vcpus_out <= domaininfo.max_vcpu_id;
-         ++*nr_vcpus_out, ++ptr) {
-        libxl_bitmap_init(&ptr->cpumap);
-        if (libxl_cpu_bitmap_alloc(ctx, &ptr->cpumap, 0))
-            goto err;
-        if (xc_vcpu_getinfo(ctx->xch, domid, *nr_vcpus_out, &vcpuinfo) == -1) {
-            LOGE(ERROR, "getting vcpu info");
-            goto err;
+    if (list_vcpus(gc, domid, domaininfo.max_vcpu_id, &ret, nr_vcpus_out))
+        ret = NULL;
+
+out:
+    GC_FREE;
+    return ret;
+}
+
+#define DOMAIN_INFO_BATCH_CHUNK 1024
+
+int libxl_domain_info_batch(libxl_ctx *ctx, unsigned int fields,
+                            libxl_domain_info_batch_entry **entries_r,
+                            int *nr_entries_r)
+{
+    GC_INIT(ctx);
+    libxl_domain_info_batch_entry *entries = NULL, *e;
+    xc_domaininfo_t *xcinfo = NULL;
+    int i, got, nr = 0, rc;
+    uint32_t domid = 0, target_memkb;
+    const char *dompath, *target;
+    char *endptr;
+
+    /* One sysctl for every DOMAIN_INFO_BATCH_CHUNK domains. */
+    for (;;) {
+        GCREALLOC_ARRAY(xcinfo, nr + DOMAIN_INFO_BATCH_CHUNK);
+        got = xc_domain_getinfolist(ctx->xch, domid,
+                                    DOMAIN_INFO_BATCH_CHUNK, xcinfo + nr);
+        if (got < 0) {
+            LOGE(ERROR, "getting domain info list");
+            rc = ERROR_FAIL;
+            goto out;
         }
-        if (xc_vcpu_getaffinity(ctx->xch, domid, *nr_vcpus_out,
-                                ptr->cpumap.map) == -1) {
-            LOGE(ERROR, "getting vcpu affinity");
-            goto err;
+        nr += got;
+        if (got < DOMAIN_INFO_BATCH_CHUNK)
+            break;
+        domid = xcinfo[nr - 1].domain + 1;
+    }
+
+    entries = libxl__calloc(NOGC, nr, sizeof(*entries));
+    for (i = 0; i < nr; i++)
+        libxl_domain_info_batch_entry_init(&entries[i]);
+
+    for (i = 0; i < nr; i++) {
+        e = &entries[i];
+        xcinfo2xlinfo(&xcinfo[i], &e->info);
+        domid = e->info.domid;
+        dompath = GCSPRINTF("/local/domain/%"PRIu32, domid);
+
+        /* A domain which went away after the sysctl simply keeps the
+         * defaults for what we failed to find. */
+        if (fields & LIBXL_DOMINFO_NAME)
+            e->name = libxl__xs_read(NOGC, XBT_NULL,
+                                     GCSPRINTF("%s/name", dompath));
+
+        if (fields & LIBXL_DOMINFO_MEMORY_TARGET) {
+            target = libxl__xs_read(gc, XBT_NULL,
+                                    GCSPRINTF("%s/memory/target", dompath));
+            if (target) {
+                target_memkb = strtoul(target, &endptr, 10);
+                if (!*endptr)
+                    e->target_memkb = target_memkb;
+            } else if (!domid) {
+                rc = libxl__fill_dom0_memory_info(gc, &target_memkb);
+                if (rc < 0) goto out;
+                e->target_memkb = target_memkb;
+            }
+        }
+
+        if (fields & LIBXL_DOMINFO_VCPUS) {
+            rc = list_vcpus(gc, domid, xcinfo[i].max_vcpu_id,
+                            &e->vcpus, &e->num_vcpus);
+            if (rc && rc != ERROR_INVAL) goto out;
         }
-        ptr->vcpuid = *nr_vcpus_out;
-        ptr->cpu = vcpuinfo.cpu;
-        ptr->online = !!vcpuinfo.online;
-        ptr->blocked = !!vcpuinfo.blocked;
-        ptr->running = !!vcpuinfo.running;
-        ptr->vcpu_time = vcpuinfo.cpu_time;
     }
-    GC_FREE;
-    return ret;
 
-err:
-    libxl_bitmap_dispose(&ptr->cpumap);
-    free(ret);
+    *entries_r = entries;
+    *nr_entries_r = nr;
+    entries = NULL;
+    rc = 0;
+
+out:
+    if (entries)
+        libxl_domain_info_batch_list_free(entries, nr);
     GC_FREE;
-    return NULL;
+    return rc;
 }
 
 int libxl_set_vcpuaffinity(libxl_ctx *ctx, uint32_t domid, uint32_t vcpuid,
@@ -436,6 +436,16 @@
  */
 #define LIBXL_HAVE_DOMAIN_CREATE_RESTORE_PARAMS 1
 
+/*
+ * LIBXL_HAVE_DOMAIN_SUSPEND_STREAMS 1
+ *
+ * If this is defined, libxl_domain_suspend_streams() and
+ * libxl_domain_create_restore_streams() are available.  They send and
+ * receive the domain's memory over a number of data streams (for
+ * instance separate TCP connections) in addition to the main stream.
+ */
+#define LIBXL_HAVE_DOMAIN_SUSPEND_STREAMS 1
+
 /*
  * LIBXL_HAVE_CREATEINFO_PVH
  * If this is defined, then libxl supports creation of a PVH guest.
@@ -497,6 +507,50 @@
  */
 #define LIBXL_HAVE_DEVICE_PCI_SEIZE 1
 
+/*
+ * LIBXL_HAVE_AO_TRACE
+ *
+ * If this is defined, libxl_ao_trace and libxl_ao_trace_entry are
+ * available, giving the timing of the stages of domain creation and
+ * of device addition and removal.
+ */
+#define LIBXL_HAVE_AO_TRACE 1
+
+/*
+ * LIBXL_HAVE_DEVICE_INDEX
+ *
+ * If this is defined, libxl_device_index_enable is available.
+ */
+#define LIBXL_HAVE_DEVICE_INDEX 1
+
+/*
+ * LIBXL_HAVE_JSON_WRITER
+ *
+ * If this is defined, libxl_json.h provides libxl_json_writer, which
+ * streams generated JSON to an fd, and libxl_yajl_gen_alloc_print.
+ */
+#define LIBXL_HAVE_JSON_WRITER 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_INFO_BATCH
+ *
+ * If this is defined, libxl_domain_info_batch and
+ * libxl_domain_info_batch_entry are available.
+ */
+#define LIBXL_HAVE_DOMAIN_INFO_BATCH 1
+
+/*
+ * LIBXL_HAVE_SUSPEND_PAGE_INDEX
+ *
+ * If this is defined, libxl_domain_suspend accepts the
+ * LIBXL_SUSPEND_PAGE_INDEX flag.  When saving to a seekable fd this
+ * records where the last copy of each guest page lies in the image, so
+ * that restoring it reads every page once, seeking over the copies a
+ * live save superseded.  Older versions of libxl cannot restore such an
+ * image.
+ */
+#define LIBXL_HAVE_SUSPEND_PAGE_INDEX 1
+
 /* Functions annotated with LIBXL_EXTERNAL_CALLERS_ONLY may not be
  * called from within libxl itself. Callers outside libxl, who
  * do not #include libxl_internal.h, are fine. */
@@ -709,6 +763,21 @@ int libxl_domain_create_restore(libxl_ctx *ctx, libxl_domain_config *d_config,
                                 const libxl_asyncprogress_how *aop_console_how)
                                 LIBXL_EXTERNAL_CALLERS_ONLY;
 
+/*
+ * As libxl_domain_create_restore, also reading page data from the
+ * @nr_data_fds fds in @data_fds, which must be connected in the same
+ * order to those passed to libxl_domain_suspend_streams by the sender.
+ * None of the fds may be 0, 1 or 2.
+ */
+int libxl_domain_create_restore_streams(libxl_ctx *ctx,
+                                libxl_domain_config *d_config,
+                                uint32_t *domid, int restore_fd,
+                                const int *data_fds, int nr_data_fds,
+                                const libxl_domain_restore_params *params,
+                                const libxl_asyncop_how *ao_how,
+                                const libxl_asyncprogress_how *aop_console_how)
+                                LIBXL_EXTERNAL_CALLERS_ONLY;
+
 #if defined(LIBXL_API_VERSION) && LIBXL_API_VERSION < 0x040400
 
 int static inline libxl_domain_create_restore_0x040200(
@@ -743,6 +812,20 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+#define LIBXL_SUSPEND_PAGE_INDEX 4 /* see LIBXL_HAVE_SUSPEND_PAGE_INDEX */
+
+/*
+ * As libxl_domain_suspend, but spreading the domain's memory over the
+ * @nr_data_fds fds in @data_fds as well as @fd, which are written to
+ * concurrently.  Everything but the page data still goes to @fd.  None
+ * of the data fds may be 0, 1 or 2.  Not supported with
+ * LIBXL_SUSPEND_DEBUG.
+ */
+int libxl_domain_suspend_streams(libxl_ctx *ctx, uint32_t domid, int fd,
+                                 const int *data_fds, int nr_data_fds,
+                                 int flags, /* LIBXL_SUSPEND_* */
+                                 const libxl_asyncop_how *ao_how)
+                                 LIBXL_EXTERNAL_CALLERS_ONLY;
 
 /* @param suspend_cancel [from xenctrl.h:xc_domain_resume( @param fast )]
  *   If this parameter is true, use co-operative resume. The guest
@@ -844,6 +927,27 @@ int libxl_primary_console_get_tty(libxl_ctx *ctx, uint32_t domid_vm, char **path
 int libxl_domain_info(libxl_ctx*, libxl_dominfo *info_r,
                       uint32_t domid);
 
+/*
+ * Gets the libxl_dominfo of every domain, like libxl_list_domain, and
+ * with it whichever of the following fields asks for:
+ *   LIBXL_DOMINFO_NAME           the name, as libxl_domid_to_name
+ *   LIBXL_DOMINFO_MEMORY_TARGET  the memory target, as
+ *                                libxl_get_memory_target
+ *   LIBXL_DOMINFO_VCPUS          the vcpus, as libxl_list_vcpu
+ * Much cheaper than making those calls for each domain; and each of
+ * them costs nothing unless asked for.  A domain which goes away
+ * during the call keeps the default for what could not be found.
+ * The entries must be freed with libxl_domain_info_batch_list_free.
+ */
+#define LIBXL_DOMINFO_NAME           (1u << 0)
+#define LIBXL_DOMINFO_MEMORY_TARGET  (1u << 1)
+#define LIBXL_DOMINFO_VCPUS          (1u << 2)
+int libxl_domain_info_batch(libxl_ctx *ctx, unsigned int fields,
+                            libxl_domain_info_batch_entry **entries_r,
+                            int *nr_entries_r);
+void libxl_domain_info_batch_list_free(libxl_domain_info_batch_entry *list,
+                                       int nr);
+
 /* These functions each return (on success) an array of elements,
  * and the length via the int* out parameter.  These arrays and
  * their contents come from malloc, and must be freed with the
@@ -873,6 +977,31 @@ void libxl_vcpuinfo_list_free(libxl_vcpuinfo *, int nr_vcpus);
 void libxl_device_vtpm_list_free(libxl_device_vtpm*, int nr_vtpms);
 void libxl_vtpminfo_list_free(libxl_vtpminfo *, int nr_vtpms);
 
+/*
+ * Timing trace of the most recent traced asynchronous operation on
+ * domid made through this ctx: domain creation, or adding or removing
+ * a device.  Each entry is one stage (eg "bootloader", "device model",
+ * or a hotplug script); stages may overlap.  If there is no such
+ * trace, returns 0 with *entries_r = NULL and *nr_entries_r = 0.
+ * The last few operations' traces are kept.
+ */
+int libxl_ao_trace(libxl_ctx *ctx, uint32_t domid,
+                   libxl_ao_trace_entry **entries_r, int *nr_entries_r);
+void libxl_ao_trace_list_free(libxl_ao_trace_entry *list, int nr);
+
+/*
+ * Makes the device list functions (libxl_device_{disk,nic,vtpm,
+ * usbctrl}_list and the like) on this ctx serve their xenstore reads
+ * from a cache, kept up to date by xenstore watches on a separate
+ * xenstore connection.  Worthwhile for long-running callers which
+ * list the devices of many domains repeatedly.
+ *
+ * Changes made through this ctx are visible straight away; changes
+ * made by others become visible once their watch events arrive, so
+ * a list may briefly lag behind xenstore.  Disabled by default.
+ */
+int libxl_device_index_enable(libxl_ctx *ctx, bool enable);
+
 /*
  * Devices
  * =======
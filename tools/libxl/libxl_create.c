@@ -683,8 +683,6 @@ static void domcreate_bootloader_done(libxl__egc *egc,
 static void domcreate_launch_dm(libxl__egc *egc, libxl__multidev *aodevs,
                                 int ret);
 
-static void domcreate_attach_vtpms(libxl__egc *egc, libxl__multidev *multidev,
-                                   int ret);
 static void domcreate_attach_usbs(libxl__egc *egc, libxl__multidev *multidev,
                                    int ret);
 static void domcreate_attach_pci(libxl__egc *egc, libxl__multidev *aodevs,
@@ -709,6 +707,15 @@ static void domcreate_destruction_cb(libxl__egc *egc,
                                      libxl__domain_destroy_state *dds,
                                      int rc);
 
+/* Ends the current stage of domain creation in the ao trace and
+ * starts the next one.  stage==NULL means creation is over. */
+static void domcreate_stage(libxl__domain_create_state *dcs,
+                            const char *stage)
+{
+    libxl__ao_trace_end(dcs->ao, dcs->stage);
+    dcs->stage = stage ? libxl__ao_trace_begin(dcs->ao, stage) : -1;
+}
+
 static void initiate_domain_create(libxl__egc *egc,
                                    libxl__domain_create_state *dcs)
 {
@@ -725,6 +732,9 @@ static void initiate_domain_create(libxl__egc *egc,
     memset(&dcs->build_state, 0, sizeof(dcs->build_state));
 
     domid = 0;
+    dcs->stage = -1;
+    libxl__ao_trace_domid(ao, LIBXL__AO_TRACE_NO_DOMID);
+    domcreate_stage(dcs, "setup");
 
     /* If target_memkb is smaller than max_memkb, the subsequent call
      * to libxc when building HVM domain will enable PoD mode.
@@ -758,6 +768,7 @@ static void initiate_domain_create(libxl__egc *egc,
 
     dcs->guest_domid = domid;
     dcs->dmss.dm.guest_domid = 0; /* means we haven't spawned */
+    libxl__ao_trace_domid(ao, domid);
 
     ret = libxl__domain_build_info_setdefault(gc, &d_config->b_info);
     if (ret) goto error_out;
@@ -805,6 +816,7 @@ static void initiate_domain_create(libxl__egc *egc,
         domcreate_bootloader_done(egc, &dcs->bl, 0);
     } else  {
         LOG(DEBUG, "running bootloader");
+        domcreate_stage(dcs, "bootloader");
         dcs->bl.callback = domcreate_bootloader_done;
         dcs->bl.console_available = domcreate_bootloader_console_available;
         dcs->bl.info = &d_config->b_info;
@@ -860,6 +872,8 @@ static void domcreate_bootloader_done(libxl__egc *egc,
         return;
     }
 
+    domcreate_stage(dcs, restore_fd >= 0 ? "restore" : "build");
+
     /* consume bootloader outputs. state->pv_{kernel,ramdisk} have
      * been initialised by the bootloader already.
      */
@@ -1036,9 +1050,19 @@ static void domcreate_rebuild_done(libxl__egc *egc,
 
     store_libxl_entry(gc, domid, &d_config->b_info);
 
+    /*
+     * Start every device class which does not depend on the device
+     * model together, so that their backends and hotplug scripts run
+     * concurrently (subject to ctx->hotplug_max).  HVM nics have to
+     * wait for qemu, which creates their emulated tap interfaces.
+     */
+    domcreate_stage(dcs, "devices");
     libxl__multidev_begin(ao, &dcs->multidev);
     dcs->multidev.callback = domcreate_launch_dm;
     libxl__add_disks(egc, ao, domid, d_config, &dcs->multidev);
+    libxl__add_vtpms(egc, ao, domid, d_config, &dcs->multidev);
+    if (d_config->c_info.type != LIBXL_DOMAIN_TYPE_HVM)
+        libxl__add_nics(egc, ao, domid, d_config, &dcs->multidev);
     libxl__multidev_prepared(egc, &dcs->multidev, 0);
 
     return;
@@ -1061,10 +1085,12 @@ static void domcreate_launch_dm(libxl__egc *egc, libxl__multidev *multidev,
     libxl__domain_build_state *const state = &dcs->build_state;
 
     if (ret) {
-        LOG(ERROR, "unable to add disk devices");
+        LOG(ERROR, "unable to add devices");
         goto error_out;
     }
 
+    domcreate_stage(dcs, "device model");
+
     for (i = 0; i < d_config->b_info.num_ioports; i++) {
         libxl_ioport_range *io = &d_config->b_info.ioports[i];
 
@@ -1200,21 +1226,23 @@ static void domcreate_devmodel_started(libxl__egc *egc,
     if (dcs->dmss.dm.guest_domid) {
         if (d_config->b_info.device_model_version
             == LIBXL_DEVICE_MODEL_VERSION_QEMU_XEN) {
+            domcreate_stage(dcs, "qmp");
             libxl__qmp_initializations(gc, domid, d_config);
         }
     }
 
-    /* Plug nic interfaces */
-    if (d_config->num_nics > 0) {
-        /* Attach nics */
+    /* Plug HVM nic interfaces, now that qemu is there */
+    if (d_config->c_info.type == LIBXL_DOMAIN_TYPE_HVM &&
+        d_config->num_nics > 0) {
+        domcreate_stage(dcs, "nics");
         libxl__multidev_begin(ao, &dcs->multidev);
-        dcs->multidev.callback = domcreate_attach_vtpms;
+        dcs->multidev.callback = domcreate_attach_usbs;
         libxl__add_nics(egc, ao, domid, d_config, &dcs->multidev);
         libxl__multidev_prepared(egc, &dcs->multidev, 0);
         return;
     }
 
-    domcreate_attach_vtpms(egc, &dcs->multidev, 0);
+    domcreate_attach_usbs(egc, &dcs->multidev, 0);
     return;
 
 error_out:
@@ -1222,39 +1250,6 @@ error_out:
     domcreate_complete(egc, dcs, ret);
 }
 
-static void domcreate_attach_vtpms(libxl__egc *egc,
-                                   libxl__multidev *multidev,
-                                   int ret)
-{
-   libxl__domain_create_state *dcs = CONTAINER_OF(multidev, *dcs, multidev);
-   STATE_AO_GC(dcs->ao);
-   int domid = dcs->guest_domid;
-
-   libxl_domain_config* const d_config = dcs->guest_config;
-
-   if(ret) {
-       LOG(ERROR, "unable to add nic devices");
-       goto error_out;
-   }
-
-    /* Plug vtpm devices */
-   if (d_config->num_vtpms > 0) {
-       /* Attach vtpms */
-       libxl__multidev_begin(ao, &dcs->multidev);
-       dcs->multidev.callback = domcreate_attach_usbs;
-       libxl__add_vtpms(egc, ao, domid, d_config, &dcs->multidev);
-       libxl__multidev_prepared(egc, &dcs->multidev, 0);
-       return;
-   }
-
-   domcreate_attach_usbs(egc, multidev, 0);
-   return;
-
-error_out:
-   assert(ret);
-   domcreate_complete(egc, dcs, ret);
-}
-
 static void domcreate_attach_usbs(libxl__egc *egc, libxl__multidev *multidev,
                                 int ret)
 {
@@ -1267,10 +1262,11 @@ static void domcreate_attach_usbs(libxl__egc *egc, libxl__multidev *multidev,
     libxl_domain_config *const d_config = dcs->guest_config;
     
     if (ret) {
-        LOG(ERROR, "unable to add vtpm devices");
+        LOG(ERROR, "unable to add nic devices");
         goto error_out;
     }
-    
+
+    domcreate_stage(dcs, "usb and pci");
     for (i = 0; i < d_config->num_usbs; i++) {
         ret = libxl__device_usb_add(gc, domid, &d_config->usbs[i]);
         if (ret < 0) {
@@ -1341,6 +1337,8 @@ static void domcreate_complete(libxl__egc *egc,
     STATE_AO_GC(dcs->ao);
     libxl_domain_config *const d_config = dcs->guest_config;
 
+    domcreate_stage(dcs, NULL);
+
     if (!rc && d_config->b_info.exec_ssidref)
         rc = xc_flask_relabel_domain(CTX->xch, dcs->guest_domid, d_config->b_info.exec_ssidref);
 
@@ -1384,17 +1382,38 @@ static void domain_create_cb(libxl__egc *egc,
 
 static int do_domain_create(libxl_ctx *ctx, libxl_domain_config *d_config,
                             uint32_t *domid,
-                            int restore_fd, int checkpointed_stream,
+                            int restore_fd,
+                            const int *data_fds, int nr_data_fds,
+                            int checkpointed_stream,
                             const libxl_asyncop_how *ao_how,
                             const libxl_asyncprogress_how *aop_console_how)
 {
     AO_CREATE(ctx, 0, ao_how);
     libxl__app_domain_create_state *cdcs;
+    int i;
+
+    if (nr_data_fds < 0 || (nr_data_fds && checkpointed_stream)) {
+        LOG(ERROR, "data streams cannot be used with a checkpointed stream");
+        return AO_ABORT(ERROR_INVAL);
+    }
+    for (i = 0; i < nr_data_fds; i++) {
+        if (data_fds[i] <= 2) {
+            LOG(ERROR, "data stream fd %d may not be 0, 1 or 2", data_fds[i]);
+            return AO_ABORT(ERROR_INVAL);
+        }
+    }
 
     GCNEW(cdcs);
     cdcs->dcs.ao = ao;
     cdcs->dcs.guest_config = d_config;
     cdcs->dcs.restore_fd = restore_fd;
+    if (nr_data_fds) {
+        int *fds;
+        GCNEW_ARRAY(fds, nr_data_fds);
+        memcpy(fds, data_fds, sizeof(*fds) * nr_data_fds);
+        cdcs->dcs.data_fds = fds;
+        cdcs->dcs.nr_data_fds = nr_data_fds;
+    }
     cdcs->dcs.callback = domain_create_cb;
     cdcs->dcs.checkpointed_stream = checkpointed_stream;
     libxl__ao_progress_gethow(&cdcs->dcs.aop_console_how, aop_console_how);
@@ -1423,7 +1442,7 @@ int libxl_domain_create_new(libxl_ctx *ctx, libxl_domain_config *d_config,
                             const libxl_asyncop_how *ao_how,
                             const libxl_asyncprogress_how *aop_console_how)
 {
-    return do_domain_create(ctx, d_config, domid, -1, 0,
+    return do_domain_create(ctx, d_config, domid, -1, NULL, 0, 0,
                             ao_how, aop_console_how);
 }
 
@@ -1432,8 +1451,21 @@ int libxl_domain_create_restore(libxl_ctx *ctx, libxl_domain_config *d_config,
                                 const libxl_domain_restore_params *params,
                                 const libxl_asyncop_how *ao_how,
                                 const libxl_asyncprogress_how *aop_console_how)
+{
+    return do_domain_create(ctx, d_config, domid, restore_fd, NULL, 0,
+                            params->checkpointed_stream, ao_how, aop_console_how);
+}
+
+int libxl_domain_create_restore_streams(libxl_ctx *ctx,
+                                libxl_domain_config *d_config,
+                                uint32_t *domid, int restore_fd,
+                                const int *data_fds, int nr_data_fds,
+                                const libxl_domain_restore_params *params,
+                                const libxl_asyncop_how *ao_how,
+                                const libxl_asyncprogress_how *aop_console_how)
 {
     return do_domain_create(ctx, d_config, domid, restore_fd,
+                            data_fds, nr_data_fds,
                             params->checkpointed_stream, ao_how, aop_console_how);
 }
 
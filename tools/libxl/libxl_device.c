@@ -155,6 +155,8 @@ retry_transaction:
             return ERROR_FAIL;
         }
     }
+    libxl__devindex_invalidate(gc, XBT_NULL, frontend_path);
+    libxl__devindex_invalidate(gc, XBT_NULL, backend_path);
     return 0;
 }
 
@@ -441,6 +443,8 @@ void libxl__prepare_ao_device(libxl__ao *ao, libxl__ao_device *aodev)
     /* We init this here because we might call device_hotplug_done
      * without actually calling any hotplug script */
     libxl__async_exec_init(&aodev->aes);
+    aodev->hotplug_queued = aodev->hotplug_running = 0;
+    aodev->trace = aodev->hotplug_trace = -1;
 }
 
 /* multidev */
@@ -707,6 +711,8 @@ static void device_backend_cleanup(libxl__gc *gc,
 
 static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev);
 
+static void device_hotplug_exec(libxl__egc *egc, libxl__ao_device *aodev);
+
 static void device_hotplug_child_death_cb(libxl__egc *egc,
                                           libxl__async_exec_state *aes,
                                           int status);
@@ -723,6 +729,19 @@ static void device_hotplug_done(libxl__egc *egc, libxl__ao_device *aodev);
 
 static void device_hotplug_clean(libxl__gc *gc, libxl__ao_device *aodev);
 
+/* Starts the ao trace stage covering the whole of aodev's operation. */
+static void device_trace_begin(libxl__ao_device *aodev)
+{
+    STATE_AO_GC(aodev->ao);
+
+    if (aodev->trace >= 0) return;
+    aodev->trace = libxl__ao_trace_begin(ao,
+                        GCSPRINTF("%s %s %d",
+                            libxl__device_action_to_string(aodev->action),
+                            libxl__device_kind_to_string(aodev->dev->kind),
+                            aodev->dev->devid));
+}
+
 void libxl__wait_device_connection(libxl__egc *egc, libxl__ao_device *aodev)
 {
     STATE_AO_GC(aodev->ao);
@@ -730,6 +749,8 @@ void libxl__wait_device_connection(libxl__egc *egc, libxl__ao_device *aodev)
     char *state_path = GCSPRINTF("%s/state", be_path);
     int rc = 0;
 
+    device_trace_begin(aodev);
+
     if (QEMU_BACKEND(aodev->dev)) {
         /*
          * If Qemu is not running, there's no point in waiting for
@@ -772,6 +793,8 @@ void libxl__initiate_device_remove(libxl__egc *egc,
     uint32_t my_domid, domid = aodev->dev->domid;
     int rc = 0;
 
+    device_trace_begin(aodev);
+
     rc = libxl__get_domid(gc, &my_domid);
     if (rc) {
         LOG(ERROR, "unable to get my domid");
@@ -954,7 +977,7 @@ static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev)
     char *be_path = libxl__device_backend_path(gc, aodev->dev);
     char **args = NULL, **env = NULL;
     int rc = 0;
-    int hotplug, nullfd = -1;
+    int hotplug;
     uint32_t domid;
 
     /*
@@ -1006,7 +1029,39 @@ static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev)
         goto out;
     }
 
-    LOG(DEBUG, "calling hotplug script: %s %s", args[0], args[1]);
+    aes->ao = ao;
+    aes->what = GCSPRINTF("%s %s", args[0], args[1]);
+    aes->env = env;
+    aes->args = args;
+    aes->callback = device_hotplug_child_death_cb;
+    aes->timeout_ms = LIBXL_HOTPLUG_TIMEOUT * 1000;
+
+    if (CTX->hotplug_max > 0 && CTX->hotplug_running >= CTX->hotplug_max) {
+        /* Started by device_hotplug_release when a slot frees up */
+        LOG(DEBUG, "hotplug script queued: %s", aes->what);
+        aodev->hotplug_queued = 1;
+        LIBXL_TAILQ_INSERT_TAIL(&CTX->hotplug_waiting, aodev, hotplug_entry);
+        return;
+    }
+
+    device_hotplug_exec(egc, aodev);
+    return;
+
+out:
+    aodev->rc = rc;
+    device_hotplug_done(egc, aodev);
+    return;
+}
+
+/* Actually runs the script set up in aodev->aes by device_hotplug,
+ * taking one of the ctx's hotplug slots. */
+static void device_hotplug_exec(libxl__egc *egc, libxl__ao_device *aodev)
+{
+    STATE_AO_GC(aodev->ao);
+    libxl__async_exec_state *aes = &aodev->aes;
+    int rc, nullfd = -1;
+
+    LOG(DEBUG, "calling hotplug script: %s", aes->what);
 
     nullfd = open("/dev/null", O_RDONLY);
     if (nullfd < 0) {
@@ -1015,12 +1070,6 @@ static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev)
         goto out;
     }
 
-    aes->ao = ao;
-    aes->what = GCSPRINTF("%s %s", args[0], args[1]);
-    aes->env = env;
-    aes->args = args;
-    aes->callback = device_hotplug_child_death_cb;
-    aes->timeout_ms = LIBXL_HOTPLUG_TIMEOUT * 1000;
     aes->stdfds[0] = nullfd;
     aes->stdfds[1] = 2;
     aes->stdfds[2] = -1;
@@ -1032,13 +1081,51 @@ static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev)
     close(nullfd);
     assert(libxl__async_exec_inuse(&aodev->aes));
 
+    aodev->hotplug_trace = libxl__ao_trace_begin(ao, aes->what);
+    aodev->hotplug_running = 1;
+    CTX->hotplug_running++;
     return;
 
 out:
     if (nullfd >= 0) close(nullfd);
     aodev->rc = rc;
     device_hotplug_done(egc, aodev);
-    return;
+}
+
+/* Gives back aodev's hotplug slot and starts as many queued scripts
+ * as the limit now allows. */
+static void device_hotplug_release(libxl__egc *egc, libxl__ao_device *aodev)
+{
+    STATE_AO_GC(aodev->ao);
+    libxl__ao_device *next;
+
+    if (!aodev->hotplug_running) return;
+    aodev->hotplug_running = 0;
+    CTX->hotplug_running--;
+    libxl__ao_trace_end(ao, aodev->hotplug_trace);
+    aodev->hotplug_trace = -1;
+
+    while ((CTX->hotplug_max <= 0 ||
+            CTX->hotplug_running < CTX->hotplug_max) &&
+           (next = LIBXL_TAILQ_FIRST(&CTX->hotplug_waiting))) {
+        LIBXL_TAILQ_REMOVE(&CTX->hotplug_waiting, next, hotplug_entry);
+        next->hotplug_queued = 0;
+        device_hotplug_exec(egc, next);
+    }
+}
+
+void libxl__device_hotplug_cancel(libxl__gc *gc, libxl__ao *ao)
+{
+    libxl__ao_device *aodev, *tmp;
+
+    LIBXL_TAILQ_FOREACH_SAFE(aodev, &CTX->hotplug_waiting, hotplug_entry,
+                             tmp) {
+        if (aodev->ao != ao)
+            continue;
+        LOG(DEBUG, "hotplug script cancelled: %s", aodev->aes.what);
+        LIBXL_TAILQ_REMOVE(&CTX->hotplug_waiting, aodev, hotplug_entry);
+        aodev->hotplug_queued = 0;
+    }
 }
 
 static void device_hotplug_child_death_cb(libxl__egc *egc,
@@ -1050,6 +1137,7 @@ static void device_hotplug_child_death_cb(libxl__egc *egc,
     char *be_path = libxl__device_backend_path(gc, aodev->dev);
     char *hotplug_error;
 
+    device_hotplug_release(egc, aodev);
     device_hotplug_clean(gc, aodev);
 
     if (status) {
@@ -1135,6 +1223,9 @@ static void device_hotplug_done(libxl__egc *egc, libxl__ao_device *aodev)
             aodev->rc = rc;
     }
 
+    libxl__ao_trace_end(ao, aodev->trace);
+    aodev->trace = -1;
+
     aodev->callback(egc, aodev);
     return;
 }
@@ -1144,7 +1235,12 @@ static void device_hotplug_clean(libxl__gc *gc, libxl__ao_device *aodev)
     /* Clean events and check reentrancy */
     libxl__ev_time_deregister(gc, &aodev->timeout);
     libxl__ev_xswatch_deregister(gc, &aodev->xs_watch);
+    if (aodev->hotplug_queued) {
+        LIBXL_TAILQ_REMOVE(&CTX->hotplug_waiting, aodev, hotplug_entry);
+        aodev->hotplug_queued = 0;
+    }
     assert(!libxl__async_exec_inuse(&aodev->aes));
+    assert(!aodev->hotplug_running);
 }
 
 static void devices_remove_callback(libxl__egc *egc,
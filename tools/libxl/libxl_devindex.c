@@ -0,0 +1,573 @@
+/*
+ * Device index: a per-ctx cache of the xenstore nodes libxl reads to
+ * enumerate devices, kept up to date by xenstore watches.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include "libxl_osdeps.h" /* must come before any other headers */
+
+#include "libxl_internal.h"
+
+/*
+ * Indexed paths are those under a "root" of the form
+ *     /local/domain/<domid>/backend/<kind>
+ *     /local/domain/<domid>/device/<kind>
+ * Each root gets a xenstore watch, on a xenstore connection of the
+ * index's own so that the application's event loop is not involved,
+ * the first time anything under it is looked up.  Pending watch
+ * events are consumed (without blocking) at every lookup; each event
+ * forgets the cached values at and below the event path, and the
+ * cached directory listings of its ancestors.
+ *
+ * An event at or above a root whose domain has gone away (the whole of
+ * /local/domain/<domid> is removed when the domain is destroyed) drops
+ * the root and its watch.  Roots of live domains stay, even while they
+ * have nothing under them.
+ *
+ * So a lookup costs no xenstore round trip once cached, and reflects
+ * every change whose watch event has reached us.  Changes made by
+ * libxl through this ctx are also forgotten straight away, see
+ * libxl__devindex_invalidate.  A change made in a transaction is
+ * forgotten again when the transaction commits, since until then a
+ * lookup outside it would still have read the old value; for this the
+ * index tracks the transactions started with
+ * libxl__xs_transaction_start, and the paths they have written.
+ *
+ * All of this is protected by the ctx lock.
+ */
+
+typedef struct devindex_node devindex_node;
+typedef struct devindex_root devindex_root;
+typedef struct devindex_txn devindex_txn;
+
+struct devindex_node {
+    LIBXL_LIST_ENTRY(devindex_node) bucket_entry;
+    LIBXL_LIST_ENTRY(devindex_node) root_entry;
+    char *path;
+    bool have_value, have_dir;
+    char *value;          /* NULL with have_value: no such node */
+    char **dir;           /* NULL with have_dir: no such node */
+    unsigned int ndir;
+};
+
+struct devindex_root {
+    LIBXL_LIST_ENTRY(devindex_root) entry;
+    char *path;
+    LIBXL_LIST_HEAD(, devindex_node) nodes;
+};
+
+struct devindex_txn {
+    LIBXL_LIST_ENTRY(devindex_txn) entry;
+    xs_transaction_t t;
+    char **paths;         /* written so far, none within another */
+    int npaths;
+};
+
+struct libxl__devindex {
+    struct xs_handle *xsh;
+    LIBXL_LIST_HEAD(, devindex_root) roots;
+    LIBXL_LIST_HEAD(, devindex_txn) txns;
+    LIBXL_LIST_HEAD(devindex_bucket, devindex_node) *buckets;
+    int nbuckets, nnodes;
+};
+
+#define DEVINDEX_MIN_BUCKETS 64
+
+static unsigned int path_hash(const char *path)
+{
+    unsigned int h = 2166136261u;          /* FNV-1a */
+
+    while (*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h;
+}
+
+/* Is path equal to or below prefix? */
+static bool path_within(const char *path, const char *prefix)
+{
+    size_t l = strlen(prefix);
+
+    return !strncmp(path, prefix, l) && (path[l] == '/' || !path[l]);
+}
+
+/* Returns the length of path's /local/domain/<domid> prefix, or 0. */
+static size_t domain_length(const char *path)
+{
+    static const char local[] = "/local/domain/";
+    const char *p = path + sizeof(local) - 1;
+    size_t l;
+
+    if (strncmp(path, local, sizeof(local) - 1)) return 0;
+    l = strspn(p, "0123456789");
+    if (!l || (p[l] != '/' && p[l])) return 0;
+    return p + l - path;
+}
+
+/* Returns the length of path's root, or 0 if path is not indexed. */
+static size_t root_length(const char *path)
+{
+    const char *p;
+    size_t l;
+
+    l = domain_length(path);
+    if (!l || !path[l]) return 0;
+    p = path + l + 1;
+
+    if (!strncmp(p, "backend/", 8))
+        p += 8;
+    else if (!strncmp(p, "device/", 7))
+        p += 7;
+    else
+        return 0;
+
+    l = strcspn(p, "/");
+    if (!l) return 0;
+    return p + l - path;
+}
+
+static void node_forget(devindex_node *node)
+{
+    free(node->value);
+    free(node->dir);
+    node->value = NULL;
+    node->dir = NULL;
+    node->have_value = node->have_dir = 0;
+}
+
+static void node_free(libxl__devindex *idx, devindex_node *node)
+{
+    LIBXL_LIST_REMOVE(node, bucket_entry);
+    LIBXL_LIST_REMOVE(node, root_entry);
+    idx->nnodes--;
+    node_forget(node);
+    free(node->path);
+    free(node);
+}
+
+static void root_flush(libxl__devindex *idx, devindex_root *root)
+{
+    devindex_node *node;
+
+    while ((node = LIBXL_LIST_FIRST(&root->nodes)))
+        node_free(idx, node);
+}
+
+/* Drops root, and its watch.  Events already queued for it are
+ * harmless: at worst they flush a root made afresh for the same path. */
+static void root_free(libxl__devindex *idx, devindex_root *root)
+{
+    root_flush(idx, root);
+    LIBXL_LIST_REMOVE(root, entry);
+    xs_unwatch(idx->xsh, root->path, "devindex");
+    free(root->path);
+    free(root);
+}
+
+/* Forgets everything cached at or below path, and the directory
+ * listings of path's ancestors. */
+static void devindex_forget(libxl__devindex *idx, const char *path)
+{
+    devindex_root *root;
+    devindex_node *node, *node_tmp;
+
+    LIBXL_LIST_FOREACH(root, &idx->roots, entry) {
+        if (path_within(root->path, path)) {
+            /* the whole root, eg the domain went away */
+            root_flush(idx, root);
+            continue;
+        }
+        if (!path_within(path, root->path))
+            continue;
+        LIBXL_LIST_FOREACH_SAFE(node, &root->nodes, root_entry, node_tmp) {
+            if (path_within(node->path, path))
+                node_free(idx, node);
+            else if (path_within(path, node->path))
+                node_forget(node);
+        }
+    }
+}
+
+/* Forgets all cached values; the roots and their watches remain. */
+static void devindex_flush(libxl__devindex *idx)
+{
+    devindex_root *root;
+
+    LIBXL_LIST_FOREACH(root, &idx->roots, entry)
+        root_flush(idx, root);
+}
+
+/* Drops the roots at or below path whose domain has gone away. */
+static void devindex_prune(libxl__gc *gc, libxl__devindex *idx,
+                           const char *path)
+{
+    devindex_root *root, *root_tmp;
+    char *dom_path, *value;
+    unsigned int len;
+
+    LIBXL_LIST_FOREACH_SAFE(root, &idx->roots, entry, root_tmp) {
+        if (!path_within(root->path, path))
+            continue;
+        dom_path = libxl__strndup(gc, root->path,
+                                  domain_length(root->path));
+        value = xs_read(idx->xsh, XBT_NULL, dom_path, &len);
+        if (value) {
+            free(value);
+            continue;
+        }
+        if (errno != ENOENT) {
+            LOGE(ERROR, "device index: cannot read %s", dom_path);
+            continue;
+        }
+        root_free(idx, root);
+    }
+}
+
+/* Consumes the watch events which have arrived so far. */
+static void devindex_drain(libxl__gc *gc, libxl__devindex *idx)
+{
+    for (;;) {
+        char **event = xs_check_watch(idx->xsh);
+        if (!event) {
+            if (errno == EAGAIN) break;
+            if (errno == EINTR) continue;
+            /* we may have lost events, so trust nothing */
+            LOGE(ERROR, "device index: cannot read xenstore watches");
+            devindex_flush(idx);
+            break;
+        }
+        devindex_forget(idx, event[XS_WATCH_PATH]);
+        devindex_prune(gc, idx, event[XS_WATCH_PATH]);
+        free(event);
+    }
+}
+
+static void devindex_grow(libxl__gc *gc, libxl__devindex *idx)
+{
+    struct devindex_bucket *buckets;
+    devindex_root *root;
+    devindex_node *node;
+    int i, nbuckets = idx->nbuckets ? idx->nbuckets * 2
+                                    : DEVINDEX_MIN_BUCKETS;
+
+    buckets = libxl__calloc(NOGC, nbuckets, sizeof(*buckets));
+    for (i = 0; i < nbuckets; i++)
+        LIBXL_LIST_INIT(&buckets[i]);
+
+    LIBXL_LIST_FOREACH(root, &idx->roots, entry) {
+        LIBXL_LIST_FOREACH(node, &root->nodes, root_entry) {
+            LIBXL_LIST_INSERT_HEAD(
+                &buckets[path_hash(node->path) & (nbuckets - 1)],
+                node, bucket_entry);
+        }
+    }
+
+    free(idx->buckets);
+    idx->buckets = buckets;
+    idx->nbuckets = nbuckets;
+}
+
+/* Returns the node for path, creating it (and registering its root's
+ * watch) if need be, or NULL if path is not indexed.  Must be called
+ * with the ctx locked. */
+static devindex_node *devindex_lookup(libxl__gc *gc, const char *path)
+{
+    libxl__devindex *idx = CTX->devindex;
+    devindex_root *root;
+    devindex_node *node;
+    size_t rootlen;
+    unsigned int h;
+
+    if (!idx) return NULL;
+    rootlen = root_length(path);
+    if (!rootlen) return NULL;
+
+    devindex_drain(gc, idx);
+
+    h = path_hash(path);
+    if (idx->nbuckets) {
+        LIBXL_LIST_FOREACH(node, &idx->buckets[h & (idx->nbuckets - 1)],
+                           bucket_entry) {
+            if (!strcmp(node->path, path))
+                return node;
+        }
+    }
+
+    LIBXL_LIST_FOREACH(root, &idx->roots, entry) {
+        if (strlen(root->path) == rootlen &&
+            !strncmp(root->path, path, rootlen))
+            break;
+    }
+    if (!root) {
+        root = libxl__zalloc(NOGC, sizeof(*root));
+        root->path = libxl__strndup(NOGC, path, rootlen);
+        LIBXL_LIST_INIT(&root->nodes);
+        /* Watch before anything under it is read, so that we cannot
+         * miss a change. */
+        if (!xs_watch(idx->xsh, root->path, "devindex")) {
+            LOGE(ERROR, "device index: cannot watch %s", root->path);
+            free(root->path);
+            free(root);
+            return NULL;
+        }
+        LIBXL_LIST_INSERT_HEAD(&idx->roots, root, entry);
+    }
+
+    if (idx->nnodes >= idx->nbuckets * 2)
+        devindex_grow(gc, idx);
+
+    node = libxl__zalloc(NOGC, sizeof(*node));
+    node->path = libxl__strdup(NOGC, path);
+    LIBXL_LIST_INSERT_HEAD(&idx->buckets[h & (idx->nbuckets - 1)],
+                           node, bucket_entry);
+    LIBXL_LIST_INSERT_HEAD(&root->nodes, node, root_entry);
+    idx->nnodes++;
+    return node;
+}
+
+int libxl__devindex_read_checked(libxl__gc *gc, const char *path,
+                                 const char **result_out)
+{
+    devindex_node *node;
+    char *value;
+    unsigned int len;
+    int rc;
+
+    CTX_LOCK;
+    node = devindex_lookup(gc, path);
+    if (!node) {
+        CTX_UNLOCK;
+        return libxl__xs_read_checked(gc, XBT_NULL, path, result_out);
+    }
+
+    if (!node->have_value) {
+        value = xs_read(CTX->xsh, XBT_NULL, path, &len);
+        if (!value && errno != ENOENT) {
+            LOGE(ERROR, "xenstore read failed: `%s'", path);
+            rc = ERROR_FAIL;
+            goto out;
+        }
+        node->value = value;
+        node->have_value = 1;
+    }
+
+    *result_out = node->value ? libxl__strdup(gc, node->value) : NULL;
+    rc = 0;
+
+ out:
+    CTX_UNLOCK;
+    return rc;
+}
+
+char *libxl__devindex_read(libxl__gc *gc, const char *path)
+{
+    const char *result;
+
+    if (libxl__devindex_read_checked(gc, path, &result))
+        return NULL;
+    if (!result)
+        errno = ENOENT;
+    return (char *)result;
+}
+
+char **libxl__devindex_directory(libxl__gc *gc, const char *path,
+                                 unsigned int *num)
+{
+    devindex_node *node;
+    char **dir, **ret = NULL;
+    unsigned int i, n;
+
+    CTX_LOCK;
+    node = devindex_lookup(gc, path);
+    if (!node) {
+        CTX_UNLOCK;
+        return libxl__xs_directory(gc, XBT_NULL, path, num);
+    }
+
+    if (!node->have_dir) {
+        dir = xs_directory(CTX->xsh, XBT_NULL, path, &n);
+        if (!dir && errno != ENOENT)
+            goto out;
+        node->dir = dir;
+        node->ndir = dir ? n : 0;
+        node->have_dir = 1;
+    }
+
+    if (node->dir) {
+        ret = libxl__calloc(gc, node->ndir + 1, sizeof(*ret));
+        for (i = 0; i < node->ndir; i++)
+            ret[i] = libxl__strdup(gc, node->dir[i]);
+        *num = node->ndir;
+    } else {
+        errno = ENOENT;
+    }
+
+ out:
+    CTX_UNLOCK;
+    return ret;
+}
+
+static devindex_txn *devindex_txn_find(libxl__devindex *idx,
+                                       xs_transaction_t t)
+{
+    devindex_txn *txn;
+
+    LIBXL_LIST_FOREACH(txn, &idx->txns, entry) {
+        if (txn->t == t)
+            return txn;
+    }
+    return NULL;
+}
+
+static void devindex_txn_free(devindex_txn *txn)
+{
+    int i;
+
+    LIBXL_LIST_REMOVE(txn, entry);
+    for (i = 0; i < txn->npaths; i++)
+        free(txn->paths[i]);
+    free(txn->paths);
+    free(txn);
+}
+
+void libxl__devindex_invalidate(libxl__gc *gc, xs_transaction_t t,
+                                const char *path)
+{
+    libxl__devindex *idx;
+    devindex_txn *txn;
+    int i, j;
+
+    CTX_LOCK;
+    idx = CTX->devindex;
+    if (!idx) goto out;
+
+    devindex_forget(idx, path);
+
+    if (t == XBT_NULL) goto out;
+    txn = devindex_txn_find(idx, t);
+    if (!txn) goto out;
+
+    for (i = 0, j = 0; i < txn->npaths; i++) {
+        if (path_within(path, txn->paths[i]))
+            goto out;
+        if (path_within(txn->paths[i], path))
+            free(txn->paths[i]);
+        else
+            txn->paths[j++] = txn->paths[i];
+    }
+    txn->npaths = j;
+    txn->paths = libxl__realloc(NOGC, txn->paths,
+                                (j + 1) * sizeof(*txn->paths));
+    txn->paths[txn->npaths++] = libxl__strdup(NOGC, path);
+
+ out:
+    CTX_UNLOCK;
+}
+
+void libxl__devindex_transaction_start(libxl__gc *gc, xs_transaction_t t)
+{
+    libxl__devindex *idx;
+    devindex_txn *txn;
+
+    CTX_LOCK;
+    idx = CTX->devindex;
+    if (idx) {
+        txn = libxl__zalloc(NOGC, sizeof(*txn));
+        txn->t = t;
+        LIBXL_LIST_INSERT_HEAD(&idx->txns, txn, entry);
+    }
+    CTX_UNLOCK;
+}
+
+void libxl__devindex_transaction_end(libxl__gc *gc, xs_transaction_t t,
+                                     bool committed)
+{
+    libxl__devindex *idx;
+    devindex_txn *txn;
+    int i;
+
+    CTX_LOCK;
+    idx = CTX->devindex;
+    txn = idx ? devindex_txn_find(idx, t) : NULL;
+    if (txn) {
+        if (committed) {
+            for (i = 0; i < txn->npaths; i++)
+                devindex_forget(idx, txn->paths[i]);
+        }
+        devindex_txn_free(txn);
+    }
+    CTX_UNLOCK;
+}
+
+void libxl__devindex_free(libxl_ctx *ctx)
+{
+    libxl__devindex *idx = ctx->devindex;
+    devindex_root *root;
+    devindex_txn *txn;
+
+    if (!idx) return;
+    while ((txn = LIBXL_LIST_FIRST(&idx->txns)))
+        devindex_txn_free(txn);
+    /* closing idx->xsh drops the watches */
+    while ((root = LIBXL_LIST_FIRST(&idx->roots))) {
+        root_flush(idx, root);
+        LIBXL_LIST_REMOVE(root, entry);
+        free(root->path);
+        free(root);
+    }
+    free(idx->buckets);
+    if (idx->xsh) xs_daemon_close(idx->xsh);
+    free(idx);
+    ctx->devindex = NULL;
+}
+
+int libxl_device_index_enable(libxl_ctx *ctx, bool enable)
+{
+    GC_INIT(ctx);
+    libxl__devindex *idx;
+    int rc = 0;
+
+    CTX_LOCK;
+
+    if (!enable) {
+        libxl__devindex_free(ctx);
+        goto out;
+    }
+    if (ctx->devindex)
+        goto out;
+
+    idx = libxl__zalloc(NOGC, sizeof(*idx));
+    LIBXL_LIST_INIT(&idx->roots);
+    LIBXL_LIST_INIT(&idx->txns);
+    idx->xsh = xs_daemon_open();
+    if (!idx->xsh)
+        idx->xsh = xs_domain_open();
+    if (!idx->xsh) {
+        LOGE(ERROR, "device index: cannot connect to xenstore");
+        free(idx);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+    ctx->devindex = idx;
+
+ out:
+    CTX_UNLOCK;
+    GC_FREE;
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -106,6 +106,9 @@ out:
  *  - the number of vcpus runnable on the candidates is considered, and
  *    candidates with fewer of them are preferred. If two candidate have
  *    the same number of runnable vcpus,
+ *  - the distance between the nodes of the candidates is considered, and
+ *    the candidate whose nodes are closer to each other is preferred. If
+ *    that is the same too (e.g., for any two single node candidates),
  *  - the amount of free memory in the candidates is considered, and the
  *    candidate with greater amount of it is preferred.
  *
@@ -119,12 +122,15 @@ out:
  * as the fact that fewer nodes is better is already accounted for in the
  * algorithm.
  */
-static int numa_cmpf(const libxl__numa_candidate *c1,
+int libxl__numa_cmpf(const libxl__numa_candidate *c1,
                      const libxl__numa_candidate *c2)
 {
     if (c1->nr_vcpus != c2->nr_vcpus)
         return c1->nr_vcpus - c2->nr_vcpus;
 
+    if (c1->distance != c2->distance)
+        return c1->distance < c2->distance ? -1 : 1;
+
     return c2->free_memkb - c1->free_memkb;
 }
 
@@ -166,7 +172,7 @@ static int numa_place_domain(libxl__gc *gc, uint32_t domid,
      * as much pcpus as the domain has vcpus.  */
     rc = libxl__get_numa_candidate(gc, memkb, info->max_vcpus,
                                    0, 0, &cpupool_info.cpumap,
-                                   numa_cmpf, &candidate, &found);
+                                   libxl__numa_cmpf, &candidate, &found);
     if (rc)
         goto out;
 
@@ -1542,7 +1548,8 @@ void libxl__domain_suspend(libxl__egc *egc, libxl__domain_suspend_state *dss)
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
           | (debug ? XCFLAGS_DEBUG : 0)
-          | (dss->hvm ? XCFLAGS_HVM : 0);
+          | (dss->hvm ? XCFLAGS_HVM : 0)
+          | (dss->page_index ? XCFLAGS_PAGE_INDEX : 0);
 
     dss->guest_evtchn.port = -1;
     dss->guest_evtchn_lockfd = -1;
@@ -19,6 +19,10 @@
 
 #include "libxl_internal.h"
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 
 //#define DEBUG 1
 
@@ -164,6 +168,131 @@ static void osevent_hook_failed_noop(libxl__gc *gc, void *ev,
                                      libxl__osevent_hook_nexus **nexus) { }
 
 
+/*
+ * epoll mirror of CTX->efds
+ *
+ * Internal pollers wait on CTX->epoll_fd instead of on a pollfd array
+ * rebuilt from efds every iteration (poller_app still uses the array,
+ * since that is what the application gives us).  An fd is in the set
+ * iff it is registered with nonzero events.  Events are mapped back
+ * to their libxl__ev_fd through epoll_efds[fd], never by pointer, so
+ * nothing in the kernel's set can refer to an ev_fd which is gone.
+ *
+ * If the set may contain a stale entry (an fd closed before it was
+ * deregistered, while some other process still has it open) we
+ * discard it and rebuild it from efds.  If the set cannot describe
+ * efds at all (two ev_fds on one fd, or an fd epoll will not take)
+ * we give up and poll, as we do where epoll is unavailable.
+ */
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static void epoll_disable(libxl__gc *gc)
+{
+    LOG(DEBUG, "not using epoll for internal pollers");
+    if (CTX->epoll_fd >= 0) close(CTX->epoll_fd);
+    CTX->epoll_fd = -2;
+}
+
+static int epoll_ctl_efd(libxl__gc *gc, int op, libxl__ev_fd *efd)
+{
+    struct epoll_event ee;
+
+    /* on Linux the POLL* and EPOLL* event bits coincide */
+    memset(&ee, 0, sizeof(ee));
+    ee.events = (unsigned short)efd->events;
+    ee.data.fd = efd->fd;
+
+    return epoll_ctl(CTX->epoll_fd, op, efd->fd, &ee);
+}
+
+static void epoll_efd_register(libxl__gc *gc, libxl__ev_fd *efd)
+{
+    int fd = efd->fd;
+
+    if (CTX->epoll_fd < 0) return;
+
+    if (fd >= CTX->epoll_efds_allocd) {
+        int newsize = fd * 2 + 16;
+        assert(ARRAY_SIZE_OK(CTX->epoll_efds, newsize));
+        CTX->epoll_efds = libxl__realloc(NOGC, CTX->epoll_efds,
+                                         newsize * sizeof(*CTX->epoll_efds));
+        memset(CTX->epoll_efds + CTX->epoll_efds_allocd, 0,
+               (newsize - CTX->epoll_efds_allocd) * sizeof(*CTX->epoll_efds));
+        CTX->epoll_efds_allocd = newsize;
+    }
+
+    if (CTX->epoll_efds[fd] && CTX->epoll_efds[fd] != efd) {
+        epoll_disable(gc);
+        return;
+    }
+    CTX->epoll_efds[fd] = efd;
+
+    if (efd->events && epoll_ctl_efd(gc, EPOLL_CTL_ADD, efd))
+        epoll_disable(gc);
+}
+
+static void epoll_efd_modify(libxl__gc *gc, libxl__ev_fd *efd,
+                             short old_events)
+{
+    int op;
+
+    if (CTX->epoll_fd < 0) return;
+
+    if (!old_events == !efd->events)
+        op = old_events ? EPOLL_CTL_MOD : 0;
+    else
+        op = old_events ? EPOLL_CTL_DEL : EPOLL_CTL_ADD;
+
+    if (op && epoll_ctl_efd(gc, op, efd))
+        epoll_disable(gc);
+}
+
+static void epoll_efd_deregister(libxl__gc *gc, libxl__ev_fd *efd)
+{
+    if (CTX->epoll_fd < 0) return;
+
+    CTX->epoll_efds[efd->fd] = 0;
+
+    if (efd->events && epoll_ctl_efd(gc, EPOLL_CTL_DEL, efd)) {
+        /* probably closed already; the set might still refer to it */
+        close(CTX->epoll_fd);
+        CTX->epoll_fd = -1;
+    }
+}
+
+static void epoll_rebuild(libxl__gc *gc)
+{
+    libxl__ev_fd *efd;
+
+    assert(CTX->epoll_fd == -1);
+
+    CTX->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (CTX->epoll_fd < 0) {
+        LOGE(DEBUG, "epoll_create1 failed");
+        epoll_disable(gc);
+        return;
+    }
+
+    if (CTX->epoll_efds)
+        memset(CTX->epoll_efds, 0,
+               CTX->epoll_efds_allocd * sizeof(*CTX->epoll_efds));
+
+    LIBXL_LIST_FOREACH(efd, &CTX->efds, entry) {
+        epoll_efd_register(gc, efd);
+        if (CTX->epoll_fd < 0) return;
+    }
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+static void epoll_efd_register(libxl__gc *gc, libxl__ev_fd *efd) { }
+static void epoll_efd_modify(libxl__gc *gc, libxl__ev_fd *efd,
+                             short old_events) { }
+static void epoll_efd_deregister(libxl__gc *gc, libxl__ev_fd *efd) { }
+
+#endif
+
 /*
  * fd events
  */
@@ -189,6 +318,7 @@ int libxl__ev_fd_register(libxl__gc *gc, libxl__ev_fd *ev,
     ev->func = func;
 
     LIBXL_LIST_INSERT_HEAD(&CTX->efds, ev, entry);
+    epoll_efd_register(gc, ev);
 
     rc = 0;
 
@@ -199,6 +329,7 @@ int libxl__ev_fd_register(libxl__gc *gc, libxl__ev_fd *ev,
 
 int libxl__ev_fd_modify(libxl__gc *gc, libxl__ev_fd *ev, short events)
 {
+    short old_events;
     int rc;
 
     CTX_LOCK;
@@ -209,7 +340,9 @@ int libxl__ev_fd_modify(libxl__gc *gc, libxl__ev_fd *ev, short events)
     rc = OSEVENT_HOOK(fd,modify, noop, ev->fd, &ev->nexus->for_app_reg, events);
     if (rc) goto out;
 
+    old_events = ev->events;
     ev->events = events;
+    epoll_efd_modify(gc, ev, old_events);
 
     rc = 0;
  out:
@@ -229,6 +362,7 @@ void libxl__ev_fd_deregister(libxl__gc *gc, libxl__ev_fd *ev)
     DBG("ev_fd=%p deregister fd=%d", ev, ev->fd);
 
     OSEVENT_HOOK_VOID(fd,deregister, release, ev->fd, ev->nexus->for_app_reg);
+    epoll_efd_deregister(gc, ev);
     LIBXL_LIST_REMOVE(ev, entry);
     ev->fd = -1;
 
@@ -267,11 +401,88 @@ static int time_rel_to_abs(libxl__gc *gc, int ms, struct timeval *abs_out)
     return 0;
 }
 
+/*
+ * CTX->etimes is a binary min-heap of the finite timeouts, ordered by
+ * abs and then by registration order, so that timeouts due at the
+ * same time still occur in the order they were registered.  Each
+ * ev_time knows its own heap_index so it can be removed in O(log n).
+ */
+
+static int time_before(const libxl__ev_time *a, const libxl__ev_time *b)
+{
+    if (timercmp(&a->abs, &b->abs, !=))
+        return timercmp(&a->abs, &b->abs, <);
+    return a->seq < b->seq;
+}
+
+static void etimes_place(libxl_ctx *ctx, int i, libxl__ev_time *ev)
+{
+    ctx->etimes[i] = ev;
+    ev->heap_index = i;
+}
+
+static void etimes_sift(libxl_ctx *ctx, int i)
+{
+    libxl__ev_time *ev = ctx->etimes[i];
+    int child;
+
+    while (i > 0 && time_before(ev, ctx->etimes[(i - 1) / 2])) {
+        etimes_place(ctx, i, ctx->etimes[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+
+    for (;;) {
+        child = i * 2 + 1;
+        if (child >= ctx->etimes_used)
+            break;
+        if (child + 1 < ctx->etimes_used &&
+            time_before(ctx->etimes[child + 1], ctx->etimes[child]))
+            child++;
+        if (!time_before(ctx->etimes[child], ev))
+            break;
+        etimes_place(ctx, i, ctx->etimes[child]);
+        i = child;
+    }
+
+    etimes_place(ctx, i, ev);
+}
+
+static void etimes_insert(libxl__gc *gc, libxl__ev_time *ev)
+{
+    if (CTX->etimes_used == CTX->etimes_allocd) {
+        int newsize = CTX->etimes_allocd * 2 + 16;
+        assert(ARRAY_SIZE_OK(CTX->etimes, newsize));
+        CTX->etimes = libxl__realloc(NOGC, CTX->etimes,
+                                     newsize * sizeof(*CTX->etimes));
+        CTX->etimes_allocd = newsize;
+    }
+
+    ev->seq = CTX->etimes_seq++;
+    etimes_place(CTX, CTX->etimes_used++, ev);
+    etimes_sift(CTX, ev->heap_index);
+}
+
+static void etimes_remove(libxl__gc *gc, libxl__ev_time *ev)
+{
+    int i = ev->heap_index;
+
+    assert(i < CTX->etimes_used && CTX->etimes[i] == ev);
+
+    if (i != --CTX->etimes_used) {
+        etimes_place(CTX, i, CTX->etimes[CTX->etimes_used]);
+        etimes_sift(CTX, i);
+    }
+}
+
+static libxl__ev_time *etimes_first(libxl__gc *gc)
+{
+    return CTX->etimes_used ? CTX->etimes[0] : NULL;
+}
+
 static int time_register_finite(libxl__gc *gc, libxl__ev_time *ev,
                                 struct timeval absolute)
 {
     int rc;
-    libxl__ev_time *evsearch;
 
     rc = OSEVENT_HOOK(timeout,register, alloc, &ev->nexus->for_app_reg,
                       absolute, ev->nexus);
@@ -279,8 +490,7 @@ static int time_register_finite(libxl__gc *gc, libxl__ev_time *ev,
 
     ev->infinite = 0;
     ev->abs = absolute;
-    LIBXL_TAILQ_INSERT_SORTED(&CTX->etimes, entry, ev, evsearch, /*empty*/,
-                              timercmp(&ev->abs, &evsearch->abs, >));
+    etimes_insert(gc, ev);
 
     return 0;
 }
@@ -294,7 +504,7 @@ static void time_deregister(libxl__gc *gc, libxl__ev_time *ev)
         OSEVENT_HOOK_VOID(timeout,modify,
                           noop /* release nexus in _occurred_ */,
                           &ev->nexus->for_app_reg, right_away);
-        LIBXL_TAILQ_REMOVE(&CTX->etimes, ev, entry);
+        etimes_remove(gc, ev);
     }
 }
 
@@ -903,6 +1113,49 @@ int libxl__domaindeathcheck_start(libxl__gc *gc,
  * osevent poll
  */
 
+static void beforepoll_timeout(libxl__gc *gc, int *timeout_upd,
+                               struct timeval now)
+{
+    libxl__ev_time *etime = etimes_first(gc);
+    if (etime) {
+        int our_timeout;
+        struct timeval rel;
+        static struct timeval zero;
+
+        timersub(&etime->abs, &now, &rel);
+
+        if (timercmp(&rel, &zero, <)) {
+            our_timeout = 0;
+        } else if (rel.tv_sec >= 2000000) {
+            our_timeout = 2000000000;
+        } else {
+            our_timeout = rel.tv_sec * 1000 + (rel.tv_usec + 999) / 1000;
+        }
+        if (*timeout_upd < 0 || our_timeout < *timeout_upd)
+            *timeout_upd = our_timeout;
+    }
+}
+
+static void afterpoll_timeouts(libxl__egc *egc, struct timeval now)
+{
+    EGC_GC;
+
+    for (;;) {
+        libxl__ev_time *etime = etimes_first(gc);
+        if (!etime)
+            break;
+
+        assert(!etime->infinite);
+
+        if (timercmp(&etime->abs, &now, >))
+            break;
+
+        time_deregister(gc, etime);
+
+        time_occurs(egc, etime);
+    }
+}
+
 static int beforepoll_internal(libxl__gc *gc, libxl__poller *poller,
                                int *nfds_io, struct pollfd *fds,
                                int *timeout_upd, struct timeval now)
@@ -1007,24 +1260,7 @@ static int beforepoll_internal(libxl__gc *gc, libxl__poller *poller,
 
     *nfds_io = used;
 
-    libxl__ev_time *etime = LIBXL_TAILQ_FIRST(&CTX->etimes);
-    if (etime) {
-        int our_timeout;
-        struct timeval rel;
-        static struct timeval zero;
-
-        timersub(&etime->abs, &now, &rel);
-
-        if (timercmp(&rel, &zero, <)) {
-            our_timeout = 0;
-        } else if (rel.tv_sec >= 2000000) {
-            our_timeout = 2000000000;
-        } else {
-            our_timeout = rel.tv_sec * 1000 + (rel.tv_usec + 999) / 1000;
-        }
-        if (*timeout_upd < 0 || our_timeout < *timeout_upd)
-            *timeout_upd = our_timeout;
-    }
+    beforepoll_timeout(gc, timeout_upd, now);
 
     return rc;
 }
@@ -1159,21 +1395,55 @@ static void afterpoll_internal(libxl__egc *egc, libxl__poller *poller,
         if (e) LIBXL__EVENT_DISASTER(egc, "read wakeup", e, 0);
     }
 
-    for (;;) {
-        libxl__ev_time *etime = LIBXL_TAILQ_FIRST(&CTX->etimes);
-        if (!etime)
-            break;
+    afterpoll_timeouts(egc, now);
+}
 
-        assert(!etime->infinite);
+#ifdef HAVE_SYS_EPOLL_H
+static void afterepoll_internal(libxl__egc *egc, libxl__poller *poller,
+                                short wakeup_revents, struct timeval now)
+{
+    /* As afterpoll_internal, but the fd events come from
+     * CTX->epoll_fd.  Each reported fd is looked up in epoll_efds
+     * only when we get to it, so callbacks may change efds freely.
+     * If the set was abandoned (here, or by another thread while we
+     * were polling) any fd events are left to the next iteration. */
+    EGC_GC;
+    struct epoll_event ees[64];
+    libxl__ev_fd *efd;
+    int i, n, fd, revents;
+
+    n = CTX->epoll_fd >= 0 ?
+        epoll_wait(CTX->epoll_fd, ees, ARRAY_SIZE(ees), 0) : 0;
+    if (n < 0) {
+        if (errno != EINTR)
+            LIBXL__EVENT_DISASTER(egc, "epoll_wait failed", errno, 0);
+        n = 0;
+    }
 
-        if (timercmp(&etime->abs, &now, >))
-            break;
+    for (i = 0; i < n && CTX->epoll_fd >= 0; i++) {
+        fd = ees[i].data.fd;
+        efd = fd < CTX->epoll_efds_allocd ? CTX->epoll_efds[fd] : 0;
+        if (!efd)
+            continue;
 
-        time_deregister(gc, etime);
+        revents = ees[i].events & (efd->events | POLLERR | POLLHUP);
+        if (!revents)
+            continue;
 
-        time_occurs(egc, etime);
+        DBG("ev_fd=%p occurs fd=%d events=%x revents=%x",
+            efd, efd->fd, efd->events, revents);
+
+        efd->func(egc, efd, efd->fd, efd->events, revents);
+    }
+
+    if (wakeup_revents & POLLIN) {
+        int e = libxl__self_pipe_eatall(poller->wakeup_pipe[0]);
+        if (e) LIBXL__EVENT_DISASTER(egc, "read wakeup", e, 0);
     }
+
+    afterpoll_timeouts(egc, now);
 }
+#endif
 
 void libxl_osevent_afterpoll(libxl_ctx *ctx, int nfds, const struct pollfd *fds,
                              struct timeval now)
@@ -1251,7 +1521,7 @@ void libxl_osevent_occurred_timeout(libxl_ctx *ctx, void *for_libxl)
     if (!ev) goto out;
     assert(!ev->infinite);
 
-    LIBXL_TAILQ_REMOVE(&CTX->etimes, ev, entry);
+    etimes_remove(gc, ev);
 
     time_occurs(egc, ev);
 
@@ -1568,18 +1838,41 @@ static int eventloop_iteration(libxl__egc *egc, libxl__poller *poller) {
     EGC_GC;
     int rc, nfds;
     struct timeval now;
+    struct pollfd *fds;
     
     rc = libxl__gettimeofday(gc, &now);
     if (rc) goto out;
 
     int timeout;
+    int use_epoll = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+    /* Only the epoll fd and our own wakeup pipe need polling. */
+    struct pollfd epoll_fds[2];
+
+    if (CTX->epoll_fd == -1)
+        epoll_rebuild(gc);
+
+    use_epoll = CTX->epoll_fd >= 0;
+    if (use_epoll) {
+        epoll_fds[0].fd = CTX->epoll_fd;
+        epoll_fds[0].events = POLLIN;
+        epoll_fds[1].fd = poller->wakeup_pipe[0];
+        epoll_fds[1].events = POLLIN;
+        epoll_fds[0].revents = epoll_fds[1].revents = 0;
+        fds = epoll_fds;
+        nfds = 2;
+        timeout = -1;
+        beforepoll_timeout(gc, &timeout, now);
+    }
+#endif
 
-    for (;;) {
+    while (!use_epoll) {
         nfds = poller->fd_polls_allocd;
         timeout = -1;
         rc = beforepoll_internal(gc, poller, &nfds, poller->fd_polls,
                                  &timeout, now);
-        if (!rc) break;
+        if (!rc) { fds = poller->fd_polls; break; }
         if (rc != ERROR_BUFFERFULL) goto out;
 
         struct pollfd *newarray =
@@ -1593,7 +1886,7 @@ static int eventloop_iteration(libxl__egc *egc, libxl__poller *poller) {
     }
 
     CTX_UNLOCK;
-    rc = poll(poller->fd_polls, nfds, timeout);
+    rc = poll(fds, nfds, timeout);
     CTX_LOCK;
 
     if (rc < 0) {
@@ -1608,7 +1901,12 @@ static int eventloop_iteration(libxl__egc *egc, libxl__poller *poller) {
     rc = libxl__gettimeofday(gc, &now);
     if (rc) goto out;
 
-    afterpoll_internal(egc, poller, nfds, poller->fd_polls, now);
+#ifdef HAVE_SYS_EPOLL_H
+    if (use_epoll)
+        afterepoll_internal(egc, poller, epoll_fds[1].revents, now);
+    else
+#endif
+        afterpoll_internal(egc, poller, nfds, fds, now);
 
     rc = 0;
  out:
@@ -1709,6 +2007,7 @@ void libxl__ao__destroy(libxl_ctx *ctx, libxl__ao *ao)
     AO_GC;
     if (!ao) return;
     LOG(DEBUG,"ao %p: destroy",ao);
+    libxl__device_hotplug_cancel(gc, ao);
     libxl__poller_put(ctx, ao->poller);
     ao->magic = LIBXL__AO_MAGIC_DESTROYED;
     libxl__free_all(&ao->gc);
@@ -1733,6 +2032,163 @@ libxl__gc *libxl__ao_inprogress_gc(libxl__ao *ao)
     return &ao->gc;
 }
 
+/*
+ * ao timing traces
+ */
+
+typedef struct libxl__ao_trace_record libxl__ao_trace_record;
+
+struct libxl__ao_trace_record {
+    LIBXL_TAILQ_ENTRY(struct libxl__ao_trace_record) entry;
+    uint32_t domid;
+    int nr;
+    libxl_ao_trace_entry *entries;
+};
+
+static uint64_t trace_us(const struct timeval *since,
+                         const struct timeval *now)
+{
+    struct timeval diff;
+
+    if (timercmp(now, since, <))
+        return 0;
+    timersub(now, since, &diff);
+    return (uint64_t)diff.tv_sec * 1000000 + diff.tv_usec;
+}
+
+int libxl__ao_trace_begin(libxl__ao *ao, const char *what)
+{
+    AO_GC;
+    libxl__ao_trace_stage *stage;
+
+    assert(ao->magic == LIBXL__AO_MAGIC);
+    assert(!ao->complete);
+
+    if (ao->trace_used >= ao->trace_allocd) {
+        ao->trace_allocd = ao->trace_used * 2 + 8;
+        GCREALLOC_ARRAY(ao->trace, ao->trace_allocd);
+    }
+    stage = &ao->trace[ao->trace_used];
+    if (libxl__gettimeofday(gc, &stage->start))
+        return -1;
+    stage->what = libxl__strdup(gc, what);
+    stage->done = 0;
+    return ao->trace_used++;
+}
+
+void libxl__ao_trace_end(libxl__ao *ao, int handle)
+{
+    AO_GC;
+    libxl__ao_trace_stage *stage;
+
+    if (handle < 0)
+        return;
+    assert(handle < ao->trace_used);
+    stage = &ao->trace[handle];
+    if (stage->done || libxl__gettimeofday(gc, &stage->end))
+        return;
+    stage->done = 1;
+
+    LOG(DEBUG, "ao %p: %s took %"PRIu64"us", ao, stage->what,
+        trace_us(&stage->start, &stage->end));
+}
+
+void libxl__ao_trace_domid(libxl__ao *ao, uint32_t domid)
+{
+    ao->trace_domid = domid;
+}
+
+static void ao_trace_record_free(libxl__ao_trace_record *rec)
+{
+    libxl_ao_trace_list_free(rec->entries, rec->nr);
+    free(rec);
+}
+
+/* Called on ao completion: copies the ao's trace to the ctx. */
+static void ao_trace_file(libxl__gc *gc, libxl__ao *ao)
+{
+    libxl__ao_trace_record *rec, *old;
+    struct timeval now;
+    int i;
+
+    if (!ao->trace_used || ao->trace_domid == LIBXL__AO_TRACE_NO_DOMID)
+        return;
+    if (libxl__gettimeofday(gc, &now))
+        return;
+
+    rec = libxl__zalloc(NOGC, sizeof(*rec));
+    rec->domid = ao->trace_domid;
+    rec->nr = ao->trace_used;
+    rec->entries = libxl__calloc(NOGC, rec->nr, sizeof(*rec->entries));
+    for (i = 0; i < rec->nr; i++) {
+        const libxl__ao_trace_stage *stage = &ao->trace[i];
+        libxl_ao_trace_entry *ent = &rec->entries[i];
+
+        libxl_ao_trace_entry_init(ent);
+        ent->what = libxl__strdup(NOGC, stage->what);
+        ent->start_us = trace_us(&ao->trace_start, &stage->start);
+        ent->duration_us = trace_us(&stage->start,
+                                    stage->done ? &stage->end : &now);
+    }
+    LOG(DEBUG, "ao %p: dom%u traced, %"PRIu64"us in all", ao, rec->domid,
+        trace_us(&ao->trace_start, &now));
+
+    LIBXL_TAILQ_FOREACH(old, &CTX->ao_traces, entry) {
+        if (old->domid != rec->domid) continue;
+        LIBXL_TAILQ_REMOVE(&CTX->ao_traces, old, entry);
+        CTX->ao_traces_count--;
+        ao_trace_record_free(old);
+        break;
+    }
+    LIBXL_TAILQ_INSERT_TAIL(&CTX->ao_traces, rec, entry);
+    if (++CTX->ao_traces_count > LIBXL__AO_TRACES_KEPT) {
+        old = LIBXL_TAILQ_FIRST(&CTX->ao_traces);
+        LIBXL_TAILQ_REMOVE(&CTX->ao_traces, old, entry);
+        CTX->ao_traces_count--;
+        ao_trace_record_free(old);
+    }
+}
+
+void libxl__ao_traces_free(libxl_ctx *ctx)
+{
+    libxl__ao_trace_record *rec;
+
+    while ((rec = LIBXL_TAILQ_FIRST(&ctx->ao_traces))) {
+        LIBXL_TAILQ_REMOVE(&ctx->ao_traces, rec, entry);
+        ao_trace_record_free(rec);
+    }
+    ctx->ao_traces_count = 0;
+}
+
+int libxl_ao_trace(libxl_ctx *ctx, uint32_t domid,
+                   libxl_ao_trace_entry **entries_r, int *nr_entries_r)
+{
+    GC_INIT(ctx);
+    libxl__ao_trace_record *rec;
+    libxl_ao_trace_entry *entries = NULL;
+    int i, nr = 0;
+
+    CTX_LOCK;
+    LIBXL_TAILQ_FOREACH(rec, &ctx->ao_traces, entry) {
+        if (rec->domid != domid) continue;
+        nr = rec->nr;
+        entries = libxl__calloc(NOGC, nr, sizeof(*entries));
+        for (i = 0; i < nr; i++) {
+            libxl_ao_trace_entry_init(&entries[i]);
+            entries[i].what = libxl__strdup(NOGC, rec->entries[i].what);
+            entries[i].start_us = rec->entries[i].start_us;
+            entries[i].duration_us = rec->entries[i].duration_us;
+        }
+        break;
+    }
+    CTX_UNLOCK;
+
+    *entries_r = entries;
+    *nr_entries_r = nr;
+    GC_FREE;
+    return 0;
+}
+
 void libxl__ao_complete(libxl__egc *egc, libxl__ao *ao, int rc)
 {
     AO_GC;
@@ -1743,6 +2199,8 @@ void libxl__ao_complete(libxl__egc *egc, libxl__ao *ao, int rc)
     ao->complete = 1;
     ao->rc = rc;
 
+    libxl__device_hotplug_cancel(gc, ao);
+    ao_trace_file(gc, ao);
     libxl__ao_complete_check_progress_reports(egc, ao);
 }
 
@@ -1797,6 +2255,8 @@ libxl__ao *libxl__ao_create(libxl_ctx *ctx, uint32_t domid,
     ao->poller = 0;
     ao->domid = domid;
     LIBXL_INIT_GC(ao->gc, ctx);
+    ao->trace_domid = domid;
+    gettimeofday(&ao->trace_start, 0);
 
     if (how) {
         ao->how = *how;
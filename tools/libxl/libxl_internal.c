@@ -30,57 +30,115 @@ void libxl__alloc_failed(libxl_ctx *ctx, const char *func,
 #undef L
 }
 
-void libxl__ptr_add(libxl__gc *gc, void *ptr)
+/*
+ * gc'd allocations are carved out of a chain of chunks by bumping a
+ * pointer, so allocating is O(1) and libxl__free_all is one free()
+ * per chunk.  Large blocks, blocks which have been libxl__realloc'd
+ * out of the arena, and pointers handed to us by libxl__ptr_add live
+ * on the alloc_ptrs side list instead.
+ */
+#define GC_ALIGN        (2 * sizeof(size_t))
+#define GC_ROUNDUP(sz)  (((sz) + GC_ALIGN - 1) & ~(GC_ALIGN - 1))
+#define GC_CHUNK_MIN    4096
+#define GC_CHUNK_MAX    65536
+#define GC_LARGE        (GC_CHUNK_MAX / 4)
+
+struct libxl__gc_chunk {
+    libxl__gc_chunk *next;
+    char *ptr;  /* next free byte */
+    char *end;
+    char *last; /* most recent allocation, which may be resized in place */
+};
+
+#define GC_CHUNK_DATA(c) ((char *)(c) + GC_ROUNDUP(sizeof(libxl__gc_chunk)))
+
+static void *gc_arena_alloc(libxl__gc *gc, size_t size)
 {
-    int i;
+    libxl__gc_chunk *c = gc->chunks;
+    size_t need = GC_ROUNDUP(size ? size : 1);
+
+    if (!c || (size_t)(c->end - c->ptr) < need) {
+        size_t csize = c ? (c->end - (char *)c) * 2 : GC_CHUNK_MIN;
+
+        if (csize > GC_CHUNK_MAX) csize = GC_CHUNK_MAX;
+        if (csize < GC_ROUNDUP(sizeof(*c)) + need)
+            csize = GC_ROUNDUP(sizeof(*c)) + need;
 
+        c = malloc(csize);
+        if (!c) libxl__alloc_failed(CTX, __func__, csize, 1);
+
+        c->next = gc->chunks;
+        c->ptr = GC_CHUNK_DATA(c);
+        c->end = (char *)c + csize;
+        gc->chunks = c;
+    }
+
+    c->last = c->ptr;
+    c->ptr += need;
+    return c->last;
+}
+
+static libxl__gc_chunk *gc_arena_find(libxl__gc *gc, const void *ptr)
+{
+    libxl__gc_chunk *c;
+
+    for (c = gc->chunks; c; c = c->next)
+        if ((const char *)ptr >= GC_CHUNK_DATA(c) &&
+            (const char *)ptr < c->ptr)
+            return c;
+
+    return NULL;
+}
+
+void libxl__ptr_add(libxl__gc *gc, void *ptr)
+{
     if (!libxl__gc_is_real(gc))
         return;
 
     if (!ptr)
         return;
 
-    /* fast case: we have space in the array for storing the pointer */
-    for (i = 0; i < gc->alloc_maxsize; i++) {
-        if (!gc->alloc_ptrs[i]) {
-            gc->alloc_ptrs[i] = ptr;
-            return;
-        }
+    if (gc->alloc_used == gc->alloc_maxsize) {
+        int new_maxsize = gc->alloc_maxsize * 2 + 25;
+        assert(new_maxsize < INT_MAX / sizeof(void*) / 2);
+        gc->alloc_ptrs = realloc(gc->alloc_ptrs, new_maxsize * sizeof(void *));
+        if (!gc->alloc_ptrs)
+            libxl__alloc_failed(CTX, __func__, new_maxsize, sizeof(void*));
+        gc->alloc_maxsize = new_maxsize;
     }
-    int new_maxsize = gc->alloc_maxsize * 2 + 25;
-    assert(new_maxsize < INT_MAX / sizeof(void*) / 2);
-    gc->alloc_ptrs = realloc(gc->alloc_ptrs, new_maxsize * sizeof(void *));
-    if (!gc->alloc_ptrs)
-        libxl__alloc_failed(CTX, __func__, new_maxsize, sizeof(void*));
-
-    gc->alloc_ptrs[gc->alloc_maxsize++] = ptr;
-
-    while (gc->alloc_maxsize < new_maxsize)
-        gc->alloc_ptrs[gc->alloc_maxsize++] = 0;
 
-    return;
+    gc->alloc_ptrs[gc->alloc_used++] = ptr;
 }
 
 void libxl__free_all(libxl__gc *gc)
 {
-    void *ptr;
+    libxl__gc_chunk *c, *next;
     int i;
 
     assert(libxl__gc_is_real(gc));
 
-    for (i = 0; i < gc->alloc_maxsize; i++) {
-        ptr = gc->alloc_ptrs[i];
-        gc->alloc_ptrs[i] = NULL;
-        free(ptr);
-    }
+    for (i = 0; i < gc->alloc_used; i++)
+        free(gc->alloc_ptrs[i]);
     free(gc->alloc_ptrs);
     gc->alloc_ptrs = 0;
     gc->alloc_maxsize = 0;
+    gc->alloc_used = 0;
+
+    for (c = gc->chunks; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+    gc->chunks = 0;
 }
 
 void *libxl__malloc(libxl__gc *gc, size_t size)
 {
-    void *ptr = malloc(size);
+    void *ptr;
+
+    if (libxl__gc_is_real(gc) && size <= GC_LARGE)
+        return gc_arena_alloc(gc, size);
+
+    ptr = malloc(size);
     if (!ptr) libxl__alloc_failed(CTX, __func__, size, 1);
 
     libxl__ptr_add(gc, ptr);
@@ -89,7 +147,12 @@ void *libxl__malloc(libxl__gc *gc, size_t size)
 
 void *libxl__zalloc(libxl__gc *gc, size_t size)
 {
-    void *ptr = calloc(size, 1);
+    void *ptr;
+
+    if (libxl__gc_is_real(gc) && size <= GC_LARGE)
+        return memset(gc_arena_alloc(gc, size), 0, size);
+
+    ptr = calloc(size, 1);
     if (!ptr) libxl__alloc_failed(CTX, __func__, size, 1);
 
     libxl__ptr_add(gc, ptr);
@@ -98,7 +161,15 @@ void *libxl__zalloc(libxl__gc *gc, size_t size)
 
 void *libxl__calloc(libxl__gc *gc, size_t nmemb, size_t size)
 {
-    void *ptr = calloc(nmemb, size);
+    void *ptr;
+
+    if (size && nmemb > SIZE_MAX / size)
+        libxl__alloc_failed(CTX, __func__, nmemb, size);
+
+    if (libxl__gc_is_real(gc) && nmemb * size <= GC_LARGE)
+        return memset(gc_arena_alloc(gc, nmemb * size), 0, nmemb * size);
+
+    ptr = calloc(nmemb, size);
     if (!ptr) libxl__alloc_failed(CTX, __func__, nmemb, size);
 
     libxl__ptr_add(gc, ptr);
@@ -107,16 +178,40 @@ void *libxl__calloc(libxl__gc *gc, size_t nmemb, size_t size)
 
 void *libxl__realloc(libxl__gc *gc, void *ptr, size_t new_size)
 {
-    void *new_ptr = realloc(ptr, new_size);
-    int i = 0;
+    libxl__gc_chunk *c;
+    void *new_ptr;
+    int i;
+
+    if (ptr == NULL && libxl__gc_is_real(gc))
+        return libxl__malloc(gc, new_size);
+
+    if (ptr && libxl__gc_is_real(gc) && (c = gc_arena_find(gc, ptr))) {
+        size_t avail = c->ptr - (char *)ptr;
+        size_t need = GC_ROUNDUP(new_size ? new_size : 1);
 
+        /* the newest block in a chunk can grow or shrink in place */
+        if (ptr == c->last && new_size <= GC_LARGE &&
+            (size_t)(c->end - (char *)ptr) >= need) {
+            c->ptr = (char *)ptr + need;
+            return ptr;
+        }
+
+        /* the old size is not recorded, but the block is wholly
+         * within [ptr, c->ptr) so copying that much is safe */
+        new_ptr = libxl__malloc(gc, new_size);
+        memcpy(new_ptr, ptr, avail < new_size ? avail : new_size);
+        return new_ptr;
+    }
+
+    new_ptr = realloc(ptr, new_size);
     if (new_ptr == NULL && new_size != 0)
         libxl__alloc_failed(CTX, __func__, new_size, 1);
 
     if (ptr == NULL) {
         libxl__ptr_add(gc, new_ptr);
     } else if (new_ptr != ptr && libxl__gc_is_real(gc)) {
-        for (i = 0; i < gc->alloc_maxsize; i++) {
+        /* recently added blocks are the likeliest to be resized */
+        for (i = gc->alloc_used - 1; i >= 0; i--) {
             if (gc->alloc_ptrs[i] == ptr) {
                 gc->alloc_ptrs[i] = new_ptr;
                 break;
@@ -139,7 +234,7 @@ char *libxl__sprintf(libxl__gc *gc, const char *fmt, ...)
 
     assert(ret >= 0);
 
-    s = libxl__zalloc(gc, ret + 1);
+    s = libxl__malloc(gc, ret + 1);
     va_start(ap, fmt);
     ret = vsnprintf(s, ret + 1, fmt, ap);
     va_end(ap);
@@ -149,22 +244,18 @@ char *libxl__sprintf(libxl__gc *gc, const char *fmt, ...)
 
 char *libxl__strdup(libxl__gc *gc, const char *c)
 {
-    char *s = strdup(c);
-
-    if (!s) libxl__alloc_failed(CTX, __func__, strlen(c), 1);
-
-    libxl__ptr_add(gc, s);
+    size_t len = strlen(c) + 1;
 
-    return s;
+    return memcpy(libxl__malloc(gc, len), c, len);
 }
 
 char *libxl__strndup(libxl__gc *gc, const char *c, size_t n)
 {
-    char *s = strndup(c, n);
-
-    if (!s) libxl__alloc_failed(CTX, __func__, n, 1);
+    size_t len = strnlen(c, n);
+    char *s = libxl__malloc(gc, len + 1);
 
-    libxl__ptr_add(gc, s);
+    memcpy(s, c, len);
+    s[len] = 0;
 
     return s;
 }
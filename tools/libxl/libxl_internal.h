@@ -83,6 +83,10 @@
 #define LIBXL_INIT_TIMEOUT 10
 #define LIBXL_DESTROY_TIMEOUT 10
 #define LIBXL_HOTPLUG_TIMEOUT 10
+/* default number of hotplug scripts run at once, per ctx; may be
+ * overridden with LIBXL_HOTPLUG_CONCURRENCY in the environment, where
+ * 0 means no limit */
+#define LIBXL_HOTPLUG_CONCURRENCY 8
 #define LIBXL_DEVICE_MODEL_START_TIMEOUT 10
 #define LIBXL_QEMU_BODGE_TIMEOUT 2
 #define LIBXL_XENCONSOLE_LIMIT 1048576
@@ -134,9 +138,11 @@ _hidden void libxl__log(libxl_ctx *ctx, xentoollog_level msglevel, int errnoval,
      /* these functions preserve errno (saving and restoring) */
 
 typedef struct libxl__gc libxl__gc;
+typedef struct libxl__gc_chunk libxl__gc_chunk;
 typedef struct libxl__egc libxl__egc;
 typedef struct libxl__ao libxl__ao;
 typedef struct libxl__aop_occurred libxl__aop_occurred;
+typedef struct libxl__devindex libxl__devindex;
 typedef struct libxl__osevent_hook_nexus libxl__osevent_hook_nexus;
 typedef struct libxl__osevent_hook_nexi libxl__osevent_hook_nexi;
 
@@ -178,8 +184,9 @@ struct libxl__ev_time {
     /* read-only for caller, who may read only when registered: */
     libxl__ev_time_callback *func;
     /* remainder is private for libxl__ev_time... */
-    int infinite; /* not registered in list or with app if infinite */
-    LIBXL_TAILQ_ENTRY(libxl__ev_time) entry;
+    int infinite; /* not registered in heap or with app if infinite */
+    int heap_index; /* in CTX->etimes */
+    uint64_t seq; /* orders timeouts with the same abs */
     struct timeval abs;
     libxl__osevent_hook_nexus *nexus;
 };
@@ -306,7 +313,9 @@ struct libxl__poller {
 struct libxl__gc {
     /* mini-GC */
     int alloc_maxsize; /* -1 means this is the dummy non-gc gc */
-    void **alloc_ptrs;
+    int alloc_used;
+    void **alloc_ptrs; /* malloc'd blocks: large, realloc'd or ptr_add'ed */
+    libxl__gc_chunk *chunks; /* bump arena for everything else */
     libxl_ctx *owner;
 };
 
@@ -346,7 +355,15 @@ struct libxl__ctx {
     LIBXL_SLIST_HEAD(libxl__osevent_hook_nexi, libxl__osevent_hook_nexus)
         hook_fd_nexi_idle, hook_timeout_nexi_idle;
     LIBXL_LIST_HEAD(, libxl__ev_fd) efds;
-    LIBXL_TAILQ_HEAD(, libxl__ev_time) etimes;
+    libxl__ev_time **etimes; /* binary min-heap, see libxl_event.c */
+    int etimes_used, etimes_allocd;
+    uint64_t etimes_seq;
+
+    /* efds mirrored in an epoll set, which internal pollers wait on
+     * instead of building a pollfd array; see eventloop_iteration */
+    int epoll_fd; /* -1: to be (re)built; -2: not in use, poll instead */
+    libxl__ev_fd **epoll_efds; /* indexed by fd */
+    int epoll_efds_allocd;
 
     libxl__ev_watch_slot *watch_slots;
     int watch_nslots;
@@ -373,6 +390,15 @@ struct libxl__ctx {
     bool sigchld_user_registered;
     LIBXL_LIST_ENTRY(libxl_ctx) sigchld_users_entry;
 
+    int hotplug_running, hotplug_max; /* hotplug_max <= 0: no limit */
+    LIBXL_TAILQ_HEAD(, struct libxl__ao_device) hotplug_waiting;
+
+    /* traces of completed aos, oldest first, for libxl_ao_trace */
+    LIBXL_TAILQ_HEAD(, struct libxl__ao_trace_record) ao_traces;
+    int ao_traces_count;
+
+    libxl__devindex *devindex; /* NULL unless libxl_device_index_enable */
+
     libxl_version_info version_info;
 };
 
@@ -425,6 +451,12 @@ struct libxl__aop_occurred {
     const libxl_asyncprogress_how *how;
 };
 
+typedef struct libxl__ao_trace_stage {
+    const char *what;
+    struct timeval start, end;
+    bool done;
+} libxl__ao_trace_stage;
+
 #define LIBXL__AO_MAGIC              0xA0FACE00ul
 #define LIBXL__AO_MAGIC_DESTROYED    0xA0DEAD00ul
 
@@ -452,11 +484,18 @@ struct libxl__ao {
     libxl__poller *poller;
     uint32_t domid;
     LIBXL_TAILQ_ENTRY(libxl__ao) entry_for_callback;
+    /* timing trace, see libxl__ao_trace_begin */
+    uint32_t trace_domid;
+    struct timeval trace_start;
+    libxl__ao_trace_stage *trace;
+    int trace_used, trace_allocd;
 };
 
 #define LIBXL_INIT_GC(gc,ctx) do{               \
         (gc).alloc_maxsize = 0;                 \
+        (gc).alloc_used = 0;                    \
         (gc).alloc_ptrs = 0;                    \
+        (gc).chunks = 0;                        \
         (gc).owner = (ctx);                     \
     } while(0)
     /* NB, also, a gc struct ctx->nogc_gc is initialised in libxl_ctx_alloc */
@@ -481,7 +520,9 @@ static inline int libxl__gc_is_real(const libxl__gc *gc)
  * that description.
  *
  * All pointers returned by these functions are registered for garbage
- * collection on exit from the outermost libxl callframe.
+ * collection on exit from the outermost libxl callframe.  Small
+ * allocations are carved out of a per-gc arena, so a gc'd pointer
+ * must never be passed to free(3) or realloc(3); use libxl__realloc.
  *
  * However, where the argument is stated to be "gc_opt", &ctx->nogc_gc
  * may be passed instead, in which case no garbage collection will
@@ -679,6 +720,38 @@ void libxl__xs_transaction_abort(libxl__gc *gc, xs_transaction_t *t);
 _hidden int libxl__xs_path_cleanup(libxl__gc *gc, xs_transaction_t t,
                                    const char *user_path);
 
+/*
+ * Device index (libxl_devindex.c), see libxl_device_index_enable.
+ *
+ * libxl__devindex_read{,_checked} and libxl__devindex_directory are
+ * like libxl__xs_read{,_checked} and libxl__xs_directory outside a
+ * transaction.  Paths under /local/domain/N/{backend,device}/KIND are
+ * served from the index when it is enabled; anything else, or
+ * everything when it is not, goes straight to xenstore.
+ *
+ * libxl__devindex_invalidate forgets anything cached at or below path,
+ * which was (or is about to be) written in t.  If t was started with
+ * libxl__xs_transaction_start the path is forgotten again when
+ * libxl__xs_transaction_commit succeeds; that and the abort call
+ * libxl__devindex_transaction_{start,end}.  The xenstore write helpers
+ * above call libxl__devindex_invalidate, so only code which writes with
+ * xs_* directly needs to (after committing, if in a transaction of its
+ * own).
+ */
+_hidden int libxl__devindex_read_checked(libxl__gc *gc, const char *path,
+                                         const char **result_out);
+_hidden char *libxl__devindex_read(libxl__gc *gc, const char *path);
+_hidden char **libxl__devindex_directory(libxl__gc *gc, const char *path,
+                                         unsigned int *num);
+_hidden void libxl__devindex_invalidate(libxl__gc *gc, xs_transaction_t t,
+                                        const char *path);
+_hidden void libxl__devindex_transaction_start(libxl__gc *gc,
+                                               xs_transaction_t t);
+_hidden void libxl__devindex_transaction_end(libxl__gc *gc,
+                                             xs_transaction_t t,
+                                             bool committed);
+_hidden void libxl__devindex_free(libxl_ctx *ctx);
+
 /*
  * Event generation functions provided by the libxl event core to the
  * rest of libxl.  Implemented in terms of _beforepoll/_afterpoll
@@ -1999,6 +2072,28 @@ _hidden libxl__ao *libxl__nested_ao_create(libxl__ao *parent); /* cannot fail */
 _hidden void libxl__nested_ao_free(libxl__ao *child);
 
 
+/*
+ * Timing trace of an ao, for libxl_ao_trace.
+ *
+ * _begin starts a stage called what (copied) and returns a handle to
+ * pass to _end, or -1 if the stage could not be timed; -1 may be
+ * passed to _end, which then does nothing.  Stages may overlap, and
+ * any left open are ended when the ao completes.  The trace is then
+ * filed under ao->domid, or the domid given to _domid, unless that is
+ * LIBXL__AO_TRACE_NO_DOMID or there were no stages.  The last
+ * LIBXL__AO_TRACES_KEPT traces are kept, one per domid.
+ *
+ * All of these must be called with the ctx locked.
+ */
+#define LIBXL__AO_TRACE_NO_DOMID (~(uint32_t)0)
+#define LIBXL__AO_TRACES_KEPT 16
+
+_hidden int libxl__ao_trace_begin(libxl__ao *ao, const char *what);
+_hidden void libxl__ao_trace_end(libxl__ao *ao, int handle);
+_hidden void libxl__ao_trace_domid(libxl__ao *ao, uint32_t domid);
+_hidden void libxl__ao_traces_free(libxl_ctx *ctx);
+
+
 /*
  * File descriptors and CLOEXEC
  */
@@ -2136,6 +2231,11 @@ struct libxl__ao_device {
     int num_exec;
     /* for calling hotplug scripts */
     libxl__async_exec_state aes;
+    /* script waiting for a slot on ctx->hotplug_waiting, or running */
+    bool hotplug_queued, hotplug_running;
+    LIBXL_TAILQ_ENTRY(struct libxl__ao_device) hotplug_entry;
+    /* ao trace handles for the whole operation and the running script */
+    int trace, hotplug_trace;
 };
 
 /*
@@ -2320,6 +2420,11 @@ _hidden void libxl__wait_device_connection(libxl__egc*,
 _hidden void libxl__initiate_device_remove(libxl__egc *egc,
                                            libxl__ao_device *aodev);
 
+/* Takes the hotplug scripts of ao still waiting for a slot off
+ * ctx->hotplug_waiting, so that they never run.  Called when ao
+ * completes or is destroyed; their aodev callbacks are not made. */
+_hidden void libxl__device_hotplug_cancel(libxl__gc *gc, libxl__ao *ao);
+
 /*
  * libxl__get_hotplug_script_info returns the args and env that should
  * be passed to the hotplug script for the requested device.
@@ -2517,9 +2622,12 @@ struct libxl__domain_suspend_state {
 
     uint32_t domid;
     int fd;
+    const int *data_fds; /* page data streams, see xc_domain_save_streams */
+    int nr_data_fds;
     libxl_domain_type type;
     int live;
     int debug;
+    int page_index;
     const libxl_domain_remus_info *remus;
     /* private */
     libxl__ev_evtchn guest_evtchn;
@@ -2793,6 +2901,8 @@ struct libxl__domain_create_state {
     libxl__ao *ao;
     libxl_domain_config *guest_config;
     int restore_fd;
+    const int *data_fds; /* page data streams, with restore_fd */
+    int nr_data_fds;
     libxl__domain_create_cb *callback;
     libxl_asyncprogress_how aop_console_how;
     /* private to domain_create */
@@ -2807,6 +2917,8 @@ struct libxl__domain_create_state {
     /* necessary if the domain creation failed and we have to destroy it */
     libxl__domain_destroy_state dds;
     libxl__multidev multidev;
+    /* ao trace handle of the current stage, see domcreate_stage */
+    int stage;
 };
 
 /*----- Domain suspend (save) functions -----*/
@@ -3034,6 +3146,8 @@ static inline void libxl__ctx_unlock(libxl_ctx *ctx) {
 typedef struct {
     int nr_cpus, nr_nodes;
     int nr_vcpus;
+    uint32_t distance; /* sum, over every two distinct nodes of the
+                        * candidate, of the distance between them */
     uint32_t free_memkb;
     libxl_bitmap nodemap;
 } libxl__numa_candidate;
@@ -3042,6 +3156,10 @@ typedef struct {
 typedef int (*libxl__numa_candidate_cmpf)(const libxl__numa_candidate *c1,
                                           const libxl__numa_candidate *c2);
 
+/* The one automatic placement uses (see libxl_dom.c) */
+_hidden int libxl__numa_cmpf(const libxl__numa_candidate *c1,
+                             const libxl__numa_candidate *c2);
+
 /*
  * This looks for the best NUMA placement candidate satisfying some
  * specific conditions. If min_nodes and/or max_nodes are not 0, their
@@ -3057,7 +3175,14 @@ typedef int (*libxl__numa_candidate_cmpf)(const libxl__numa_candidate *c1,
  * is where the heuristics for determining which candidate is the best
  * one is actually implemented. The only bit of it that is hardcoded in
  * this function is the fact that candidates with fewer nodes are always
- * preferrable.
+ * preferrable. numa_cmpf() is only given the numeric fields of the
+ * candidates: their nodemaps are not filled in.
+ *
+ * On hosts with up to LIBXL__NUMA_MAX_EXHAUSTIVE_NODES suitable nodes,
+ * all the possible candidates are evaluated. On bigger ones a greedy
+ * search, seeded from each node in turn and growing towards the closest
+ * nodes, is refined by swapping nodes in and out of the candidate for
+ * as long as that improves it (see libxl__numa_search()).
  *
  * If at least one suitable candidate is found, it is returned in cndt_out,
  * cndt_found is set to one, and the function returns successfully. On the
@@ -3081,10 +3206,42 @@ _hidden int libxl__get_numa_candidate(libxl__gc *gc,
                                       libxl__numa_candidate *cndt_out,
                                       int *cndt_found);
 
+/*
+ * The search proper, which libxl__get_numa_candidate() runs on what it
+ * finds out about the host, but which can just as well be run on a
+ * synthetic host (see libxl_test_numaplace.c).
+ *
+ * The arrays in host are indexed by node. dists, if not NULL, is the
+ * nr_nodes x nr_nodes distance matrix, in row major order. Only the
+ * nodes in suitable_nodemap are considered. The candidates are searched
+ * exhaustively iff there are no more than max_exhaustive_nodes of them.
+ * cndt_out->nodemap must already be allocated. The rest of the arguments
+ * and the return value are as for libxl__get_numa_candidate().
+ */
+typedef struct {
+    int nr_nodes;
+    const uint32_t *free_memkb;
+    const int *nr_cpus; /* suitable cpus */
+    const int *nr_vcpus; /* vcpus able to run on the node */
+    const uint32_t *dists;
+    const libxl_bitmap *suitable_nodemap;
+} libxl__numa_host;
+
+#define LIBXL__NUMA_MAX_EXHAUSTIVE_NODES 16
+
+_hidden int libxl__numa_search(libxl__gc *gc, const libxl__numa_host *host,
+                               int max_exhaustive_nodes,
+                               uint32_t min_free_memkb, int min_cpus,
+                               int min_nodes, int max_nodes,
+                               libxl__numa_candidate_cmpf numa_cmpf,
+                               libxl__numa_candidate *cndt_out,
+                               int *cndt_found);
+
 /* Initialization, allocation and deallocation for placement candidates */
 static inline void libxl__numa_candidate_init(libxl__numa_candidate *cndt)
 {
     cndt->free_memkb = 0;
+    cndt->distance = 0;
     cndt->nr_cpus = cndt->nr_nodes = cndt->nr_vcpus = 0;
     libxl_bitmap_init(&cndt->nodemap);
 }
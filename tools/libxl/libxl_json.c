@@ -971,6 +971,83 @@ out:
     return ret;
 }
 
+/*
+ * Streaming writer
+ */
+
+#define JSON_WRITER_BUFSZ 16384
+
+struct libxl_json_writer {
+    libxl_ctx *ctx;
+    int fd;
+    yajl_gen hand;
+    int rc;                     /* sticky: set by the first failed write */
+    size_t used;
+    char buf[JSON_WRITER_BUFSZ];
+};
+
+static void json_writer_write(libxl_json_writer *w,
+                              const char *data, size_t len)
+{
+    if (w->rc || !len)
+        return;
+    if (libxl_write_exactly(w->ctx, w->fd, data, len, "JSON output", NULL))
+        w->rc = ERROR_FAIL;
+}
+
+static void json_writer_print(void *opaque, const char *str,
+                              libxl_yajl_length len)
+{
+    libxl_json_writer *w = opaque;
+
+    if (w->used + len > sizeof(w->buf)) {
+        json_writer_write(w, w->buf, w->used);
+        w->used = 0;
+    }
+    if (len > sizeof(w->buf)) {
+        json_writer_write(w, str, len);
+        return;
+    }
+    memcpy(w->buf + w->used, str, len);
+    w->used += len;
+}
+
+libxl_json_writer *libxl_json_writer_alloc(libxl_ctx *ctx, int fd)
+{
+    libxl_json_writer *w;
+
+    w = malloc(sizeof(*w));
+    if (!w)
+        return NULL;
+
+    w->ctx = ctx;
+    w->fd = fd;
+    w->rc = 0;
+    w->used = 0;
+    w->hand = libxl_yajl_gen_alloc_print(json_writer_print, w, NULL);
+    if (!w->hand) {
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+yajl_gen libxl_json_writer_gen(libxl_json_writer *w)
+{
+    return w->hand;
+}
+
+int libxl_json_writer_free(libxl_json_writer *w)
+{
+    int rc;
+
+    yajl_gen_free(w->hand);
+    json_writer_write(w, w->buf, w->used);
+    rc = w->rc;
+    free(w);
+    return rc;
+}
+
 yajl_gen_status libxl__uint64_gen_json(yajl_gen hand, uint64_t val)
 {
     char *num;
@@ -61,6 +61,17 @@ static inline yajl_gen libxl_yajl_gen_alloc(const yajl_alloc_funcs *allocFuncs)
     return g;
 }
 
+static inline yajl_gen libxl_yajl_gen_alloc_print(yajl_print_t print,
+                                                  void *print_ctx,
+                                                  const yajl_alloc_funcs *allocFuncs)
+{
+    yajl_gen g;
+    g = libxl_yajl_gen_alloc(allocFuncs);
+    if (g)
+        yajl_gen_config(g, yajl_gen_print_callback, print, print_ctx);
+    return g;
+}
+
 #else /* !HAVE_YAJL_V2 */
 
 #define yajl_complete_parse yajl_parse_complete
@@ -84,9 +95,33 @@ static inline yajl_gen libxl_yajl_gen_alloc(const yajl_alloc_funcs *allocFuncs)
     return yajl_gen_alloc(&conf, allocFuncs);
 }
 
+static inline yajl_gen libxl_yajl_gen_alloc_print(yajl_print_t print,
+                                                  void *print_ctx,
+                                                  const yajl_alloc_funcs *allocFuncs)
+{
+    yajl_gen_config conf = { 1, "    " };
+    return yajl_gen_alloc2(print, &conf, allocFuncs, print_ctx);
+}
+
 #endif /* !HAVE_YAJL_V2 */
 
 yajl_gen_status libxl_domain_config_gen_json(yajl_gen hand,
                                              libxl_domain_config *p);
 
+/*
+ * A JSON generator which writes its output to fd as it goes (through
+ * a small buffer of its own) rather than accumulating the whole
+ * document in memory, for callers emitting large documents such as
+ * the configs of many domains.
+ *
+ * Generate into libxl_json_writer_gen(w), with the *_gen_json
+ * functions or yajl_gen_* directly.  libxl_json_writer_free flushes
+ * any remaining output and returns 0, or ERROR_FAIL if any write to
+ * fd failed (which will have been logged).  fd is not closed.
+ */
+typedef struct libxl_json_writer libxl_json_writer;
+libxl_json_writer *libxl_json_writer_alloc(libxl_ctx *ctx, int fd);
+yajl_gen libxl_json_writer_gen(libxl_json_writer *w);
+int libxl_json_writer_free(libxl_json_writer *w);
+
 #endif /* LIBXL_JSON_H */
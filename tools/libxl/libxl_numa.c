@@ -105,76 +105,324 @@ static int comb_next(comb_iter_t it, int n, int k)
 /* NUMA automatic placement (see libxl_internal.h for details) */
 
 /*
- * This function turns a k-combination iterator into a node map,
- * given another map, telling us which nodes should be considered.
+ * Both the exhaustive and the heuristic search deal with sets of k
+ * indexes into sn[], the array of the suitable nodes of the host. The
+ * free memory, cpus, vcpus and distance of a set are accounted for by
+ * summing up the per-node figures in the libxl__numa_host, and when a
+ * set changes by one node its figures are updated rather than computed
+ * again, so that looking at a set costs O(k) at most.
+ */
+typedef struct {
+    const libxl__numa_host *host;
+    int *sn, nr_sn;
+    uint32_t min_free_memkb;
+    int min_cpus;
+    libxl__numa_candidate_cmpf numa_cmpf;
+} numa_search;
+
+static uint32_t node_distance(const numa_search *s, int i, int j)
+{
+    const libxl__numa_host *host = s->host;
+
+    if (!host->dists)
+        return 0;
+    return host->dists[s->sn[i] * host->nr_nodes + s->sn[j]];
+}
+
+/* Update the figures in c for node i joining (sign > 0) or leaving
+ * (sign < 0) the set of k nodes (i itself may be listed in set). */
+static void set_update(const numa_search *s, const int *set, int k,
+                       int i, int sign, libxl__numa_candidate *c)
+{
+    int node = s->sn[i], j;
+    uint32_t dist = 0;
+
+    for (j = 0; j < k; j++)
+        if (set[j] != i)
+            dist += node_distance(s, i, set[j]);
+
+    c->free_memkb += sign * s->host->free_memkb[node];
+    c->nr_cpus += sign * s->host->nr_cpus[node];
+    c->nr_vcpus += sign * s->host->nr_vcpus[node];
+    c->distance += sign * dist;
+    c->nr_nodes += sign;
+}
+
+static void set_eval(const numa_search *s, const int *set, int k,
+                     libxl__numa_candidate *c)
+{
+    int i;
+
+    libxl__numa_candidate_init(c);
+    for (i = 0; i < k; i++)
+        set_update(s, set, i, set[i], 1, c);
+}
+
+/* How far a set is from meeting the constraints, 0 if it meets them */
+static double set_shortfall(const numa_search *s,
+                            const libxl__numa_candidate *c)
+{
+    double shortfall = 0;
+
+    if (s->min_free_memkb && c->free_memkb < s->min_free_memkb)
+        shortfall += (double)(s->min_free_memkb - c->free_memkb) /
+                     s->min_free_memkb;
+    if (s->min_cpus && c->nr_cpus < s->min_cpus)
+        shortfall += (double)(s->min_cpus - c->nr_cpus) / s->min_cpus;
+
+    return shortfall;
+}
+
+/* Whether set c1 is better than set c2: any set meeting the constraints
+ * is better than any which does not, and those which do not are the
+ * better the closer they get. */
+static int set_better(const numa_search *s, const libxl__numa_candidate *c1,
+                      const libxl__numa_candidate *c2)
+{
+    double short1 = set_shortfall(s, c1), short2 = set_shortfall(s, c2);
+    int r;
+
+    if (short1 != short2)
+        return short1 < short2;
+    if (short1 > 0)
+        return 0;
+    if (s->numa_cmpf && (r = s->numa_cmpf(c1, c2)))
+        return r < 0;
+    return c1->distance < c2->distance;
+}
+
+/* Evaluates all the k-combinations of the suitable nodes */
+static int numa_search_exhaustive(libxl__gc *gc, const numa_search *s, int k,
+                                  int *best_set, libxl__numa_candidate *best)
+{
+    libxl__numa_candidate c;
+    comb_iter_t comb_iter;
+    int comb_ok, found = 0;
+
+    for (comb_ok = comb_init(gc, &comb_iter, s->nr_sn, k);
+         comb_ok;
+         comb_ok = comb_next(comb_iter, s->nr_sn, k)) {
+        set_eval(s, comb_iter, k, &c);
+        if (set_shortfall(s, &c) > 0)
+            continue;
+
+        /* If no comparison function is provided, just return as soon
+         * as we find our first candidate. */
+        if (!found || (s->numa_cmpf && s->numa_cmpf(&c, best) < 0)) {
+            found = 1;
+            *best = c;
+            memcpy(best_set, comb_iter, k * sizeof(*best_set));
+            if (!s->numa_cmpf)
+                break;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Greedy plus local search, for when there are too many combinations.
  *
- * This means the bits that are set in suitable_nodemap and that
- * corresponds to the indexes of the given combination are the ones
- * that will be set in nodemap.
+ * Starting from each suitable node in turn, a set is grown to k nodes
+ * by adding the node closest to the ones already in it (the nodes at
+ * the same distance are told apart with set_better()). Then, for as long
+ * as swapping one of its nodes with one outside of it gives a better
+ * set, that is done. The best of the sets found this way wins.
  *
- * For example, given a fully set suitable_nodemap, if the iterator
- * represents the combination { 0, 2, 4}, nodmeap will have bits #0,
- * #2 and #4 set.
- * On the other hand, if, say,  suitable_nodemap=01011011, the same
- * iterator will cause bits #1, #4 and #7 of nodemap to be set.
+ * That is O(k^2 * n) per starting node for the greedy phase, and the
+ * same again per round of swapping (of which, in practice, there are
+ * very few).
  */
-static void comb_get_nodemap(comb_iter_t it, libxl_bitmap *suitable_nodemap,
-                             libxl_bitmap *nodemap, int k)
+static int numa_search_heuristic(libxl__gc *gc, const numa_search *s, int k,
+                                 int *best_set, libxl__numa_candidate *best)
 {
-    int i, m = 0, n = 0;
-
-    libxl_bitmap_set_none(nodemap);
-    libxl_for_each_set_bit(i, *suitable_nodemap) {
-        /* Check wether the n-th set bit of suitable_nodemap
-         * matches with the m-th element of the iterator (and,
-         * only if it does, advance to the next one) */
-        if (m < k && n == it[m]) {
-            libxl_bitmap_set(nodemap, i);
-            m++;
+    libxl__numa_candidate c, t, next;
+    int *set, seed, size, i, j, next_j, improved, round, found = 0;
+    char *in_set;
+
+    libxl__numa_candidate_init(&next);
+
+    GCNEW_ARRAY(set, k);
+    GCNEW_ARRAY(in_set, s->nr_sn);
+
+    for (seed = 0; seed < s->nr_sn; seed++) {
+        memset(in_set, 0, s->nr_sn);
+        set[0] = seed;
+        in_set[seed] = 1;
+        set_eval(s, set, 1, &c);
+
+        for (size = 1; size < k; size++) {
+            next_j = -1;
+            for (j = 0; j < s->nr_sn; j++) {
+                if (in_set[j])
+                    continue;
+                t = c;
+                set_update(s, set, size, j, 1, &t);
+                if (next_j < 0 || t.distance < next.distance ||
+                    (t.distance == next.distance && set_better(s, &t, &next))) {
+                    next_j = j;
+                    next = t;
+                }
+            }
+            set[size] = next_j;
+            in_set[next_j] = 1;
+            c = next;
+        }
+
+        improved = 1;
+        for (round = 0; improved && round < s->nr_sn; round++) {
+            improved = 0;
+            for (i = 0; i < k; i++) {
+                for (j = 0; j < s->nr_sn; j++) {
+                    if (in_set[j])
+                        continue;
+                    t = c;
+                    set_update(s, set, k, set[i], -1, &t);
+                    set_update(s, set, k, j, 1, &t);
+                    /* set[i] is still in the set, so undo its distance
+                     * from j having been accounted for */
+                    t.distance -= node_distance(s, set[i], j);
+                    if (set_better(s, &t, &c)) {
+                        in_set[set[i]] = 0;
+                        in_set[j] = 1;
+                        set[i] = j;
+                        c = t;
+                        improved = 1;
+                    }
+                }
+            }
+        }
+
+        if (set_shortfall(s, &c) == 0 &&
+            (!found || set_better(s, &c, best))) {
+            found = 1;
+            *best = c;
+            memcpy(best_set, set, k * sizeof(*set));
         }
-        n++;
     }
+
+    return found;
 }
 
-/* Retrieve the number of cpus that the nodes that are part of the nodemap
- * span and are also set in suitable_cpumap. */
-static int nodemap_to_nr_cpus(libxl_cputopology *tinfo, int nr_cpus,
-                              const libxl_bitmap *suitable_cpumap,
-                              const libxl_bitmap *nodemap)
+static int uint32_cmp_desc(const void *a, const void *b)
 {
-    int i, nodes_cpus = 0;
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
 
-    for (i = 0; i < nr_cpus; i++) {
-        if (libxl_bitmap_test(suitable_cpumap, i) &&
-            libxl_bitmap_test(nodemap, tinfo[i].node))
-            nodes_cpus++;
-    }
-    return nodes_cpus;
+    return x < y ? 1 : x > y ? -1 : 0;
 }
 
-/* Retrieve the amount of free memory within the nodemap */
-static uint32_t nodemap_to_free_memkb(libxl_numainfo *ninfo,
-                                      libxl_bitmap *nodemap)
+static int int_cmp_desc(const void *a, const void *b)
 {
-    uint32_t free_memkb = 0;
-    int i;
+    return *(const int *)b - *(const int *)a;
+}
 
-    libxl_for_each_set_bit(i, *nodemap)
-        free_memkb += ninfo[i].free / 1024;
+/* Fewest nodes that could possibly meet the constraints, or 0 if not
+ * even all the suitable nodes together do */
+static int numa_search_min_nodes(libxl__gc *gc, const numa_search *s)
+{
+    uint32_t *free_memkb;
+    uint64_t memkb = 0;
+    int *nr_cpus, cpus = 0, i;
+
+    GCNEW_ARRAY(free_memkb, s->nr_sn);
+    GCNEW_ARRAY(nr_cpus, s->nr_sn);
+    for (i = 0; i < s->nr_sn; i++) {
+        free_memkb[i] = s->host->free_memkb[s->sn[i]];
+        nr_cpus[i] = s->host->nr_cpus[s->sn[i]];
+    }
+    qsort(free_memkb, s->nr_sn, sizeof(*free_memkb), uint32_cmp_desc);
+    qsort(nr_cpus, s->nr_sn, sizeof(*nr_cpus), int_cmp_desc);
+
+    for (i = 0; i < s->nr_sn; i++) {
+        memkb += free_memkb[i];
+        cpus += nr_cpus[i];
+        if (memkb >= s->min_free_memkb && cpus >= s->min_cpus)
+            return i + 1;
+    }
 
-    return free_memkb;
+    return 0;
 }
 
-/* Retrieve the number of vcpus able to run on the nodes in nodemap */
-static int nodemap_to_nr_vcpus(libxl__gc *gc, int vcpus_on_node[],
-                               const libxl_bitmap *nodemap)
+int libxl__numa_search(libxl__gc *gc, const libxl__numa_host *host,
+                       int max_exhaustive_nodes,
+                       uint32_t min_free_memkb, int min_cpus,
+                       int min_nodes, int max_nodes,
+                       libxl__numa_candidate_cmpf numa_cmpf,
+                       libxl__numa_candidate *cndt_out,
+                       int *cndt_found)
 {
-    int i, nr_vcpus = 0;
+    numa_search s;
+    libxl__numa_candidate best;
+    int *best_set, i, k, fewest;
+
+    s.host = host;
+    s.min_free_memkb = min_free_memkb;
+    s.min_cpus = min_cpus;
+    s.numa_cmpf = numa_cmpf;
+
+    GCNEW_ARRAY(s.sn, host->nr_nodes);
+    s.nr_sn = 0;
+    libxl_for_each_set_bit(i, *host->suitable_nodemap) {
+        if (i >= host->nr_nodes)
+            break;
+        s.sn[s.nr_sn++] = i;
+    }
+
+    /* The maximum number of nodes should not exceed the number of
+     * nodes we are allowed to use. */
+    if (min_nodes > s.nr_sn)
+        min_nodes = s.nr_sn;
+    if (!max_nodes || max_nodes > s.nr_sn)
+        max_nodes = s.nr_sn;
+    if (min_nodes > max_nodes) {
+        LOG(ERROR, "Inconsistent minimum or maximum number of guest nodes");
+        return ERROR_INVAL;
+    }
+
+    *cndt_found = 0;
+
+    /* There is no point in looking at sets of nodes that could not meet
+     * the constraints even if they were made of the biggest nodes. */
+    fewest = numa_search_min_nodes(gc, &s);
+    if (!fewest)
+        goto out;
+    if (min_nodes < fewest)
+        min_nodes = fewest;
 
-    libxl_for_each_set_bit(i, *nodemap)
-        nr_vcpus += vcpus_on_node[i];
+    /*
+     * Since the fewer the number of nodes the better, it is guaranteed
+     * that any candidate found during the i-eth step will be better than
+     * any other one we could find during the (i+1)-eth and all the
+     * subsequent steps (they all will have more nodes). It's thus
+     * pointless to keep going if we already found something.
+     */
+    GCNEW_ARRAY(best_set, max_nodes ? max_nodes : 1);
+    for (k = min_nodes; k <= max_nodes && !*cndt_found; k++) {
+        if (s.nr_sn <= max_exhaustive_nodes)
+            *cndt_found = numa_search_exhaustive(gc, &s, k, best_set, &best);
+        else
+            *cndt_found = numa_search_heuristic(gc, &s, k, best_set, &best);
+    }
+    if (!*cndt_found)
+        goto out;
+
+    libxl_bitmap_set_none(&cndt_out->nodemap);
+    for (i = 0; i < best.nr_nodes; i++)
+        libxl_bitmap_set(&cndt_out->nodemap, s.sn[best_set[i]]);
+    cndt_out->nr_nodes = best.nr_nodes;
+    cndt_out->nr_cpus = best.nr_cpus;
+    cndt_out->nr_vcpus = best.nr_vcpus;
+    cndt_out->distance = best.distance;
+    cndt_out->free_memkb = best.free_memkb;
+
+    LOG(DEBUG, "Best NUMA placement candidate found: nr_nodes=%d, "
+               "nr_cpus=%d, nr_vcpus=%d, distance=%"PRIu32", "
+               "free_memkb=%"PRIu32"", cndt_out->nr_nodes,
+               cndt_out->nr_cpus, cndt_out->nr_vcpus, cndt_out->distance,
+               cndt_out->free_memkb / 1024);
 
-    return nr_vcpus;
+ out:
+    return 0;
 }
 
 /* Number of vcpus able to run on the cpus of the various nodes
@@ -292,16 +540,15 @@ int libxl__get_numa_candidate(libxl__gc *gc,
                               libxl__numa_candidate *cndt_out,
                               int *cndt_found)
 {
-    libxl__numa_candidate new_cndt;
+    libxl__numa_host host;
     libxl_cputopology *tinfo = NULL;
     libxl_numainfo *ninfo = NULL;
-    int nr_nodes = 0, nr_suit_nodes, nr_cpus = 0;
-    libxl_bitmap suitable_nodemap, nodemap;
-    int *vcpus_on_node, rc = 0;
+    int nr_nodes = 0, nr_cpus = 0;
+    libxl_bitmap suitable_nodemap;
+    uint32_t *free_memkb, *dists = NULL;
+    int *cpus_on_node, *vcpus_on_node, i, j, rc = 0;
 
-    libxl_bitmap_init(&nodemap);
     libxl_bitmap_init(&suitable_nodemap);
-    libxl__numa_candidate_init(&new_cndt);
 
     /* Get platform info and prepare the map for testing the combinations */
     ninfo = libxl_get_numainfo(CTX, &nr_nodes);
@@ -314,32 +561,8 @@ int libxl__get_numa_candidate(libxl__gc *gc,
     }
 
     GCNEW_ARRAY(vcpus_on_node, nr_nodes);
-
-    /*
-     * The good thing about this solution is that it is based on heuristics
-     * (implemented in numa_cmpf() ), but we at least can evaluate it on
-     * all the possible placement candidates. That can happen because the
-     * number of nodes present in current NUMA systems is quite small.
-     * In fact, even if a sum of binomials is involved, if the system has
-     * up to 16 nodes it "only" takes 65535 steps. This is fine, as the
-     * number of nodes the biggest NUMA systems provide at the time of this
-     * writing is 8 (and it will probably continue to be so for a while).
-     * However, computanional complexity would explode on systems bigger
-     * than that, and it's really important we avoid trying to run this
-     * on monsters with 32, 64 or more nodes (if they ever pop into being).
-     * Therefore, here it comes a safety catch that disables the algorithm
-     * for the cases when it wouldn't work well.
-     */
-    if (nr_nodes > 16) {
-        /* Log we did nothing and return 0, as no real error occurred */
-        LOG(WARN, "System has %d NUMA nodes, which is too big for the "
-                  "placement algorithm to work effectively: skipping it. "
-                  "Consider manually pinning the vCPUs and/or looking at "
-                  "cpupools for manually partitioning the system.",
-                  nr_nodes);
-        *cndt_found = 0;
-        goto out;
-    }
+    GCNEW_ARRAY(cpus_on_node, nr_nodes);
+    GCNEW_ARRAY(free_memkb, nr_nodes);
 
     tinfo = libxl_get_cpu_topology(CTX, &nr_cpus);
     if (tinfo == NULL) {
@@ -347,13 +570,6 @@ int libxl__get_numa_candidate(libxl__gc *gc,
         goto out;
     }
 
-    rc = libxl_node_bitmap_alloc(CTX, &nodemap, 0);
-    if (rc)
-        goto out;
-    rc = libxl__numa_candidate_alloc(gc, &new_cndt);
-    if (rc)
-        goto out;
-
     /* Allocate and prepare the map of the node that can be utilized for
      * placement, basing on the map of suitable cpus. */
     rc = libxl_node_bitmap_alloc(CTX, &suitable_nodemap, 0);
@@ -370,19 +586,40 @@ int libxl__get_numa_candidate(libxl__gc *gc,
      * their affinities. So, instead of doing that for each candidate,
      * let's count here the number of vcpus runnable on each node, so that
      * all we have to do later is summing up the right elements of the
-     * vcpus_on_node array.
+     * vcpus_on_node array. The same goes for free memory, suitable cpus
+     * and distances.
      */
     rc = nr_vcpus_on_nodes(gc, tinfo, nr_cpus, suitable_cpumap, vcpus_on_node);
     if (rc)
         goto out;
 
+    for (i = 0; i < nr_cpus; i++) {
+        if (tinfo[i].node < nr_nodes &&
+            libxl_bitmap_test(suitable_cpumap, i))
+            cpus_on_node[tinfo[i].node]++;
+    }
+
+    for (i = 0; i < nr_nodes; i++)
+        free_memkb[i] = ninfo[i].free / 1024;
+
+    if (ninfo[0].num_dists >= nr_nodes) {
+        GCNEW_ARRAY(dists, nr_nodes * nr_nodes);
+        for (i = 0; i < nr_nodes; i++) {
+            for (j = 0; j < nr_nodes; j++) {
+                uint32_t d = ninfo[i].dists[j];
+
+                /* 255 is "unreachable" in ACPI SLIT terms */
+                dists[i * nr_nodes + j] =
+                    d == LIBXL_NUMAINFO_INVALID_ENTRY ? 255 : d;
+            }
+        }
+    }
+
     /*
      * If the minimum number of NUMA nodes is not explicitly specified
      * (i.e., min_nodes == 0), we try to figure out a sensible number of nodes
      * from where to start generating candidates, if possible (or just start
-     * from 1 otherwise). The maximum number of nodes should not exceed the
-     * number of existent NUMA nodes on the host, or the candidate generation
-     * won't work properly.
+     * from 1 otherwise).
      */
     if (!min_nodes) {
         int cpus_per_node;
@@ -393,115 +630,30 @@ int libxl__get_numa_candidate(libxl__gc *gc,
         else
             min_nodes = (min_cpus + cpus_per_node - 1) / cpus_per_node;
     }
-    /* We also need to be sure we do not exceed the number of
-     * nodes we are allowed to use. */
-    nr_suit_nodes = libxl_bitmap_count_set(&suitable_nodemap);
-
-    if (min_nodes > nr_suit_nodes)
-        min_nodes = nr_suit_nodes;
-    if (!max_nodes || max_nodes > nr_suit_nodes)
-        max_nodes = nr_suit_nodes;
-    if (min_nodes > max_nodes) {
-        LOG(ERROR, "Inconsistent minimum or maximum number of guest nodes");
-        rc = ERROR_INVAL;
-        goto out;
-    }
 
     /* This is up to the caller to be disposed */
     rc = libxl__numa_candidate_alloc(gc, cndt_out);
     if (rc)
         goto out;
 
-    /*
-     * Consider all the combinations with sizes in [min_nodes, max_nodes]
-     * (see comb_init() and comb_next()). Note that, since the fewer the
-     * number of nodes the better, it is guaranteed that any candidate
-     * found during the i-eth step will be better than any other one we
-     * could find during the (i+1)-eth and all the subsequent steps (they
-     * all will have more nodes). It's thus pointless to keep going if
-     * we already found something.
-     */
-    *cndt_found = 0;
-    while (min_nodes <= max_nodes && *cndt_found == 0) {
-        comb_iter_t comb_iter;
-        int comb_ok;
-
-        /*
-         * And here it is. Each step of this cycle generates a combination of
-         * nodes as big as min_nodes mandates.  Each of these combinations is
-         * checked against the constraints provided by the caller (namely,
-         * amount of free memory and number of cpus) and it can concur to
-         * become our best placement iff it passes the check.
-         */
-        for (comb_ok = comb_init(gc, &comb_iter, nr_suit_nodes, min_nodes);
-             comb_ok;
-             comb_ok = comb_next(comb_iter, nr_suit_nodes, min_nodes)) {
-            uint32_t nodes_free_memkb;
-            int nodes_cpus;
-
-            /* Get the nodemap for the combination, only considering
-             * suitable nodes. */
-            comb_get_nodemap(comb_iter, &suitable_nodemap,
-                             &nodemap, min_nodes);
-
-            /* If there is not enough memory in this combination, skip it
-             * and go generating the next one... */
-            nodes_free_memkb = nodemap_to_free_memkb(ninfo, &nodemap);
-            if (min_free_memkb && nodes_free_memkb < min_free_memkb)
-                continue;
-
-            /* And the same applies if this combination is short in cpus */
-            nodes_cpus = nodemap_to_nr_cpus(tinfo, nr_cpus, suitable_cpumap,
-                                            &nodemap);
-            if (min_cpus && nodes_cpus < min_cpus)
-                continue;
+    host.nr_nodes = nr_nodes;
+    host.free_memkb = free_memkb;
+    host.nr_cpus = cpus_on_node;
+    host.nr_vcpus = vcpus_on_node;
+    host.dists = dists;
+    host.suitable_nodemap = &suitable_nodemap;
 
-            /*
-             * Conditions are met, we can compare this candidate with the
-             * current best one (if any).
-             */
-            libxl__numa_candidate_put_nodemap(gc, &new_cndt, &nodemap);
-            new_cndt.nr_vcpus = nodemap_to_nr_vcpus(gc, vcpus_on_node,
-                                                    &nodemap);
-            new_cndt.free_memkb = nodes_free_memkb;
-            new_cndt.nr_nodes = libxl_bitmap_count_set(&nodemap);
-            new_cndt.nr_cpus = nodes_cpus;
-
-            /*
-             * Check if the new candidate we is better the what we found up
-             * to now by means of the comparison function. If no comparison
-             * function is provided, just return as soon as we find our first
-             * candidate.
-             */
-            if (*cndt_found == 0 || numa_cmpf(&new_cndt, cndt_out) < 0) {
-                *cndt_found = 1;
-
-                LOG(DEBUG, "New best NUMA placement candidate found: "
-                           "nr_nodes=%d, nr_cpus=%d, nr_vcpus=%d, "
-                           "free_memkb=%"PRIu32"", new_cndt.nr_nodes,
-                           new_cndt.nr_cpus, new_cndt.nr_vcpus,
-                           new_cndt.free_memkb / 1024);
-
-                libxl__numa_candidate_put_nodemap(gc, cndt_out, &nodemap);
-                cndt_out->nr_vcpus = new_cndt.nr_vcpus;
-                cndt_out->free_memkb = new_cndt.free_memkb;
-                cndt_out->nr_nodes = new_cndt.nr_nodes;
-                cndt_out->nr_cpus = new_cndt.nr_cpus;
-
-                if (numa_cmpf == NULL)
-                    break;
-            }
-        }
-        min_nodes++;
-    }
+    rc = libxl__numa_search(gc, &host, LIBXL__NUMA_MAX_EXHAUSTIVE_NODES,
+                            min_free_memkb, min_cpus, min_nodes, max_nodes,
+                            numa_cmpf, cndt_out, cndt_found);
+    if (rc)
+        goto out;
 
     if (*cndt_found == 0)
         LOG(NOTICE, "NUMA placement failed, performance might be affected");
 
  out:
-    libxl_bitmap_dispose(&nodemap);
     libxl_bitmap_dispose(&suitable_nodemap);
-    libxl__numa_candidate_dispose(&new_cndt);
     libxl_numainfo_list_free(ninfo, nr_nodes);
     libxl_cputopology_list_free(tinfo, nr_cpus);
     return rc;
@@ -31,6 +31,12 @@ static void run_helper(libxl__egc *egc, libxl__save_helper_state *shs,
                        const int *preserve_fds, int num_preserve_fds,
                        const unsigned long *argnums, int num_argnums);
 
+static const unsigned long *data_fds_argnums(libxl__gc *gc,
+                                             const unsigned long *argnums,
+                                             int *num_argnums,
+                                             const int *data_fds,
+                                             int nr_data_fds);
+
 static void helper_failed(libxl__egc*, libxl__save_helper_state *shs, int rc);
 static void helper_stdout_readable(libxl__egc *egc, libxl__ev_fd *ev,
                                    int fd, short events, short revents);
@@ -62,6 +68,10 @@ void libxl__xc_domain_restore(libxl__egc *egc, libxl__domain_create_state *dcs,
         hvm, pae, superpages, no_incr_generationid,
         cbflags, dcs->checkpointed_stream,
     };
+    int num_argnums = ARRAY_SIZE(argnums);
+    const unsigned long *all_argnums =
+        data_fds_argnums(gc, argnums, &num_argnums,
+                         dcs->data_fds, dcs->nr_data_fds);
 
     dcs->shs.ao = ao;
     dcs->shs.domid = domid;
@@ -71,15 +81,16 @@ void libxl__xc_domain_restore(libxl__egc *egc, libxl__domain_create_state *dcs,
     dcs->shs.need_results = 1;
     dcs->shs.toolstack_data_file = 0;
 
-    run_helper(egc, &dcs->shs, "--restore-domain", restore_fd, 0,0,
-               argnums, ARRAY_SIZE(argnums));
+    run_helper(egc, &dcs->shs, "--restore-domain", restore_fd,
+               dcs->data_fds, dcs->nr_data_fds,
+               all_argnums, num_argnums);
 }
 
 void libxl__xc_domain_save(libxl__egc *egc, libxl__domain_suspend_state *dss,
                            unsigned long vm_generationid_addr)
 {
     STATE_AO_GC(dss->ao);
-    int r, rc, toolstack_data_fd = -1;
+    int i, r, rc, toolstack_data_fd = -1;
     uint32_t toolstack_data_len = 0;
 
     /* Resources we need to free */
@@ -116,6 +127,16 @@ void libxl__xc_domain_save(libxl__egc *egc, libxl__domain_suspend_state *dss,
         toolstack_data_fd, toolstack_data_len,
         cbflags,
     };
+    int num_argnums = ARRAY_SIZE(argnums);
+    const unsigned long *all_argnums =
+        data_fds_argnums(gc, argnums, &num_argnums,
+                         dss->data_fds, dss->nr_data_fds);
+
+    int *preserve_fds;
+    GCNEW_ARRAY(preserve_fds, 1 + dss->nr_data_fds);
+    preserve_fds[0] = toolstack_data_fd;
+    for (i=0; i<dss->nr_data_fds; i++)
+        preserve_fds[1 + i] = dss->data_fds[i];
 
     dss->shs.ao = ao;
     dss->shs.domid = dss->domid;
@@ -127,8 +148,8 @@ void libxl__xc_domain_save(libxl__egc *egc, libxl__domain_suspend_state *dss,
     free(toolstack_data_buf);
 
     run_helper(egc, &dss->shs, "--save-domain", dss->fd,
-               &toolstack_data_fd, 1,
-               argnums, ARRAY_SIZE(argnums));
+               preserve_fds, 1 + dss->nr_data_fds,
+               all_argnums, num_argnums);
     return;
 
  out:
@@ -149,6 +170,26 @@ void libxl__xc_domain_saverestore_async_callback_done(libxl__egc *egc,
 
 /*----- helper execution -----*/
 
+/* The helper takes the number of data streams and their fds last. */
+static const unsigned long *data_fds_argnums(libxl__gc *gc,
+                                             const unsigned long *argnums,
+                                             int *num_argnums,
+                                             const int *data_fds,
+                                             int nr_data_fds)
+{
+    unsigned long *all;
+    int i, n = *num_argnums;
+
+    GCNEW_ARRAY(all, n + 1 + nr_data_fds);
+    memcpy(all, argnums, sizeof(*all) * n);
+    all[n++] = nr_data_fds;
+    for (i=0; i<nr_data_fds; i++)
+        all[n++] = data_fds[i];
+
+    *num_argnums = n;
+    return all;
+}
+
 static void run_helper(libxl__egc *egc, libxl__save_helper_state *shs,
                        const char *mode_arg, int stream_fd,
                        const int *preserve_fds, int num_preserve_fds,
@@ -197,6 +197,7 @@ static struct restore_callbacks helper_restore_callbacks;
 int main(int argc, char **argv)
 {
     int r;
+    unsigned i;
 
 #define NEXTARG (++argv, assert(*argv), *argv)
 
@@ -215,6 +216,10 @@ int main(int argc, char **argv)
         toolstack_save_fd  =       atoi(NEXTARG);
         toolstack_save_len =       strtoul(NEXTARG,0,10);
         unsigned cbflags =         strtoul(NEXTARG,0,10);
+        unsigned nr_data_fds =     strtoul(NEXTARG,0,10);
+        int *data_fds =            xmalloc(nr_data_fds * sizeof(*data_fds));
+        for (i=0; i<nr_data_fds; i++)
+            data_fds[i] =          atoi(NEXTARG);
         assert(!*++argv);
 
         if (toolstack_save_fd >= 0)
@@ -223,8 +228,9 @@ int main(int argc, char **argv)
         helper_setcallbacks_save(&helper_save_callbacks, cbflags);
 
         startup("save");
-        r = xc_domain_save(xch, io_fd, dom, max_iters, max_factor, flags,
-                           &helper_save_callbacks, hvm, genidad);
+        r = xc_domain_save_streams(xch, io_fd, data_fds, nr_data_fds,
+                                   dom, max_iters, max_factor, flags,
+                                   &helper_save_callbacks, hvm, genidad);
         complete(r);
 
     } else if (!strcmp(mode,"--restore-domain")) {
@@ -241,6 +247,10 @@ int main(int argc, char **argv)
         int no_incr_genidad =      strtoul(NEXTARG,0,10);
         unsigned cbflags =         strtoul(NEXTARG,0,10);
         int checkpointed =         strtoul(NEXTARG,0,10);
+        unsigned nr_data_fds =     strtoul(NEXTARG,0,10);
+        int *data_fds =            xmalloc(nr_data_fds * sizeof(*data_fds));
+        for (i=0; i<nr_data_fds; i++)
+            data_fds[i] =          atoi(NEXTARG);
         assert(!*++argv);
 
         helper_setcallbacks_restore(&helper_restore_callbacks, cbflags);
@@ -250,11 +260,13 @@ int main(int argc, char **argv)
         unsigned long genidad = 0;
 
         startup("restore");
-        r = xc_domain_restore(xch, io_fd, dom, store_evtchn, &store_mfn,
-                              store_domid, console_evtchn, &console_mfn,
-                              console_domid, hvm, pae, superpages,
-                              no_incr_genidad, checkpointed, &genidad,
-                              &helper_restore_callbacks);
+        r = xc_domain_restore_streams(xch, io_fd, data_fds, nr_data_fds,
+                                      dom, store_evtchn, &store_mfn,
+                                      store_domid, console_evtchn,
+                                      &console_mfn, console_domid, hvm, pae,
+                                      superpages, no_incr_genidad,
+                                      checkpointed, &genidad,
+                                      &helper_restore_callbacks);
         helper_stub_restore_results(store_mfn,console_mfn,genidad,0);
         complete(r);
 
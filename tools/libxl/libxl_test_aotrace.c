@@ -0,0 +1,80 @@
+/*
+ * aotrace test case for the libxl ao timing trace
+ *
+ * To run this test:
+ *    ./test_aotrace
+ * Success:
+ *    program prints the trace and exits 0
+ * Failure:
+ *    crash
+ *
+ * begin "first" and "second", 50ms apart
+ * end "first" 100ms in, "second" 250ms in, begin "open"
+ * complete the ao with "open" still running
+ */
+
+#include "libxl_internal.h"
+
+#include "libxl_test_aotrace.h"
+
+static libxl__ev_time et;
+static libxl__ao *tao;
+static int first, second, seq;
+
+static void occurs(libxl__egc *egc, libxl__ev_time *ev,
+                   const struct timeval *requested_abs);
+
+static void next(libxl__gc *gc, int ms)
+{
+    int rc = libxl__ev_time_register_rel(gc, &et, occurs, ms);
+    assert(!rc);
+}
+
+int libxl_test_aotrace(libxl_ctx *ctx, uint32_t domid,
+                       libxl_asyncop_how *ao_how)
+{
+    AO_CREATE(ctx, domid, ao_how);
+
+    tao = ao;
+    seq = 0;
+    libxl__ev_time_init(&et);
+
+    first = libxl__ao_trace_begin(ao, "first");
+    assert(first >= 0);
+    next(gc, 50);
+
+    return AO_INPROGRESS;
+}
+
+static void occurs(libxl__egc *egc, libxl__ev_time *ev,
+                   const struct timeval *requested_abs)
+{
+    STATE_AO_GC(tao);
+
+    LOG(DEBUG, "occurs seq=%d", seq);
+    libxl__ev_time_deregister(gc, &et);
+
+    switch (seq++) {
+    case 0:
+        second = libxl__ao_trace_begin(ao, "second");
+        assert(second >= 0);
+        next(gc, 50);
+        break;
+
+    case 1:
+        libxl__ao_trace_end(ao, first);
+        libxl__ao_trace_end(ao, first); /* no-op */
+        next(gc, 150);
+        break;
+
+    case 2:
+        libxl__ao_trace_end(ao, second);
+        libxl__ao_trace_begin(ao, "open");
+        libxl__ao_trace_end(ao, -1); /* no-op */
+        libxl__ao_complete(egc, ao, 0);
+        break;
+
+    default:
+        abort();
+    }
+}
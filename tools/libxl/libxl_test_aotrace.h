@@ -0,0 +1,13 @@
+#ifndef TEST_AOTRACE_H
+#define TEST_AOTRACE_H
+
+#include <pthread.h>
+
+/* Runs an ao on behalf of domid which records three trace stages:
+ * "first" for about 100ms, "second" overlapping it and lasting about
+ * 200ms, and "open" which is still running when the ao completes. */
+int libxl_test_aotrace(libxl_ctx *ctx, uint32_t domid,
+                       libxl_asyncop_how *ao_how)
+    LIBXL_EXTERNAL_CALLERS_ONLY;
+
+#endif /*TEST_AOTRACE_H*/
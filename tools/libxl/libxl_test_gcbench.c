@@ -0,0 +1,46 @@
+/*
+ * gcbench microbenchmark for the libxl gc allocator
+ *
+ * The allocation mix is roughly what a device hotplug does: mostly
+ * small GCSPRINTF'd xenstore paths and GCNEW'd structs, with the odd
+ * array grown by GCREALLOC_ARRAY.  Every result is checked before the
+ * gc is torn down, so this also serves as a correctness test.
+ */
+
+#include "libxl_internal.h"
+
+#include "libxl_test_gcbench.h"
+
+int libxl_test_gcbench(libxl_ctx *ctx, int nallocs)
+{
+    GC_INIT(ctx);
+    char **paths;
+    int *ids = NULL, nids = 0;
+    int i, domid, devid;
+
+    GCNEW_ARRAY(paths, nallocs);
+
+    for (i = 0; i < nallocs; i++) {
+        libxl_device_disk *disk;
+
+        paths[i] = GCSPRINTF("/local/domain/%d/device/vbd/%d", i / 16, i);
+        GCNEW(disk);
+        assert(!disk->vdev);
+
+        if (!(i % 8)) {
+            GCREALLOC_ARRAY(ids, nids + 1);
+            ids[nids++] = i;
+        }
+    }
+
+    for (i = 0; i < nallocs; i++) {
+        assert(sscanf(paths[i], "/local/domain/%d/device/vbd/%d",
+                      &domid, &devid) == 2);
+        assert(domid == i / 16 && devid == i);
+    }
+    for (i = 0; i < nids; i++)
+        assert(ids[i] == i * 8);
+
+    GC_FREE;
+    return 0;
+}
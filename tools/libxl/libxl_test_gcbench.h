@@ -0,0 +1,8 @@
+#ifndef TEST_GCBENCH_H
+#define TEST_GCBENCH_H
+
+/* Makes @nallocs assorted gc allocations in one gc and frees them. */
+int libxl_test_gcbench(libxl_ctx *ctx, int nallocs)
+    LIBXL_EXTERNAL_CALLERS_ONLY;
+
+#endif /*TEST_GCBENCH_H*/
@@ -0,0 +1,145 @@
+/*
+ * numaplace simulation for the libxl NUMA placement search
+ *
+ * Builds a synthetic host out of boards of 4 sockets with 2 nodes each,
+ * with distances 10 (local), 12 (same socket), 20 (same board) and 30 +
+ * 5 for each board further away along a ring of boards.  Nodes get
+ * random amounts of free memory and vcpus already running on them, and
+ * then random domains are placed on the host by libxl__numa_search().
+ *
+ * With r->exhaustive set, the heuristic search is checked against the
+ * exhaustive one: it must never come up with a better candidate, nor
+ * with one with fewer nodes, and how often it finds an equally good
+ * candidate is reported.
+ */
+
+#include "libxl_internal.h"
+
+#include "libxl_test_numaplace.h"
+
+#define CPUS_PER_NODE 8
+#define NODES_PER_SOCKET 2
+#define NODES_PER_BOARD 8
+
+static uint32_t distance(int nr_nodes, int i, int j)
+{
+    int nr_boards = (nr_nodes + NODES_PER_BOARD - 1) / NODES_PER_BOARD;
+    int hops = abs(i / NODES_PER_BOARD - j / NODES_PER_BOARD);
+
+    if (i == j)
+        return 10;
+    if (i / NODES_PER_SOCKET == j / NODES_PER_SOCKET)
+        return 12;
+    if (!hops)
+        return 20;
+    if (hops > nr_boards / 2)
+        hops = nr_boards - hops;
+    return 30 + 5 * hops;
+}
+
+static double usecs_since(const struct timeval *start)
+{
+    struct timeval now, d;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &d);
+    return d.tv_sec * 1e6 + d.tv_usec;
+}
+
+int libxl_test_numaplace(libxl_ctx *ctx, libxl_test_numaplace_result *r)
+{
+    GC_INIT(ctx);
+    libxl__numa_host host;
+    libxl__numa_candidate c, ce;
+    libxl_bitmap suitable;
+    uint32_t *free_memkb, *dists, memkb;
+    int *nr_cpus, *nr_vcpus, n = r->nr_nodes, i, j, found, found_e;
+    struct timeval start;
+    int rc;
+
+    libxl_bitmap_init(&suitable);
+    libxl__numa_candidate_init(&c);
+    libxl__numa_candidate_init(&ce);
+
+    rc = libxl_bitmap_alloc(CTX, &suitable, n);
+    assert(!rc);
+    rc = libxl_bitmap_alloc(CTX, &c.nodemap, n);
+    assert(!rc);
+    rc = libxl_bitmap_alloc(CTX, &ce.nodemap, n);
+    assert(!rc);
+    libxl_bitmap_set_any(&suitable);
+
+    GCNEW_ARRAY(free_memkb, n);
+    GCNEW_ARRAY(nr_cpus, n);
+    GCNEW_ARRAY(nr_vcpus, n);
+    GCNEW_ARRAY(dists, n * n);
+
+    srandom(r->seed);
+    for (i = 0; i < n; i++) {
+        free_memkb[i] = (1 + random() % 32) << 20;
+        nr_cpus[i] = CPUS_PER_NODE;
+        nr_vcpus[i] = random() % (4 * CPUS_PER_NODE);
+        for (j = 0; j < n; j++)
+            dists[i * n + j] = distance(n, i, j);
+    }
+
+    host.nr_nodes = n;
+    host.free_memkb = free_memkb;
+    host.nr_cpus = nr_cpus;
+    host.nr_vcpus = nr_vcpus;
+    host.dists = dists;
+    host.suitable_nodemap = &suitable;
+
+    r->found = r->found_exhaustive = 0;
+    r->same_nr_nodes = r->as_good = 0;
+    r->usecs = r->usecs_exhaustive = 0;
+
+    for (i = 0; i < r->nr_requests; i++) {
+        int vcpus = 1 + random() % (4 * CPUS_PER_NODE);
+
+        memkb = (1 + random() % 128) << 20;
+
+        gettimeofday(&start, NULL);
+        rc = libxl__numa_search(gc, &host, 0, memkb, vcpus, 0, 0,
+                                libxl__numa_cmpf, &c, &found);
+        r->usecs += usecs_since(&start);
+        assert(!rc);
+        r->found += found;
+        if (found) {
+            assert(c.free_memkb >= memkb && c.nr_cpus >= vcpus);
+            assert(libxl_bitmap_count_set(&c.nodemap) == c.nr_nodes);
+        }
+
+        if (!r->exhaustive)
+            continue;
+
+        gettimeofday(&start, NULL);
+        rc = libxl__numa_search(gc, &host, INT_MAX, memkb, vcpus, 0, 0,
+                                libxl__numa_cmpf, &ce, &found_e);
+        r->usecs_exhaustive += usecs_since(&start);
+        assert(!rc);
+        r->found_exhaustive += found_e;
+
+        assert(found_e || !found);
+        if (!found)
+            continue;
+        assert(c.nr_nodes >= ce.nr_nodes);
+        if (c.nr_nodes != ce.nr_nodes)
+            continue;
+        r->same_nr_nodes++;
+        assert(libxl__numa_cmpf(&c, &ce) >= 0);
+        if (!libxl__numa_cmpf(&c, &ce))
+            r->as_good++;
+    }
+
+    if (r->nr_requests) {
+        r->usecs /= r->nr_requests;
+        r->usecs_exhaustive /= r->nr_requests;
+    }
+
+    libxl__numa_candidate_dispose(&c);
+    libxl__numa_candidate_dispose(&ce);
+    libxl_bitmap_dispose(&suitable);
+    GC_FREE;
+    return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef TEST_NUMAPLACE_H
+#define TEST_NUMAPLACE_H
+
+typedef struct {
+    /* in */
+    int nr_nodes;
+    int nr_requests;
+    unsigned int seed;
+    int exhaustive; /* run the exhaustive search too, and compare */
+    /* out */
+    int found, found_exhaustive;
+    int same_nr_nodes; /* requests for which the two agree on that */
+    int as_good; /* requests for which the two candidates are as good */
+    double usecs, usecs_exhaustive; /* per request */
+} libxl_test_numaplace_result;
+
+/* Runs nr_requests random placements on a synthetic nr_nodes host. */
+int libxl_test_numaplace(libxl_ctx *ctx, libxl_test_numaplace_result *r)
+    LIBXL_EXTERNAL_CALLERS_ONLY;
+
+#endif /*TEST_NUMAPLACE_H*/
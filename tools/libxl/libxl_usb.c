@@ -211,31 +211,31 @@ libxl_device_usbctrl *libxl_device_usbctrl_list(libxl_ctx *ctx, uint32_t domid,
     
     *num = 0;
     
-    fe_path = libxl__sprintf(gc, "%s/device/vusb", libxl__xs_get_dompath(gc, domid));
-    dir = libxl__xs_directory(gc, XBT_NULL, fe_path, &ndirs);
+    fe_path = GCSPRINTF("/local/domain/%"PRIu32"/device/vusb", domid);
+    dir = libxl__devindex_directory(gc, fe_path, &ndirs);
 
     if (dir && ndirs) {
         usbctrls = malloc(sizeof(*usbctrls) * ndirs);
         libxl_device_usbctrl* usbctrl;
         libxl_device_usbctrl* end = usbctrls + ndirs;
         for(usbctrl = usbctrls; usbctrl < end; ++usbctrl, ++dir, (*num)++) {
-            const char *be_path = libxl__xs_read(gc, XBT_NULL,
+            const char *be_path = libxl__devindex_read(gc,
                                     GCSPRINTF("%s/%s/backend", fe_path, *dir));
 
             libxl_device_usbctrl_init(usbctrl);
 
             usbctrl->devid = atoi(*dir);
 
-            result = libxl__xs_read(gc, XBT_NULL, GCSPRINTF("%s/%s/backend-id",
-                                                   fe_path, *dir));
+            result = libxl__devindex_read(gc, GCSPRINTF("%s/%s/backend-id",
+                                                        fe_path, *dir));
             if( result == NULL)
                 goto outerr;
             usbctrl->backend_domid = atoi(result);
 
-            result = libxl__xs_read(gc, XBT_NULL, GCSPRINTF("%s/usb-ver", be_path));
+            result = libxl__devindex_read(gc, GCSPRINTF("%s/usb-ver", be_path));
             usbctrl->usb_version =  atoi(result);
 
-            result = libxl__xs_read(gc, XBT_NULL, GCSPRINTF("%s/num-ports", be_path));
+            result = libxl__devindex_read(gc, GCSPRINTF("%s/num-ports", be_path));
             usbctrl->num_ports = atoi(result);
        }
     }
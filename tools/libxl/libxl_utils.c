@@ -854,6 +854,14 @@ void libxl_numainfo_list_free(libxl_numainfo *list, int nr)
     free(list);
 }
 
+void libxl_ao_trace_list_free(libxl_ao_trace_entry *list, int nr)
+{
+    int i;
+    for (i = 0; i < nr; i++)
+        libxl_ao_trace_entry_dispose(&list[i]);
+    free(list);
+}
+
 void libxl_vcpuinfo_list_free(libxl_vcpuinfo *list, int nr)
 {
     int i;
@@ -862,6 +870,15 @@ void libxl_vcpuinfo_list_free(libxl_vcpuinfo *list, int nr)
     free(list);
 }
 
+void libxl_domain_info_batch_list_free(libxl_domain_info_batch_entry *list,
+                                       int nr)
+{
+    int i;
+    for (i = 0; i < nr; i++)
+        libxl_domain_info_batch_entry_dispose(&list[i]);
+    free(list);
+}
+
 int libxl__sendmsg_fds(libxl__gc *gc, int carrier,
                        const void *data, size_t datalen,
                        int nfds, const int fds[], const char *what) {
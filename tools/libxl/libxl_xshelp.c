@@ -62,6 +62,7 @@ int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
                 xs_set_permissions(ctx->xsh, t, path, perms, num_perms);
         }
     }
+    libxl__devindex_invalidate(gc, t, dir);
     return 0;
 }
 
@@ -112,6 +113,7 @@ int libxl__xs_write(libxl__gc *gc, xs_transaction_t t,
     }
     xs_write(ctx->xsh, t, path, s, ret);
     free(s);
+    libxl__devindex_invalidate(gc, t, path);
     return 0;
 }
 
@@ -153,6 +155,7 @@ bool libxl__xs_mkdir(libxl__gc *gc, xs_transaction_t t,
 			         unsigned int num_perms)
 {
     libxl_ctx *ctx = libxl__gc_owner(gc);
+    libxl__devindex_invalidate(gc, t, path);
     if (!xs_mkdir(ctx->xsh, t, path))
         return false;
     return xs_set_permissions(ctx->xsh, t, path, perms, num_perms);
@@ -185,6 +188,7 @@ int libxl__xs_write_checked(libxl__gc *gc, xs_transaction_t t,
                             const char *path, const char *string)
 {
     size_t length = strlen(string);
+    libxl__devindex_invalidate(gc, t, path);
     if (!xs_write(CTX->xsh, t, path, string, length)) {
         LOGE(ERROR, "xenstore write failed: `%s' = `%s'", path, string);
         return ERROR_FAIL;
@@ -194,6 +198,7 @@ int libxl__xs_write_checked(libxl__gc *gc, xs_transaction_t t,
 
 int libxl__xs_rm_checked(libxl__gc *gc, xs_transaction_t t, const char *path)
 {
+    libxl__devindex_invalidate(gc, t, path);
     if (!xs_rm(CTX->xsh, t, path)) {
         if (errno == ENOENT)
             return 0;
@@ -212,6 +217,7 @@ int libxl__xs_transaction_start(libxl__gc *gc, xs_transaction_t *t)
         LOGE(ERROR, "could not create xenstore transaction");
         return ERROR_FAIL;
     }
+    libxl__devindex_transaction_start(gc, *t);
     return 0;
 }
 
@@ -220,14 +226,22 @@ int libxl__xs_transaction_commit(libxl__gc *gc, xs_transaction_t *t)
     assert(*t);
 
     if (!xs_transaction_end(CTX->xsh, *t, 0)) {
+        int e = errno;
+
+        /* Unless it was EAGAIN we cannot tell whether it committed */
+        libxl__devindex_transaction_end(gc, *t, e != EAGAIN);
         *t = 0;
-        if (errno == EAGAIN)
+        if (e == EAGAIN)
             return +1;
 
+        errno = e;
         LOGE(ERROR, "could not commit xenstore transaction");
         return ERROR_FAIL;
     }
 
+    /* The index may have cached, from outside the transaction, nodes
+     * which it wrote; their watch events need not have arrived yet. */
+    libxl__devindex_transaction_end(gc, *t, 1);
     *t = 0;
     return 0;
 }
@@ -240,6 +254,7 @@ void libxl__xs_transaction_abort(libxl__gc *gc, xs_transaction_t *t)
     if (!xs_transaction_end(CTX->xsh, *t, 1))
         LOGE(ERROR, "could not abort xenstore transaction");
 
+    libxl__devindex_transaction_end(gc, *t, 0);
     *t = 0;
 }
 
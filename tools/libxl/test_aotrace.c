@@ -0,0 +1,40 @@
+#include "test_common.h"
+#include "libxl_test_aotrace.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DOMID 42
+
+int main(int argc, char **argv) {
+    libxl_ao_trace_entry *ents;
+    int rc, i, nr;
+
+    test_common_setup(XTL_DEBUG);
+
+    rc = libxl_ao_trace(ctx, DOMID, &ents, &nr);
+    assert(!rc && !nr && !ents);
+
+    rc = libxl_test_aotrace(ctx, DOMID, 0);
+    assert(!rc);
+
+    rc = libxl_ao_trace(ctx, DOMID, &ents, &nr);
+    assert(!rc);
+    assert(nr == 3);
+
+    for (i = 0; i < nr; i++)
+        printf("%s: start %"PRIu64"us, took %"PRIu64"us\n",
+               ents[i].what, ents[i].start_us, ents[i].duration_us);
+
+    assert(!strcmp(ents[0].what, "first"));
+    assert(!strcmp(ents[1].what, "second"));
+    assert(!strcmp(ents[2].what, "open"));
+    assert(ents[0].duration_us >= 100000);
+    assert(ents[1].start_us >= ents[0].start_us + 50000);
+    assert(ents[1].duration_us >= 200000);
+    assert(ents[2].start_us >= ents[1].start_us + ents[1].duration_us);
+
+    libxl_ao_trace_list_free(ents, nr);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#include "test_common.h"
+#include "libxl_test_gcbench.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#define TOTAL 1000000
+
+int main(int argc, char **argv) {
+    static const int sizes[] = { 16, 256, 4096, 65536 };
+    struct timeval start, end;
+    double ns;
+    int i, j, rc, rounds;
+
+    test_common_setup(XTL_INFO);
+
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        rounds = TOTAL / sizes[i];
+
+        gettimeofday(&start, NULL);
+        for (j = 0; j < rounds; j++) {
+            rc = libxl_test_gcbench(ctx, sizes[i]);
+            assert(!rc);
+        }
+        gettimeofday(&end, NULL);
+
+        ns = (end.tv_sec - start.tv_sec) * 1e9 +
+             (end.tv_usec - start.tv_usec) * 1e3;
+        printf("%6d allocations per gc: %7.1f ns per iteration\n",
+               sizes[i], ns / ((double)rounds * sizes[i]));
+    }
+
+    return 0;
+}
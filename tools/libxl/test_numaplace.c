@@ -0,0 +1,34 @@
+#include "test_common.h"
+#include "libxl_test_numaplace.h"
+
+#include <stdio.h>
+
+int main(int argc, char **argv) {
+    static const struct { int nodes, exhaustive; } runs[] = {
+        { 8, 1 }, { 16, 1 }, { 32, 0 }, { 64, 0 },
+    };
+    libxl_test_numaplace_result r;
+    int i, rc;
+
+    test_common_setup(XTL_INFO);
+
+    for (i = 0; i < sizeof(runs)/sizeof(runs[0]); i++) {
+        r.nr_nodes = runs[i].nodes;
+        r.nr_requests = 200;
+        r.seed = i + 1;
+        r.exhaustive = runs[i].exhaustive;
+
+        rc = libxl_test_numaplace(ctx, &r);
+        assert(!rc);
+
+        printf("%2d nodes: placed %d/%d, %.0f us each",
+               r.nr_nodes, r.found, r.nr_requests, r.usecs);
+        if (r.exhaustive)
+            printf("; exhaustive placed %d, %.0f us each; same nr_nodes %d,"
+                   " as good %d", r.found_exhaustive, r.usecs_exhaustive,
+                   r.same_nr_nodes, r.as_good);
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -142,6 +142,7 @@ typedef struct {
 
 typedef enum {
     child_console, child_waitdaemon, child_migration, child_vncviewer,
+    child_migration_streams,
     child_max
 } xlchildnum;
 
@@ -29,6 +29,9 @@
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include <sys/utsname.h> /* for utsname in xl info */
 #include <xentoollog.h>
 #include <ctype.h>
@@ -94,6 +97,9 @@ static int *vcpu_to_pcpu;
 static const char savefileheader_magic[32]=
     "Xen saved domain, xl format\n \0 \r";
 
+/* Most additional data streams xl migrate --streams will open */
+#define MIGRATE_MAX_STREAMS 16
+
 static const char migrate_receiver_banner[]=
     "xl migration receiver ready, send binary domain data.\n";
 static const char migrate_receiver_ready[]=
@@ -150,10 +156,14 @@ struct domain_create {
     int vncautopass;
     int console_autoconnect;
     int checkpointed_stream;
+    int timing;
     const char *config_file;
     const char *extra_config; /* extra config string */
     const char *restore_file;
     int migrate_fd; /* -1 means none */
+    int *migrate_data_fds; /* additional data streams, see migrate --streams */
+    int *migrate_data_conns; /* where each data stream was handed over */
+    int migrate_nr_data;
     char **migration_domname_r; /* from malloc */
 };
 
@@ -374,33 +384,26 @@ static void printf_info(enum output_format output_format,
     if (output_format == OUTPUT_FORMAT_SXP)
         return printf_info_sexp(domid, d_config);
 
-    const char *buf;
-    libxl_yajl_length len = 0;
+    libxl_json_writer *w;
     yajl_gen_status s;
-    yajl_gen hand;
 
-    hand = libxl_yajl_gen_alloc(NULL);
-    if (!hand) {
+    if (fflush(stdout)) { perror("stdout"); exit(-1); }
+
+    w = libxl_json_writer_alloc(ctx, STDOUT_FILENO);
+    if (!w) {
         fprintf(stderr, "unable to allocate JSON generator\n");
         return;
     }
 
-    s = printf_info_one_json(hand, domid, d_config);
-    if (s != yajl_gen_status_ok)
-        goto out;
-
-    s = yajl_gen_get_buf(hand, (const unsigned char **)&buf, &len);
-    if (s != yajl_gen_status_ok)
-        goto out;
-
-    puts(buf);
+    s = printf_info_one_json(libxl_json_writer_gen(w), domid, d_config);
 
-out:
-    yajl_gen_free(hand);
+    if (libxl_json_writer_free(w)) exit(-1);
 
     if (s != yajl_gen_status_ok)
         fprintf(stderr,
                 "unable to format domain config as JSON (YAJL:%d)\n", s);
+    else
+        putchar('\n');
 
     if (ferror(stdout) || fflush(stdout)) { perror("stdout"); exit(-1); }
 }
@@ -2036,6 +2039,26 @@ static void evdisable_disk_ejects(libxl_evgen_disk_eject **diskws,
     }
 }
 
+static void print_create_timing(uint32_t domid)
+{
+    libxl_ao_trace_entry *entries;
+    int i, nr;
+
+    if (libxl_ao_trace(ctx, domid, &entries, &nr) || !nr) {
+        fprintf(stderr, "no timing recorded for domain %u\n", domid);
+        return;
+    }
+
+    printf("Domain %u creation timing (ms):\n", domid);
+    printf("%10s %10s  %s\n", "start", "duration", "stage");
+    for (i = 0; i < nr; i++)
+        printf("%10.1f %10.1f  %s\n", entries[i].start_us / 1000.0,
+               entries[i].duration_us / 1000.0, entries[i].what);
+    fflush(stdout);
+
+    libxl_ao_trace_list_free(entries, nr);
+}
+
 static uint32_t create_domain(struct domain_create *dom_info)
 {
     uint32_t domid = INVALID_DOMID;
@@ -2239,10 +2262,27 @@ start:
     if ( restoring ) {
         libxl_domain_restore_params params;
         params.checkpointed_stream = dom_info->checkpointed_stream;
-        ret = libxl_domain_create_restore(ctx, &d_config,
+        if (dom_info->migrate_nr_data)
+            ret = libxl_domain_create_restore_streams(ctx, &d_config,
                                           &domid, restore_fd,
+                                          dom_info->migrate_data_fds,
+                                          dom_info->migrate_nr_data,
                                           &params,
                                           0, autoconnect_console_how);
+        else
+            ret = libxl_domain_create_restore(ctx, &d_config,
+                                          &domid, restore_fd,
+                                          &params,
+                                          0, autoconnect_console_how);
+        /*
+         * Let the data stream transports go before we daemonize: the
+         * data streams are finished with either way.
+         */
+        for (i = 0; i < dom_info->migrate_nr_data; i++) {
+            close(dom_info->migrate_data_fds[i]);
+            close(dom_info->migrate_data_conns[i]);
+        }
+        dom_info->migrate_nr_data = 0;
         /*
          * On subsequent reboot etc we should create the domain, not
          * restore/migrate-receive it again.
@@ -2252,6 +2292,8 @@ start:
         ret = libxl_domain_create_new(ctx, &d_config, &domid,
                                       0, autoconnect_console_how);
     }
+    if ( dom_info->timing && domid != INVALID_DOMID )
+        print_create_timing(domid);
     if ( ret )
         goto error_out;
 
@@ -3445,7 +3487,8 @@ static void reboot_domain(uint32_t domid, libxl_evgen_domain_death **deathw,
     }
 }
 
-static void list_domains_details(const libxl_dominfo *info, int nb_domain)
+static void list_domains_details(const libxl_domain_info_batch_entry *entries,
+                                 int nb_domain)
 {
     libxl_domain_config d_config;
 
@@ -3453,17 +3496,20 @@ static void list_domains_details(const libxl_dominfo *info, int nb_domain)
     uint8_t *data;
     int i, len, rc;
 
+    libxl_json_writer *w = NULL;
     yajl_gen hand = NULL;
     yajl_gen_status s;
-    const char *buf;
-    libxl_yajl_length yajl_len = 0;
 
     if (default_output_format == OUTPUT_FORMAT_JSON) {
-        hand = libxl_yajl_gen_alloc(NULL);
-        if (!hand) {
+        /* Each domain's config is written out as soon as it has been
+         * generated, rather than all of them being built up in memory. */
+        if (fflush(stdout)) { perror("stdout"); exit(-1); }
+        w = libxl_json_writer_alloc(ctx, STDOUT_FILENO);
+        if (!w) {
             fprintf(stderr, "unable to allocate JSON generator\n");
             return;
         }
+        hand = libxl_json_writer_gen(w);
 
         s = yajl_gen_array_open(hand);
         if (s != yajl_gen_status_ok)
@@ -3472,19 +3518,21 @@ static void list_domains_details(const libxl_dominfo *info, int nb_domain)
         s = yajl_gen_status_ok;
 
     for (i = 0; i < nb_domain; i++) {
+        const libxl_dominfo *info = &entries[i].info;
+
         /* no detailed info available on dom0 */
-        if (info[i].domid == 0)
+        if (info->domid == 0)
             continue;
-        rc = libxl_userdata_retrieve(ctx, info[i].domid, "xl", &data, &len);
+        rc = libxl_userdata_retrieve(ctx, info->domid, "xl", &data, &len);
         if (rc)
             continue;
-        CHK_SYSCALL(asprintf(&config_source, "<domid %d data>", info[i].domid));
+        CHK_SYSCALL(asprintf(&config_source, "<domid %d data>", info->domid));
         libxl_domain_config_init(&d_config);
         parse_config_data(config_source, (char *)data, len, &d_config);
         if (default_output_format == OUTPUT_FORMAT_JSON)
-            s = printf_info_one_json(hand, info[i].domid, &d_config);
+            s = printf_info_one_json(hand, info->domid, &d_config);
         else
-            printf_info_sexp(info[i].domid, &d_config);
+            printf_info_sexp(info->domid, &d_config);
         libxl_domain_config_dispose(&d_config);
         free(data);
         free(config_source);
@@ -3496,20 +3544,16 @@ static void list_domains_details(const libxl_dominfo *info, int nb_domain)
         s = yajl_gen_array_close(hand);
         if (s != yajl_gen_status_ok)
             goto out;
-
-        s = yajl_gen_get_buf(hand, (const unsigned char **)&buf, &yajl_len);
-        if (s != yajl_gen_status_ok)
-            goto out;
-
-        puts(buf);
     }
 
 out:
     if (default_output_format == OUTPUT_FORMAT_JSON) {
-        yajl_gen_free(hand);
+        if (libxl_json_writer_free(w)) exit(-1);
         if (s != yajl_gen_status_ok)
             fprintf(stderr,
                     "unable to format domain config as JSON (YAJL:%d)\n", s);
+        else
+            putchar('\n');
     }
 }
 
@@ -3564,7 +3608,8 @@ static void print_bitmap(uint8_t *map, int maplen, FILE *stream)
 }
 
 static void list_domains(int verbose, int context, int claim, int numa,
-                         const libxl_dominfo *info, int nb_domain)
+                         const libxl_domain_info_batch_entry *entries,
+                         int nb_domain)
 {
     int i;
     static const char shutdown_reason_letters[]= "-rscw";
@@ -3593,44 +3638,42 @@ static void list_domains(int verbose, int context, int claim, int numa,
     }
     printf("\n");
     for (i = 0; i < nb_domain; i++) {
-        char *domname;
+        const libxl_dominfo *info = &entries[i].info;
         unsigned shutdown_reason;
-        domname = libxl_domid_to_name(ctx, info[i].domid);
-        shutdown_reason = info[i].shutdown ? info[i].shutdown_reason : 0;
+        shutdown_reason = info->shutdown ? info->shutdown_reason : 0;
         printf("%-40s %5d %5lu %5d     %c%c%c%c%c%c  %8.1f",
-                domname,
-                info[i].domid,
-                (unsigned long) ((info[i].current_memkb +
-                    info[i].outstanding_memkb)/ 1024),
-                info[i].vcpu_online,
-                info[i].running ? 'r' : '-',
-                info[i].blocked ? 'b' : '-',
-                info[i].paused ? 'p' : '-',
-                info[i].shutdown ? 's' : '-',
+                entries[i].name,
+                info->domid,
+                (unsigned long) ((info->current_memkb +
+                    info->outstanding_memkb)/ 1024),
+                info->vcpu_online,
+                info->running ? 'r' : '-',
+                info->blocked ? 'b' : '-',
+                info->paused ? 'p' : '-',
+                info->shutdown ? 's' : '-',
                 (shutdown_reason >= 0 &&
                  shutdown_reason < sizeof(shutdown_reason_letters)-1
                  ? shutdown_reason_letters[shutdown_reason] : '?'),
-                info[i].dying ? 'd' : '-',
-                ((float)info[i].cpu_time / 1e9));
-        free(domname);
+                info->dying ? 'd' : '-',
+                ((float)info->cpu_time / 1e9));
         if (verbose) {
-            printf(" " LIBXL_UUID_FMT, LIBXL_UUID_BYTES(info[i].uuid));
-            if (info[i].shutdown) printf(" %8x", shutdown_reason);
+            printf(" " LIBXL_UUID_FMT, LIBXL_UUID_BYTES(info->uuid));
+            if (info->shutdown) printf(" %8x", shutdown_reason);
             else printf(" %8s", "-");
         }
         if (claim)
-            printf(" %5lu", (unsigned long)info[i].outstanding_memkb / 1024);
+            printf(" %5lu", (unsigned long)info->outstanding_memkb / 1024);
         if (verbose || context) {
             int rc;
             size_t size;
             char *buf = NULL;
-            rc = libxl_flask_sid_to_context(ctx, info[i].ssidref, &buf,
+            rc = libxl_flask_sid_to_context(ctx, info->ssidref, &buf,
                                             &size);
             printf(" %16s", rc < 0 ? "-" : buf);
             free(buf);
         }
         if (numa) {
-            libxl_domain_get_nodeaffinity(ctx, info[i].domid, &nodemap);
+            libxl_domain_get_nodeaffinity(ctx, info->domid, &nodemap);
 
             putchar(' ');
             print_bitmap(nodemap.map, physinfo.nr_nodes, stdout);
@@ -3740,7 +3783,8 @@ static void save_domain_core_writeconfig(int fd, const char *source,
 }
 
 static int save_domain(uint32_t domid, const char *filename, int checkpoint,
-                            int leavepaused, const char *override_config_file)
+                       int leavepaused, int page_index,
+                       const char *override_config_file)
 {
     int fd;
     uint8_t *config_data;
@@ -3761,7 +3805,9 @@ static int save_domain(uint32_t domid, const char *filename, int checkpoint,
 
     save_domain_core_writeconfig(fd, filename, config_data, config_len);
 
-    int rc = libxl_domain_suspend(ctx, domid, fd, 0, NULL);
+    int rc = libxl_domain_suspend(ctx, domid, fd,
+                                  page_index ? LIBXL_SUSPEND_PAGE_INDEX : 0,
+                                  NULL);
     close(fd);
 
     if (rc < 0) {
@@ -3815,6 +3861,69 @@ static pid_t create_migration_child(const char *rune, int *send_fd,
     return child;
 }
 
+/*
+ * With --streams, each additional data stream of the migration has its
+ * own transport, which runs "xl migrate-receive --data-stream" on the
+ * target.  They all run under a single child, so that they are reaped
+ * together.
+ */
+static void create_migration_stream_children(char **runes, int nr,
+                                             int *send_fds)
+{
+    int (*pipes)[2] = xmalloc(sizeof(*pipes) * nr);
+    pid_t child, got;
+    int i, j, status, failed = 0;
+
+    for (i = 0; i < nr; i++)
+        MUST( libxl_pipe(ctx, pipes[i]) );
+
+    child = xl_fork(child_migration_streams,
+                    "migration data stream transport process");
+
+    if (!child) {
+        for (i = 0; i < nr; i++) {
+            got = fork();
+            if (got == -1) {
+                perror("fork failed");
+                exit(-1);
+            }
+            if (!got) {
+                dup2(pipes[i][0], 0);
+                for (j = 0; j < nr; j++) {
+                    close(pipes[j][0]);
+                    close(pipes[j][1]);
+                }
+                execlp("sh","sh","-c",runes[i],(char*)0);
+                perror("failed to exec sh");
+                exit(-1);
+            }
+        }
+        for (i = 0; i < nr; i++) {
+            close(pipes[i][0]);
+            close(pipes[i][1]);
+        }
+        for (;;) {
+            got = wait(&status);
+            if (got == -1) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (status) {
+                libxl_report_child_exitstatus(ctx, XTL_ERROR,
+                        "migration data stream transport", got, status);
+                failed = 1;
+            }
+        }
+        exit(failed);
+    }
+
+    for (i = 0; i < nr; i++) {
+        close(pipes[i][0]);
+        send_fds[i] = pipes[i][1];
+    }
+    free(pipes);
+}
+
 static int migrate_read_fixedmessage(int fd, const void *msg, int msgsz,
                                      const char *what, const char *rune) {
     char buf[msgsz];
@@ -3835,24 +3944,24 @@ static int migrate_read_fixedmessage(int fd, const void *msg, int msgsz,
     return 0;
 }
 
-static void migration_child_report(int recv_fd) {
+static void migration_child_report_one(xlchildnum which, int recv_fd) {
     pid_t child;
     int status, sr;
     struct timeval now, waituntil, timeout;
     static const struct timeval pollinterval = { 0, 1000 }; /* 1ms */
 
-    if (!xl_child_pid(child_migration)) return;
+    if (!xl_child_pid(which)) return;
 
     CHK_SYSCALL(gettimeofday(&waituntil, 0));
     waituntil.tv_sec += 2;
 
     for (;;) {
-        pid_t migration_child = xl_child_pid(child_migration);
-        child = xl_waitpid(child_migration, &status, WNOHANG);
+        pid_t migration_child = xl_child_pid(which);
+        child = xl_waitpid(which, &status, WNOHANG);
 
         if (child == migration_child) {
             if (status)
-                xl_report_child_exitstatus(XTL_INFO, child_migration,
+                xl_report_child_exitstatus(XTL_INFO, which,
                                            migration_child, status);
             break;
         }
@@ -3898,6 +4007,11 @@ static void migration_child_report(int recv_fd) {
     }
 }
 
+static void migration_child_report(int recv_fd) {
+    migration_child_report_one(child_migration, recv_fd);
+    migration_child_report_one(child_migration_streams, -1);
+}
+
 static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
                                 uint8_t *config_data, int config_len,
                                 const char *rune)
@@ -3924,11 +4038,13 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 }
 
 static void migrate_domain(uint32_t domid, const char *rune, int debug,
-                           const char *override_config_file)
+                           const char *override_config_file,
+                           int nr_streams, char **stream_runes)
 {
     pid_t child = -1;
-    int rc;
+    int i, rc;
     int send_fd = -1, recv_fd = -1;
+    int *stream_fds = NULL;
     char *away_domname;
     char rc_buf;
     uint8_t *config_data;
@@ -3945,6 +4061,12 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 
     child = create_migration_child(rune, &send_fd, &recv_fd);
 
+    if (nr_streams) {
+        stream_fds = xmalloc(sizeof(*stream_fds) * nr_streams);
+        create_migration_stream_children(stream_runes, nr_streams,
+                                         stream_fds);
+    }
+
     migrate_do_preamble(send_fd, recv_fd, child, config_data, config_len,
                         rune);
 
@@ -3952,7 +4074,15 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 
     if (debug)
         flags |= LIBXL_SUSPEND_DEBUG;
-    rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
+    if (nr_streams)
+        rc = libxl_domain_suspend_streams(ctx, domid, send_fd,
+                                          stream_fds, nr_streams,
+                                          flags, NULL);
+    else
+        rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
+    for (i = 0; i < nr_streams; i++)
+        close(stream_fds[i]);
+    free(stream_fds);
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
                 " (rc=%d)\n", rc);
@@ -4063,18 +4193,209 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
     exit(-ERROR_BADFAIL);
 }
 
+/*
+ * The target end of each additional data stream passes its stdin to the
+ * main receiver over a unix socket named after a token chosen by the
+ * sender.  It then keeps its transport up until the main receiver closes
+ * the connection, once the domain's memory has been restored.
+ */
+#define MIGRATE_STREAM_TIMEOUT_MS 30000
+
+static char *migrate_stream_socket_path(const char *token)
+{
+    char *path;
+    const char *p;
+
+    for (p = token; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '-') {
+            fprintf(stderr, "invalid migration stream token `%s'\n", token);
+            exit(2);
+        }
+    }
+
+    if (asprintf(&path, XEN_RUN_DIR "/xl-migrate-%s.sock", token) < 0) {
+        perror("asprintf");
+        exit(-ERROR_FAIL);
+    }
+    if (strlen(path) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+        fprintf(stderr, "migration stream socket path %s too long\n", path);
+        exit(2);
+    }
+    return path;
+}
+
+static int migrate_stream_listen(const char *path, int nr)
+{
+    struct sockaddr_un sa;
+    int fd;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("migration target: socket");
+        exit(-ERROR_FAIL);
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+        listen(fd, nr)) {
+        fprintf(stderr, "migration target: cannot listen on %s: %s\n",
+                path, strerror(errno));
+        exit(-ERROR_FAIL);
+    }
+    MUST( libxl_fd_set_cloexec(ctx, fd, 1) );
+
+    return fd;
+}
+
+/* Collects the fds of nr data streams, and the connections they came on. */
+static void migrate_stream_accept(int listen_fd, const char *path, int nr,
+                                  int *data_fds, int *conns)
+{
+    struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+    union {
+        struct cmsghdr cmsg;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char dummy;
+    int i, r;
+
+    for (i = 0; i < nr; i++) {
+        r = poll(&pfd, 1, MIGRATE_STREAM_TIMEOUT_MS);
+        if (r < 0 && errno == EINTR) { i--; continue; }
+        if (r <= 0) {
+            fprintf(stderr, "migration target: only %d of %d data streams"
+                    " connected\n", i, nr);
+            unlink(path);
+            exit(-ERROR_FAIL);
+        }
+
+        conns[i] = accept(listen_fd, NULL, NULL);
+        if (conns[i] < 0) {
+            perror("migration target: accept data stream");
+            unlink(path);
+            exit(-ERROR_FAIL);
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &dummy;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        do {
+            r = recvmsg(conns[i], &msg, 0);
+        } while (r < 0 && errno == EINTR);
+        cmsg = r == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+            fprintf(stderr, "migration target: bad data stream handover\n");
+            unlink(path);
+            exit(-ERROR_FAIL);
+        }
+        memcpy(&data_fds[i], CMSG_DATA(cmsg), sizeof(int));
+        MUST( libxl_fd_set_cloexec(ctx, data_fds[i], 1) );
+        MUST( libxl_fd_set_cloexec(ctx, conns[i], 1) );
+    }
+
+    close(listen_fd);
+    unlink(path);
+}
+
+static void migrate_receive_data_stream(const char *token)
+{
+    char *path = migrate_stream_socket_path(token);
+    union {
+        struct cmsghdr cmsg;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct sockaddr_un sa;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char dummy = 0;
+    int fd, r, waited;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("migration data stream: socket");
+        exit(-ERROR_FAIL);
+    }
+
+    /* The main receiver may not have got as far as listening yet. */
+    for (waited = 0; ; waited += 100) {
+        if (!connect(fd, (struct sockaddr *)&sa, sizeof(sa)))
+            break;
+        if ((errno != ENOENT && errno != ECONNREFUSED) ||
+            waited >= MIGRATE_STREAM_TIMEOUT_MS) {
+            fprintf(stderr, "migration data stream: cannot connect to %s:"
+                    " %s\n", path, strerror(errno));
+            exit(-ERROR_FAIL);
+        }
+        usleep(100000);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &dummy;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    r = STDIN_FILENO;
+    memcpy(CMSG_DATA(cmsg), &r, sizeof(int));
+
+    do {
+        r = sendmsg(fd, &msg, 0);
+    } while (r < 0 && errno == EINTR);
+    if (r != 1) {
+        perror("migration data stream: handing over stream");
+        exit(-ERROR_FAIL);
+    }
+
+    do {
+        r = read(fd, &dummy, 1);
+    } while (r > 0 || (r < 0 && errno == EINTR));
+
+    exit(0);
+}
+
 static void migrate_receive(int debug, int daemonize, int monitor,
-                            int send_fd, int recv_fd, int remus)
+                            int send_fd, int recv_fd, int remus,
+                            int nr_streams, const char *stream_token)
 {
     uint32_t domid;
     int rc, rc2;
     char rc_buf;
     char *migration_domname;
+    char *stream_path = NULL;
+    int stream_listen_fd = -1;
     struct domain_create dom_info;
 
     signal(SIGPIPE, SIG_IGN);
     /* if we get SIGPIPE we'd rather just have it as an error */
 
+    if (nr_streams) {
+        stream_path = migrate_stream_socket_path(stream_token);
+        stream_listen_fd = migrate_stream_listen(stream_path, nr_streams);
+    }
+
     fprintf(stderr, "migration target: Ready to receive domain.\n");
 
     CHK_ERRNOVAL(libxl_write_exactly(
@@ -4091,6 +4412,15 @@ static void migrate_receive(int debug, int daemonize, int monitor,
     dom_info.migration_domname_r = &migration_domname;
     dom_info.checkpointed_stream = remus;
 
+    if (nr_streams) {
+        dom_info.migrate_data_fds = xmalloc(sizeof(int) * nr_streams);
+        dom_info.migrate_data_conns = xmalloc(sizeof(int) * nr_streams);
+        dom_info.migrate_nr_data = nr_streams;
+        migrate_stream_accept(stream_listen_fd, stream_path, nr_streams,
+                              dom_info.migrate_data_fds,
+                              dom_info.migrate_data_conns);
+    }
+
     rc = create_domain(&dom_info);
     if (rc < 0) {
         fprintf(stderr, "migration target: Domain creation failed"
@@ -4272,9 +4602,18 @@ int main_restore(int argc, char **argv)
 int main_migrate_receive(int argc, char **argv)
 {
     int debug = 0, daemonize = 1, monitor = 1, remus = 0;
+    int nr_streams = 0;
+    const char *stream_token = NULL;
+    char *end;
     int opt;
+    static struct option opts[] = {
+        {"streams", 1, 0, 0x100},
+        {"data-stream", 1, 0, 0x101},
+        COMMON_LONG_OPTS,
+        {0, 0, 0, 0}
+    };
 
-    SWITCH_FOREACH_OPT(opt, "Fedr", NULL, "migrate-receive", 0) {
+    SWITCH_FOREACH_OPT(opt, "Fedr", opts, "migrate-receive", 0) {
     case 'F':
         daemonize = 0;
         break;
@@ -4288,15 +4627,27 @@ int main_migrate_receive(int argc, char **argv)
     case 'r':
         remus = 1;
         break;
+    case 0x100:
+        /* --streams=<number>:<token> */
+        nr_streams = strtoul(optarg, &end, 10);
+        if (nr_streams <= 0 || *end != ':') {
+            help("migrate-receive");
+            return 2;
+        }
+        stream_token = end + 1;
+        break;
+    case 0x101:
+        migrate_receive_data_stream(optarg);
+        break;
     }
 
-    if (argc-optind != 0) {
+    if (argc-optind != 0 || (nr_streams && remus)) {
         help("migrate-receive");
         return 2;
     }
     migrate_receive(debug, daemonize, monitor,
                     STDOUT_FILENO, STDIN_FILENO,
-                    remus);
+                    remus, nr_streams, stream_token);
 
     return 0;
 }
@@ -4308,15 +4659,19 @@ int main_save(int argc, char **argv)
     const char *config_filename = NULL;
     int checkpoint = 0;
     int leavepaused = 0;
+    int page_index = 0;
     int opt;
 
-    SWITCH_FOREACH_OPT(opt, "cp", NULL, "save", 2) {
+    SWITCH_FOREACH_OPT(opt, "cpi", NULL, "save", 2) {
     case 'c':
         checkpoint = 1;
         break;
     case 'p':
         leavepaused = 1;
         break;
+    case 'i':
+        page_index = 1;
+        break;
     }
 
     if (argc-optind > 3) {
@@ -4329,7 +4684,8 @@ int main_save(int argc, char **argv)
     if ( argc - optind >= 3 )
         config_filename = argv[optind + 2];
 
-    save_domain(domid, filename, checkpoint, leavepaused, config_filename);
+    save_domain(domid, filename, checkpoint, leavepaused, page_index,
+                config_filename);
     return 0;
 }
 
@@ -4339,10 +4695,13 @@ int main_migrate(int argc, char **argv)
     const char *config_filename = NULL;
     const char *ssh_command = "ssh";
     char *rune = NULL;
+    char **stream_runes = NULL;
+    char *streams_arg = "";
     char *host;
-    int opt, daemonize = 1, monitor = 1, debug = 0;
+    int i, opt, daemonize = 1, monitor = 1, debug = 0, nr_streams = 0;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
+        {"streams", 1, 0, 0x101},
         COMMON_LONG_OPTS,
         {0, 0, 0, 0}
     };
@@ -4364,11 +4723,25 @@ int main_migrate(int argc, char **argv)
     case 0x100:
         debug = 1;
         break;
+    case 0x101:
+        nr_streams = atoi(optarg);
+        if (nr_streams < 0 || nr_streams > MIGRATE_MAX_STREAMS) {
+            fprintf(stderr, "--streams must be between 0 and %d\n",
+                    MIGRATE_MAX_STREAMS);
+            return 2;
+        }
+        break;
     }
 
     domid = find_domain(argv[optind]);
     host = argv[optind + 1];
 
+    if (nr_streams && (!ssh_command[0] || debug)) {
+        fprintf(stderr, "--streams cannot be used with --debug, nor with"
+                " an empty -s\n");
+        return 2;
+    }
+
     bool pass_tty_arg = progress_use_cr || (isatty(2) > 0);
 
     if (!ssh_command[0]) {
@@ -4385,16 +4758,36 @@ int main_migrate(int argc, char **argv)
         } else {
             verbose_len = (minmsglevel_default - minmsglevel) + 2;
         }
-        if (asprintf(&rune, "exec %s %s xl%s%.*s migrate-receive%s%s",
+        if (nr_streams) {
+            /* Names the socket the target joins the streams up on. */
+            struct timeval now;
+            char token[64];
+
+            CHK_SYSCALL(gettimeofday(&now, 0));
+            snprintf(token, sizeof(token), "%ld-%ld-%ld", (long)getpid(),
+                     (long)now.tv_sec, (long)now.tv_usec);
+            if (asprintf(&streams_arg, " --streams=%d:%s",
+                         nr_streams, token) < 0)
+                return 1;
+            stream_runes = xmalloc(sizeof(*stream_runes) * nr_streams);
+            for (i = 0; i < nr_streams; i++)
+                if (asprintf(&stream_runes[i], "exec %s %s xl"
+                             " migrate-receive --data-stream=%s",
+                             ssh_command, host, token) < 0)
+                    return 1;
+        }
+        if (asprintf(&rune, "exec %s %s xl%s%.*s migrate-receive%s%s%s",
                      ssh_command, host,
                      pass_tty_arg ? " -t" : "",
                      verbose_len, verbose_buf,
                      daemonize ? "" : " -e",
-                     debug ? " -d" : "") < 0)
+                     debug ? " -d" : "",
+                     streams_arg) < 0)
             return 1;
     }
 
-    migrate_domain(domid, rune, debug, config_filename);
+    migrate_domain(domid, rune, debug, config_filename,
+                   nr_streams, stream_runes);
     return 0;
 }
 #endif
@@ -4546,8 +4939,8 @@ int main_list(int argc, char **argv)
         {0, 0, 0, 0}
     };
 
-    libxl_dominfo info_buf;
-    libxl_dominfo *info, *info_free=0;
+    libxl_domain_info_batch_entry entry_buf;
+    libxl_domain_info_batch_entry *entries, *entries_free=0;
     int nb_domain, rc;
 
     SWITCH_FOREACH_OPT(opt, "lvhZn", opts, "list", 0) {
@@ -4566,15 +4959,17 @@ int main_list(int argc, char **argv)
     }
 
     if (optind >= argc) {
-        info = libxl_list_domain(ctx, &nb_domain);
-        if (!info) {
-            fprintf(stderr, "libxl_list_domain failed.\n");
+        rc = libxl_domain_info_batch(ctx, details ? 0 : LIBXL_DOMINFO_NAME,
+                                     &entries, &nb_domain);
+        if (rc) {
+            fprintf(stderr, "libxl_domain_info_batch failed.\n");
             return 1;
         }
-        info_free = info;
+        entries_free = entries;
     } else if (optind == argc-1) {
         uint32_t domid = find_domain(argv[optind]);
-        rc = libxl_domain_info(ctx, &info_buf, domid);
+        libxl_domain_info_batch_entry_init(&entry_buf);
+        rc = libxl_domain_info(ctx, &entry_buf.info, domid);
         if (rc == ERROR_INVAL) {
             fprintf(stderr, "Error: Domain \'%s\' does not exist.\n",
                 argv[optind]);
@@ -4584,7 +4979,8 @@ int main_list(int argc, char **argv)
             fprintf(stderr, "libxl_domain_info failed (code %d).\n", rc);
             return -rc;
         }
-        info = &info_buf;
+        entry_buf.name = libxl_domid_to_name(ctx, domid);
+        entries = &entry_buf;
         nb_domain = 1;
     } else {
         help("list");
@@ -4592,14 +4988,15 @@ int main_list(int argc, char **argv)
     }
 
     if (details)
-        list_domains_details(info, nb_domain);
+        list_domains_details(entries, nb_domain);
     else
-        list_domains(verbose, context, 0 /* claim */, numa, info, nb_domain);
+        list_domains(verbose, context, 0 /* claim */, numa,
+                     entries, nb_domain);
 
-    if (info_free)
-        libxl_dominfo_list_free(info, nb_domain);
+    if (entries_free)
+        libxl_domain_info_batch_list_free(entries, nb_domain);
     else
-        libxl_dominfo_dispose(info);
+        libxl_domain_info_batch_entry_dispose(entries);
 
     return 0;
 }
@@ -4623,7 +5020,7 @@ int main_create(int argc, char **argv)
     char extra_config[1024];
     struct domain_create dom_info;
     int paused = 0, debug = 0, daemonize = 1, console_autoconnect = 0,
-        quiet = 0, monitor = 1, vnc = 0, vncautopass = 0;
+        quiet = 0, monitor = 1, vnc = 0, vncautopass = 0, timing = 0;
     int opt, rc;
     static struct option opts[] = {
         {"dryrun", 0, 0, 'n'},
@@ -4631,6 +5028,7 @@ int main_create(int argc, char **argv)
         {"defconfig", 1, 0, 'f'},
         {"vncviewer", 0, 0, 'V'},
         {"vncviewer-autopass", 0, 0, 'A'},
+        {"timing", 0, 0, 'T'},
         COMMON_LONG_OPTS,
         {0, 0, 0, 0}
     };
@@ -4640,7 +5038,7 @@ int main_create(int argc, char **argv)
         argc--; argv++;
     }
 
-    SWITCH_FOREACH_OPT(opt, "Fhnqf:pcdeVA", opts, "create", 0) {
+    SWITCH_FOREACH_OPT(opt, "Fhnqf:pcdeVAT", opts, "create", 0) {
     case 'f':
         filename = optarg;
         break;
@@ -4672,6 +5070,9 @@ int main_create(int argc, char **argv)
     case 'A':
         vnc = vncautopass = 1;
         break;
+    case 'T':
+        timing = 1;
+        break;
     }
 
     extra_config[0] = '\0';
@@ -4700,6 +5101,7 @@ int main_create(int argc, char **argv)
     dom_info.vnc = vnc;
     dom_info.vncautopass = vncautopass;
     dom_info.console_autoconnect = console_autoconnect;
+    dom_info.timing = timing;
 
     rc = create_domain(&dom_info);
     if (rc < 0)
@@ -4843,17 +5245,13 @@ int main_button_press(int argc, char **argv)
     return 0;
 }
 
-static void print_vcpuinfo(uint32_t tdomid,
+static void print_vcpuinfo(uint32_t tdomid, const char *domname,
                            const libxl_vcpuinfo *vcpuinfo,
                            uint32_t nr_cpus)
 {
-    char *domname;
-
     /*      NAME  ID  VCPU */
-    domname = libxl_domid_to_name(ctx, tdomid);
     printf("%-32s %5u %5u",
            domname, tdomid, vcpuinfo->vcpuid);
-    free(domname);
     if (!vcpuinfo->online) {
         /*      CPU STA */
         printf("%5c %3c%cp ", '-', '-', '-');
@@ -4873,6 +5271,7 @@ static void print_vcpuinfo(uint32_t tdomid,
 static void print_domain_vcpuinfo(uint32_t domid, uint32_t nr_cpus)
 {
     libxl_vcpuinfo *vcpuinfo;
+    char *domname;
     int i, nb_vcpu, nrcpus;
 
     vcpuinfo = libxl_list_vcpu(ctx, domid, &nb_vcpu, &nrcpus);
@@ -4882,18 +5281,20 @@ static void print_domain_vcpuinfo(uint32_t domid, uint32_t nr_cpus)
         return;
     }
 
+    domname = libxl_domid_to_name(ctx, domid);
     for (i = 0; i < nb_vcpu; i++) {
-        print_vcpuinfo(domid, &vcpuinfo[i], nr_cpus);
+        print_vcpuinfo(domid, domname, &vcpuinfo[i], nr_cpus);
     }
+    free(domname);
 
     libxl_vcpuinfo_list_free(vcpuinfo, nb_vcpu);
 }
 
 static void vcpulist(int argc, char **argv)
 {
-    libxl_dominfo *dominfo;
+    libxl_domain_info_batch_entry *entries;
     libxl_physinfo physinfo;
-    int i, nb_domain;
+    int i, j, nb_domain;
 
     if (libxl_get_physinfo(ctx, &physinfo) != 0) {
         fprintf(stderr, "libxl_physinfo failed.\n");
@@ -4903,15 +5304,19 @@ static void vcpulist(int argc, char **argv)
     printf("%-32s %5s %5s %5s %5s %9s %s\n",
            "Name", "ID", "VCPU", "CPU", "State", "Time(s)", "CPU Affinity");
     if (!argc) {
-        if (!(dominfo = libxl_list_domain(ctx, &nb_domain))) {
-            fprintf(stderr, "libxl_list_domain failed.\n");
+        if (libxl_domain_info_batch(ctx,
+                                    LIBXL_DOMINFO_NAME | LIBXL_DOMINFO_VCPUS,
+                                    &entries, &nb_domain)) {
+            fprintf(stderr, "libxl_domain_info_batch failed.\n");
             goto vcpulist_out;
         }
 
         for (i = 0; i<nb_domain; i++)
-            print_domain_vcpuinfo(dominfo[i].domid, physinfo.nr_cpus);
+            for (j = 0; j < entries[i].num_vcpus; j++)
+                print_vcpuinfo(entries[i].info.domid, entries[i].name,
+                               &entries[i].vcpus[j], physinfo.nr_cpus);
 
-        libxl_dominfo_list_free(dominfo, nb_domain);
+        libxl_domain_info_batch_list_free(entries, nb_domain);
     } else {
         for (; argc > 0; ++argv, --argc) {
             uint32_t domid = find_domain(*argv);
@@ -6458,7 +6863,7 @@ static char *uptime_to_string(unsigned long uptime, int short_mode)
 
 int main_claims(int argc, char **argv)
 {
-    libxl_dominfo *info;
+    libxl_domain_info_batch_entry *entries;
     int opt;
     int nb_domain;
 
@@ -6469,16 +6874,16 @@ int main_claims(int argc, char **argv)
     if (!claim_mode)
         fprintf(stderr, "claim_mode not enabled (see man xl.conf).\n");
 
-    info = libxl_list_domain(ctx, &nb_domain);
-    if (!info) {
-        fprintf(stderr, "libxl_list_domain failed.\n");
+    if (libxl_domain_info_batch(ctx, LIBXL_DOMINFO_NAME,
+                                &entries, &nb_domain)) {
+        fprintf(stderr, "libxl_domain_info_batch failed.\n");
         return 1;
     }
 
     list_domains(0 /* verbose */, 0 /* context */, 1 /* claim */,
-                 0 /* numa */, info, nb_domain);
+                 0 /* numa */, entries, nb_domain);
 
-    libxl_dominfo_list_free(info, nb_domain);
+    libxl_domain_info_batch_list_free(entries, nb_domain);
     return 0;
 }
 